@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+/*
+ * Writes a raw image, or a compressed one together with everything its
+ * append log has accumulated, to a new compact compressed image that
+ * dokany-lkl mounts as is:
+ *
+ *   chunk-image In Out
+ */
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t *argv[])
+#else
+int main(int argc, char *argv[])
+#endif
+{
+  struct disk_dev *src;
+  host_file_t in, out;
+  uint64_t disk_size = 0, out_size = 0;
+  int ret;
+
+  if (argc != 3) {
+    fprintf(stderr, "chunk-image In Out\n"
+                    "  converts the raw image In to a compressed image, or "
+                    "compacts the compressed image In, into the new file "
+                    "Out\n");
+    return EXIT_FAILURE;
+  }
+
+  in = host_file_open(argv[1], HOST_OPEN_READONLY, &ret);
+  if (in == HOST_INVALID_FILE)
+    goto out;
+
+  ret = disk_chunk_probe(in);
+  if (ret < 0) {
+    host_file_close(in);
+    goto out;
+  }
+
+  if (ret)
+    src = disk_chunk_open(in, DISK_F_READONLY, 0, &ret);
+  else
+    src = disk_raw_open(in, DISK_F_READONLY, &ret);
+  if (!src)
+    goto out;
+  disk_size = src->size;
+
+  out = host_file_open(argv[2], HOST_OPEN_CREATE, &ret);
+  if (out == HOST_INVALID_FILE)
+    goto out_close;
+
+  ret = host_file_size(out, &out_size);
+  if (!ret && out_size)
+    ret = -EEXIST;
+  if (!ret)
+    ret = disk_chunk_create(src, out);
+  if (!ret)
+    ret = host_file_size(out, &out_size);
+
+  host_file_close(out);
+out_close:
+  disk_close(src);
+out:
+  if (ret) {
+    fprintf(stderr, "can't write image: %s\n", strerror(-ret));
+    return EXIT_FAILURE;
+  }
+
+  printf("%llu bytes stored in %llu bytes\n", (unsigned long long)disk_size,
+         (unsigned long long)out_size);
+  return EXIT_SUCCESS;
+}
@@ -1,2 +1,3 @@
 #!/bin/sh
-${CC:=gcc} -g -Iinclude -Iinclude/lkl -L. -D_UNICODE -municode dokany-lkl.c utils.c -llkl -lws2_32 dokan1.lib dokannp1.lib  -o dokany-lkl.exe
+${CC:=gcc} -g -Iinclude -Iinclude/lkl -L. -D_UNICODE -municode dokany-lkl.c utils.c host.c disk.c disk-mq.c disk-cache.c disk-mmap.c disk-overlay.c disk-ram.c disk-chunk.c disk-vhd.c disk-part.c disk-stripe.c disk-crypt.c -llkl -llz4 -lws2_32 dokan1.lib dokannp1.lib  -o dokany-lkl.exe
+${CC} -g -Iinclude -Iinclude/lkl -L. -D_UNICODE -municode chunk-image.c host.c disk.c disk-chunk.c -llkl -llz4 -o chunk-image.exe
@@ -0,0 +1,722 @@
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+/*
+ * Host memory block cache with 2Q replacement.  Blocks seen once sit in the
+ * A1in FIFO and leave through the A1out ghost list, which remembers their
+ * numbers but not their data; only blocks referenced again while on A1out
+ * make it into the Am LRU.  A large sequential copy therefore cycles
+ * through A1in and can't push the metadata blocks out of Am.
+ *
+ * Read misses go to the lower device without the cache lock held.  Every
+ * write and discard bumps generation, and a miss only inserts what it read
+ * if the generation didn't move meanwhile, so stale data never gets cached.
+ * In write-back mode dirty blocks are written out when evicted, on flush
+ * and on close.  Those writes and the reads that fill partly written
+ * blocks also run without the lock: the blocks are marked busy meanwhile,
+ * and nothing changes, evicts or drops a busy block.  Flushes write runs
+ * of adjacent dirty blocks in single requests.
+ */
+
+#define CACHE_BLOCK_SHIFT 12
+#define CACHE_BLOCK_SIZE (1 << CACHE_BLOCK_SHIFT)
+#define CACHE_MAX_RUN 64
+
+enum {
+  CACHE_A1IN,
+  CACHE_AM,
+  CACHE_A1OUT,
+  NR_CACHE_QUEUES
+};
+
+struct cache_block {
+  uint64_t blk;
+  struct cache_block *hash_next;
+  struct cache_block *prev;
+  struct cache_block *next;
+  int queue;
+  int dirty;
+  int busy;             /* lower I/O on data in progress */
+  char *data;
+};
+
+struct cache_dev {
+  struct disk_dev dev;
+  struct disk_dev *lower;
+  int write_back;
+  host_mutex_t lock;
+  host_cond_t idle;     /* signalled when blocks stop being busy */
+  uint64_t generation;
+  size_t nr_blocks;
+  size_t kin;
+  size_t kout;
+  size_t nr[NR_CACHE_QUEUES];
+  struct cache_block queues[NR_CACHE_QUEUES];
+  size_t hash_mask;
+  struct cache_block **hash;
+};
+
+static struct cache_block **cache_hash_slot(struct cache_dev *c, uint64_t blk)
+{
+  return &c->hash[(blk * 0x9e3779b97f4a7c15ULL >> 32) & c->hash_mask];
+}
+
+static struct cache_block *cache_lookup(struct cache_dev *c, uint64_t blk)
+{
+  struct cache_block *b = *cache_hash_slot(c, blk);
+
+  while (b && b->blk != blk)
+    b = b->hash_next;
+
+  return b;
+}
+
+/* Called with the lock held; waits until blk isn't busy, if cached. */
+static struct cache_block *cache_lookup_idle(struct cache_dev *c,
+                                             uint64_t blk)
+{
+  struct cache_block *b;
+
+  while ((b = cache_lookup(c, blk)) && b->busy)
+    host_cond_wait(&c->idle, &c->lock);
+
+  return b;
+}
+
+static void cache_list_del(struct cache_dev *c, struct cache_block *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  c->nr[b->queue]--;
+}
+
+static void cache_list_add(struct cache_dev *c, int queue,
+                           struct cache_block *b)
+{
+  struct cache_block *head = &c->queues[queue];
+
+  b->queue = queue;
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+  c->nr[queue]++;
+}
+
+static void cache_free_block(struct cache_dev *c, struct cache_block *b)
+{
+  struct cache_block **p = cache_hash_slot(c, b->blk);
+
+  while (*p != b)
+    p = &(*p)->hash_next;
+  *p = b->hash_next;
+
+  cache_list_del(c, b);
+  free(b->data);
+  free(b);
+}
+
+/*
+ * Writes back n dirty blocks with consecutive numbers in one request.
+ * Called with the lock held, which is dropped for the write while the
+ * blocks are busy.
+ */
+static int cache_writeback(struct cache_dev *c, struct cache_block **run,
+                           int n)
+{
+  struct disk_iovec iov[CACHE_MAX_RUN];
+  uint64_t off = run[0]->blk << CACHE_BLOCK_SHIFT;
+  uint64_t last = run[n - 1]->blk << CACHE_BLOCK_SHIFT;
+  int i, ret;
+
+  for (i = 0; i < n; i++) {
+    run[i]->busy = 1;
+    iov[i].base = run[i]->data;
+    iov[i].len = CACHE_BLOCK_SIZE;
+  }
+  if (iov[n - 1].len > c->dev.size - last)
+    iov[n - 1].len = c->dev.size - last;
+
+  host_mutex_unlock(&c->lock);
+  ret = disk_write(c->lower, iov, n, off);
+  host_mutex_lock(&c->lock);
+
+  for (i = 0; i < n; i++) {
+    run[i]->busy = 0;
+    if (!ret)
+      run[i]->dirty = 0;
+  }
+  host_cond_broadcast(&c->idle);
+
+  if (!ret)
+    host_atomic_add(&disk_stats.cache_writebacks, n);
+  return ret;
+}
+
+/* The oldest block that isn't busy, of A1in or Am as 2Q picks them. */
+static struct cache_block *cache_victim(struct cache_dev *c)
+{
+  int q, i;
+
+  if (c->nr[CACHE_A1IN] > c->kin || !c->nr[CACHE_AM])
+    q = CACHE_A1IN;
+  else
+    q = CACHE_AM;
+
+  for (i = 0; i < 2; i++, q = q == CACHE_AM ? CACHE_A1IN : CACHE_AM) {
+    struct cache_block *b;
+
+    for (b = c->queues[q].prev; b != &c->queues[q]; b = b->prev)
+      if (!b->busy)
+        return b;
+  }
+
+  return NULL;
+}
+
+/*
+ * Returns a block buffer, evicting A1in's or Am's oldest block when the
+ * cache is full; NULL if that needed a write-back which failed.  The lock
+ * is dropped while a dirty victim is written back or all blocks are busy,
+ * so callers look up again whatever they found before.
+ */
+static char *cache_reclaim(struct cache_dev *c, int *err)
+{
+  struct cache_block *victim;
+  char *data;
+
+  for (;;) {
+    if (c->nr[CACHE_A1IN] + c->nr[CACHE_AM] < c->nr_blocks) {
+      data = malloc(CACHE_BLOCK_SIZE);
+      if (!data)
+        *err = -ENOMEM;
+      return data;
+    }
+
+    victim = cache_victim(c);
+    if (!victim) {
+      host_cond_wait(&c->idle, &c->lock);
+      continue;
+    }
+    if (!victim->dirty)
+      break;
+
+    *err = cache_writeback(c, &victim, 1);
+    if (*err)
+      return NULL;
+  }
+
+  host_atomic_add(&disk_stats.cache_evictions, 1);
+  data = victim->data;
+  victim->data = NULL;
+
+  if (victim->queue == CACHE_AM) {
+    cache_free_block(c, victim);
+    return data;
+  }
+
+  cache_list_del(c, victim);
+  cache_list_add(c, CACHE_A1OUT, victim);
+  if (c->nr[CACHE_A1OUT] > c->kout)
+    cache_free_block(c, c->queues[CACHE_A1OUT].prev);
+
+  return data;
+}
+
+/* Called with the lock held for a block that has no data in the cache. */
+static struct cache_block *cache_insert(struct cache_dev *c, uint64_t blk,
+                                        char *data)
+{
+  struct cache_block *b = cache_lookup(c, blk);
+
+  if (b) {
+    /* a ghost hit: the block was seen before, promote it */
+    cache_list_del(c, b);
+    cache_list_add(c, CACHE_AM, b);
+    b->data = data;
+    return b;
+  }
+
+  b = calloc(1, sizeof(*b));
+  if (!b)
+    return NULL;
+
+  b->blk = blk;
+  b->data = data;
+  b->hash_next = *cache_hash_slot(c, blk);
+  *cache_hash_slot(c, blk) = b;
+  cache_list_add(c, CACHE_A1IN, b);
+  return b;
+}
+
+static void cache_touch(struct cache_dev *c, struct cache_block *b)
+{
+  if (b->queue == CACHE_AM) {
+    cache_list_del(c, b);
+    cache_list_add(c, CACHE_AM, b);
+  }
+}
+
+/* The part of block blk covered by [off, off + len), relative to off. */
+static void cache_block_range(uint64_t blk, uint64_t off, uint64_t len,
+                              size_t *skip, size_t *in_blk, size_t *n)
+{
+  uint64_t start = blk << CACHE_BLOCK_SHIFT, end = start + CACHE_BLOCK_SIZE;
+
+  if (start < off)
+    start = off;
+  if (end > off + len)
+    end = off + len;
+
+  *skip = start - off;
+  *in_blk = start & (CACHE_BLOCK_SIZE - 1);
+  *n = end - start;
+}
+
+static int cache_read_miss(struct cache_dev *c, const struct disk_iovec *iov,
+                           int iovcnt, uint64_t off, uint64_t len,
+                           uint64_t first, uint64_t last, uint64_t gen)
+{
+  struct disk_iovec run;
+  uint64_t blk;
+  char *buf;
+  int ret;
+
+  run.len = (last - first + 1) << CACHE_BLOCK_SHIFT;
+  if (run.len > c->dev.size - (first << CACHE_BLOCK_SHIFT))
+    run.len = c->dev.size - (first << CACHE_BLOCK_SHIFT);
+
+  buf = calloc(last - first + 1, CACHE_BLOCK_SIZE);
+  if (!buf)
+    return disk_read(c->lower, iov, iovcnt, off);
+
+  run.base = buf;
+  ret = disk_read(c->lower, &run, 1, first << CACHE_BLOCK_SHIFT);
+  if (ret)
+    goto out;
+
+  host_atomic_add(&disk_stats.cache_misses, last - first + 1);
+
+  for (blk = first; blk <= last; blk++) {
+    char *src = buf + ((blk - first) << CACHE_BLOCK_SHIFT);
+    size_t skip, in_blk, n;
+
+    cache_block_range(blk, off, len, &skip, &in_blk, &n);
+    disk_iov_from_buf(iov, iovcnt, skip, src + in_blk, n);
+  }
+
+  host_mutex_lock(&c->lock);
+  for (blk = first; gen == c->generation && blk <= last; blk++) {
+    struct cache_block *b = cache_lookup(c, blk);
+    char *data;
+    int err;
+
+    if (b && b->data)
+      continue;
+
+    data = cache_reclaim(c, &err);
+    if (!data)
+      break;
+
+    b = cache_lookup(c, blk);
+    if (gen != c->generation || (b && b->data)) {
+      free(data);
+      continue;
+    }
+
+    memcpy(data, buf + ((blk - first) << CACHE_BLOCK_SHIFT),
+           CACHE_BLOCK_SIZE);
+    if (!cache_insert(c, blk, data)) {
+      free(data);
+      break;
+    }
+  }
+  host_mutex_unlock(&c->lock);
+
+out:
+  free(buf);
+  return ret;
+}
+
+static int cache_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                      int iovcnt, uint64_t off)
+{
+  struct cache_dev *c = (struct cache_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt);
+  uint64_t blk, last, run, gen;
+  int ret;
+
+  if (!len)
+    return 0;
+
+  blk = off >> CACHE_BLOCK_SHIFT;
+  last = (off + len - 1) >> CACHE_BLOCK_SHIFT;
+
+  while (blk <= last) {
+    struct cache_block *b;
+
+    host_mutex_lock(&c->lock);
+    for (; blk <= last; blk++) {
+      size_t skip, in_blk, n;
+
+      b = cache_lookup_idle(c, blk);
+      if (!b || !b->data)
+        break;
+
+      cache_block_range(blk, off, len, &skip, &in_blk, &n);
+      disk_iov_from_buf(iov, iovcnt, skip, b->data + in_blk, n);
+      cache_touch(c, b);
+      host_atomic_add(&disk_stats.cache_hits, 1);
+    }
+
+    if (blk > last) {
+      host_mutex_unlock(&c->lock);
+      break;
+    }
+
+    for (run = blk + 1; run <= last && run - blk < CACHE_MAX_RUN; run++) {
+      b = cache_lookup(c, run);
+      if (b && b->data)
+        break;
+    }
+    gen = c->generation;
+    host_mutex_unlock(&c->lock);
+
+    ret = cache_read_miss(c, iov, iovcnt, off, len, blk, run - 1, gen);
+    if (ret)
+      return ret;
+    blk = run;
+  }
+
+  return 0;
+}
+
+/* Called with the lock held. */
+static void cache_drop_range(struct cache_dev *c, uint64_t first,
+                             uint64_t last)
+{
+  uint64_t blk;
+  int q;
+
+  if (last - first > c->nr_blocks + c->kout) {
+restart:
+    for (q = 0; q < NR_CACHE_QUEUES; q++) {
+      struct cache_block *b = c->queues[q].next, *next;
+
+      for (; b != &c->queues[q]; b = next) {
+        next = b->next;
+        if (b->blk < first || b->blk > last)
+          continue;
+        if (b->busy) {
+          host_cond_wait(&c->idle, &c->lock);
+          goto restart;
+        }
+        cache_free_block(c, b);
+      }
+    }
+    return;
+  }
+
+  for (blk = first; blk <= last; blk++) {
+    struct cache_block *b = cache_lookup_idle(c, blk);
+
+    if (b)
+      cache_free_block(c, b);
+  }
+}
+
+static int cache_write_through(struct cache_dev *c,
+                               const struct disk_iovec *iov, int iovcnt,
+                               uint64_t off, uint64_t len)
+{
+  uint64_t blk, last = (off + len - 1) >> CACHE_BLOCK_SHIFT;
+  int ret;
+
+  ret = disk_write(c->lower, iov, iovcnt, off);
+
+  host_mutex_lock(&c->lock);
+  c->generation++;
+  for (blk = off >> CACHE_BLOCK_SHIFT; blk <= last; blk++) {
+    struct cache_block *b = cache_lookup_idle(c, blk);
+    size_t skip, in_blk, n;
+
+    if (!b || !b->data)
+      continue;
+
+    if (ret) {
+      cache_free_block(c, b);
+      continue;
+    }
+
+    cache_block_range(blk, off, len, &skip, &in_blk, &n);
+    disk_iov_to_buf(iov, iovcnt, skip, b->data + in_blk, n);
+  }
+  host_mutex_unlock(&c->lock);
+
+  return ret;
+}
+
+/*
+ * Called with the lock held for a block that has no data in the cache and
+ * is about to be written.  If the write covers only part of the block, the
+ * rest is read from the lower device while the block is busy.
+ */
+static struct cache_block *cache_fill(struct cache_dev *c, uint64_t blk,
+                                      int partial, int *err)
+{
+  struct disk_iovec fill;
+  struct cache_block *b;
+  uint64_t start = blk << CACHE_BLOCK_SHIFT;
+  char *data;
+
+  data = cache_reclaim(c, err);
+  if (!data)
+    return NULL;
+
+  /* another writer may have added it while the lock was dropped */
+  b = cache_lookup_idle(c, blk);
+  if (b && b->data) {
+    free(data);
+    cache_touch(c, b);
+    return b;
+  }
+
+  b = cache_insert(c, blk, data);
+  if (!b) {
+    free(data);
+    *err = -ENOMEM;
+    return NULL;
+  }
+  if (!partial)
+    return b;
+
+  fill.base = data;
+  fill.len = CACHE_BLOCK_SIZE;
+  if (fill.len > c->dev.size - start)
+    fill.len = c->dev.size - start;
+  memset(data, 0, CACHE_BLOCK_SIZE);
+
+  b->busy = 1;
+  host_mutex_unlock(&c->lock);
+  *err = disk_read(c->lower, &fill, 1, start);
+  host_mutex_lock(&c->lock);
+  b->busy = 0;
+  host_cond_broadcast(&c->idle);
+
+  if (*err) {
+    cache_free_block(c, b);
+    return NULL;
+  }
+  return b;
+}
+
+static int cache_write_back(struct cache_dev *c, const struct disk_iovec *iov,
+                            int iovcnt, uint64_t off, uint64_t len)
+{
+  uint64_t blk, last = (off + len - 1) >> CACHE_BLOCK_SHIFT;
+  int ret = 0;
+
+  host_mutex_lock(&c->lock);
+  c->generation++;
+  for (blk = off >> CACHE_BLOCK_SHIFT; blk <= last; blk++) {
+    struct cache_block *b = cache_lookup_idle(c, blk);
+    size_t skip, in_blk, n;
+
+    cache_block_range(blk, off, len, &skip, &in_blk, &n);
+
+    if (!b || !b->data) {
+      b = cache_fill(c, blk, n < CACHE_BLOCK_SIZE, &ret);
+      if (!b)
+        break;
+    } else {
+      cache_touch(c, b);
+    }
+
+    disk_iov_to_buf(iov, iovcnt, skip, b->data + in_blk, n);
+    b->dirty = 1;
+  }
+  host_mutex_unlock(&c->lock);
+
+  return ret;
+}
+
+static int cache_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                       int iovcnt, uint64_t off)
+{
+  struct cache_dev *c = (struct cache_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt);
+
+  if (!len)
+    return 0;
+
+  if (c->write_back)
+    return cache_write_back(c, iov, iovcnt, off, len);
+
+  return cache_write_through(c, iov, iovcnt, off, len);
+}
+
+static int cache_cmp_blk(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Writes back the blocks that are dirty when called, in block order, with
+ * runs of adjacent ones merged into single requests.  The lock is dropped
+ * for each write, so the blocks are looked up again by number.
+ */
+static int cache_sync(struct cache_dev *c)
+{
+  struct cache_block *run[CACHE_MAX_RUN];
+  uint64_t *dirty;
+  size_t nr = 0, i;
+  int q, n, ret = 0;
+
+  if (!c->write_back)
+    return 0;
+
+  host_mutex_lock(&c->lock);
+  dirty = malloc((c->nr[CACHE_A1IN] + c->nr[CACHE_AM] + 1) * sizeof(*dirty));
+  if (!dirty) {
+    host_mutex_unlock(&c->lock);
+    return -ENOMEM;
+  }
+  for (q = CACHE_A1IN; q <= CACHE_AM; q++) {
+    struct cache_block *b;
+
+    for (b = c->queues[q].next; b != &c->queues[q]; b = b->next)
+      if (b->dirty)
+        dirty[nr++] = b->blk;
+  }
+  qsort(dirty, nr, sizeof(*dirty), cache_cmp_blk);
+
+  for (i = 0; i < nr; i += n) {
+    struct cache_block *b = cache_lookup_idle(c, dirty[i]);
+    int err;
+
+    n = 1;
+    if (!b || !b->dirty)
+      continue;
+
+    run[0] = b;
+    while (n < CACHE_MAX_RUN && i + n < nr &&
+           dirty[i + n] == dirty[i] + n) {
+      b = cache_lookup(c, dirty[i + n]);
+      if (!b || !b->dirty || b->busy)
+        break;
+      run[n++] = b;
+    }
+
+    err = cache_writeback(c, run, n);
+    if (err && !ret)
+      ret = err;
+  }
+  host_mutex_unlock(&c->lock);
+
+  free(dirty);
+  return ret;
+}
+
+static int cache_flush(struct disk_dev *dev)
+{
+  struct cache_dev *c = (struct cache_dev *)dev;
+  int ret;
+
+  ret = cache_sync(c);
+  if (ret)
+    return ret;
+
+  return disk_flush(c->lower);
+}
+
+static int cache_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct cache_dev *c = (struct cache_dev *)dev;
+  uint64_t first = (off + CACHE_BLOCK_SIZE - 1) >> CACHE_BLOCK_SHIFT;
+  uint64_t end = (off + len) >> CACHE_BLOCK_SHIFT;
+
+  /* only whole blocks are dropped, dirty or not */
+  host_mutex_lock(&c->lock);
+  c->generation++;
+  if (first < end)
+    cache_drop_range(c, first, end - 1);
+  host_mutex_unlock(&c->lock);
+
+  return disk_discard(c->lower, off, len);
+}
+
+static void cache_close(struct disk_dev *dev)
+{
+  struct cache_dev *c = (struct cache_dev *)dev;
+  int q;
+
+  cache_sync(c);
+
+  for (q = 0; q < NR_CACHE_QUEUES; q++)
+    while (c->queues[q].next != &c->queues[q])
+      cache_free_block(c, c->queues[q].next);
+
+  disk_close(c->lower);
+  free(c->hash);
+  free(c);
+}
+
+static const struct disk_ops cache_ops = {
+  .read = cache_read,
+  .write = cache_write,
+  .flush = cache_flush,
+  .discard = cache_discard,
+  .close = cache_close,
+};
+
+/* On failure lower is left to the caller. */
+struct disk_dev *disk_cache_open(struct disk_dev *lower, uint64_t size,
+                                 int write_back, int *err)
+{
+  struct cache_dev *c;
+  size_t hash_size = 1;
+  int q;
+
+  if (size < 4 * CACHE_BLOCK_SIZE) {
+    if (err)
+      *err = -EINVAL;
+    return NULL;
+  }
+
+  c = calloc(1, sizeof(*c));
+  if (!c)
+    goto out_nomem;
+
+  c->dev.ops = &cache_ops;
+  c->dev.size = lower->size;
+  c->dev.flags = lower->flags;
+  c->lower = lower;
+  c->write_back = write_back;
+  c->nr_blocks = size >> CACHE_BLOCK_SHIFT;
+  c->kin = c->nr_blocks / 4;
+  c->kout = c->nr_blocks / 2;
+  host_mutex_init(&c->lock);
+  host_cond_init(&c->idle);
+
+  for (q = 0; q < NR_CACHE_QUEUES; q++)
+    c->queues[q].next = c->queues[q].prev = &c->queues[q];
+
+  while (hash_size < c->nr_blocks + c->kout)
+    hash_size <<= 1;
+  c->hash = calloc(hash_size, sizeof(*c->hash));
+  if (!c->hash)
+    goto out_free;
+  c->hash_mask = hash_size - 1;
+
+  return &c->dev;
+
+out_free:
+  free(c);
+out_nomem:
+  if (err)
+    *err = -ENOMEM;
+  return NULL;
+}
@@ -0,0 +1,851 @@
+#include <stdlib.h>
+#include <string.h>
+#include <lz4.h>
+#include "disk.h"
+
+/*
+ * Compressed image backend.  The image is cut into 64 KiB chunks, each
+ * compressed with LZ4 on its own, and the file is laid out as
+ *
+ *   header | chunks | index | appended chunks and journal records
+ *
+ * The index has an entry per chunk with its offset and compressed length,
+ * a length of zero meaning a chunk of zeroes, and is loaded at open, so
+ * reading any chunk costs one host read and one decompression.  Recently
+ * used chunks are kept decompressed in an LRU cache, which is also where
+ * writes land.
+ *
+ * Nothing is ever overwritten in place.  Dirty chunks are compressed and
+ * appended to the file when they are evicted or on flush, and a flush then
+ * appends a journal record with the index entries changed since the last
+ * one and only then points the header at it.  Records are chained, opening
+ * the image replays them over the index, and after a crash the image reads
+ * as of the last completed flush.  Replaced chunks stay behind as garbage
+ * until chunk-image compacts the image offline.
+ *
+ * cache_lock covers the cache lists, chunk stores and the journal; a slot's
+ * lock covers its data and is never held while waiting for cache_lock.
+ * Loads only take index_lock to look up their entry.  The format is little
+ * endian, like every host this builds for.
+ */
+
+#define CHUNK_MAGIC "LKLCHUNK"
+#define CHUNK_JOURNAL_MAGIC "LKLCJRNL"
+#define CHUNK_VERSION 1
+#define CHUNK_SHIFT 16
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_HEADER_SIZE 4096
+#define CHUNK_COMPRESS_LZ4 1
+#define CHUNK_HASH_BITS 12
+#define CHUNK_MIN_SLOTS 16
+#define CHUNK_NONE UINT64_MAX
+
+/* stored as is, it didn't compress */
+#define CHUNK_F_RAW 0x1
+/* in memory only: changed since the last journal record */
+#define CHUNK_F_PENDING 0x80000000
+
+struct chunk_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t chunk_size;
+  uint32_t compression;
+  uint32_t reserved;
+  uint64_t disk_size;
+  uint64_t nr_chunks;
+  uint64_t index_off;
+  uint64_t journal_off;
+};
+
+struct chunk_entry {
+  uint64_t off;
+  uint32_t len;
+  uint32_t flags;
+};
+
+/* followed by nr_entries chunk_journal_entry */
+struct chunk_journal {
+  char magic[8];
+  uint64_t prev;
+  uint64_t nr_entries;
+};
+
+struct chunk_journal_entry {
+  uint64_t chunk;
+  struct chunk_entry entry;
+};
+
+struct chunk_slot {
+  uint64_t chunk;
+  int refs;
+  int valid;
+  int dirty;
+  char *data;
+  host_mutex_t lock;
+  struct chunk_slot *hash_next;
+  struct chunk_slot *lru_prev;
+  struct chunk_slot *lru_next;
+};
+
+struct chunk_dev {
+  struct disk_dev dev;
+  host_file_t file;
+  struct chunk_header hdr;
+  uint64_t nr_chunks;
+  uint64_t tail;
+  host_mutex_t index_lock;
+  struct chunk_entry *index;
+  uint64_t *pending;
+  uint64_t nr_pending;
+  uint64_t max_pending;
+  host_mutex_t cache_lock;
+  host_cond_t cache_cond;
+  struct chunk_slot *slots;
+  int nr_slots;
+  char *slot_data;
+  char *scratch;
+  struct chunk_slot *lru_head;
+  struct chunk_slot *lru_tail;
+  struct chunk_slot *hash[1 << CHUNK_HASH_BITS];
+};
+
+static size_t chunk_len(uint64_t size, uint64_t chunk)
+{
+  uint64_t start = chunk << CHUNK_SHIFT;
+
+  return size - start < CHUNK_SIZE ? size - start : CHUNK_SIZE;
+}
+
+static int chunk_is_zero(const char *data, size_t len)
+{
+  const uint64_t *p = (const uint64_t *)data;
+  size_t i;
+
+  for (i = 0; i < len / sizeof(*p); i++)
+    if (p[i])
+      return 0;
+  for (i *= sizeof(*p); i < len; i++)
+    if (data[i])
+      return 0;
+
+  return 1;
+}
+
+/*
+ * Compresses len bytes of data into scratch, or leaves them as they are if
+ * that doesn't make them smaller.  Returns the buffer to store.
+ */
+static const char *chunk_compress(const char *data, size_t len,
+                                  char *scratch, struct chunk_entry *e)
+{
+  int n = LZ4_compress_default(data, scratch, len, len - 1);
+
+  if (n > 0) {
+    e->len = n;
+    e->flags = 0;
+    return scratch;
+  }
+
+  e->len = len;
+  e->flags = CHUNK_F_RAW;
+  return data;
+}
+
+static struct chunk_slot **chunk_hash(struct chunk_dev *c, uint64_t chunk)
+{
+  return &c->hash[(chunk * 0x9e3779b97f4a7c15ULL) >> (64 - CHUNK_HASH_BITS)];
+}
+
+static struct chunk_slot *chunk_lookup(struct chunk_dev *c, uint64_t chunk)
+{
+  struct chunk_slot *s = *chunk_hash(c, chunk);
+
+  while (s && s->chunk != chunk)
+    s = s->hash_next;
+
+  return s;
+}
+
+static void chunk_unhash(struct chunk_dev *c, struct chunk_slot *s)
+{
+  struct chunk_slot **p = chunk_hash(c, s->chunk);
+
+  while (*p != s)
+    p = &(*p)->hash_next;
+  *p = s->hash_next;
+  s->chunk = CHUNK_NONE;
+}
+
+static void chunk_lru_unlink(struct chunk_dev *c, struct chunk_slot *s)
+{
+  if (s->lru_prev)
+    s->lru_prev->lru_next = s->lru_next;
+  else
+    c->lru_head = s->lru_next;
+  if (s->lru_next)
+    s->lru_next->lru_prev = s->lru_prev;
+  else
+    c->lru_tail = s->lru_prev;
+}
+
+static void chunk_lru_push(struct chunk_dev *c, struct chunk_slot *s)
+{
+  s->lru_prev = NULL;
+  s->lru_next = c->lru_head;
+  if (c->lru_head)
+    c->lru_head->lru_prev = s;
+  else
+    c->lru_tail = s;
+  c->lru_head = s;
+}
+
+/* Updates the index entry of chunk; called with cache_lock held. */
+static int chunk_set_entry(struct chunk_dev *c, uint64_t chunk,
+                           const struct chunk_entry *e)
+{
+  struct chunk_entry *old = &c->index[chunk];
+
+  if (!(old->flags & CHUNK_F_PENDING) && c->nr_pending == c->max_pending) {
+    uint64_t max = c->max_pending ? c->max_pending * 2 : 64;
+    uint64_t *pending = realloc(c->pending, max * sizeof(*pending));
+
+    if (!pending)
+      return -ENOMEM;
+    c->pending = pending;
+    c->max_pending = max;
+  }
+
+  host_mutex_lock(&c->index_lock);
+  if (!(old->flags & CHUNK_F_PENDING))
+    c->pending[c->nr_pending++] = chunk;
+  host_atomic_add(&disk_stats.chunk_live_bytes,
+                  (int64_t)e->len - (int64_t)old->len);
+  *old = *e;
+  old->flags |= CHUNK_F_PENDING;
+  host_mutex_unlock(&c->index_lock);
+
+  return 0;
+}
+
+/*
+ * Appends the slot's data to the image and points the index at it; called
+ * with cache_lock held and the slot either locked or unreferenced.
+ */
+static int chunk_store(struct chunk_dev *c, struct chunk_slot *s)
+{
+  size_t len = chunk_len(c->dev.size, s->chunk);
+  struct chunk_entry e;
+  const char *buf;
+  int ret;
+
+  memset(&e, 0, sizeof(e));
+  if (!chunk_is_zero(s->data, len)) {
+    buf = chunk_compress(s->data, len, c->scratch, &e);
+    e.off = c->tail;
+    ret = host_file_write(c->file, buf, e.len, e.off);
+    if (ret)
+      return ret;
+    c->tail += e.len;
+    disk_stats.chunk_image_bytes = c->tail;
+  }
+
+  ret = chunk_set_entry(c, s->chunk, &e);
+  if (ret)
+    return ret;
+
+  s->dirty = 0;
+  host_atomic_add(&disk_stats.chunk_stores, 1);
+  return 0;
+}
+
+/* Called with the slot locked. */
+static int chunk_load(struct chunk_dev *c, struct chunk_slot *s)
+{
+  size_t len = chunk_len(c->dev.size, s->chunk);
+  struct chunk_entry e;
+  char *buf;
+  int ret;
+
+  host_mutex_lock(&c->index_lock);
+  e = c->index[s->chunk];
+  host_mutex_unlock(&c->index_lock);
+
+  if (!e.len) {
+    memset(s->data, 0, len);
+    s->valid = 1;
+    return 0;
+  }
+
+  if (e.flags & CHUNK_F_RAW) {
+    if (e.len != len)
+      return -EIO;
+    ret = host_file_read(c->file, s->data, len, e.off);
+    goto out;
+  }
+
+  buf = malloc(e.len);
+  if (!buf)
+    return -ENOMEM;
+
+  ret = host_file_read(c->file, buf, e.len, e.off);
+  if (!ret && LZ4_decompress_safe(buf, s->data, e.len, CHUNK_SIZE) != (int)len)
+    ret = -EIO;
+  free(buf);
+
+out:
+  if (!ret) {
+    s->valid = 1;
+    host_atomic_add(&disk_stats.chunk_loads, 1);
+  }
+  return ret;
+}
+
+/* Least recently used slot nobody holds; called with cache_lock held. */
+static struct chunk_slot *chunk_victim(struct chunk_dev *c)
+{
+  struct chunk_slot *s;
+
+  for (s = c->lru_tail; s; s = s->lru_prev)
+    if (!s->refs)
+      return s;
+
+  return NULL;
+}
+
+/* Returns the slot for chunk locked, possibly not loaded yet. */
+static struct chunk_slot *chunk_get(struct chunk_dev *c, uint64_t chunk,
+                                    int *err)
+{
+  struct chunk_slot *s;
+
+  host_mutex_lock(&c->cache_lock);
+  for (;;) {
+    s = chunk_lookup(c, chunk);
+    if (s) {
+      host_atomic_add(&disk_stats.chunk_hits, 1);
+      break;
+    }
+
+    s = chunk_victim(c);
+    if (s) {
+      if (s->dirty) {
+        *err = chunk_store(c, s);
+        if (*err) {
+          host_mutex_unlock(&c->cache_lock);
+          return NULL;
+        }
+      }
+
+      if (s->chunk != CHUNK_NONE)
+        chunk_unhash(c, s);
+      s->chunk = chunk;
+      s->valid = 0;
+      s->hash_next = *chunk_hash(c, chunk);
+      *chunk_hash(c, chunk) = s;
+      break;
+    }
+
+    host_cond_wait(&c->cache_cond, &c->cache_lock);
+  }
+
+  s->refs++;
+  chunk_lru_unlink(c, s);
+  chunk_lru_push(c, s);
+  host_mutex_unlock(&c->cache_lock);
+
+  host_mutex_lock(&s->lock);
+  return s;
+}
+
+static void chunk_put(struct chunk_dev *c, struct chunk_slot *s)
+{
+  host_mutex_unlock(&s->lock);
+
+  host_mutex_lock(&c->cache_lock);
+  if (!--s->refs)
+    host_cond_signal(&c->cache_cond);
+  host_mutex_unlock(&c->cache_lock);
+}
+
+static int chunk_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                      int iovcnt, uint64_t off)
+{
+  struct chunk_dev *c = (struct chunk_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt), end = off + len, pos, next;
+  int ret = 0;
+
+  if (off > dev->size || len > dev->size - off)
+    return -EIO;
+
+  for (pos = off; !ret && pos < end; pos = next) {
+    uint64_t chunk = pos >> CHUNK_SHIFT;
+    size_t in_chunk = pos & (CHUNK_SIZE - 1);
+    struct chunk_slot *s;
+
+    next = (chunk + 1) << CHUNK_SHIFT;
+    if (next > end)
+      next = end;
+
+    s = chunk_get(c, chunk, &ret);
+    if (!s)
+      break;
+
+    if (!s->valid)
+      ret = chunk_load(c, s);
+    if (!ret)
+      disk_iov_from_buf(iov, iovcnt, pos - off, s->data + in_chunk,
+                        next - pos);
+    chunk_put(c, s);
+  }
+
+  return ret;
+}
+
+static int chunk_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                       int iovcnt, uint64_t off)
+{
+  struct chunk_dev *c = (struct chunk_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt), end = off + len, pos, next;
+  int ret = 0;
+
+  if (dev->flags & DISK_F_READONLY)
+    return -EROFS;
+
+  if (off > dev->size || len > dev->size - off)
+    return -EIO;
+
+  for (pos = off; !ret && pos < end; pos = next) {
+    uint64_t chunk = pos >> CHUNK_SHIFT;
+    size_t in_chunk = pos & (CHUNK_SIZE - 1);
+    struct chunk_slot *s;
+
+    next = (chunk + 1) << CHUNK_SHIFT;
+    if (next > end)
+      next = end;
+
+    s = chunk_get(c, chunk, &ret);
+    if (!s)
+      break;
+
+    /* chunks that are overwritten whole are not decompressed first */
+    if (!s->valid && next - pos < chunk_len(dev->size, chunk))
+      ret = chunk_load(c, s);
+    if (!ret) {
+      disk_iov_to_buf(iov, iovcnt, pos - off, s->data + in_chunk,
+                      next - pos);
+      s->valid = 1;
+      s->dirty = 1;
+    }
+    chunk_put(c, s);
+  }
+
+  return ret;
+}
+
+/* Appends a journal record and commits it; called with cache_lock held. */
+static int chunk_commit(struct chunk_dev *c)
+{
+  struct chunk_journal *rec;
+  struct chunk_journal_entry *entries;
+  struct chunk_header hdr;
+  uint64_t i, rec_off = c->tail;
+  size_t size;
+  int ret;
+
+  if (!c->nr_pending)
+    return 0;
+
+  size = sizeof(*rec) + c->nr_pending * sizeof(*entries);
+  rec = malloc(size);
+  if (!rec)
+    return -ENOMEM;
+
+  memcpy(rec->magic, CHUNK_JOURNAL_MAGIC, sizeof(rec->magic));
+  rec->prev = c->hdr.journal_off;
+  rec->nr_entries = c->nr_pending;
+  entries = (struct chunk_journal_entry *)(rec + 1);
+  for (i = 0; i < c->nr_pending; i++) {
+    entries[i].chunk = c->pending[i];
+    entries[i].entry = c->index[c->pending[i]];
+    entries[i].entry.flags &= ~CHUNK_F_PENDING;
+  }
+
+  /* never reuse the space, the header may already point into it */
+  c->tail += size;
+  disk_stats.chunk_image_bytes = c->tail;
+
+  ret = host_file_write(c->file, rec, size, rec_off);
+  if (!ret)
+    ret = host_file_flush(c->file);
+  if (ret)
+    goto out;
+
+  hdr = c->hdr;
+  hdr.journal_off = rec_off;
+  ret = host_file_write(c->file, &hdr, sizeof(hdr), 0);
+  if (!ret)
+    ret = host_file_flush(c->file);
+  if (ret)
+    goto out;
+
+  c->hdr = hdr;
+  host_mutex_lock(&c->index_lock);
+  for (i = 0; i < c->nr_pending; i++)
+    c->index[c->pending[i]].flags &= ~CHUNK_F_PENDING;
+  host_mutex_unlock(&c->index_lock);
+  c->nr_pending = 0;
+
+out:
+  free(rec);
+  return ret;
+}
+
+static int chunk_flush(struct disk_dev *dev)
+{
+  struct chunk_dev *c = (struct chunk_dev *)dev;
+  int i, ret = 0;
+
+  if (dev->flags & DISK_F_READONLY)
+    return 0;
+
+  host_mutex_lock(&c->cache_lock);
+  for (i = 0; !ret && i < c->nr_slots; i++) {
+    struct chunk_slot *s = &c->slots[i];
+
+    host_mutex_lock(&s->lock);
+    if (s->dirty)
+      ret = chunk_store(c, s);
+    host_mutex_unlock(&s->lock);
+  }
+  if (!ret)
+    ret = chunk_commit(c);
+  host_mutex_unlock(&c->cache_lock);
+
+  return ret;
+}
+
+/* Whole chunks are dropped and read as zeroes from then on. */
+static int chunk_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct chunk_dev *c = (struct chunk_dev *)dev;
+  struct chunk_entry zero;
+  uint64_t chunk, end;
+  int ret = 0;
+
+  if (dev->flags & DISK_F_READONLY)
+    return -EOPNOTSUPP;
+
+  if (off >= dev->size)
+    return 0;
+  if (len > dev->size - off)
+    len = dev->size - off;
+
+  chunk = (off + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+  end = off + len == dev->size ? c->nr_chunks : (off + len) >> CHUNK_SHIFT;
+  memset(&zero, 0, sizeof(zero));
+
+  host_mutex_lock(&c->cache_lock);
+  for (; !ret && chunk < end; chunk++) {
+    struct chunk_slot *s = chunk_lookup(c, chunk);
+
+    if (s) {
+      host_mutex_lock(&s->lock);
+      memset(s->data, 0, CHUNK_SIZE);
+      s->valid = 1;
+      s->dirty = 0;
+      host_mutex_unlock(&s->lock);
+    }
+
+    if (c->index[chunk].len) {
+      ret = chunk_set_entry(c, chunk, &zero);
+      if (!ret) {
+        host_atomic_add(&disk_stats.host_discards, 1);
+        host_atomic_add(&disk_stats.discard_bytes,
+                        chunk_len(dev->size, chunk));
+      }
+    }
+  }
+  host_mutex_unlock(&c->cache_lock);
+
+  return ret;
+}
+
+static void chunk_free(struct chunk_dev *c)
+{
+  free(c->index);
+  free(c->pending);
+  free(c->slots);
+  free(c->slot_data);
+  free(c->scratch);
+  free(c);
+}
+
+static void chunk_close(struct disk_dev *dev)
+{
+  struct chunk_dev *c = (struct chunk_dev *)dev;
+
+  chunk_flush(dev);
+  host_file_close(c->file);
+  chunk_free(c);
+}
+
+static const struct disk_ops chunk_ops = {
+  .read = chunk_read,
+  .write = chunk_write,
+  .flush = chunk_flush,
+  .discard = chunk_discard,
+  .close = chunk_close,
+};
+
+static int chunk_check_header(const struct chunk_header *hdr)
+{
+  if (memcmp(hdr->magic, CHUNK_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != CHUNK_VERSION || hdr->chunk_size != CHUNK_SIZE ||
+      hdr->compression != CHUNK_COMPRESS_LZ4 ||
+      hdr->nr_chunks != (hdr->disk_size + CHUNK_SIZE - 1) >> CHUNK_SHIFT ||
+      hdr->nr_chunks > SIZE_MAX / sizeof(struct chunk_entry))
+    return -EINVAL;
+
+  return 0;
+}
+
+/* Applies the journal records, oldest first, over the index. */
+static int chunk_replay(struct chunk_dev *c)
+{
+  uint64_t *recs = NULL, nr_recs = 0, max_recs = 0, off, i, j;
+  struct chunk_journal rec;
+  struct chunk_journal_entry *entries = NULL;
+  int ret = 0;
+
+  for (off = c->hdr.journal_off; off; off = rec.prev) {
+    ret = host_file_read(c->file, &rec, sizeof(rec), off);
+    if (ret)
+      goto out;
+
+    /* records only ever point back */
+    if (memcmp(rec.magic, CHUNK_JOURNAL_MAGIC, sizeof(rec.magic)) ||
+        rec.prev >= off) {
+      ret = -EINVAL;
+      goto out;
+    }
+
+    if (nr_recs == max_recs) {
+      uint64_t max = max_recs ? max_recs * 2 : 64;
+      uint64_t *p = realloc(recs, max * sizeof(*recs));
+
+      if (!p) {
+        ret = -ENOMEM;
+        goto out;
+      }
+      recs = p;
+      max_recs = max;
+    }
+    recs[nr_recs++] = off;
+  }
+
+  for (i = nr_recs; i--;) {
+    ret = host_file_read(c->file, &rec, sizeof(rec), recs[i]);
+    if (ret)
+      goto out;
+
+    if (rec.nr_entries > c->nr_chunks) {
+      ret = -EINVAL;
+      goto out;
+    }
+
+    free(entries);
+    entries = malloc(rec.nr_entries * sizeof(*entries));
+    if (!entries) {
+      ret = -ENOMEM;
+      goto out;
+    }
+
+    ret = host_file_read(c->file, entries,
+                         rec.nr_entries * sizeof(*entries),
+                         recs[i] + sizeof(rec));
+    if (ret)
+      goto out;
+
+    for (j = 0; j < rec.nr_entries; j++) {
+      if (entries[j].chunk >= c->nr_chunks) {
+        ret = -EINVAL;
+        goto out;
+      }
+      c->index[entries[j].chunk] = entries[j].entry;
+    }
+  }
+
+out:
+  free(entries);
+  free(recs);
+  return ret;
+}
+
+/*
+ * Returns 1 if file holds a compressed image, 0 if not.  Reads a whole
+ * aligned page, so it also works on unbuffered files.
+ */
+int disk_chunk_probe(host_file_t file)
+{
+  char *buf;
+  int ret;
+
+  buf = host_alloc_aligned(CHUNK_HEADER_SIZE, CHUNK_HEADER_SIZE);
+  if (!buf)
+    return -ENOMEM;
+
+  ret = host_file_read(file, buf, CHUNK_HEADER_SIZE, 0);
+  if (!ret)
+    ret = !memcmp(buf, CHUNK_MAGIC, strlen(CHUNK_MAGIC));
+
+  host_free_aligned(buf);
+  return ret;
+}
+
+/*
+ * Opens a compressed image, caching up to cache_size bytes of decompressed
+ * chunks.  Takes ownership of file, also on failure.
+ */
+struct disk_dev *disk_chunk_open(host_file_t file, unsigned int flags,
+                                 uint64_t cache_size, int *err)
+{
+  struct chunk_dev *c;
+  uint64_t i;
+  int j, ret = -ENOMEM;
+
+  if (flags & DISK_F_UNBUFFERED) {
+    ret = -EINVAL;
+    goto out_close;
+  }
+
+  c = calloc(1, sizeof(*c));
+  if (!c)
+    goto out_close;
+
+  c->dev.ops = &chunk_ops;
+  c->dev.flags = flags;
+  c->file = file;
+  host_mutex_init(&c->index_lock);
+  host_mutex_init(&c->cache_lock);
+  host_cond_init(&c->cache_cond);
+
+  ret = host_file_read(file, &c->hdr, sizeof(c->hdr), 0);
+  if (!ret)
+    ret = chunk_check_header(&c->hdr);
+  if (ret)
+    goto out_free;
+
+  c->dev.size = c->hdr.disk_size;
+  c->nr_chunks = c->hdr.nr_chunks;
+  c->index = malloc(c->nr_chunks * sizeof(*c->index));
+  if (!c->index) {
+    ret = -ENOMEM;
+    goto out_free;
+  }
+
+  ret = host_file_read(file, c->index, c->nr_chunks * sizeof(*c->index),
+                       c->hdr.index_off);
+  if (!ret)
+    ret = chunk_replay(c);
+  if (!ret)
+    ret = host_file_size(file, &c->tail);
+  if (ret)
+    goto out_free;
+
+  for (i = 0; i < c->nr_chunks; i++) {
+    c->index[i].flags &= ~CHUNK_F_PENDING;
+    disk_stats.chunk_live_bytes += c->index[i].len;
+  }
+  disk_stats.chunk_image_bytes = c->tail;
+
+  c->nr_slots = cache_size >> CHUNK_SHIFT;
+  if (c->nr_slots < CHUNK_MIN_SLOTS)
+    c->nr_slots = CHUNK_MIN_SLOTS;
+  c->slots = calloc(c->nr_slots, sizeof(*c->slots));
+  c->slot_data = malloc((size_t)c->nr_slots << CHUNK_SHIFT);
+  c->scratch = malloc(CHUNK_SIZE);
+  if (!c->slots || !c->slot_data || !c->scratch) {
+    ret = -ENOMEM;
+    goto out_free;
+  }
+
+  for (j = 0; j < c->nr_slots; j++) {
+    struct chunk_slot *s = &c->slots[j];
+
+    s->chunk = CHUNK_NONE;
+    s->data = c->slot_data + ((size_t)j << CHUNK_SHIFT);
+    host_mutex_init(&s->lock);
+    chunk_lru_push(c, s);
+  }
+
+  return &c->dev;
+
+out_free:
+  chunk_free(c);
+out_close:
+  host_file_close(file);
+  if (err)
+    *err = ret;
+  return NULL;
+}
+
+/*
+ * Writes the contents of src to the empty file as a compressed image with
+ * no garbage and no journal.  The header goes last, so an interrupted run
+ * doesn't leave a file that looks like an image.
+ */
+int disk_chunk_create(struct disk_dev *src, host_file_t file)
+{
+  struct chunk_header hdr;
+  struct chunk_entry *index;
+  char *data, *scratch;
+  uint64_t chunk, off = CHUNK_HEADER_SIZE;
+  int ret = -ENOMEM;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CHUNK_MAGIC, sizeof(hdr.magic));
+  hdr.version = CHUNK_VERSION;
+  hdr.chunk_size = CHUNK_SIZE;
+  hdr.compression = CHUNK_COMPRESS_LZ4;
+  hdr.disk_size = src->size;
+  hdr.nr_chunks = (src->size + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+  if (hdr.nr_chunks > SIZE_MAX / sizeof(*index))
+    return -EFBIG;
+
+  index = calloc(hdr.nr_chunks, sizeof(*index));
+  data = malloc(CHUNK_SIZE);
+  scratch = malloc(CHUNK_SIZE);
+  if (!index || !data || !scratch)
+    goto out;
+
+  ret = 0;
+  for (chunk = 0; !ret && chunk < hdr.nr_chunks; chunk++) {
+    struct disk_iovec iov = { data, chunk_len(src->size, chunk) };
+    const char *buf;
+
+    ret = disk_read(src, &iov, 1, chunk << CHUNK_SHIFT);
+    if (ret || chunk_is_zero(data, iov.len))
+      continue;
+
+    buf = chunk_compress(data, iov.len, scratch, &index[chunk]);
+    index[chunk].off = off;
+    ret = host_file_write(file, buf, index[chunk].len, off);
+    off += index[chunk].len;
+  }
+
+  hdr.index_off = off;
+  if (!ret)
+    ret = host_file_write(file, index, hdr.nr_chunks * sizeof(*index), off);
+  if (!ret)
+    ret = host_file_flush(file);
+  if (!ret)
+    ret = host_file_write(file, &hdr, sizeof(hdr), 0);
+  if (!ret)
+    ret = host_file_flush(file);
+
+out:
+  free(index);
+  free(data);
+  free(scratch);
+  return ret;
+}
@@ -0,0 +1,593 @@
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AESNI
+#endif
+
+/*
+ * Encryption layer: the lower device holds the image encrypted with
+ * XTS-AES (IEEE 1619) in 512 byte data units, the tweak being the little
+ * endian sector number, like dm-crypt's aes-xts-plain64.  There is no
+ * header; the key, 32 bytes for XTS-AES-128 or 64 for XTS-AES-256, comes
+ * from the caller.
+ *
+ * Reads are decrypted in place in the caller's buffers, writes encrypted
+ * into a bounce buffer.  Either way all the sectors of a contiguous run
+ * are handed to the cipher at once, which keeps 8 registers of blocks in
+ * flight at a time: with VAES 16 blocks, two to a register, with AES-NI
+ * 8, and with neither a byte-oriented portable AES does them one by one.
+ *
+ * Discards aren't passed down: they would show which parts of the image
+ * are in use.
+ */
+
+#define CRYPT_SECTOR_SHIFT 9
+#define CRYPT_SECTOR_SIZE (1 << CRYPT_SECTOR_SHIFT)
+#define CRYPT_BLOCK_SIZE 16
+#define CRYPT_BLOCKS (CRYPT_SECTOR_SIZE / CRYPT_BLOCK_SIZE)
+#define CRYPT_BATCH 8
+#define CRYPT_BUF_SIZE (256 << 10)
+#define AES_MAX_ROUNDS 14
+
+struct aes_key {
+  uint8_t enc[AES_MAX_ROUNDS + 1][CRYPT_BLOCK_SIZE];
+  /* for the AES-NI equivalent inverse cipher */
+  uint8_t dec[AES_MAX_ROUNDS + 1][CRYPT_BLOCK_SIZE];
+  int rounds;
+};
+
+struct crypt_keys {
+  struct aes_key data;
+  struct aes_key tweak;
+};
+
+typedef void (*xts_fn)(const struct crypt_keys *k, uint8_t *buf,
+                       size_t nr_sectors, uint64_t sector, int encrypt);
+
+struct crypt_dev {
+  struct disk_dev dev;
+  struct disk_dev *lower;
+  struct crypt_keys keys;
+  xts_fn xts;
+};
+
+static const uint8_t aes_sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b,
+  0xfe, 0xd7, 0xab, 0x76, 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+  0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0, 0xb7, 0xfd, 0x93, 0x26,
+  0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2,
+  0xeb, 0x27, 0xb2, 0x75, 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+  0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84, 0x53, 0xd1, 0x00, 0xed,
+  0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f,
+  0x50, 0x3c, 0x9f, 0xa8, 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+  0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2, 0xcd, 0x0c, 0x13, 0xec,
+  0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14,
+  0xde, 0x5e, 0x0b, 0xdb, 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+  0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79, 0xe7, 0xc8, 0x37, 0x6d,
+  0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f,
+  0x4b, 0xbd, 0x8b, 0x8a, 0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+  0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e, 0xe1, 0xf8, 0x98, 0x11,
+  0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f,
+  0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t aes_inv_sbox[256];
+
+static uint8_t aes_xtime(uint8_t x)
+{
+  return (uint8_t)((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+static void aes_expand_key(struct aes_key *k, const uint8_t *key,
+                           size_t key_len)
+{
+  uint8_t *w = &k->enc[0][0];
+  int nk = (int)key_len / 4, nr_words, i, j;
+  uint8_t t[4], rcon = 1;
+
+  k->rounds = nk + 6;
+  nr_words = 4 * (k->rounds + 1);
+  memcpy(w, key, key_len);
+
+  for (i = nk; i < nr_words; i++) {
+    memcpy(t, w + 4 * (i - 1), 4);
+    if (i % nk == 0) {
+      uint8_t t0 = t[0];
+
+      t[0] = aes_sbox[t[1]] ^ rcon;
+      t[1] = aes_sbox[t[2]];
+      t[2] = aes_sbox[t[3]];
+      t[3] = aes_sbox[t0];
+      rcon = aes_xtime(rcon);
+    } else if (nk > 6 && i % nk == 4) {
+      for (j = 0; j < 4; j++)
+        t[j] = aes_sbox[t[j]];
+    }
+    for (j = 0; j < 4; j++)
+      w[4 * i + j] = w[4 * (i - nk) + j] ^ t[j];
+  }
+}
+
+static void aes_add_round_key(uint8_t *s, const uint8_t *rk)
+{
+  int i;
+
+  for (i = 0; i < CRYPT_BLOCK_SIZE; i++)
+    s[i] ^= rk[i];
+}
+
+static void aes_mix_column(uint8_t *col)
+{
+  uint8_t a = col[0] ^ col[1] ^ col[2] ^ col[3], c0 = col[0];
+
+  col[0] ^= a ^ aes_xtime(col[0] ^ col[1]);
+  col[1] ^= a ^ aes_xtime(col[1] ^ col[2]);
+  col[2] ^= a ^ aes_xtime(col[2] ^ col[3]);
+  col[3] ^= a ^ aes_xtime(col[3] ^ c0);
+}
+
+/* SubBytes and ShiftRows; the state is column major. */
+static void aes_sub_shift(uint8_t *s, const uint8_t *box, int dir)
+{
+  uint8_t t[CRYPT_BLOCK_SIZE];
+  int c, r;
+
+  for (c = 0; c < 4; c++)
+    for (r = 0; r < 4; r++)
+      t[4 * c + r] = box[s[4 * ((c + dir * r + 4) % 4) + r]];
+  memcpy(s, t, sizeof(t));
+}
+
+static void aes_encrypt_block(const struct aes_key *k, uint8_t *s)
+{
+  int round, c;
+
+  aes_add_round_key(s, k->enc[0]);
+  for (round = 1; round <= k->rounds; round++) {
+    aes_sub_shift(s, aes_sbox, 1);
+    for (c = 0; round < k->rounds && c < 4; c++)
+      aes_mix_column(s + 4 * c);
+    aes_add_round_key(s, k->enc[round]);
+  }
+}
+
+static void aes_decrypt_block(const struct aes_key *k, uint8_t *s)
+{
+  int round, c;
+
+  for (round = k->rounds; round > 0; round--) {
+    aes_add_round_key(s, k->enc[round]);
+    for (c = 0; round < k->rounds && c < 4; c++) {
+      /* InvMixColumns is MixColumns after this */
+      uint8_t *col = s + 4 * c, u, v;
+
+      u = aes_xtime(aes_xtime(col[0] ^ col[2]));
+      v = aes_xtime(aes_xtime(col[1] ^ col[3]));
+      col[0] ^= u;
+      col[1] ^= v;
+      col[2] ^= u;
+      col[3] ^= v;
+      aes_mix_column(col);
+    }
+    aes_sub_shift(s, aes_inv_sbox, -1);
+  }
+  aes_add_round_key(s, k->enc[0]);
+}
+
+static void xts_tweak(uint8_t *t, uint64_t sector)
+{
+  int i;
+
+  for (i = 0; i < CRYPT_BLOCK_SIZE; i++, sector >>= 8)
+    t[i] = i < 8 ? (uint8_t)sector : 0;
+}
+
+/* Multiplies the tweak by the primitive element of GF(2^128). */
+static void xts_next_tweak(uint8_t *t)
+{
+  uint8_t carry = t[CRYPT_BLOCK_SIZE - 1] >> 7;
+  int i;
+
+  for (i = CRYPT_BLOCK_SIZE - 1; i > 0; i--)
+    t[i] = (uint8_t)((t[i] << 1) | (t[i - 1] >> 7));
+  t[0] = (uint8_t)((t[0] << 1) ^ (carry * 0x87));
+}
+
+static void xts_generic(const struct crypt_keys *k, uint8_t *buf,
+                        size_t nr_sectors, uint64_t sector, int encrypt)
+{
+  uint8_t t[CRYPT_BLOCK_SIZE];
+  int b;
+
+  for (; nr_sectors--; sector++) {
+    xts_tweak(t, sector);
+    aes_encrypt_block(&k->tweak, t);
+
+    for (b = 0; b < CRYPT_BLOCKS; b++, buf += CRYPT_BLOCK_SIZE) {
+      aes_add_round_key(buf, t);
+      if (encrypt)
+        aes_encrypt_block(&k->data, buf);
+      else
+        aes_decrypt_block(&k->data, buf);
+      aes_add_round_key(buf, t);
+      xts_next_tweak(t);
+    }
+  }
+}
+
+#ifdef HAVE_AESNI
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#define VAES_TARGET __attribute__((target("vaes,avx2,aes,sse2")))
+/* keeps the batch in registers rather than in an array on the stack */
+#define CRYPT_UNROLL _Pragma("GCC unroll 8")
+
+AESNI_TARGET
+static __m128i aesni_next_tweak(__m128i t)
+{
+  /* the carries out of bits 63 and 127, moved to where they go in */
+  __m128i carry = _mm_srai_epi32(_mm_shuffle_epi32(t, 0x13), 31);
+
+  return _mm_xor_si128(_mm_add_epi64(t, t),
+                       _mm_and_si128(carry, _mm_set_epi32(0, 1, 0, 0x87)));
+}
+
+AESNI_TARGET
+static __m128i aesni_first_tweak(const struct aes_key *k, uint64_t sector)
+{
+  __m128i t = _mm_xor_si128(_mm_set_epi64x(0, (long long)sector),
+                            _mm_loadu_si128((const __m128i *)k->enc[0]));
+  int r;
+
+  for (r = 1; r < k->rounds; r++)
+    t = _mm_aesenc_si128(t, _mm_loadu_si128((const __m128i *)k->enc[r]));
+  return _mm_aesenclast_si128(t,
+                              _mm_loadu_si128((const __m128i *)k->enc[r]));
+}
+
+AESNI_TARGET
+static void xts_aesni(const struct crypt_keys *k, uint8_t *buf,
+                      size_t nr_sectors, uint64_t sector, int encrypt)
+{
+  const struct aes_key *d = &k->data;
+  __m128i rk[AES_MAX_ROUNDS + 1], t[CRYPT_BATCH], x[CRYPT_BATCH], tweak;
+  int b, i, r;
+
+  for (r = 0; r <= d->rounds; r++)
+    rk[r] = _mm_loadu_si128((const __m128i *)(encrypt ? d->enc[r] :
+                                              d->dec[r]));
+
+  for (; nr_sectors--; sector++) {
+    tweak = aesni_first_tweak(&k->tweak, sector);
+
+    for (b = 0; b < CRYPT_BLOCKS; b += CRYPT_BATCH) {
+      __m128i *p = (__m128i *)(buf + b * CRYPT_BLOCK_SIZE);
+
+      CRYPT_UNROLL
+      for (i = 0; i < CRYPT_BATCH; i++) {
+        t[i] = tweak;
+        tweak = aesni_next_tweak(tweak);
+        x[i] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(p + i), t[i]),
+                             rk[0]);
+      }
+
+      if (encrypt) {
+        for (r = 1; r < d->rounds; r++) {
+          CRYPT_UNROLL
+          for (i = 0; i < CRYPT_BATCH; i++)
+            x[i] = _mm_aesenc_si128(x[i], rk[r]);
+        }
+        CRYPT_UNROLL
+        for (i = 0; i < CRYPT_BATCH; i++)
+          x[i] = _mm_aesenclast_si128(x[i], rk[r]);
+      } else {
+        for (r = 1; r < d->rounds; r++) {
+          CRYPT_UNROLL
+          for (i = 0; i < CRYPT_BATCH; i++)
+            x[i] = _mm_aesdec_si128(x[i], rk[r]);
+        }
+        CRYPT_UNROLL
+        for (i = 0; i < CRYPT_BATCH; i++)
+          x[i] = _mm_aesdeclast_si128(x[i], rk[r]);
+      }
+
+      CRYPT_UNROLL
+      for (i = 0; i < CRYPT_BATCH; i++)
+        _mm_storeu_si128(p + i, _mm_xor_si128(x[i], t[i]));
+    }
+    buf += CRYPT_SECTOR_SIZE;
+  }
+}
+
+/* Multiplies the tweak in each half by the primitive element. */
+VAES_TARGET
+static __m256i vaes_next_tweaks(__m256i t)
+{
+  __m256i carry = _mm256_srai_epi32(_mm256_shuffle_epi32(t, 0x13), 31);
+
+  return _mm256_xor_si256(
+      _mm256_add_epi64(t, t),
+      _mm256_and_si256(carry, _mm256_set_epi32(0, 1, 0, 0x87, 0, 1, 0, 0x87)));
+}
+
+/*
+ * Sectors go two at a time, in batches of CRYPT_BATCH registers of two
+ * blocks each.  The first batch of a pair also encrypts the tweaks of the
+ * next pair, one to each half of another register, so that tweak AES
+ * overlaps the data rounds instead of delaying every sector.
+ */
+VAES_TARGET
+static void xts_vaes(const struct crypt_keys *k, uint8_t *buf,
+                     size_t nr_sectors, uint64_t sector, int encrypt)
+{
+  const struct aes_key *d = &k->data;
+  __m256i rk[AES_MAX_ROUNDS + 1], tk[AES_MAX_ROUNDS + 1];
+  __m256i t[CRYPT_BATCH], x[CRYPT_BATCH], tweaks, next, step;
+  int rounds = d->rounds, b, i, r, s, n;
+
+  for (r = 0; r <= rounds; r++) {
+    rk[r] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)(encrypt ? d->enc[r] : d->dec[r])));
+    tk[r] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)k->tweak.enc[r]));
+  }
+
+  next = _mm256_set_m128i(aesni_first_tweak(&k->tweak, sector + 1),
+                          aesni_first_tweak(&k->tweak, sector));
+
+  for (; nr_sectors; nr_sectors -= n, sector += n) {
+    n = nr_sectors < 2 ? 1 : 2;
+    tweaks = next;
+    next = _mm256_xor_si256(
+        _mm256_set_epi64x(0, (long long)(sector + 3), 0,
+                          (long long)(sector + 2)),
+        tk[0]);
+
+    for (s = 0; s < n; s++) {
+      /* the sector's tweak and the one after it, in both halves */
+      step = _mm256_broadcastsi128_si256(s ? _mm256_extracti128_si256(
+                                                 tweaks, 1) :
+                                             _mm256_castsi256_si128(tweaks));
+      step = _mm256_blend_epi32(step, vaes_next_tweaks(step), 0xf0);
+
+      for (b = 0; b < CRYPT_BLOCKS; b += 2 * CRYPT_BATCH) {
+        __m256i *p = (__m256i *)(buf + b * CRYPT_BLOCK_SIZE);
+
+        CRYPT_UNROLL
+        for (i = 0; i < CRYPT_BATCH; i++) {
+          t[i] = step;
+          step = vaes_next_tweaks(vaes_next_tweaks(step));
+          x[i] = _mm256_xor_si256(
+              _mm256_xor_si256(_mm256_loadu_si256(p + i), t[i]), rk[0]);
+        }
+
+        if (encrypt) {
+          for (r = 1; r < rounds; r++) {
+            CRYPT_UNROLL
+            for (i = 0; i < CRYPT_BATCH; i++)
+              x[i] = _mm256_aesenc_epi128(x[i], rk[r]);
+            if (!s && !b)
+              next = _mm256_aesenc_epi128(next, tk[r]);
+          }
+          CRYPT_UNROLL
+          for (i = 0; i < CRYPT_BATCH; i++)
+            x[i] = _mm256_aesenclast_epi128(x[i], rk[r]);
+        } else {
+          for (r = 1; r < rounds; r++) {
+            CRYPT_UNROLL
+            for (i = 0; i < CRYPT_BATCH; i++)
+              x[i] = _mm256_aesdec_epi128(x[i], rk[r]);
+            if (!s && !b)
+              next = _mm256_aesenc_epi128(next, tk[r]);
+          }
+          CRYPT_UNROLL
+          for (i = 0; i < CRYPT_BATCH; i++)
+            x[i] = _mm256_aesdeclast_epi128(x[i], rk[r]);
+        }
+        if (!s && !b)
+          next = _mm256_aesenclast_epi128(next, tk[r]);
+
+        CRYPT_UNROLL
+        for (i = 0; i < CRYPT_BATCH; i++)
+          _mm256_storeu_si256(p + i, _mm256_xor_si256(x[i], t[i]));
+      }
+      buf += CRYPT_SECTOR_SIZE;
+    }
+  }
+  _mm256_zeroupper();
+}
+
+AESNI_TARGET
+static void aesni_dec_keys(struct aes_key *k)
+{
+  int r;
+
+  for (r = 1; r < k->rounds; r++)
+    _mm_storeu_si128((__m128i *)k->dec[r],
+                     _mm_aesimc_si128(_mm_loadu_si128(
+                         (const __m128i *)k->enc[k->rounds - r])));
+  memcpy(k->dec[0], k->enc[k->rounds], CRYPT_BLOCK_SIZE);
+  memcpy(k->dec[k->rounds], k->enc[0], CRYPT_BLOCK_SIZE);
+}
+#endif
+
+/* Runs the cipher over whole sectors of iov, starting at sector. */
+static void crypt_iov(struct crypt_dev *c, const struct disk_iovec *iov,
+                      int iovcnt, uint64_t sector, int encrypt)
+{
+  uint8_t split[CRYPT_SECTOR_SIZE];
+  size_t skip = 0, n;
+  int i = 0;
+
+  while (i < iovcnt) {
+    n = (iov[i].len - skip) >> CRYPT_SECTOR_SHIFT;
+    if (n) {
+      c->xts(&c->keys, (uint8_t *)iov[i].base + skip, n, sector, encrypt);
+      sector += n;
+      skip += n << CRYPT_SECTOR_SHIFT;
+    }
+
+    if (skip < iov[i].len) {
+      /* a sector split over elements */
+      disk_iov_to_buf(iov + i, iovcnt - i, skip, split, sizeof(split));
+      c->xts(&c->keys, split, 1, sector++, encrypt);
+      disk_iov_from_buf(iov + i, iovcnt - i, skip, split, sizeof(split));
+      skip += sizeof(split);
+    }
+
+    while (i < iovcnt && skip >= iov[i].len)
+      skip -= iov[i++].len;
+  }
+}
+
+static int crypt_check(uint64_t off, size_t len)
+{
+  return (off | len) & (CRYPT_SECTOR_SIZE - 1) ? -EINVAL : 0;
+}
+
+static int crypt_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                      int iovcnt, uint64_t off)
+{
+  struct crypt_dev *c = (struct crypt_dev *)dev;
+  size_t len = disk_iov_len(iov, iovcnt);
+  int ret;
+
+  ret = crypt_check(off, len);
+  if (!ret)
+    ret = disk_read(c->lower, iov, iovcnt, off);
+  if (ret)
+    return ret;
+
+  crypt_iov(c, iov, iovcnt, off >> CRYPT_SECTOR_SHIFT, 0);
+  host_atomic_add(&disk_stats.decrypted_bytes, len);
+  return 0;
+}
+
+static int crypt_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                       int iovcnt, uint64_t off)
+{
+  struct crypt_dev *c = (struct crypt_dev *)dev;
+  size_t len = disk_iov_len(iov, iovcnt), done, n;
+  struct disk_iovec out;
+  uint8_t *buf;
+  int ret;
+
+  ret = crypt_check(off, len);
+  if (ret || !len)
+    return ret;
+
+  buf = host_alloc_aligned(len < CRYPT_BUF_SIZE ? len : CRYPT_BUF_SIZE,
+                           4096);
+  if (!buf)
+    return -ENOMEM;
+
+  for (done = 0; !ret && done < len; done += n) {
+    n = len - done < CRYPT_BUF_SIZE ? len - done : CRYPT_BUF_SIZE;
+    disk_iov_to_buf(iov, iovcnt, done, buf, n);
+    c->xts(&c->keys, buf, n >> CRYPT_SECTOR_SHIFT,
+           (off + done) >> CRYPT_SECTOR_SHIFT, 1);
+
+    out.base = buf;
+    out.len = n;
+    ret = disk_write(c->lower, &out, 1, off + done);
+  }
+
+  host_free_aligned(buf);
+  if (!ret)
+    host_atomic_add(&disk_stats.encrypted_bytes, len);
+  return ret;
+}
+
+static int crypt_flush(struct disk_dev *dev)
+{
+  struct crypt_dev *c = (struct crypt_dev *)dev;
+
+  return disk_flush(c->lower);
+}
+
+/* Clears the keys in a way the compiler can't drop. */
+static void crypt_wipe(void *p, size_t len)
+{
+  volatile uint8_t *v = p;
+
+  while (len--)
+    *v++ = 0;
+}
+
+static void crypt_close(struct disk_dev *dev)
+{
+  struct crypt_dev *c = (struct crypt_dev *)dev;
+
+  disk_close(c->lower);
+  crypt_wipe(&c->keys, sizeof(c->keys));
+  free(c);
+}
+
+static const struct disk_ops crypt_ops = {
+  .read = crypt_read,
+  .write = crypt_write,
+  .flush = crypt_flush,
+  .close = crypt_close,
+};
+
+static xts_fn crypt_pick(struct crypt_keys *k)
+{
+#ifdef HAVE_AESNI
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("aes")) {
+    aesni_dec_keys(&k->data);
+    if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx2"))
+      return xts_vaes;
+    return xts_aesni;
+  }
+#endif
+  (void)k;
+  return xts_generic;
+}
+
+/*
+ * Opens lower, encrypted with the XTS key of key_len bytes, 32 or 64.
+ * lower is left to the caller on failure.
+ */
+struct disk_dev *disk_crypt_open(struct disk_dev *lower, const uint8_t *key,
+                                 size_t key_len, int *err)
+{
+  struct crypt_dev *c;
+  int i, ret = -EINVAL;
+
+  /* XTS needs two different keys */
+  if ((key_len != 32 && key_len != 64) ||
+      !memcmp(key, key + key_len / 2, key_len / 2))
+    goto out_err;
+
+  ret = -ENOMEM;
+  c = calloc(1, sizeof(*c));
+  if (!c)
+    goto out_err;
+
+  if (!aes_inv_sbox[aes_sbox[1]])
+    for (i = 0; i < 256; i++)
+      aes_inv_sbox[aes_sbox[i]] = (uint8_t)i;
+
+  c->dev.ops = &crypt_ops;
+  c->dev.size = lower->size & ~(uint64_t)(CRYPT_SECTOR_SIZE - 1);
+  c->dev.flags = lower->flags & ~DISK_F_DISCARD;
+  c->lower = lower;
+  aes_expand_key(&c->keys.data, key, key_len / 2);
+  aes_expand_key(&c->keys.tweak, key + key_len / 2, key_len / 2);
+  c->xts = crypt_pick(&c->keys);
+
+  return &c->dev;
+
+out_err:
+  if (err)
+    *err = ret;
+  return NULL;
+}
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include "disk.h"
+
+/*
+ * Mapped backend: the whole image is mapped into the process and requests
+ * are served by copying to and from the mapping, without a host request
+ * (or a host page cache copy) per block.  Flushes write back only the range
+ * dirtied since the previous flush.
+ */
+struct mmap_dev {
+  struct disk_dev dev;
+  host_file_t file;
+  struct host_map map;
+  host_mutex_t dirty_lock;
+  uint64_t dirty_start;
+  uint64_t dirty_end;
+};
+
+static int mmap_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                     int iovcnt, uint64_t off)
+{
+  struct mmap_dev *m = (struct mmap_dev *)dev;
+  size_t len = disk_iov_len(iov, iovcnt);
+
+  if (off > dev->size || len > dev->size - off)
+    return -EIO;
+
+  disk_iov_from_buf(iov, iovcnt, 0, (char *)m->map.addr + off, len);
+  return 0;
+}
+
+static int mmap_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                      int iovcnt, uint64_t off)
+{
+  struct mmap_dev *m = (struct mmap_dev *)dev;
+  size_t len = disk_iov_len(iov, iovcnt);
+
+  if (dev->flags & DISK_F_READONLY)
+    return -EROFS;
+
+  if (off > dev->size || len > dev->size - off)
+    return -EIO;
+
+  disk_iov_to_buf(iov, iovcnt, 0, (char *)m->map.addr + off, len);
+
+  host_mutex_lock(&m->dirty_lock);
+  if (m->dirty_start == m->dirty_end) {
+    m->dirty_start = off;
+    m->dirty_end = off + len;
+  } else {
+    if (off < m->dirty_start)
+      m->dirty_start = off;
+    if (off + len > m->dirty_end)
+      m->dirty_end = off + len;
+  }
+  host_mutex_unlock(&m->dirty_lock);
+
+  return 0;
+}
+
+static int mmap_flush(struct disk_dev *dev)
+{
+  struct mmap_dev *m = (struct mmap_dev *)dev;
+  uint64_t start, end;
+  int ret = 0;
+
+  host_mutex_lock(&m->dirty_lock);
+  start = m->dirty_start;
+  end = m->dirty_end;
+  m->dirty_start = m->dirty_end = 0;
+  host_mutex_unlock(&m->dirty_lock);
+
+  if (start != end)
+    ret = host_map_flush(&m->map, start, end - start);
+  if (!ret)
+    ret = host_file_flush(m->file);
+
+  return ret;
+}
+
+static int mmap_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct mmap_dev *m = (struct mmap_dev *)dev;
+  int ret;
+
+  if (dev->flags & DISK_F_READONLY)
+    return -EOPNOTSUPP;
+
+  if (off >= dev->size)
+    return 0;
+  if (len > dev->size - off)
+    len = dev->size - off;
+
+  ret = host_file_punch_hole(m->file, off, len);
+  if (!ret) {
+    host_atomic_add(&disk_stats.host_discards, 1);
+    host_atomic_add(&disk_stats.discard_bytes, len);
+  }
+
+  return ret;
+}
+
+static void mmap_close(struct disk_dev *dev)
+{
+  struct mmap_dev *m = (struct mmap_dev *)dev;
+
+  mmap_flush(dev);
+  host_file_unmap(&m->map);
+  host_file_close(m->file);
+  free(m);
+}
+
+static const struct disk_ops mmap_ops = {
+  .read = mmap_read,
+  .write = mmap_write,
+  .flush = mmap_flush,
+  .discard = mmap_discard,
+  .close = mmap_close,
+};
+
+/* Takes ownership of file, also on failure. */
+struct disk_dev *disk_mmap_open(host_file_t file, unsigned int flags,
+                                int *err)
+{
+  struct mmap_dev *m;
+  int ret;
+
+  m = calloc(1, sizeof(*m));
+  if (!m) {
+    ret = -ENOMEM;
+    goto out_close;
+  }
+
+  m->dev.ops = &mmap_ops;
+  m->dev.flags = flags;
+  m->file = file;
+  host_mutex_init(&m->dirty_lock);
+
+  ret = host_file_size(file, &m->dev.size);
+  if (ret)
+    goto out_free;
+
+  ret = host_file_map(file, m->dev.size, flags & DISK_F_READONLY, &m->map);
+  if (ret)
+    goto out_free;
+
+  return &m->dev;
+
+out_free:
+  free(m);
+out_close:
+  host_file_close(file);
+  if (err)
+    *err = ret;
+  return NULL;
+}
@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+/*
+ * Multi-queue layer.  Requests are spread over nr_queues queues by disk
+ * region and every queue is served by depth host threads, so up to
+ * nr_queues * depth requests are in flight on the host while submission
+ * only links the request into a queue.  Requests to the same region land in
+ * the same queue, which keeps them close together for the host.
+ *
+ * Within a queue, reads and writes are kept sorted by offset over the last
+ * window requests, and a thread picking up work takes the contiguous run of
+ * same-type requests at the head with it and issues it as one vectored host
+ * request.  Flushes and discards are barriers nothing is sorted across.
+ */
+
+#define MQ_REGION_SHIFT 20
+#define MQ_MERGE_MAX_IOVECS 256
+#define MQ_MERGE_MAX_BYTES (1024 * 1024)
+
+struct mq_dev;
+
+struct mq_queue {
+  struct mq_dev *mq;
+  host_mutex_t lock;
+  host_cond_t cond;
+  struct disk_req *head;
+  struct disk_req **tail;
+  int nr_queued;
+  int stop;
+  int nr_threads;
+  host_thread_t *threads;
+};
+
+struct mq_dev {
+  struct disk_dev dev;
+  struct disk_dev *lower;
+  volatile int64_t in_flight;
+  volatile int64_t next_queue;
+  int nr_queues;
+  int window;
+  struct mq_queue *queues;
+};
+
+static int mq_mergeable(struct disk_req *req)
+{
+  return req->type == DISK_REQ_READ || req->type == DISK_REQ_WRITE;
+}
+
+/* Called with the queue lock held. */
+static void mq_insert(struct mq_queue *q, struct disk_req *req, int window)
+{
+  struct disk_req **pos = &q->head, **start = &q->head;
+  int i;
+
+  req->next = NULL;
+  q->nr_queued++;
+
+  if (!window || !mq_mergeable(req)) {
+    *q->tail = req;
+    q->tail = &req->next;
+    return;
+  }
+
+  /* only the last window requests, after the last barrier, are candidates */
+  for (i = 0; *pos; pos = &(*pos)->next, i++)
+    if (!mq_mergeable(*pos) || i < q->nr_queued - 1 - window)
+      start = &(*pos)->next;
+
+  for (pos = start; *pos && (*pos)->off <= req->off; pos = &(*pos)->next)
+    ;
+
+  if (*pos)
+    host_atomic_add(&disk_stats.sorted, 1);
+
+  req->next = *pos;
+  *pos = req;
+  if (!req->next)
+    q->tail = &req->next;
+}
+
+/*
+ * Takes the head request plus the contiguous same-type requests following
+ * it, linked through next; returns how many were taken.
+ */
+static int mq_dequeue(struct mq_queue *q, struct disk_req **head)
+{
+  struct disk_req *req, *last;
+  uint64_t end, bytes;
+  int nr = 1, iovcnt;
+
+  host_mutex_lock(&q->lock);
+  while (!q->head && !q->stop)
+    host_cond_wait(&q->cond, &q->lock);
+
+  req = q->head;
+  if (!req) {
+    host_mutex_unlock(&q->lock);
+    return 0;
+  }
+
+  last = req;
+  end = req->off + req->len;
+  bytes = req->len;
+  iovcnt = req->iovcnt;
+  while (mq_mergeable(req) && last->next && last->next->type == req->type &&
+         last->next->off == end &&
+         iovcnt + last->next->iovcnt <= MQ_MERGE_MAX_IOVECS &&
+         bytes + last->next->len <= MQ_MERGE_MAX_BYTES) {
+    last = last->next;
+    end += last->len;
+    bytes += last->len;
+    iovcnt += last->iovcnt;
+    nr++;
+  }
+
+  q->head = last->next;
+  if (!q->head)
+    q->tail = &q->head;
+  q->nr_queued -= nr;
+  last->next = NULL;
+  host_mutex_unlock(&q->lock);
+
+  *head = req;
+  return nr;
+}
+
+static int mq_execute_merged(struct mq_dev *mq, struct disk_req *head)
+{
+  struct disk_iovec iov_buf[MQ_MERGE_MAX_IOVECS];
+  struct disk_req merged = *head;
+  struct disk_req *req;
+  int nr = 0;
+
+  merged.iov = iov_buf;
+  merged.iovcnt = 0;
+  merged.len = 0;
+  for (req = head; req; req = req->next) {
+    memcpy(&iov_buf[merged.iovcnt], req->iov,
+           req->iovcnt * sizeof(*req->iov));
+    merged.iovcnt += req->iovcnt;
+    merged.len += req->len;
+    nr++;
+  }
+
+  host_atomic_add(&disk_stats.merged, nr - 1);
+  host_atomic_add(&disk_stats.merged_bytes, merged.len);
+  return disk_execute(mq->lower, &merged);
+}
+
+/* Queues are drained before the worker exits. */
+static void mq_worker(void *arg)
+{
+  struct mq_queue *q = arg;
+  struct mq_dev *mq = q->mq;
+  struct disk_req *req, *next;
+  int nr, ret;
+
+  while ((nr = mq_dequeue(q, &req))) {
+    if (nr == 1)
+      ret = disk_execute(mq->lower, req);
+    else
+      ret = mq_execute_merged(mq, req);
+
+    host_atomic_add(&mq->in_flight, -nr);
+    for (; req; req = next) {
+      next = req->next;
+      req->complete(req, ret);
+    }
+  }
+}
+
+static void mq_submit(struct disk_dev *dev, struct disk_req *req)
+{
+  struct mq_dev *mq = (struct mq_dev *)dev;
+  struct mq_queue *q;
+  int64_t in_flight;
+
+  if (req->type == DISK_REQ_FLUSH)
+    q = &mq->queues[host_atomic_add(&mq->next_queue, 1) % mq->nr_queues];
+  else
+    q = &mq->queues[(req->off >> MQ_REGION_SHIFT) % mq->nr_queues];
+
+  in_flight = host_atomic_add(&mq->in_flight, 1) + 1;
+  if (in_flight > disk_stats.max_in_flight)
+    disk_stats.max_in_flight = in_flight;
+  host_atomic_add(&disk_stats.queued, 1);
+
+  host_mutex_lock(&q->lock);
+  mq_insert(q, req, mq->window);
+  host_cond_signal(&q->cond);
+  host_mutex_unlock(&q->lock);
+}
+
+static int mq_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                   int iovcnt, uint64_t off)
+{
+  struct mq_dev *mq = (struct mq_dev *)dev;
+
+  return disk_read(mq->lower, iov, iovcnt, off);
+}
+
+static int mq_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                    int iovcnt, uint64_t off)
+{
+  struct mq_dev *mq = (struct mq_dev *)dev;
+
+  return disk_write(mq->lower, iov, iovcnt, off);
+}
+
+static int mq_flush(struct disk_dev *dev)
+{
+  struct mq_dev *mq = (struct mq_dev *)dev;
+
+  return disk_flush(mq->lower);
+}
+
+static int mq_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct mq_dev *mq = (struct mq_dev *)dev;
+
+  return disk_discard(mq->lower, off, len);
+}
+
+static void mq_stop(struct mq_dev *mq)
+{
+  int i, j;
+
+  for (i = 0; i < mq->nr_queues; i++) {
+    struct mq_queue *q = &mq->queues[i];
+
+    host_mutex_lock(&q->lock);
+    q->stop = 1;
+    host_cond_broadcast(&q->cond);
+    host_mutex_unlock(&q->lock);
+  }
+
+  for (i = 0; i < mq->nr_queues; i++) {
+    struct mq_queue *q = &mq->queues[i];
+
+    for (j = 0; j < q->nr_threads; j++)
+      host_thread_join(q->threads[j]);
+    free(q->threads);
+  }
+
+  free(mq->queues);
+}
+
+static void mq_close(struct disk_dev *dev)
+{
+  struct mq_dev *mq = (struct mq_dev *)dev;
+
+  mq_stop(mq);
+  disk_close(mq->lower);
+  free(mq);
+}
+
+static const struct disk_ops mq_ops = {
+  .read = mq_read,
+  .write = mq_write,
+  .flush = mq_flush,
+  .discard = mq_discard,
+  .close = mq_close,
+  .submit = mq_submit,
+};
+
+/* On failure lower is left to the caller. */
+struct disk_dev *disk_mq_open(struct disk_dev *lower, int nr_queues,
+                              int depth, int window, int *err)
+{
+  struct mq_dev *mq;
+  int i, ret = -ENOMEM;
+
+  if (nr_queues < 1 || depth < 1) {
+    ret = -EINVAL;
+    goto out;
+  }
+
+  mq = calloc(1, sizeof(*mq));
+  if (!mq)
+    goto out;
+
+  mq->queues = calloc(nr_queues, sizeof(*mq->queues));
+  if (!mq->queues)
+    goto out_free;
+
+  mq->dev.ops = &mq_ops;
+  mq->dev.size = lower->size;
+  mq->dev.flags = lower->flags;
+  mq->lower = lower;
+  mq->nr_queues = nr_queues;
+  mq->window = window;
+
+  for (i = 0; i < nr_queues; i++) {
+    struct mq_queue *q = &mq->queues[i];
+
+    q->mq = mq;
+    q->tail = &q->head;
+    host_mutex_init(&q->lock);
+    host_cond_init(&q->cond);
+  }
+
+  for (i = 0; i < nr_queues; i++) {
+    struct mq_queue *q = &mq->queues[i];
+
+    q->threads = calloc(depth, sizeof(*q->threads));
+    if (!q->threads) {
+      ret = -ENOMEM;
+      goto out_stop;
+    }
+
+    for (; q->nr_threads < depth; q->nr_threads++) {
+      ret = host_thread_create(&q->threads[q->nr_threads], mq_worker, q);
+      if (ret)
+        goto out_stop;
+    }
+  }
+
+  return &mq->dev;
+
+out_stop:
+  mq_stop(mq);
+out_free:
+  free(mq);
+out:
+  if (err)
+    *err = ret;
+  return NULL;
+}
@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+/*
+ * Copy-on-write overlay: a read-only base device plus a delta file that
+ * takes every write.  The delta is a sparse file laid out as
+ *
+ *   header | allocation bitmap, one bit per block | blocks
+ *
+ * with block n at data_off + n * OVERLAY_BLOCK_SIZE, so the bitmap, which
+ * is kept in memory, is the whole index.  Blocks with their bit clear are
+ * read from the base.  A write that only covers part of a clean block
+ * copies the rest of it up from the base first; those writes hold io_lock
+ * exclusively so that no other write into the block can get lost, all
+ * others hold it shared.
+ *
+ * Bits are set once the block's data is written, and the bitmap pages are
+ * written back on flush after the data is flushed, so after a crash a
+ * block is either in the delta with all its data or still read from the
+ * base.  The header is little endian, like every host this builds for.
+ */
+
+#define OVERLAY_MAGIC "LKLDELTA"
+#define OVERLAY_VERSION 1
+#define OVERLAY_BLOCK_SHIFT 12
+#define OVERLAY_BLOCK_SIZE (1 << OVERLAY_BLOCK_SHIFT)
+#define OVERLAY_PAGE_SIZE 4096
+
+struct overlay_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t disk_size;
+  uint64_t bitmap_off;
+  uint64_t data_off;
+};
+
+struct overlay_dev {
+  struct disk_dev dev;
+  struct disk_dev *base;
+  host_file_t delta;
+  uint64_t bitmap_off;
+  uint64_t data_off;
+  uint64_t nr_blocks;
+  host_rwlock_t io_lock;
+  host_mutex_t bitmap_lock;
+  uint8_t *bitmap;
+  size_t bitmap_size;
+  uint8_t *dirty_pages;
+};
+
+static int overlay_test(struct overlay_dev *o, uint64_t blk)
+{
+  return o->bitmap[blk >> 3] & (1 << (blk & 7));
+}
+
+static void overlay_set_range(struct overlay_dev *o, uint64_t first,
+                              uint64_t last)
+{
+  uint64_t blk;
+
+  host_mutex_lock(&o->bitmap_lock);
+  for (blk = first; blk <= last; blk++) {
+    if (overlay_test(o, blk))
+      continue;
+
+    o->bitmap[blk >> 3] |= 1 << (blk & 7);
+    o->dirty_pages[(blk >> 3) / OVERLAY_PAGE_SIZE] = 1;
+    host_atomic_add(&disk_stats.delta_blocks, 1);
+  }
+  host_mutex_unlock(&o->bitmap_lock);
+}
+
+/* Length of the run starting at pos where all blocks are in the same place. */
+static uint64_t overlay_run(struct overlay_dev *o, uint64_t pos, uint64_t end,
+                            int *in_delta)
+{
+  uint64_t blk = pos >> OVERLAY_BLOCK_SHIFT;
+  uint64_t run_end = (blk + 1) << OVERLAY_BLOCK_SHIFT;
+
+  host_mutex_lock(&o->bitmap_lock);
+  *in_delta = overlay_test(o, blk) != 0;
+  while (run_end < end && (overlay_test(o, ++blk) != 0) == *in_delta)
+    run_end += OVERLAY_BLOCK_SIZE;
+  host_mutex_unlock(&o->bitmap_lock);
+
+  return (run_end < end ? run_end : end) - pos;
+}
+
+static int overlay_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                        int iovcnt, uint64_t off)
+{
+  struct overlay_dev *o = (struct overlay_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt), pos = off;
+  struct disk_iovec *sub;
+  int ret = 0;
+
+  sub = malloc(iovcnt * sizeof(*sub));
+  if (!sub)
+    return -ENOMEM;
+
+  while (!ret && pos < off + len) {
+    int in_delta, n;
+    uint64_t run = overlay_run(o, pos, off + len, &in_delta);
+
+    n = disk_iov_slice(iov, iovcnt, pos - off, run, sub);
+    if (in_delta)
+      ret = host_file_readv(o->delta, (const struct host_iovec *)sub, n,
+                            o->data_off + pos);
+    else
+      ret = disk_read(o->base, sub, n, pos);
+    pos += run;
+  }
+
+  free(sub);
+  return ret;
+}
+
+/* Copies clean block blk up from the base; called with io_lock exclusive. */
+static int overlay_copy_up(struct overlay_dev *o, uint64_t blk)
+{
+  struct disk_iovec iov;
+  uint64_t start = blk << OVERLAY_BLOCK_SHIFT;
+  int ret;
+
+  iov.len = OVERLAY_BLOCK_SIZE;
+  if (iov.len > o->dev.size - start)
+    iov.len = o->dev.size - start;
+  iov.base = malloc(iov.len);
+  if (!iov.base)
+    return -ENOMEM;
+
+  ret = disk_read(o->base, &iov, 1, start);
+  if (!ret)
+    ret = host_file_write(o->delta, iov.base, iov.len, o->data_off + start);
+  if (!ret)
+    host_atomic_add(&disk_stats.cow_copies, 1);
+
+  free(iov.base);
+  return ret;
+}
+
+static int overlay_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                         int iovcnt, uint64_t off)
+{
+  struct overlay_dev *o = (struct overlay_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt), end = off + len;
+  uint64_t first, last;
+  int copy_first, copy_last, ret = 0;
+
+  if (!len)
+    return 0;
+
+  first = off >> OVERLAY_BLOCK_SHIFT;
+  last = (end - 1) >> OVERLAY_BLOCK_SHIFT;
+
+  host_mutex_lock(&o->bitmap_lock);
+  copy_first = (off & (OVERLAY_BLOCK_SIZE - 1)) && !overlay_test(o, first);
+  copy_last = (end & (OVERLAY_BLOCK_SIZE - 1)) && end < o->dev.size &&
+              !overlay_test(o, last);
+  host_mutex_unlock(&o->bitmap_lock);
+
+  if (!copy_first && !copy_last) {
+    host_rwlock_read_lock(&o->io_lock);
+  } else {
+    host_rwlock_write_lock(&o->io_lock);
+
+    /* somebody else may have copied them up while we waited */
+    if (copy_first && !overlay_test(o, first))
+      ret = overlay_copy_up(o, first);
+    if (!ret && copy_last && (last != first || !copy_first) &&
+        !overlay_test(o, last))
+      ret = overlay_copy_up(o, last);
+  }
+
+  if (!ret)
+    ret = host_file_writev(o->delta, (const struct host_iovec *)iov, iovcnt,
+                           o->data_off + off);
+  if (!ret)
+    overlay_set_range(o, first, last);
+
+  if (!copy_first && !copy_last)
+    host_rwlock_read_unlock(&o->io_lock);
+  else
+    host_rwlock_write_unlock(&o->io_lock);
+
+  return ret;
+}
+
+static int overlay_sync_bitmap(struct overlay_dev *o)
+{
+  size_t i, nr_pages = o->bitmap_size / OVERLAY_PAGE_SIZE;
+  int ret = 0;
+
+  host_mutex_lock(&o->bitmap_lock);
+  for (i = 0; !ret && i < nr_pages; i++) {
+    if (!o->dirty_pages[i])
+      continue;
+
+    ret = host_file_write(o->delta, o->bitmap + i * OVERLAY_PAGE_SIZE,
+                          OVERLAY_PAGE_SIZE,
+                          o->bitmap_off + i * OVERLAY_PAGE_SIZE);
+    if (!ret)
+      o->dirty_pages[i] = 0;
+  }
+  host_mutex_unlock(&o->bitmap_lock);
+
+  return ret;
+}
+
+static int overlay_flush(struct disk_dev *dev)
+{
+  struct overlay_dev *o = (struct overlay_dev *)dev;
+  int ret;
+
+  ret = host_file_flush(o->delta);
+  if (!ret)
+    ret = overlay_sync_bitmap(o);
+  if (!ret)
+    ret = host_file_flush(o->delta);
+
+  return ret;
+}
+
+/* Whole blocks in the delta are punched out, they then read as zeroes. */
+static int overlay_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct overlay_dev *o = (struct overlay_dev *)dev;
+  uint64_t first = (off + OVERLAY_BLOCK_SIZE - 1) >> OVERLAY_BLOCK_SHIFT;
+  uint64_t end = (off + len) >> OVERLAY_BLOCK_SHIFT;
+  uint64_t blk, run;
+  int ret = 0;
+
+  for (blk = first; !ret && blk < end; blk += run) {
+    int in_delta;
+
+    run = overlay_run(o, blk << OVERLAY_BLOCK_SHIFT,
+                      end << OVERLAY_BLOCK_SHIFT, &in_delta) >>
+          OVERLAY_BLOCK_SHIFT;
+    if (in_delta)
+      ret = host_file_punch_hole(o->delta,
+                                 o->data_off + (blk << OVERLAY_BLOCK_SHIFT),
+                                 run << OVERLAY_BLOCK_SHIFT);
+  }
+
+  return ret;
+}
+
+static void overlay_free(struct overlay_dev *o)
+{
+  free(o->bitmap);
+  free(o->dirty_pages);
+  free(o);
+}
+
+static void overlay_close(struct disk_dev *dev)
+{
+  struct overlay_dev *o = (struct overlay_dev *)dev;
+
+  overlay_flush(dev);
+  host_file_close(o->delta);
+  disk_close(o->base);
+  overlay_free(o);
+}
+
+static const struct disk_ops overlay_ops = {
+  .read = overlay_read,
+  .write = overlay_write,
+  .flush = overlay_flush,
+  .discard = overlay_discard,
+  .close = overlay_close,
+};
+
+static int overlay_create(struct overlay_dev *o)
+{
+  struct overlay_header hdr;
+  int ret;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic));
+  hdr.version = OVERLAY_VERSION;
+  hdr.block_size = OVERLAY_BLOCK_SIZE;
+  hdr.disk_size = o->dev.size;
+  hdr.bitmap_off = o->bitmap_off;
+  hdr.data_off = o->data_off;
+
+  ret = host_file_set_sparse(o->delta);
+  if (!ret)
+    ret = host_file_write(o->delta, o->bitmap, o->bitmap_size,
+                          o->bitmap_off);
+  if (!ret)
+    ret = host_file_write(o->delta, &hdr, sizeof(hdr), 0);
+  if (!ret)
+    ret = host_file_flush(o->delta);
+
+  return ret;
+}
+
+static int overlay_load(struct overlay_dev *o)
+{
+  struct overlay_header hdr;
+  uint64_t i;
+  int ret;
+
+  ret = host_file_read(o->delta, &hdr, sizeof(hdr), 0);
+  if (ret)
+    return ret;
+
+  if (memcmp(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic)) ||
+      hdr.version != OVERLAY_VERSION ||
+      hdr.block_size != OVERLAY_BLOCK_SIZE ||
+      hdr.disk_size != o->dev.size || hdr.bitmap_off != o->bitmap_off ||
+      hdr.data_off != o->data_off)
+    return -EINVAL;
+
+  ret = host_file_read(o->delta, o->bitmap, o->bitmap_size, o->bitmap_off);
+  if (ret)
+    return ret;
+
+  for (i = 0; i < o->nr_blocks; i++)
+    if (overlay_test(o, i))
+      disk_stats.delta_blocks++;
+
+  return 0;
+}
+
+/*
+ * Layers a delta file over base, initializing the delta if it is empty.
+ * Takes ownership of delta, also on failure; base is left to the caller
+ * on failure.
+ */
+struct disk_dev *disk_overlay_open(struct disk_dev *base, host_file_t delta,
+                                   int *err)
+{
+  struct overlay_dev *o;
+  uint64_t delta_size;
+  int ret = -ENOMEM;
+
+  o = calloc(1, sizeof(*o));
+  if (!o)
+    goto out_close;
+
+  o->dev.ops = &overlay_ops;
+  o->dev.size = base->size;
+  o->dev.flags = DISK_F_DISCARD;
+  o->base = base;
+  o->delta = delta;
+  host_rwlock_init(&o->io_lock);
+  host_mutex_init(&o->bitmap_lock);
+
+  o->nr_blocks = (base->size + OVERLAY_BLOCK_SIZE - 1) >> OVERLAY_BLOCK_SHIFT;
+  o->bitmap_size = ((o->nr_blocks + 7) / 8 + OVERLAY_PAGE_SIZE - 1) &
+                   ~(size_t)(OVERLAY_PAGE_SIZE - 1);
+  o->bitmap_off = OVERLAY_PAGE_SIZE;
+  o->data_off = o->bitmap_off + o->bitmap_size;
+
+  o->bitmap = calloc(1, o->bitmap_size);
+  o->dirty_pages = calloc(1, o->bitmap_size / OVERLAY_PAGE_SIZE);
+  if (!o->bitmap || !o->dirty_pages)
+    goto out_free;
+
+  ret = host_file_size(delta, &delta_size);
+  if (!ret)
+    ret = delta_size ? overlay_load(o) : overlay_create(o);
+  if (ret)
+    goto out_free;
+
+  return &o->dev;
+
+out_free:
+  overlay_free(o);
+out_close:
+  host_file_close(delta);
+  if (err)
+    *err = ret;
+  return NULL;
+}
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+/*
+ * Partition slice: presents one partition of a whole-disk image, found in
+ * its MBR or GPT partition table, as a device of its own.  Requests are
+ * only shifted by the partition's offset, so nothing is copied however big
+ * the disk is.
+ *
+ * Partitions are numbered like Linux does: GPT entries from 1, MBR primary
+ * partitions 1 to 4 and logical ones in the extended partition from 5.
+ * Tables are little endian.
+ */
+
+#define PART_SECTOR_SIZE 512
+#define PART_MBR_SIGNATURE_OFF 510
+#define PART_MBR_TABLE_OFF 446
+#define PART_MBR_ENTRIES 4
+#define PART_TYPE_GPT_PROTECTIVE 0xee
+#define PART_GPT_SIGNATURE "EFI PART"
+#define PART_GPT_HEADER_SIZE 92
+#define PART_GPT_MAX_ENTRIES 1024
+#define PART_GPT_MAX_ENTRY_SIZE 512
+/* logical partitions followed before giving up on a looping chain */
+#define PART_MAX_LOGICAL 128
+
+struct part_dev {
+  struct disk_dev dev;
+  struct disk_dev *lower;
+  uint64_t start;
+};
+
+struct mbr_entry {
+  uint8_t status;
+  uint8_t chs_first[3];
+  uint8_t type;
+  uint8_t chs_last[3];
+  uint32_t lba_first;
+  uint32_t nr_sectors;
+};
+
+struct gpt_header {
+  char signature[8];
+  uint32_t revision;
+  uint32_t header_size;
+  uint32_t header_crc;
+  uint32_t reserved;
+  uint64_t current_lba;
+  uint64_t backup_lba;
+  uint64_t first_usable_lba;
+  uint64_t last_usable_lba;
+  uint8_t disk_guid[16];
+  uint64_t entries_lba;
+  uint32_t nr_entries;
+  uint32_t entry_size;
+  uint32_t entries_crc;
+};
+
+struct gpt_entry {
+  uint8_t type_guid[16];
+  uint8_t part_guid[16];
+  uint64_t first_lba;
+  uint64_t last_lba;
+  uint64_t attributes;
+};
+
+static uint32_t part_crc32(const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  uint32_t crc = ~0U;
+  int i;
+
+  while (len--) {
+    crc ^= *p++;
+    for (i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+
+  return ~crc;
+}
+
+static int part_read(struct disk_dev *dev, void *buf, size_t len,
+                     uint64_t off)
+{
+  struct disk_iovec iov = { buf, len };
+
+  if (off > dev->size || len > dev->size - off)
+    return -EINVAL;
+
+  return disk_read(dev, &iov, 1, off);
+}
+
+static int part_is_extended(uint8_t type)
+{
+  return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+static void part_mbr_entries(const uint8_t *sector, struct mbr_entry *e)
+{
+  memcpy(e, sector + PART_MBR_TABLE_OFF, PART_MBR_ENTRIES * sizeof(*e));
+}
+
+/* Follows the chain of extended boot records to logical partition nr. */
+static int part_find_logical(struct disk_dev *lower, uint64_t ext_start,
+                             int nr, uint64_t *start, uint64_t *size)
+{
+  struct mbr_entry e[PART_MBR_ENTRIES];
+  uint8_t sector[PART_SECTOR_SIZE];
+  uint64_t ebr = ext_start;
+  int i, ret;
+
+  for (i = 5; i < 5 + PART_MAX_LOGICAL; i++) {
+    ret = part_read(lower, sector, sizeof(sector), ebr * PART_SECTOR_SIZE);
+    if (ret)
+      return ret;
+    if (sector[PART_MBR_SIGNATURE_OFF] != 0x55 ||
+        sector[PART_MBR_SIGNATURE_OFF + 1] != 0xaa)
+      return -ENOENT;
+
+    part_mbr_entries(sector, e);
+    if (i == nr) {
+      if (!e[0].type || !e[0].nr_sectors)
+        return -ENOENT;
+      *start = (ebr + e[0].lba_first) * PART_SECTOR_SIZE;
+      *size = (uint64_t)e[0].nr_sectors * PART_SECTOR_SIZE;
+      return 0;
+    }
+
+    if (!part_is_extended(e[1].type))
+      return -ENOENT;
+    ebr = ext_start + e[1].lba_first;
+  }
+
+  return -ENOENT;
+}
+
+static int part_find_mbr(struct disk_dev *lower, const uint8_t *sector,
+                         int nr, uint64_t *start, uint64_t *size)
+{
+  struct mbr_entry e[PART_MBR_ENTRIES];
+  int i;
+
+  part_mbr_entries(sector, e);
+
+  if (nr > PART_MBR_ENTRIES) {
+    for (i = 0; i < PART_MBR_ENTRIES; i++)
+      if (part_is_extended(e[i].type))
+        return part_find_logical(lower, e[i].lba_first, nr, start, size);
+    return -ENOENT;
+  }
+
+  if (!e[nr - 1].type || !e[nr - 1].nr_sectors ||
+      part_is_extended(e[nr - 1].type))
+    return -ENOENT;
+
+  *start = (uint64_t)e[nr - 1].lba_first * PART_SECTOR_SIZE;
+  *size = (uint64_t)e[nr - 1].nr_sectors * PART_SECTOR_SIZE;
+  return 0;
+}
+
+/* Reads and checks the GPT header at lba, with sectors of lba_size bytes. */
+static int part_gpt_header(struct disk_dev *lower, uint64_t lba,
+                           unsigned int lba_size, struct gpt_header *hdr)
+{
+  uint8_t sector[PART_SECTOR_SIZE];
+  uint32_t crc;
+  int ret;
+
+  ret = part_read(lower, sector, sizeof(sector), lba * lba_size);
+  if (ret)
+    return ret;
+
+  memcpy(hdr, sector, sizeof(*hdr));
+  if (memcmp(hdr->signature, PART_GPT_SIGNATURE, sizeof(hdr->signature)) ||
+      hdr->header_size < PART_GPT_HEADER_SIZE ||
+      hdr->header_size > sizeof(sector))
+    return -ENOENT;
+
+  crc = hdr->header_crc;
+  memset(sector + offsetof(struct gpt_header, header_crc), 0, sizeof(crc));
+  if (part_crc32(sector, hdr->header_size) != crc)
+    return -EINVAL;
+
+  if (hdr->entry_size < sizeof(struct gpt_entry) || hdr->entry_size % 8 ||
+      hdr->entry_size > PART_GPT_MAX_ENTRY_SIZE ||
+      hdr->nr_entries > PART_GPT_MAX_ENTRIES)
+    return -EINVAL;
+
+  return 0;
+}
+
+static int part_find_gpt(struct disk_dev *lower, int nr, uint64_t *start,
+                         uint64_t *size)
+{
+  static const unsigned int lba_sizes[] = { 512, 4096 };
+  struct gpt_header hdr;
+  struct gpt_entry e;
+  unsigned int lba_size = 0;
+  uint8_t *entries;
+  size_t len;
+  int i, ret = -ENOENT;
+
+  /* the primary header, on either sector size, then the backup */
+  for (i = 0; ret && i < 2; i++) {
+    lba_size = lba_sizes[i];
+    ret = part_gpt_header(lower, 1, lba_size, &hdr);
+    if (ret)
+      ret = part_gpt_header(lower, lower->size / lba_size - 1, lba_size,
+                            &hdr);
+  }
+  if (ret)
+    return ret;
+
+  if (nr > (int)hdr.nr_entries)
+    return -ENOENT;
+
+  /* the entry array must lie within the disk */
+  len = (size_t)hdr.nr_entries * hdr.entry_size;
+  if (hdr.entries_lba > lower->size / lba_size ||
+      len > lower->size - hdr.entries_lba * lba_size)
+    return -EINVAL;
+
+  entries = malloc(len);
+  if (!entries)
+    return -ENOMEM;
+
+  ret = part_read(lower, entries, len, hdr.entries_lba * lba_size);
+  if (!ret && part_crc32(entries, len) != hdr.entries_crc)
+    ret = -EINVAL;
+  if (ret)
+    goto out;
+
+  memcpy(&e, entries + (size_t)(nr - 1) * hdr.entry_size, sizeof(e));
+  if (!memcmp(e.type_guid, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) ||
+      e.last_lba < e.first_lba) {
+    ret = -ENOENT;
+    goto out;
+  }
+  if (e.last_lba >= lower->size / lba_size) {
+    ret = -EINVAL;
+    goto out;
+  }
+
+  *start = e.first_lba * lba_size;
+  *size = (e.last_lba - e.first_lba + 1) * lba_size;
+
+out:
+  free(entries);
+  return ret;
+}
+
+static int part_find(struct disk_dev *lower, int nr, uint64_t *start,
+                     uint64_t *size)
+{
+  struct mbr_entry e[PART_MBR_ENTRIES];
+  uint8_t sector[PART_SECTOR_SIZE];
+  int i, ret;
+
+  ret = part_read(lower, sector, sizeof(sector), 0);
+  if (ret)
+    return ret;
+  if (sector[PART_MBR_SIGNATURE_OFF] != 0x55 ||
+      sector[PART_MBR_SIGNATURE_OFF + 1] != 0xaa)
+    return -ENOENT;
+
+  part_mbr_entries(sector, e);
+  for (i = 0; i < PART_MBR_ENTRIES; i++)
+    if (e[i].type == PART_TYPE_GPT_PROTECTIVE)
+      return part_find_gpt(lower, nr, start, size);
+
+  return part_find_mbr(lower, sector, nr, start, size);
+}
+
+static int part_check(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  return off > dev->size || len > dev->size - off ? -EIO : 0;
+}
+
+static int part_dev_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                         int iovcnt, uint64_t off)
+{
+  struct part_dev *p = (struct part_dev *)dev;
+  int ret = part_check(dev, off, disk_iov_len(iov, iovcnt));
+
+  return ret ? ret : disk_read(p->lower, iov, iovcnt, p->start + off);
+}
+
+static int part_dev_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                          int iovcnt, uint64_t off)
+{
+  struct part_dev *p = (struct part_dev *)dev;
+  int ret = part_check(dev, off, disk_iov_len(iov, iovcnt));
+
+  return ret ? ret : disk_write(p->lower, iov, iovcnt, p->start + off);
+}
+
+static int part_dev_flush(struct disk_dev *dev)
+{
+  struct part_dev *p = (struct part_dev *)dev;
+
+  return disk_flush(p->lower);
+}
+
+static int part_dev_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct part_dev *p = (struct part_dev *)dev;
+  int ret = part_check(dev, off, len);
+
+  return ret ? ret : disk_discard(p->lower, p->start + off, len);
+}
+
+static void part_dev_close(struct disk_dev *dev)
+{
+  struct part_dev *p = (struct part_dev *)dev;
+
+  disk_close(p->lower);
+  free(p);
+}
+
+static const struct disk_ops part_ops = {
+  .read = part_dev_read,
+  .write = part_dev_write,
+  .flush = part_dev_flush,
+  .discard = part_dev_discard,
+  .close = part_dev_close,
+};
+
+/*
+ * Opens partition nr of lower; -ENOENT if there is no such partition.
+ * lower is left to the caller on failure.
+ */
+struct disk_dev *disk_part_open(struct disk_dev *lower, int nr, int *err)
+{
+  struct part_dev *p;
+  uint64_t start, size;
+  int ret;
+
+  ret = nr < 1 ? -ENOENT : part_find(lower, nr, &start, &size);
+  if (!ret && (start > lower->size || size > lower->size - start))
+    ret = -EINVAL;
+  if (ret)
+    goto out_err;
+
+  p = calloc(1, sizeof(*p));
+  if (!p) {
+    ret = -ENOMEM;
+    goto out_err;
+  }
+
+  p->dev.ops = &part_ops;
+  p->dev.size = size;
+  p->dev.flags = lower->flags;
+  p->lower = lower;
+  p->start = start;
+
+  return &p->dev;
+
+out_err:
+  if (err)
+    *err = ret;
+  return NULL;
+}
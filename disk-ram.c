@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+/*
+ * RAM write layer for throw-away mounts: every write lands in memory on
+ * top of a read-only lower device and nothing is ever written back, so
+ * flushes are free.  Once limit bytes are in use, new blocks go to the
+ * optional spill file, a temporary file that disappears on close, and
+ * writes fail with ENOSPC when there is none.
+ *
+ * Blocks are found through a hash table.  Reads hold the lock shared,
+ * writes exclusively, which also covers filling a partially written new
+ * block from the lower device.
+ */
+
+#define RAM_BLOCK_SHIFT 12
+#define RAM_BLOCK_SIZE (1 << RAM_BLOCK_SHIFT)
+#define RAM_HASH_BITS 16
+
+struct ram_block {
+  uint64_t blk;
+  struct ram_block *next;
+  char *data;
+  uint64_t slot;
+};
+
+struct ram_dev {
+  struct disk_dev dev;
+  struct disk_dev *lower;
+  host_file_t spill;
+  uint64_t limit;
+  uint64_t used;
+  uint64_t nr_slots;
+  uint64_t *free_slots;
+  uint64_t nr_free_slots;
+  uint64_t max_free_slots;
+  host_rwlock_t lock;
+  struct ram_block *hash[1 << RAM_HASH_BITS];
+};
+
+static struct ram_block **ram_slot(struct ram_dev *r, uint64_t blk)
+{
+  return &r->hash[(blk * 0x9e3779b97f4a7c15ULL) >> (64 - RAM_HASH_BITS)];
+}
+
+static struct ram_block *ram_lookup(struct ram_dev *r, uint64_t blk)
+{
+  struct ram_block *b = *ram_slot(r, blk);
+
+  while (b && b->blk != blk)
+    b = b->next;
+
+  return b;
+}
+
+static int ram_block_read(struct ram_dev *r, struct ram_block *b,
+                          size_t in_blk, void *buf, size_t len)
+{
+  if (b->data) {
+    memcpy(buf, b->data + in_blk, len);
+    return 0;
+  }
+
+  return host_file_read(r->spill, buf, len,
+                        (b->slot << RAM_BLOCK_SHIFT) + in_blk);
+}
+
+static int ram_block_write(struct ram_dev *r, struct ram_block *b,
+                           size_t in_blk, const void *buf, size_t len)
+{
+  if (b->data) {
+    memcpy(b->data + in_blk, buf, len);
+    return 0;
+  }
+
+  return host_file_write(r->spill, buf, len,
+                         (b->slot << RAM_BLOCK_SHIFT) + in_blk);
+}
+
+static int ram_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                    int iovcnt, uint64_t off)
+{
+  struct ram_dev *r = (struct ram_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt), end = off + len;
+  uint64_t pos = off, lower_start = off;
+  struct disk_iovec *sub;
+  char bounce[RAM_BLOCK_SIZE];
+  int n, ret = 0;
+
+  sub = malloc(iovcnt * sizeof(*sub));
+  if (!sub)
+    return -ENOMEM;
+
+  host_rwlock_read_lock(&r->lock);
+  while (!ret && pos < end) {
+    uint64_t blk = pos >> RAM_BLOCK_SHIFT;
+    uint64_t next = (blk + 1) << RAM_BLOCK_SHIFT;
+    struct ram_block *b = ram_lookup(r, blk);
+    size_t in_blk = pos & (RAM_BLOCK_SIZE - 1), chunk;
+
+    if (next > end)
+      next = end;
+    chunk = next - pos;
+
+    if (!b) {
+      pos = next;
+      continue;
+    }
+
+    /* read the run of blocks below this one from the lower device */
+    if (lower_start < pos) {
+      n = disk_iov_slice(iov, iovcnt, lower_start - off, pos - lower_start,
+                         sub);
+      ret = disk_read(r->lower, sub, n, lower_start);
+      if (ret)
+        break;
+    }
+
+    ret = ram_block_read(r, b, in_blk, bounce, chunk);
+    if (!ret)
+      disk_iov_from_buf(iov, iovcnt, pos - off, bounce, chunk);
+    pos = lower_start = next;
+  }
+
+  if (!ret && lower_start < end) {
+    n = disk_iov_slice(iov, iovcnt, lower_start - off, end - lower_start,
+                       sub);
+    ret = disk_read(r->lower, sub, n, lower_start);
+  }
+  host_rwlock_read_unlock(&r->lock);
+
+  free(sub);
+  return ret;
+}
+
+/* Called with the lock held exclusively. */
+static struct ram_block *ram_alloc(struct ram_dev *r, uint64_t blk, int *err)
+{
+  struct ram_block *b = calloc(1, sizeof(*b));
+
+  if (!b) {
+    *err = -ENOMEM;
+    return NULL;
+  }
+
+  b->blk = blk;
+  if (r->used + RAM_BLOCK_SIZE <= r->limit) {
+    b->data = malloc(RAM_BLOCK_SIZE);
+    if (!b->data) {
+      free(b);
+      *err = -ENOMEM;
+      return NULL;
+    }
+    r->used += RAM_BLOCK_SIZE;
+    host_atomic_add(&disk_stats.ram_blocks, 1);
+  } else if (r->spill != HOST_INVALID_FILE) {
+    b->slot = r->nr_free_slots ? r->free_slots[--r->nr_free_slots] :
+                                 r->nr_slots++;
+    host_atomic_add(&disk_stats.spilled_blocks, 1);
+  } else {
+    free(b);
+    host_atomic_add(&disk_stats.ram_full, 1);
+    *err = -ENOSPC;
+    return NULL;
+  }
+
+  b->next = *ram_slot(r, blk);
+  *ram_slot(r, blk) = b;
+  return b;
+}
+
+static void ram_free(struct ram_dev *r, struct ram_block *b)
+{
+  struct ram_block **p = ram_slot(r, b->blk);
+
+  while (*p != b)
+    p = &(*p)->next;
+  *p = b->next;
+
+  if (b->data) {
+    free(b->data);
+    r->used -= RAM_BLOCK_SIZE;
+    host_atomic_add(&disk_stats.ram_blocks, -1);
+  } else {
+    if (r->nr_free_slots == r->max_free_slots) {
+      uint64_t max = r->max_free_slots ? r->max_free_slots * 2 : 64;
+      uint64_t *slots = realloc(r->free_slots, max * sizeof(*slots));
+
+      /* a leaked slot only costs spill file space */
+      if (!slots)
+        goto out;
+      r->free_slots = slots;
+      r->max_free_slots = max;
+    }
+    r->free_slots[r->nr_free_slots++] = b->slot;
+    host_atomic_add(&disk_stats.spilled_blocks, -1);
+  }
+
+out:
+  free(b);
+}
+
+static int ram_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                     int iovcnt, uint64_t off)
+{
+  struct ram_dev *r = (struct ram_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt), end = off + len, pos;
+  char bounce[RAM_BLOCK_SIZE];
+  int ret = 0;
+
+  host_rwlock_write_lock(&r->lock);
+  for (pos = off; !ret && pos < end;) {
+    uint64_t blk = pos >> RAM_BLOCK_SHIFT;
+    uint64_t next = (blk + 1) << RAM_BLOCK_SHIFT;
+    struct ram_block *b = ram_lookup(r, blk);
+    size_t in_blk = pos & (RAM_BLOCK_SIZE - 1), chunk;
+
+    if (next > end)
+      next = end;
+    chunk = next - pos;
+
+    if (!b) {
+      b = ram_alloc(r, blk, &ret);
+      if (!b)
+        break;
+
+      if (chunk < RAM_BLOCK_SIZE) {
+        struct disk_iovec fill = { bounce, RAM_BLOCK_SIZE };
+        uint64_t start = blk << RAM_BLOCK_SHIFT;
+
+        memset(bounce, 0, RAM_BLOCK_SIZE);
+        if (fill.len > dev->size - start)
+          fill.len = dev->size - start;
+        ret = disk_read(r->lower, &fill, 1, start);
+        if (!ret)
+          ret = ram_block_write(r, b, 0, bounce, RAM_BLOCK_SIZE);
+        if (ret) {
+          ram_free(r, b);
+          break;
+        }
+      }
+    }
+
+    disk_iov_to_buf(iov, iovcnt, pos - off, bounce, chunk);
+    ret = ram_block_write(r, b, in_blk, bounce, chunk);
+    pos = next;
+  }
+
+  if ((int64_t)r->used > disk_stats.ram_peak_bytes)
+    disk_stats.ram_peak_bytes = r->used;
+  host_rwlock_write_unlock(&r->lock);
+
+  return ret;
+}
+
+/* Nothing is ever written back. */
+static int ram_flush(struct disk_dev *dev)
+{
+  (void)dev;
+  return 0;
+}
+
+/* Whole discarded blocks are dropped and read from below again. */
+static int ram_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct ram_dev *r = (struct ram_dev *)dev;
+  uint64_t blk = (off + RAM_BLOCK_SIZE - 1) >> RAM_BLOCK_SHIFT;
+  uint64_t end = (off + len) >> RAM_BLOCK_SHIFT;
+  unsigned int i;
+
+  /* less than a whole block */
+  if (blk >= end)
+    return 0;
+
+  host_rwlock_write_lock(&r->lock);
+  if (end - blk > (1 << RAM_HASH_BITS)) {
+    for (i = 0; i < (1 << RAM_HASH_BITS); i++) {
+      struct ram_block *b = r->hash[i], *next;
+
+      for (; b; b = next) {
+        next = b->next;
+        if (b->blk >= blk && b->blk < end)
+          ram_free(r, b);
+      }
+    }
+  } else {
+    for (; blk < end; blk++) {
+      struct ram_block *b = ram_lookup(r, blk);
+
+      if (b)
+        ram_free(r, b);
+    }
+  }
+  host_rwlock_write_unlock(&r->lock);
+
+  return 0;
+}
+
+static void ram_close(struct disk_dev *dev)
+{
+  struct ram_dev *r = (struct ram_dev *)dev;
+  unsigned int i;
+
+  for (i = 0; i < (1 << RAM_HASH_BITS); i++)
+    while (r->hash[i])
+      ram_free(r, r->hash[i]);
+
+  if (r->spill != HOST_INVALID_FILE)
+    host_file_close(r->spill);
+  disk_close(r->lower);
+  free(r->free_slots);
+  free(r);
+}
+
+static const struct disk_ops ram_ops = {
+  .read = ram_read,
+  .write = ram_write,
+  .flush = ram_flush,
+  .discard = ram_discard,
+  .close = ram_close,
+};
+
+/*
+ * Keeps up to limit bytes of writes in memory, then spills them to spill
+ * if that isn't HOST_INVALID_FILE.  Takes ownership of spill, also on
+ * failure; lower is left to the caller on failure.
+ */
+struct disk_dev *disk_ram_open(struct disk_dev *lower, uint64_t limit,
+                               host_file_t spill, int *err)
+{
+  struct ram_dev *r;
+
+  r = calloc(1, sizeof(*r));
+  if (!r) {
+    if (spill != HOST_INVALID_FILE)
+      host_file_close(spill);
+    if (err)
+      *err = -ENOMEM;
+    return NULL;
+  }
+
+  r->dev.ops = &ram_ops;
+  r->dev.size = lower->size;
+  r->dev.flags = DISK_F_DISCARD;
+  r->lower = lower;
+  r->limit = limit;
+  r->spill = spill;
+  host_rwlock_init(&r->lock);
+
+  return &r->dev;
+}
@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+/*
+ * Striping layer: nr member devices, typically images on different host
+ * disks, presented as one device whose stripes of stripe_size bytes go
+ * round robin over the members.  The stripes a request covers on one
+ * member are adjacent there, so a request becomes at most one contiguous
+ * sub-request per member, and those are issued in parallel through a
+ * queue per member and waited for.  Requests within a single stripe go
+ * straight to their member.
+ */
+
+#define STRIPE_DEPTH 4
+#define STRIPE_WINDOW 16
+
+struct stripe_dev {
+  struct disk_dev dev;
+  int nr;
+  uint64_t stripe_size;
+  struct disk_dev **members;
+  struct disk_dev **queues;
+};
+
+struct stripe_wait {
+  host_mutex_t lock;
+  host_cond_t cond;
+  int pending;
+  int ret;
+};
+
+static void stripe_complete(struct disk_req *req, int ret)
+{
+  struct stripe_wait *w = req->priv;
+
+  host_mutex_lock(&w->lock);
+  if (ret && !w->ret)
+    w->ret = ret;
+  if (!--w->pending)
+    host_cond_signal(&w->cond);
+  host_mutex_unlock(&w->lock);
+}
+
+/* Issues the requests in reqs, nr of them, in parallel and waits for them. */
+static int stripe_run(struct stripe_dev *s, struct disk_req *reqs,
+                      int *member, int nr)
+{
+  struct stripe_wait w;
+  int i;
+
+  host_mutex_init(&w.lock);
+  host_cond_init(&w.cond);
+  w.pending = nr;
+  w.ret = 0;
+
+  for (i = 0; i < nr; i++) {
+    reqs[i].complete = stripe_complete;
+    reqs[i].priv = &w;
+    disk_submit(s->queues[member[i]], &reqs[i]);
+  }
+
+  host_mutex_lock(&w.lock);
+  while (w.pending)
+    host_cond_wait(&w.cond, &w.lock);
+  host_mutex_unlock(&w.lock);
+
+  return w.ret;
+}
+
+/* Member and member offset of device offset off. */
+static int stripe_map(struct stripe_dev *s, uint64_t off, uint64_t *moff)
+{
+  uint64_t stripe = off / s->stripe_size;
+
+  *moff = stripe / s->nr * s->stripe_size + off % s->stripe_size;
+  return stripe % s->nr;
+}
+
+/*
+ * Splits [off, off + len) into one request per member it touches, with
+ * the data in iov, if any, gathered into iov_buf.
+ */
+static int stripe_split(struct stripe_dev *s, enum disk_req_type type,
+                        const struct disk_iovec *iov, int iovcnt,
+                        uint64_t off, uint64_t len, struct disk_req *reqs,
+                        int *member, struct disk_iovec *iov_buf)
+{
+  uint64_t first = off / s->stripe_size;
+  uint64_t last = (off + len - 1) / s->stripe_size;
+  int m, nr = 0;
+
+  for (m = 0; m < s->nr; m++) {
+    uint64_t stripe = first + (m - first % s->nr + s->nr) % s->nr;
+    struct disk_req *req = &reqs[nr];
+
+    if (stripe > last)
+      continue;
+
+    memset(req, 0, sizeof(*req));
+    req->type = type;
+    req->iov = iov_buf;
+    member[nr] = stripe_map(s, stripe == first ? off :
+                            stripe * s->stripe_size, &req->off);
+
+    for (; stripe <= last; stripe += s->nr) {
+      uint64_t start = stripe * s->stripe_size;
+      uint64_t end = start + s->stripe_size;
+
+      if (start < off)
+        start = off;
+      if (end > off + len)
+        end = off + len;
+
+      if (iov) {
+        int n = disk_iov_slice(iov, iovcnt, start - off, end - start,
+                               iov_buf);
+
+        iov_buf += n;
+        req->iovcnt += n;
+      }
+      req->len += end - start;
+    }
+    nr++;
+  }
+
+  return nr;
+}
+
+static int stripe_rw(struct stripe_dev *s, enum disk_req_type type,
+                     const struct disk_iovec *iov, int iovcnt, uint64_t off,
+                     uint64_t len)
+{
+  struct disk_req *reqs;
+  struct disk_iovec *iov_buf = NULL;
+  uint64_t moff;
+  int *member, nr, ret = -ENOMEM;
+
+  if (off > s->dev.size || len > s->dev.size - off)
+    return -EIO;
+  if (!len)
+    return 0;
+
+  /* within one stripe */
+  if (off / s->stripe_size == (off + len - 1) / s->stripe_size) {
+    struct disk_dev *lower = s->members[stripe_map(s, off, &moff)];
+
+    if (type == DISK_REQ_READ)
+      return disk_read(lower, iov, iovcnt, moff);
+    if (type == DISK_REQ_WRITE)
+      return disk_write(lower, iov, iovcnt, moff);
+    return disk_discard(lower, moff, len);
+  }
+
+  reqs = calloc(s->nr, sizeof(*reqs));
+  member = calloc(s->nr, sizeof(*member));
+  if (iov)
+    iov_buf = malloc((iovcnt + len / s->stripe_size + 2) * sizeof(*iov_buf));
+  if (!reqs || !member || (iov && !iov_buf))
+    goto out;
+
+  nr = stripe_split(s, type, iov, iovcnt, off, len, reqs, member, iov_buf);
+  host_atomic_add(&disk_stats.stripe_splits, 1);
+  ret = stripe_run(s, reqs, member, nr);
+
+out:
+  free(reqs);
+  free(member);
+  free(iov_buf);
+  return ret;
+}
+
+static int stripe_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                       int iovcnt, uint64_t off)
+{
+  return stripe_rw((struct stripe_dev *)dev, DISK_REQ_READ, iov, iovcnt, off,
+                   disk_iov_len(iov, iovcnt));
+}
+
+static int stripe_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                        int iovcnt, uint64_t off)
+{
+  return stripe_rw((struct stripe_dev *)dev, DISK_REQ_WRITE, iov, iovcnt,
+                   off, disk_iov_len(iov, iovcnt));
+}
+
+static int stripe_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  return stripe_rw((struct stripe_dev *)dev, DISK_REQ_DISCARD, NULL, 0, off,
+                   len);
+}
+
+static int stripe_flush(struct disk_dev *dev)
+{
+  struct stripe_dev *s = (struct stripe_dev *)dev;
+  struct disk_req *reqs;
+  int *member, i, ret = -ENOMEM;
+
+  reqs = calloc(s->nr, sizeof(*reqs));
+  member = calloc(s->nr, sizeof(*member));
+  if (!reqs || !member)
+    goto out;
+
+  for (i = 0; i < s->nr; i++) {
+    reqs[i].type = DISK_REQ_FLUSH;
+    member[i] = i;
+  }
+  ret = stripe_run(s, reqs, member, s->nr);
+
+out:
+  free(reqs);
+  free(member);
+  return ret;
+}
+
+static void stripe_free(struct stripe_dev *s)
+{
+  int i;
+
+  for (i = 0; i < s->nr; i++) {
+    if (s->queues[i])
+      disk_close(s->queues[i]);
+    else
+      disk_close(s->members[i]);
+  }
+
+  free(s->members);
+  free(s->queues);
+  free(s);
+}
+
+static void stripe_close(struct disk_dev *dev)
+{
+  stripe_free((struct stripe_dev *)dev);
+}
+
+static const struct disk_ops stripe_ops = {
+  .read = stripe_read,
+  .write = stripe_write,
+  .flush = stripe_flush,
+  .discard = stripe_discard,
+  .close = stripe_close,
+};
+
+/*
+ * Stripes over the nr devices in members, using as much of each as fits
+ * in whole stripes on the smallest.  Takes ownership of the members, also
+ * on failure.
+ */
+struct disk_dev *disk_stripe_open(struct disk_dev **members, int nr,
+                                  uint64_t stripe_size, int *err)
+{
+  struct stripe_dev *s;
+  uint64_t member_size = UINT64_MAX;
+  int i, ret = -ENOMEM;
+
+  s = calloc(1, sizeof(*s));
+  if (!s)
+    goto out_close;
+
+  s->dev.ops = &stripe_ops;
+  s->dev.flags = members[0]->flags;
+  s->nr = nr;
+  s->stripe_size = stripe_size;
+  s->members = calloc(nr, sizeof(*s->members));
+  s->queues = calloc(nr, sizeof(*s->queues));
+  if (!s->members || !s->queues) {
+    free(s->members);
+    free(s->queues);
+    free(s);
+    goto out_close;
+  }
+
+  for (i = 0; i < nr; i++) {
+    s->members[i] = members[i];
+    s->dev.flags &= members[i]->flags;
+    if (members[i]->size < member_size)
+      member_size = members[i]->size;
+  }
+
+  ret = -EINVAL;
+  if (!stripe_size || stripe_size % 512 || member_size < stripe_size)
+    goto out_free;
+  s->dev.size = member_size / stripe_size * stripe_size * nr;
+
+  for (i = 0; i < nr; i++) {
+    s->queues[i] = disk_mq_open(members[i], 1, STRIPE_DEPTH, STRIPE_WINDOW,
+                                &ret);
+    if (!s->queues[i])
+      goto out_free;
+  }
+
+  return &s->dev;
+
+out_free:
+  stripe_free(s);
+  goto out;
+out_close:
+  for (i = 0; i < nr; i++)
+    disk_close(members[i]);
+out:
+  if (err)
+    *err = ret;
+  return NULL;
+}
@@ -0,0 +1,983 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "disk.h"
+
+/*
+ * Dynamic VHD and VHDX images.  Both formats map the virtual disk in fixed
+ * size blocks through a block allocation table (BAT) that is read into
+ * memory at open as the file offset of each block, or 0 for blocks that
+ * were never written.  Those read as zeroes without any host I/O, and a
+ * write into one allocates it at the end of the file first.
+ *
+ * VHD keeps a bitmap of the sectors written in front of every block; reads
+ * of clear sectors are zero filled and writes set their bits after the
+ * data is written.  Bitmaps are loaded the first time a block is used.
+ * VHD metadata is big endian, VHDX little endian.
+ *
+ * VHDX updates its BAT in place, after the block's space exists, rather
+ * than through the metadata log, so images whose log needs replaying are
+ * refused; so are differencing images of either format.
+ *
+ * alloc_lock serializes allocations, which alone write the BAT; bat_lock
+ * covers the in-memory BAT and bitmap_lock the VHD sector bitmaps.
+ */
+
+#define VHD_SECTOR_SIZE 512
+#define VHD_FOOTER_SIZE 512
+#define VHD_DYN_HEADER_SIZE 1024
+#define VHD_TYPE_DYNAMIC 3
+#define VHD_TYPE_DIFFERENCING 4
+#define VHD_BAT_UNUSED 0xffffffff
+
+/* VHD footer and dynamic header fields */
+#define VHD_FOOTER_DATA_OFFSET 16
+#define VHD_FOOTER_CURRENT_SIZE 48
+#define VHD_FOOTER_TYPE 60
+#define VHD_FOOTER_CHECKSUM 64
+#define VHD_DYN_TABLE_OFFSET 16
+#define VHD_DYN_MAX_ENTRIES 28
+#define VHD_DYN_BLOCK_SIZE 32
+#define VHD_DYN_CHECKSUM 36
+
+#define VHDX_MB (1 << 20)
+#define VHDX_HEADER_SIZE 4096
+#define VHDX_HEADER_OFF(i) ((uint64_t)(1 + (i)) * 64 * 1024)
+#define VHDX_REGION_OFF(i) ((uint64_t)(3 + (i)) * 64 * 1024)
+#define VHDX_REGION_SIZE (64 * 1024)
+#define VHDX_METADATA_TABLE_SIZE (64 * 1024)
+#define VHDX_HEADER_SIGNATURE 0x64616568 /* "head" */
+#define VHDX_REGION_SIGNATURE 0x69676572 /* "regi" */
+#define VHDX_BAT_STATE_MASK 7
+#define VHDX_BAT_FULLY_PRESENT 6
+#define VHDX_BAT_OFFSET_MASK (~(uint64_t)(VHDX_MB - 1))
+#define VHDX_PARAM_HAS_PARENT 0x2
+#define VHDX_METADATA_REQUIRED 0x4
+
+struct vhdx_header {
+  uint32_t signature;
+  uint32_t checksum;
+  uint64_t sequence;
+  uint8_t file_write_guid[16];
+  uint8_t data_write_guid[16];
+  uint8_t log_guid[16];
+  uint16_t log_version;
+  uint16_t version;
+  uint32_t log_length;
+  uint64_t log_offset;
+};
+
+struct vhdx_region_header {
+  uint32_t signature;
+  uint32_t checksum;
+  uint32_t entry_count;
+  uint32_t reserved;
+};
+
+struct vhdx_region_entry {
+  uint8_t guid[16];
+  uint64_t file_offset;
+  uint32_t length;
+  uint32_t required;
+};
+
+struct vhdx_metadata_header {
+  char signature[8];
+  uint16_t reserved;
+  uint16_t entry_count;
+  uint8_t reserved2[20];
+};
+
+struct vhdx_metadata_entry {
+  uint8_t guid[16];
+  uint32_t offset;
+  uint32_t length;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+/* GUIDs as laid out in the file */
+static const uint8_t vhdx_bat_guid[16] = {
+  0x66, 0x77, 0xc2, 0x2d, 0x23, 0xf6, 0x00, 0x42,
+  0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08 };
+static const uint8_t vhdx_metadata_guid[16] = {
+  0x06, 0xa2, 0x7c, 0x8b, 0x90, 0x47, 0x9a, 0x4b,
+  0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e };
+static const uint8_t vhdx_file_params_guid[16] = {
+  0x37, 0x67, 0xa1, 0xca, 0x36, 0xfa, 0x43, 0x4d,
+  0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b };
+static const uint8_t vhdx_disk_size_guid[16] = {
+  0x24, 0x42, 0xa5, 0x2f, 0x1b, 0xcd, 0x76, 0x48,
+  0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8 };
+static const uint8_t vhdx_logical_sector_guid[16] = {
+  0x1d, 0xbf, 0x41, 0x81, 0x6f, 0xa9, 0x09, 0x47,
+  0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f };
+static const uint8_t vhdx_physical_sector_guid[16] = {
+  0xc7, 0x48, 0xa3, 0xcd, 0x5d, 0x44, 0x71, 0x44,
+  0x9c, 0xc9, 0xe9, 0x88, 0x52, 0x51, 0xc5, 0x56 };
+static const uint8_t vhdx_page83_guid[16] = {
+  0xab, 0x12, 0xca, 0xbe, 0xe6, 0xb2, 0x23, 0x45,
+  0x93, 0xef, 0xc3, 0x09, 0xe0, 0x00, 0xc7, 0x46 };
+
+struct vhd_dev {
+  struct disk_dev dev;
+  host_file_t file;
+  int vhdx;
+  unsigned int block_shift;
+  uint64_t nr_blocks;
+  uint64_t bat_off;
+  uint64_t tail;
+  host_mutex_t alloc_lock;
+  host_rwlock_t bat_lock;
+  uint64_t *blocks;
+  /* VHD */
+  uint32_t bitmap_size;
+  host_mutex_t bitmap_lock;
+  uint8_t **bitmaps;
+  uint8_t footer[VHD_FOOTER_SIZE];
+  /* VHDX */
+  uint64_t chunk_ratio;
+  struct vhdx_header hdr;
+  int hdr_slot;
+  volatile int hdr_updated;
+};
+
+static uint32_t get_be32(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static uint64_t get_be64(const uint8_t *p)
+{
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/* One's complement of the byte sum, skipping the checksum field. */
+static uint32_t vhd_checksum(const uint8_t *buf, size_t len, size_t skip)
+{
+  uint32_t sum = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    if (i < skip || i >= skip + 4)
+      sum += buf[i];
+
+  return ~sum;
+}
+
+static uint32_t vhdx_crc32c(const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  uint32_t crc = ~0U;
+  int i;
+
+  while (len--) {
+    crc ^= *p++;
+    for (i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+  }
+
+  return ~crc;
+}
+
+/* Checks the CRC-32C at checksum_off of a structure of len bytes. */
+static int vhdx_check_crc(void *buf, size_t len, size_t checksum_off)
+{
+  uint32_t *checksum = (uint32_t *)((char *)buf + checksum_off);
+  uint32_t expected = *checksum;
+  uint32_t crc;
+
+  *checksum = 0;
+  crc = vhdx_crc32c(buf, len);
+  *checksum = expected;
+
+  return crc == expected;
+}
+
+static uint64_t vhd_block(struct vhd_dev *v, uint64_t blk)
+{
+  uint64_t data;
+
+  host_rwlock_read_lock(&v->bat_lock);
+  data = v->blocks[blk];
+  host_rwlock_read_unlock(&v->bat_lock);
+
+  return data;
+}
+
+static void vhd_set_block(struct vhd_dev *v, uint64_t blk, uint64_t data)
+{
+  host_rwlock_write_lock(&v->bat_lock);
+  v->blocks[blk] = data;
+  host_rwlock_write_unlock(&v->bat_lock);
+}
+
+static int vhd_test_bit(const uint8_t *bitmap, uint64_t sector)
+{
+  return bitmap[sector >> 3] & (0x80 >> (sector & 7));
+}
+
+/* Returns the sector bitmap of block blk; called with bitmap_lock held. */
+static uint8_t *vhd_bitmap(struct vhd_dev *v, uint64_t blk, uint64_t data,
+                           int *err)
+{
+  uint8_t *bitmap = v->bitmaps[blk];
+
+  if (bitmap)
+    return bitmap;
+
+  bitmap = malloc(v->bitmap_size);
+  if (!bitmap) {
+    *err = -ENOMEM;
+    return NULL;
+  }
+
+  *err = host_file_read(v->file, bitmap, v->bitmap_size,
+                        data - v->bitmap_size);
+  if (*err) {
+    free(bitmap);
+    return NULL;
+  }
+
+  v->bitmaps[blk] = bitmap;
+  return bitmap;
+}
+
+/*
+ * Length of the run starting at pos, up to end in the same block, whose
+ * sectors are all written or all not.
+ */
+static int vhd_sector_run(struct vhd_dev *v, uint64_t blk, uint64_t data,
+                          uint64_t pos, uint64_t end, int *present,
+                          uint64_t *run)
+{
+  uint64_t mask = ((uint64_t)1 << v->block_shift) - 1;
+  uint64_t run_end = ((pos >> 9) + 1) << 9;
+  uint8_t *bitmap;
+  int ret = 0;
+
+  host_mutex_lock(&v->bitmap_lock);
+  bitmap = vhd_bitmap(v, blk, data, &ret);
+  if (bitmap) {
+    *present = vhd_test_bit(bitmap, (pos & mask) >> 9) != 0;
+    while (run_end < end &&
+           (vhd_test_bit(bitmap, (run_end & mask) >> 9) != 0) == *present)
+      run_end += VHD_SECTOR_SIZE;
+    *run = (run_end < end ? run_end : end) - pos;
+  }
+  host_mutex_unlock(&v->bitmap_lock);
+
+  return ret;
+}
+
+/* Marks the sectors of [pos, end) in block blk written. */
+static int vhd_mark_sectors(struct vhd_dev *v, uint64_t blk, uint64_t data,
+                            uint64_t pos, uint64_t end)
+{
+  uint64_t mask = ((uint64_t)1 << v->block_shift) - 1;
+  uint64_t first = (pos & mask) >> 9, last = ((end - 1) & mask) >> 9, s;
+  uint64_t lo = UINT64_MAX, hi = 0;
+  uint8_t *bitmap;
+  int ret = 0;
+
+  host_mutex_lock(&v->bitmap_lock);
+  bitmap = vhd_bitmap(v, blk, data, &ret);
+  for (s = first; bitmap && s <= last; s++) {
+    if (vhd_test_bit(bitmap, s))
+      continue;
+
+    bitmap[s >> 3] |= 0x80 >> (s & 7);
+    if (s >> 3 < lo)
+      lo = s >> 3;
+    hi = s >> 3;
+  }
+
+  /* write back the bitmap sectors that changed */
+  if (bitmap && lo <= hi) {
+    lo &= ~(uint64_t)(VHD_SECTOR_SIZE - 1);
+    hi = (hi | (VHD_SECTOR_SIZE - 1)) + 1;
+    ret = host_file_write(v->file, bitmap + lo, hi - lo,
+                          data - v->bitmap_size + lo);
+  }
+  host_mutex_unlock(&v->bitmap_lock);
+
+  return ret;
+}
+
+/*
+ * Moves the footer behind a new block at the end of the file and points
+ * the BAT entry at it; called with alloc_lock held.
+ */
+static int vhd_alloc(struct vhd_dev *v, uint64_t blk, uint64_t *data)
+{
+  uint64_t start = v->tail;
+  uint64_t end = start + v->bitmap_size + ((uint64_t)1 << v->block_shift);
+  uint8_t *bitmap, entry[4];
+  int ret;
+
+  if (start >> 9 >= VHD_BAT_UNUSED)
+    return -EFBIG;
+
+  bitmap = calloc(1, v->bitmap_size);
+  if (!bitmap)
+    return -ENOMEM;
+
+  ret = host_file_write(v->file, bitmap, v->bitmap_size, start);
+  if (!ret)
+    ret = host_file_write(v->file, v->footer, VHD_FOOTER_SIZE, end);
+  if (ret)
+    goto out_free;
+  v->tail = end;
+
+  put_be32(entry, start >> 9);
+  ret = host_file_write(v->file, entry, sizeof(entry), v->bat_off + blk * 4);
+  if (ret)
+    goto out_free;
+
+  host_mutex_lock(&v->bitmap_lock);
+  v->bitmaps[blk] = bitmap;
+  host_mutex_unlock(&v->bitmap_lock);
+
+  *data = start + v->bitmap_size;
+  return 0;
+
+out_free:
+  free(bitmap);
+  return ret;
+}
+
+static uint64_t vhdx_bat_index(struct vhd_dev *v, uint64_t blk)
+{
+  return blk + blk / v->chunk_ratio;
+}
+
+/*
+ * Extends the file by a block and points the BAT entry at it; called with
+ * alloc_lock held.
+ */
+static int vhdx_alloc(struct vhd_dev *v, uint64_t blk, uint64_t *data)
+{
+  uint64_t start = v->tail, size = (uint64_t)1 << v->block_shift;
+  uint64_t entry = start | VHDX_BAT_FULLY_PRESENT;
+  char zero[VHD_SECTOR_SIZE];
+  int ret;
+
+  memset(zero, 0, sizeof(zero));
+  ret = host_file_write(v->file, zero, sizeof(zero),
+                        start + size - sizeof(zero));
+  if (ret)
+    return ret;
+  v->tail += size;
+
+  ret = host_file_write(v->file, &entry, sizeof(entry),
+                        v->bat_off + vhdx_bat_index(v, blk) * 8);
+  if (ret)
+    return ret;
+
+  *data = start;
+  return 0;
+}
+
+static void vhdx_new_guid(uint8_t *guid, uint64_t seed)
+{
+  uint64_t x = seed ^ (uint64_t)time(NULL) ^ (uintptr_t)guid;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    x += 0x9e3779b97f4a7c15ULL;
+    guid[i] = (x ^ (x >> 31)) * 0xbf58476d1ce4e5b9ULL >> 56;
+  }
+  guid[7] = (guid[7] & 0x0f) | 0x40;
+  guid[8] = (guid[8] & 0x3f) | 0x80;
+}
+
+/*
+ * Before the first modification the file and data write GUIDs change, in
+ * a new header written over the older of the two copies.
+ */
+static int vhdx_begin_write(struct vhd_dev *v)
+{
+  struct vhdx_header *hdr;
+  uint8_t *buf;
+  int ret;
+
+  host_mutex_lock(&v->alloc_lock);
+  if (v->hdr_updated) {
+    host_mutex_unlock(&v->alloc_lock);
+    return 0;
+  }
+
+  ret = -ENOMEM;
+  buf = calloc(1, VHDX_HEADER_SIZE);
+  if (!buf)
+    goto out;
+
+  hdr = (struct vhdx_header *)buf;
+  *hdr = v->hdr;
+  hdr->sequence++;
+  vhdx_new_guid(hdr->file_write_guid, hdr->sequence);
+  vhdx_new_guid(hdr->data_write_guid, ~hdr->sequence);
+  hdr->checksum = 0;
+  hdr->checksum = vhdx_crc32c(buf, VHDX_HEADER_SIZE);
+
+  ret = host_file_write(v->file, buf, VHDX_HEADER_SIZE,
+                        VHDX_HEADER_OFF(!v->hdr_slot));
+  if (!ret)
+    ret = host_file_flush(v->file);
+  if (!ret) {
+    v->hdr = *hdr;
+    v->hdr_slot = !v->hdr_slot;
+    v->hdr_updated = 1;
+  }
+  free(buf);
+
+out:
+  host_mutex_unlock(&v->alloc_lock);
+  return ret;
+}
+
+static int vhd_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                    int iovcnt, uint64_t off)
+{
+  struct vhd_dev *v = (struct vhd_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt), end = off + len, pos, run;
+  uint64_t mask = ((uint64_t)1 << v->block_shift) - 1;
+  struct disk_iovec *sub;
+  int ret = 0;
+
+  if (off > dev->size || len > dev->size - off)
+    return -EIO;
+
+  sub = malloc(iovcnt * sizeof(*sub));
+  if (!sub)
+    return -ENOMEM;
+
+  for (pos = off; !ret && pos < end; pos += run) {
+    uint64_t blk = pos >> v->block_shift;
+    uint64_t next = (blk + 1) << v->block_shift;
+    uint64_t data = vhd_block(v, blk);
+    int present = data != 0, n;
+
+    if (next > end)
+      next = end;
+    run = next - pos;
+
+    if (present && !v->vhdx) {
+      ret = vhd_sector_run(v, blk, data, pos, next, &present, &run);
+      if (ret)
+        break;
+    }
+
+    if (!present) {
+      disk_iov_zero(iov, iovcnt, pos - off, run);
+      host_atomic_add(&disk_stats.unallocated_bytes, run);
+      continue;
+    }
+
+    n = disk_iov_slice(iov, iovcnt, pos - off, run, sub);
+    ret = host_file_readv(v->file, (const struct host_iovec *)sub, n,
+                          data + (pos & mask));
+  }
+
+  free(sub);
+  return ret;
+}
+
+static int vhd_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                     int iovcnt, uint64_t off)
+{
+  struct vhd_dev *v = (struct vhd_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt), end = off + len, pos, next;
+  uint64_t mask = ((uint64_t)1 << v->block_shift) - 1;
+  struct disk_iovec *sub;
+  int ret = 0;
+
+  if (dev->flags & DISK_F_READONLY)
+    return -EROFS;
+
+  if (off > dev->size || len > dev->size - off)
+    return -EIO;
+
+  if (v->vhdx && !v->hdr_updated) {
+    ret = vhdx_begin_write(v);
+    if (ret)
+      return ret;
+  }
+
+  sub = malloc(iovcnt * sizeof(*sub));
+  if (!sub)
+    return -ENOMEM;
+
+  for (pos = off; !ret && pos < end; pos = next) {
+    uint64_t blk = pos >> v->block_shift;
+    uint64_t data = vhd_block(v, blk);
+    int n;
+
+    next = (blk + 1) << v->block_shift;
+    if (next > end)
+      next = end;
+
+    if (!data) {
+      host_mutex_lock(&v->alloc_lock);
+      data = v->blocks[blk];
+      if (!data) {
+        ret = v->vhdx ? vhdx_alloc(v, blk, &data) : vhd_alloc(v, blk, &data);
+        if (!ret) {
+          vhd_set_block(v, blk, data);
+          host_atomic_add(&disk_stats.vhd_allocs, 1);
+        }
+      }
+      host_mutex_unlock(&v->alloc_lock);
+      if (ret)
+        break;
+    }
+
+    n = disk_iov_slice(iov, iovcnt, pos - off, next - pos, sub);
+    ret = host_file_writev(v->file, (const struct host_iovec *)sub, n,
+                           data + (pos & mask));
+    if (!ret && !v->vhdx)
+      ret = vhd_mark_sectors(v, blk, data, pos, next);
+  }
+
+  free(sub);
+  return ret;
+}
+
+static int vhd_flush(struct disk_dev *dev)
+{
+  struct vhd_dev *v = (struct vhd_dev *)dev;
+
+  return host_file_flush(v->file);
+}
+
+static void vhd_free(struct vhd_dev *v)
+{
+  uint64_t i;
+
+  if (v->bitmaps)
+    for (i = 0; i < v->nr_blocks; i++)
+      free(v->bitmaps[i]);
+  free(v->bitmaps);
+  free(v->blocks);
+  free(v);
+}
+
+static void vhd_close(struct disk_dev *dev)
+{
+  struct vhd_dev *v = (struct vhd_dev *)dev;
+
+  host_file_close(v->file);
+  vhd_free(v);
+}
+
+static const struct disk_ops vhd_ops = {
+  .read = vhd_read,
+  .write = vhd_write,
+  .flush = vhd_flush,
+  .close = vhd_close,
+};
+
+static int vhd_set_geometry(struct vhd_dev *v, uint64_t size,
+                            uint64_t block_size, uint64_t nr_entries)
+{
+  unsigned int shift = 0;
+
+  while (shift < 63 && ((uint64_t)1 << shift) < block_size)
+    shift++;
+  if (((uint64_t)1 << shift) != block_size || block_size < VHD_SECTOR_SIZE)
+    return -EINVAL;
+
+  v->dev.size = size;
+  v->block_shift = shift;
+  v->nr_blocks = (size + block_size - 1) >> shift;
+  if (v->nr_blocks > nr_entries || v->nr_blocks > SIZE_MAX / 8)
+    return -EINVAL;
+
+  v->blocks = calloc(v->nr_blocks ? v->nr_blocks : 1, sizeof(*v->blocks));
+  if (!v->blocks)
+    return -ENOMEM;
+
+  return 0;
+}
+
+static int vhd_load(struct vhd_dev *v, uint64_t file_size)
+{
+  uint8_t dyn[VHD_DYN_HEADER_SIZE], *bat;
+  uint64_t i, end;
+  uint32_t nr_entries;
+  int ret;
+
+  /* the footer at the end is authoritative, the copy at 0 a fallback */
+  ret = host_file_read(v->file, v->footer, VHD_FOOTER_SIZE,
+                       (file_size & ~(uint64_t)(VHD_SECTOR_SIZE - 1)) -
+                       VHD_FOOTER_SIZE);
+  if (ret)
+    return ret;
+  if (memcmp(v->footer, "conectix", 8) ||
+      get_be32(v->footer + VHD_FOOTER_CHECKSUM) !=
+      vhd_checksum(v->footer, VHD_FOOTER_SIZE, VHD_FOOTER_CHECKSUM)) {
+    ret = host_file_read(v->file, v->footer, VHD_FOOTER_SIZE, 0);
+    if (ret)
+      return ret;
+  }
+
+  if (memcmp(v->footer, "conectix", 8) ||
+      get_be32(v->footer + VHD_FOOTER_CHECKSUM) !=
+      vhd_checksum(v->footer, VHD_FOOTER_SIZE, VHD_FOOTER_CHECKSUM))
+    return -EINVAL;
+  if (get_be32(v->footer + VHD_FOOTER_TYPE) == VHD_TYPE_DIFFERENCING)
+    return -EOPNOTSUPP;
+  if (get_be32(v->footer + VHD_FOOTER_TYPE) != VHD_TYPE_DYNAMIC)
+    return -EINVAL;
+
+  ret = host_file_read(v->file, dyn, sizeof(dyn),
+                       get_be64(v->footer + VHD_FOOTER_DATA_OFFSET));
+  if (ret)
+    return ret;
+  if (memcmp(dyn, "cxsparse", 8) ||
+      get_be32(dyn + VHD_DYN_CHECKSUM) !=
+      vhd_checksum(dyn, sizeof(dyn), VHD_DYN_CHECKSUM))
+    return -EINVAL;
+
+  nr_entries = get_be32(dyn + VHD_DYN_MAX_ENTRIES);
+  ret = vhd_set_geometry(v, get_be64(v->footer + VHD_FOOTER_CURRENT_SIZE),
+                         get_be32(dyn + VHD_DYN_BLOCK_SIZE), nr_entries);
+  if (ret)
+    return ret;
+
+  v->bat_off = get_be64(dyn + VHD_DYN_TABLE_OFFSET);
+  v->bitmap_size = ((((uint64_t)1 << v->block_shift) / VHD_SECTOR_SIZE / 8 +
+                     VHD_SECTOR_SIZE - 1) & ~(VHD_SECTOR_SIZE - 1));
+  v->bitmaps = calloc(v->nr_blocks ? v->nr_blocks : 1, sizeof(*v->bitmaps));
+  bat = malloc((size_t)nr_entries * 4);
+  if (!v->bitmaps || !bat) {
+    free(bat);
+    return -ENOMEM;
+  }
+
+  ret = host_file_read(v->file, bat, (size_t)nr_entries * 4, v->bat_off);
+  if (ret)
+    goto out;
+
+  /* new blocks go where the footer is, or behind everything else */
+  v->tail = (file_size & ~(uint64_t)(VHD_SECTOR_SIZE - 1)) - VHD_FOOTER_SIZE;
+  end = v->bat_off + (((uint64_t)nr_entries * 4 + VHD_SECTOR_SIZE - 1) &
+                      ~(uint64_t)(VHD_SECTOR_SIZE - 1));
+  if (v->tail < end)
+    v->tail = end;
+
+  for (i = 0; i < v->nr_blocks; i++) {
+    uint32_t sector = get_be32(bat + i * 4);
+
+    if (sector == VHD_BAT_UNUSED)
+      continue;
+
+    v->blocks[i] = ((uint64_t)sector << 9) + v->bitmap_size;
+    end = v->blocks[i] + ((uint64_t)1 << v->block_shift);
+    if (v->tail < end)
+      v->tail = end;
+  }
+
+out:
+  free(bat);
+  return ret;
+}
+
+static int vhdx_load_header(struct vhd_dev *v)
+{
+  uint8_t *buf;
+  int i, ret = 0, found = 0;
+
+  buf = malloc(VHDX_HEADER_SIZE);
+  if (!buf)
+    return -ENOMEM;
+
+  for (i = 0; i < 2; i++) {
+    struct vhdx_header *hdr = (struct vhdx_header *)buf;
+
+    ret = host_file_read(v->file, buf, VHDX_HEADER_SIZE, VHDX_HEADER_OFF(i));
+    if (ret)
+      goto out;
+
+    if (hdr->signature != VHDX_HEADER_SIGNATURE ||
+        !vhdx_check_crc(buf, VHDX_HEADER_SIZE,
+                        offsetof(struct vhdx_header, checksum)))
+      continue;
+
+    if (!found || hdr->sequence > v->hdr.sequence) {
+      v->hdr = *hdr;
+      v->hdr_slot = i;
+      found = 1;
+    }
+  }
+
+  if (!found || v->hdr.version != 1)
+    ret = -EINVAL;
+
+out:
+  free(buf);
+  return ret;
+}
+
+static int vhdx_find_regions(struct vhd_dev *v, struct vhdx_region_entry *bat,
+                             struct vhdx_region_entry *meta)
+{
+  struct vhdx_region_header *rh;
+  struct vhdx_region_entry *re;
+  uint8_t *buf;
+  uint32_t i;
+  int t, ret = -EINVAL;
+
+  buf = malloc(VHDX_REGION_SIZE);
+  if (!buf)
+    return -ENOMEM;
+
+  rh = (struct vhdx_region_header *)buf;
+  re = (struct vhdx_region_entry *)(rh + 1);
+
+  for (t = 0; t < 2; t++) {
+    ret = host_file_read(v->file, buf, VHDX_REGION_SIZE, VHDX_REGION_OFF(t));
+    if (ret)
+      goto out;
+
+    ret = -EINVAL;
+    if (rh->signature == VHDX_REGION_SIGNATURE &&
+        rh->entry_count <= (VHDX_REGION_SIZE - sizeof(*rh)) / sizeof(*re) &&
+        vhdx_check_crc(buf, VHDX_REGION_SIZE,
+                       offsetof(struct vhdx_region_header, checksum)))
+      break;
+  }
+  if (t == 2)
+    goto out;
+
+  memset(bat, 0, sizeof(*bat));
+  memset(meta, 0, sizeof(*meta));
+  for (i = 0; i < rh->entry_count; i++) {
+    if (!memcmp(re[i].guid, vhdx_bat_guid, 16))
+      *bat = re[i];
+    else if (!memcmp(re[i].guid, vhdx_metadata_guid, 16))
+      *meta = re[i];
+    else if (re[i].required & 1)
+      goto out;
+  }
+
+  if (bat->file_offset && meta->file_offset)
+    ret = 0;
+
+out:
+  free(buf);
+  return ret;
+}
+
+static int vhdx_read_item(struct vhd_dev *v, uint64_t meta_off,
+                          const struct vhdx_metadata_entry *e, void *val,
+                          size_t len)
+{
+  if (e->length != len)
+    return -EINVAL;
+
+  return host_file_read(v->file, val, len, meta_off + e->offset);
+}
+
+static int vhdx_load_metadata(struct vhd_dev *v,
+                              const struct vhdx_region_entry *meta,
+                              uint32_t *block_size, uint64_t *size,
+                              uint32_t *sector_size)
+{
+  struct vhdx_metadata_header *mh;
+  struct vhdx_metadata_entry *me;
+  uint32_t params[2], i;
+  uint8_t *buf;
+  int ret = -EINVAL, found = 0;
+
+  if (meta->length < VHDX_METADATA_TABLE_SIZE)
+    return -EINVAL;
+
+  buf = malloc(VHDX_METADATA_TABLE_SIZE);
+  if (!buf)
+    return -ENOMEM;
+
+  ret = host_file_read(v->file, buf, VHDX_METADATA_TABLE_SIZE,
+                       meta->file_offset);
+  if (ret)
+    goto out;
+
+  mh = (struct vhdx_metadata_header *)buf;
+  me = (struct vhdx_metadata_entry *)(mh + 1);
+  ret = -EINVAL;
+  if (memcmp(mh->signature, "metadata", 8) ||
+      mh->entry_count > (VHDX_METADATA_TABLE_SIZE - sizeof(*mh)) /
+                        sizeof(*me))
+    goto out;
+
+  for (i = 0; i < mh->entry_count; i++) {
+    const uint8_t *guid = me[i].guid;
+
+    if (!memcmp(guid, vhdx_file_params_guid, 16)) {
+      ret = vhdx_read_item(v, meta->file_offset, &me[i], params,
+                           sizeof(params));
+      *block_size = params[0];
+      found |= 1;
+    } else if (!memcmp(guid, vhdx_disk_size_guid, 16)) {
+      ret = vhdx_read_item(v, meta->file_offset, &me[i], size, sizeof(*size));
+      found |= 2;
+    } else if (!memcmp(guid, vhdx_logical_sector_guid, 16)) {
+      ret = vhdx_read_item(v, meta->file_offset, &me[i], sector_size,
+                           sizeof(*sector_size));
+      found |= 4;
+    } else if (!memcmp(guid, vhdx_physical_sector_guid, 16) ||
+               !memcmp(guid, vhdx_page83_guid, 16)) {
+      continue;
+    } else if (me[i].flags & VHDX_METADATA_REQUIRED) {
+      ret = -EINVAL;
+    }
+    if (ret)
+      goto out;
+  }
+
+  if (found != 7) {
+    ret = -EINVAL;
+  } else if (params[1] & VHDX_PARAM_HAS_PARENT) {
+    ret = -EOPNOTSUPP;
+  } else if (*block_size < VHDX_MB || *block_size % VHDX_MB ||
+             (*sector_size != 512 && *sector_size != 4096)) {
+    ret = -EINVAL;
+  }
+
+out:
+  free(buf);
+  return ret;
+}
+
+static int vhdx_load(struct vhd_dev *v, uint64_t file_size)
+{
+  struct vhdx_region_entry bat_region, meta_region;
+  uint64_t size, nr_entries, i, *bat;
+  uint32_t block_size = 0, sector_size = 0;
+  static const uint8_t no_log[16];
+  int ret;
+
+  ret = vhdx_load_header(v);
+  if (ret)
+    return ret;
+
+  /* an unreplayed log may hold metadata updates we would miss */
+  if (memcmp(v->hdr.log_guid, no_log, sizeof(no_log)))
+    return -EINVAL;
+
+  ret = vhdx_find_regions(v, &bat_region, &meta_region);
+  if (!ret)
+    ret = vhdx_load_metadata(v, &meta_region, &block_size, &size,
+                             &sector_size);
+  if (ret)
+    return ret;
+
+  v->chunk_ratio = ((uint64_t)1 << 23) * sector_size / block_size;
+  ret = vhd_set_geometry(v, size, block_size, UINT64_MAX);
+  if (ret)
+    return ret;
+
+  nr_entries = v->nr_blocks ? vhdx_bat_index(v, v->nr_blocks - 1) + 1 : 0;
+  if (nr_entries * 8 > bat_region.length)
+    return -EINVAL;
+
+  v->bat_off = bat_region.file_offset;
+  bat = malloc(nr_entries ? nr_entries * 8 : 1);
+  if (!bat)
+    return -ENOMEM;
+
+  ret = host_file_read(v->file, bat, nr_entries * 8, v->bat_off);
+  if (ret)
+    goto out;
+
+  v->tail = (file_size + VHDX_MB - 1) & VHDX_BAT_OFFSET_MASK;
+  for (i = 0; i < v->nr_blocks; i++) {
+    uint64_t entry = bat[vhdx_bat_index(v, i)];
+
+    /* not present, undefined, zero and unmapped blocks all read as zeroes */
+    if ((entry & VHDX_BAT_STATE_MASK) != VHDX_BAT_FULLY_PRESENT)
+      continue;
+
+    v->blocks[i] = entry & VHDX_BAT_OFFSET_MASK;
+    if (v->tail < v->blocks[i] + block_size)
+      v->tail = v->blocks[i] + block_size;
+  }
+
+out:
+  free(bat);
+  return ret;
+}
+
+/* Returns 1 if file holds a VHD or VHDX image, 0 if not. */
+int disk_vhd_probe(host_file_t file)
+{
+  char *buf;
+  int ret;
+
+  buf = host_alloc_aligned(4096, 4096);
+  if (!buf)
+    return -ENOMEM;
+
+  ret = host_file_read(file, buf, 4096, 0);
+  if (!ret)
+    ret = !memcmp(buf, "conectix", 8) || !memcmp(buf, "vhdxfile", 8);
+
+  host_free_aligned(buf);
+  return ret;
+}
+
+/* Takes ownership of file, also on failure. */
+struct disk_dev *disk_vhd_open(host_file_t file, unsigned int flags,
+                               int *err)
+{
+  struct vhd_dev *v;
+  uint64_t file_size;
+  char magic[8];
+  int ret = -ENOMEM;
+
+  if (flags & DISK_F_UNBUFFERED) {
+    ret = -EINVAL;
+    goto out_close;
+  }
+
+  v = calloc(1, sizeof(*v));
+  if (!v)
+    goto out_close;
+
+  v->dev.ops = &vhd_ops;
+  v->dev.flags = flags & DISK_F_READONLY;
+  v->file = file;
+  host_mutex_init(&v->alloc_lock);
+  host_rwlock_init(&v->bat_lock);
+  host_mutex_init(&v->bitmap_lock);
+
+  ret = host_file_size(file, &file_size);
+  if (!ret)
+    ret = host_file_read(file, magic, sizeof(magic), 0);
+  if (ret)
+    goto out_free;
+
+  v->vhdx = !memcmp(magic, "vhdxfile", sizeof(magic));
+  ret = v->vhdx ? vhdx_load(v, file_size) : vhd_load(v, file_size);
+  if (ret)
+    goto out_free;
+
+  return &v->dev;
+
+out_free:
+  vhd_free(v);
+out_close:
+  host_file_close(file);
+  if (err)
+    *err = ret;
+  return NULL;
+}
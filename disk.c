@@ -0,0 +1,1073 @@
+#include <stdlib.h>
+#include <string.h>
+#include <lkl/lkl.h>
+#include <lkl/lkl_host.h>
+#include "disk.h"
+
+#define DISK_SECTOR_SIZE 512
+#define DISCARD_MAX_RANGES 256
+#define LKL_REQ_IOVECS 16
+
+struct disk_stats disk_stats;
+
+int disk_read(struct disk_dev *dev, const struct disk_iovec *iov, int iovcnt,
+              uint64_t off)
+{
+  return dev->ops->read(dev, iov, iovcnt, off);
+}
+
+int disk_write(struct disk_dev *dev, const struct disk_iovec *iov, int iovcnt,
+               uint64_t off)
+{
+  return dev->ops->write(dev, iov, iovcnt, off);
+}
+
+int disk_flush(struct disk_dev *dev)
+{
+  if (!dev->ops->flush)
+    return 0;
+  return dev->ops->flush(dev);
+}
+
+int disk_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  if (!(dev->flags & DISK_F_DISCARD) || !dev->ops->discard)
+    return -EOPNOTSUPP;
+  return dev->ops->discard(dev, off, len);
+}
+
+void disk_close(struct disk_dev *dev)
+{
+  if (dev)
+    dev->ops->close(dev);
+}
+
+static void disk_iov_copy(const struct disk_iovec *iov, int iovcnt,
+                          size_t skip, char *buf, size_t len, int to_iov)
+{
+  int i;
+
+  for (i = 0; i < iovcnt && len; i++) {
+    size_t n;
+
+    if (skip >= iov[i].len) {
+      skip -= iov[i].len;
+      continue;
+    }
+
+    n = iov[i].len - skip;
+    if (n > len)
+      n = len;
+
+    if (!buf)
+      memset((char *)iov[i].base + skip, 0, n);
+    else if (to_iov)
+      memcpy((char *)iov[i].base + skip, buf, n);
+    else
+      memcpy(buf, (char *)iov[i].base + skip, n);
+
+    if (buf)
+      buf += n;
+    len -= n;
+    skip = 0;
+  }
+}
+
+/* Copy len bytes from the vector, starting skip bytes into it, to buf. */
+void disk_iov_to_buf(const struct disk_iovec *iov, int iovcnt, size_t skip,
+                     void *buf, size_t len)
+{
+  disk_iov_copy(iov, iovcnt, skip, buf, len, 0);
+}
+
+/* Copy len bytes from buf into the vector, starting skip bytes into it. */
+void disk_iov_from_buf(const struct disk_iovec *iov, int iovcnt, size_t skip,
+                       const void *buf, size_t len)
+{
+  disk_iov_copy(iov, iovcnt, skip, (char *)buf, len, 1);
+}
+
+/* Zero len bytes of the vector, starting skip bytes into it. */
+void disk_iov_zero(const struct disk_iovec *iov, int iovcnt, size_t skip,
+                   size_t len)
+{
+  disk_iov_copy(iov, iovcnt, skip, NULL, len, 1);
+}
+
+/*
+ * Fills out, which needs room for iovcnt entries, with the part
+ * [skip, skip + len) of the vector and returns its number of entries.
+ */
+int disk_iov_slice(const struct disk_iovec *iov, int iovcnt, size_t skip,
+                   size_t len, struct disk_iovec *out)
+{
+  int i, n = 0;
+
+  for (i = 0; i < iovcnt && len; i++) {
+    if (skip >= iov[i].len) {
+      skip -= iov[i].len;
+      continue;
+    }
+
+    out[n].base = (char *)iov[i].base + skip;
+    out[n].len = iov[i].len - skip;
+    if (out[n].len > len)
+      out[n].len = len;
+    len -= out[n].len;
+    skip = 0;
+    n++;
+  }
+
+  return n;
+}
+
+/* Runs req synchronously on dev, without completing it. */
+int disk_execute(struct disk_dev *dev, struct disk_req *req)
+{
+  switch (req->type) {
+  case DISK_REQ_READ:
+    return disk_read(dev, req->iov, req->iovcnt, req->off);
+  case DISK_REQ_WRITE:
+    return disk_write(dev, req->iov, req->iovcnt, req->off);
+  case DISK_REQ_FLUSH:
+    return disk_flush(dev);
+  case DISK_REQ_DISCARD:
+    return disk_discard(dev, req->off, req->len);
+  default:
+    return -EOPNOTSUPP;
+  }
+}
+
+void disk_submit(struct disk_dev *dev, struct disk_req *req)
+{
+  if (dev->ops->submit)
+    dev->ops->submit(dev, req);
+  else
+    req->complete(req, disk_execute(dev, req));
+}
+
+size_t disk_iov_len(const struct disk_iovec *iov, int iovcnt)
+{
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].len;
+
+  return len;
+}
+
+/*
+ * Raw backend: the image file (or host device) is the disk.
+ *
+ * With DISK_F_UNBUFFERED the image is opened past the host page cache, and
+ * every host request has to be aligned to the host sector size in offset,
+ * length and buffer address.  Requests that aren't go through bounce
+ * buffers from a small pool, split into pieces that each fit one buffer;
+ * writes that only cover part of a host sector read it first, with rmw_lock held exclusively so that no other write to
+ * the same sector can slip in between.
+ *
+ * Image files are often sparse, and reading a hole still costs a host
+ * request that returns zeros.  An allocation map of the file, one known
+ * and one data bit per granule, is filled in from the host's
+ * SEEK_DATA/SEEK_HOLE or allocated ranges a window at a time as reads
+ * reach unknown granules, and runs of granules that are wholly holes are
+ * read as zeros without any host I/O.  Writes mark their granules as data
+ * before they are issued and refreshes only fill in unknown granules, so
+ * a refresh racing a write can't make its data look like a hole.  Punched
+ * out granules become holes again.
+ */
+#define BOUNCE_POOL_BUFS 8
+#define BOUNCE_BUF_SIZE (1024 * 1024)
+#define SPARSE_GRANULE_SHIFT 16
+/* granules in the map at most, the granule grows beyond */
+#define SPARSE_MAX_GRANULES (1ULL << 24)
+/* granules filled in by one refresh */
+#define SPARSE_REFRESH_GRANULES 1024
+
+struct raw_dev {
+  struct disk_dev dev;
+  host_file_t file;
+  unsigned int sector_size;
+  host_rwlock_t rmw_lock;
+  host_mutex_t pool_lock;
+  host_cond_t pool_cond;
+  int nr_bounce;
+  int nr_free;
+  void *free_bounce[BOUNCE_POOL_BUFS];
+  /* allocation map, NULL when the host can't tell where the holes are */
+  host_rwlock_t map_lock;
+  unsigned int map_shift;
+  uint64_t *map_known;
+  uint64_t *map_data;
+};
+
+static void *raw_bounce_get(struct raw_dev *raw)
+{
+  void *buf = NULL;
+
+  host_mutex_lock(&raw->pool_lock);
+  while (!raw->nr_free && raw->nr_bounce == BOUNCE_POOL_BUFS)
+    host_cond_wait(&raw->pool_cond, &raw->pool_lock);
+
+  if (raw->nr_free) {
+    buf = raw->free_bounce[--raw->nr_free];
+  } else {
+    buf = host_alloc_aligned(BOUNCE_BUF_SIZE, raw->sector_size);
+    if (buf)
+      raw->nr_bounce++;
+  }
+  host_mutex_unlock(&raw->pool_lock);
+
+  return buf;
+}
+
+static void raw_bounce_put(struct raw_dev *raw, void *buf)
+{
+  host_mutex_lock(&raw->pool_lock);
+  raw->free_bounce[raw->nr_free++] = buf;
+  host_cond_signal(&raw->pool_cond);
+  host_mutex_unlock(&raw->pool_lock);
+}
+
+static int raw_aligned(struct raw_dev *raw, const struct disk_iovec *iov,
+                       int iovcnt, uint64_t off)
+{
+  uintptr_t mask = raw->sector_size - 1;
+  int i;
+
+  if (off & mask)
+    return 0;
+
+  for (i = 0; i < iovcnt; i++)
+    if (((uintptr_t)iov[i].base | iov[i].len) & mask)
+      return 0;
+
+  return 1;
+}
+
+/* The sectors of the request must fit in one pool buffer, see raw_bounce. */
+static int raw_bounce_read(struct raw_dev *raw, const struct disk_iovec *iov,
+                           int iovcnt, uint64_t off)
+{
+  uint64_t mask = raw->sector_size - 1;
+  size_t len = disk_iov_len(iov, iovcnt);
+  uint64_t start = off & ~mask, end = (off + len + mask) & ~mask;
+  char *buf;
+  int ret;
+
+  buf = raw_bounce_get(raw);
+  if (!buf)
+    return -ENOMEM;
+
+  host_atomic_add(&disk_stats.bounced, 1);
+
+  host_rwlock_read_lock(&raw->rmw_lock);
+  ret = host_file_read(raw->file, buf, end - start, start);
+  host_rwlock_read_unlock(&raw->rmw_lock);
+
+  if (!ret)
+    disk_iov_from_buf(iov, iovcnt, 0, buf + (off - start), len);
+
+  raw_bounce_put(raw, buf);
+  return ret;
+}
+
+static int raw_bounce_write(struct raw_dev *raw, const struct disk_iovec *iov,
+                            int iovcnt, uint64_t off)
+{
+  uint64_t mask = raw->sector_size - 1;
+  size_t len = disk_iov_len(iov, iovcnt);
+  uint64_t start = off & ~mask, end = (off + len + mask) & ~mask;
+  int partial = (off & mask) || ((off + len) & mask);
+  char *buf;
+  int ret = 0;
+
+  buf = raw_bounce_get(raw);
+  if (!buf)
+    return -ENOMEM;
+
+  host_atomic_add(&disk_stats.bounced, 1);
+
+  if (partial) {
+    host_rwlock_write_lock(&raw->rmw_lock);
+    host_atomic_add(&disk_stats.rmw_sectors, 1);
+    if (off & mask)
+      ret = host_file_read(raw->file, buf, raw->sector_size, start);
+    if (!ret && ((off + len) & mask) &&
+        (end - raw->sector_size >= start + raw->sector_size || !(off & mask)))
+      ret = host_file_read(raw->file, buf + (end - start) - raw->sector_size,
+                           raw->sector_size, end - raw->sector_size);
+  } else {
+    host_rwlock_read_lock(&raw->rmw_lock);
+  }
+
+  if (!ret) {
+    disk_iov_to_buf(iov, iovcnt, 0, buf + (off - start), len);
+    ret = host_file_write(raw->file, buf, end - start, start);
+  }
+
+  if (partial)
+    host_rwlock_write_unlock(&raw->rmw_lock);
+  else
+    host_rwlock_read_unlock(&raw->rmw_lock);
+
+  raw_bounce_put(raw, buf);
+  return ret;
+}
+
+/*
+ * Bounces a request in pieces that don't cross a BOUNCE_BUF_SIZE boundary,
+ * so that the sectors of each fit in one pool buffer.
+ */
+static int raw_bounce(struct raw_dev *raw, const struct disk_iovec *iov,
+                      int iovcnt, uint64_t off, int write)
+{
+  size_t len = disk_iov_len(iov, iovcnt), done, piece;
+  struct disk_iovec *slice;
+  int n, ret = 0;
+
+  if (!len)
+    return 0;
+
+  if (off / BOUNCE_BUF_SIZE == (off + len - 1) / BOUNCE_BUF_SIZE)
+    return write ? raw_bounce_write(raw, iov, iovcnt, off) :
+                   raw_bounce_read(raw, iov, iovcnt, off);
+
+  slice = malloc(iovcnt * sizeof(*slice));
+  if (!slice)
+    return -ENOMEM;
+
+  for (done = 0; !ret && done < len; done += piece) {
+    piece = BOUNCE_BUF_SIZE - (off + done) % BOUNCE_BUF_SIZE;
+    if (piece > len - done)
+      piece = len - done;
+
+    n = disk_iov_slice(iov, iovcnt, done, piece, slice);
+    if (write)
+      ret = raw_bounce_write(raw, slice, n, off + done);
+    else
+      ret = raw_bounce_read(raw, slice, n, off + done);
+  }
+
+  free(slice);
+  return ret;
+}
+
+static int raw_read_data(struct raw_dev *raw, const struct disk_iovec *iov,
+                         int iovcnt, uint64_t off)
+{
+  int ret;
+
+  if (!(raw->dev.flags & DISK_F_UNBUFFERED))
+    return host_file_readv(raw->file, (const struct host_iovec *)iov, iovcnt,
+                           off);
+
+  if (!raw_aligned(raw, iov, iovcnt, off))
+    return raw_bounce(raw, iov, iovcnt, off, 0);
+
+  host_rwlock_read_lock(&raw->rmw_lock);
+  ret = host_file_readv(raw->file, (const struct host_iovec *)iov, iovcnt,
+                        off);
+  host_rwlock_read_unlock(&raw->rmw_lock);
+  return ret;
+}
+
+static int raw_map_test(const uint64_t *map, uint64_t g)
+{
+  return (map[g / 64] >> (g % 64)) & 1;
+}
+
+static void raw_map_assign(uint64_t *map, uint64_t g, int val)
+{
+  if (val)
+    map[g / 64] |= 1ULL << (g % 64);
+  else
+    map[g / 64] &= ~(1ULL << (g % 64));
+}
+
+/* Marks the granules from first to last, both included, as known. */
+static void raw_map_set(struct raw_dev *raw, uint64_t first, uint64_t last,
+                        int data)
+{
+  uint64_t g;
+
+  host_rwlock_write_lock(&raw->map_lock);
+  for (g = first; g <= last; g++) {
+    raw_map_assign(raw->map_known, g, 1);
+    raw_map_assign(raw->map_data, g, data);
+  }
+  host_rwlock_write_unlock(&raw->map_lock);
+}
+
+/* Fills in the unknown granules of the window starting at granule first. */
+static int raw_map_refresh(struct raw_dev *raw, uint64_t first)
+{
+  uint64_t data_bits[SPARSE_REFRESH_GRANULES / 64] = { 0 };
+  uint64_t start = first << raw->map_shift, end, off, data, hole, g;
+  int ret = 0;
+
+  end = start + ((uint64_t)SPARSE_REFRESH_GRANULES << raw->map_shift);
+  if (end > raw->dev.size)
+    end = raw->dev.size;
+
+  host_atomic_add(&disk_stats.sparse_refreshes, 1);
+
+  for (off = start; off < end; off = hole) {
+    ret = host_file_next_data(raw->file, off, &data, &hole);
+    if (ret == -ENXIO || (!ret && data >= end))
+      break;
+    if (ret)
+      return ret;
+    if (hole > end)
+      hole = end;
+
+    for (g = data >> raw->map_shift; g << raw->map_shift < hole; g++)
+      raw_map_assign(data_bits, g - first, 1);
+  }
+
+  host_rwlock_write_lock(&raw->map_lock);
+  for (g = first; g << raw->map_shift < end; g++) {
+    if (raw_map_test(raw->map_known, g))
+      continue;
+    raw_map_assign(raw->map_known, g, 1);
+    raw_map_assign(raw->map_data, g, raw_map_test(data_bits, g - first));
+  }
+  host_rwlock_write_unlock(&raw->map_lock);
+
+  return 0;
+}
+
+/*
+ * Returns the length of the run of holes or of data starting at off, at
+ * most len, refreshing the map if it doesn't know about off yet.
+ */
+static uint64_t raw_map_run(struct raw_dev *raw, uint64_t off, uint64_t len,
+                            int *is_hole)
+{
+  uint64_t g = off >> raw->map_shift, end;
+  int data;
+
+  host_rwlock_read_lock(&raw->map_lock);
+  if (!raw_map_test(raw->map_known, g)) {
+    host_rwlock_read_unlock(&raw->map_lock);
+    /* on failure the read just goes to the host */
+    if (raw_map_refresh(raw, g)) {
+      *is_hole = 0;
+      return len;
+    }
+    host_rwlock_read_lock(&raw->map_lock);
+  }
+
+  data = raw_map_test(raw->map_data, g);
+  for (g++; g << raw->map_shift < off + len; g++)
+    if (!raw_map_test(raw->map_known, g) ||
+        raw_map_test(raw->map_data, g) != data)
+      break;
+  host_rwlock_read_unlock(&raw->map_lock);
+
+  end = g << raw->map_shift;
+  *is_hole = !data;
+  return end < off + len ? end - off : len;
+}
+
+static int raw_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                    int iovcnt, uint64_t off)
+{
+  struct raw_dev *raw = (struct raw_dev *)dev;
+  size_t len = disk_iov_len(iov, iovcnt), done, n;
+  struct disk_iovec *slice = NULL;
+  int is_hole, cnt, ret = 0;
+
+  if (!raw->map_known || off >= dev->size || len > dev->size - off)
+    return raw_read_data(raw, iov, iovcnt, off);
+
+  for (done = 0; !ret && done < len; done += n) {
+    n = raw_map_run(raw, off + done, len - done, &is_hole);
+    if (!is_hole && n == len)
+      return raw_read_data(raw, iov, iovcnt, off);
+
+    if (is_hole) {
+      disk_iov_zero(iov, iovcnt, done, n);
+      host_atomic_add(&disk_stats.unallocated_bytes, n);
+      continue;
+    }
+
+    if (!slice) {
+      slice = malloc(iovcnt * sizeof(*slice));
+      if (!slice)
+        return -ENOMEM;
+    }
+    cnt = disk_iov_slice(iov, iovcnt, done, n, slice);
+    ret = raw_read_data(raw, slice, cnt, off + done);
+  }
+
+  free(slice);
+  return ret;
+}
+
+static int raw_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                     int iovcnt, uint64_t off)
+{
+  struct raw_dev *raw = (struct raw_dev *)dev;
+  size_t len = disk_iov_len(iov, iovcnt);
+  int ret;
+
+  if (dev->flags & DISK_F_READONLY)
+    return -EROFS;
+
+  if (raw->map_known && len && off < dev->size) {
+    uint64_t end = off + len < dev->size ? off + len : dev->size;
+
+    raw_map_set(raw, off >> raw->map_shift, (end - 1) >> raw->map_shift, 1);
+  }
+
+  if (!(dev->flags & DISK_F_UNBUFFERED))
+    return host_file_writev(raw->file, (const struct host_iovec *)iov,
+                            iovcnt, off);
+
+  if (!raw_aligned(raw, iov, iovcnt, off))
+    return raw_bounce(raw, iov, iovcnt, off, 1);
+
+  host_rwlock_read_lock(&raw->rmw_lock);
+  ret = host_file_writev(raw->file, (const struct host_iovec *)iov, iovcnt,
+                         off);
+  host_rwlock_read_unlock(&raw->rmw_lock);
+  return ret;
+}
+
+static int raw_flush(struct disk_dev *dev)
+{
+  struct raw_dev *raw = (struct raw_dev *)dev;
+
+  return host_file_flush(raw->file);
+}
+
+static int raw_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct raw_dev *raw = (struct raw_dev *)dev;
+  int ret;
+
+  if (dev->flags & DISK_F_READONLY)
+    return -EOPNOTSUPP;
+
+  if (off >= dev->size)
+    return 0;
+  if (len > dev->size - off)
+    len = dev->size - off;
+
+  ret = host_file_punch_hole(raw->file, off, len);
+  if (!ret) {
+    uint64_t mask = (1ULL << raw->map_shift) - 1;
+    uint64_t first = (off + mask) >> raw->map_shift;
+    uint64_t end = (off + len) >> raw->map_shift;
+
+    /* whole granules read as zeros now, even if still allocated */
+    if (raw->map_known && first < end)
+      raw_map_set(raw, first, end - 1, 0);
+    host_atomic_add(&disk_stats.host_discards, 1);
+    host_atomic_add(&disk_stats.discard_bytes, len);
+  }
+
+  return ret;
+}
+
+static void raw_close(struct disk_dev *dev)
+{
+  struct raw_dev *raw = (struct raw_dev *)dev;
+
+  while (raw->nr_free)
+    host_free_aligned(raw->free_bounce[--raw->nr_free]);
+
+  host_file_close(raw->file);
+  free(raw->map_known);
+  free(raw->map_data);
+  free(raw);
+}
+
+static const struct disk_ops raw_ops = {
+  .read = raw_read,
+  .write = raw_write,
+  .flush = raw_flush,
+  .discard = raw_discard,
+  .close = raw_close,
+};
+
+/*
+ * Sets up the allocation map, unless the host can't report holes in the
+ * file, e.g. because it is a device; then reads always go to the host.
+ */
+static void raw_map_init(struct raw_dev *raw)
+{
+  uint64_t nr_granules, data, hole;
+  int ret;
+
+  if (!raw->dev.size)
+    return;
+
+  ret = host_file_next_data(raw->file, 0, &data, &hole);
+  if (ret && ret != -ENXIO)
+    return;
+
+  raw->map_shift = SPARSE_GRANULE_SHIFT;
+  while ((raw->dev.size >> raw->map_shift) >= SPARSE_MAX_GRANULES)
+    raw->map_shift++;
+  nr_granules = ((raw->dev.size - 1) >> raw->map_shift) + 1;
+
+  host_rwlock_init(&raw->map_lock);
+  raw->map_known = calloc((nr_granules + 63) / 64, sizeof(uint64_t));
+  raw->map_data = calloc((nr_granules + 63) / 64, sizeof(uint64_t));
+  if (!raw->map_known || !raw->map_data) {
+    free(raw->map_known);
+    free(raw->map_data);
+    raw->map_known = raw->map_data = NULL;
+  }
+}
+
+/* Takes ownership of file, also on failure. */
+struct disk_dev *disk_raw_open(host_file_t file, unsigned int flags, int *err)
+{
+  struct raw_dev *raw;
+  int ret;
+
+  raw = calloc(1, sizeof(*raw));
+  if (!raw) {
+    ret = -ENOMEM;
+    goto out_close;
+  }
+
+  raw->dev.ops = &raw_ops;
+  raw->dev.flags = flags;
+  raw->file = file;
+  raw->sector_size = host_file_sector_size(file);
+  host_rwlock_init(&raw->rmw_lock);
+  host_mutex_init(&raw->pool_lock);
+  host_cond_init(&raw->pool_cond);
+
+  ret = host_file_size(file, &raw->dev.size);
+  if (ret)
+    goto out_free;
+
+  raw_map_init(raw);
+  return &raw->dev;
+
+out_free:
+  free(raw);
+out_close:
+  host_file_close(file);
+  if (err)
+    *err = ret;
+  return NULL;
+}
+
+/*
+ * Discard batching layer.  Filesystems discard freed blocks in small pieces;
+ * each of them would cost a punch-hole round trip on the host.  Discarded
+ * ranges are kept in a sorted list where adjacent and overlapping ranges
+ * are merged, and handed down once batch_bytes have accumulated, on flush
+ * and on close.
+ *
+ * A write into a pending range must not be punched out afterwards, so
+ * writes trim the list and hold io_lock shared while the batch is issued
+ * with io_lock held exclusively.  Dropping part of a discard is always
+ * safe, the blocks just stay allocated on the host.
+ */
+struct discard_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+struct batch_dev {
+  struct disk_dev dev;
+  struct disk_dev *lower;
+  uint64_t batch_bytes;
+  host_rwlock_t io_lock;
+  host_rwlock_t list_lock;
+  uint64_t pending;
+  int nr_ranges;
+  struct discard_range ranges[DISCARD_MAX_RANGES];
+};
+
+static void batch_remove(struct batch_dev *batch, int i, int n)
+{
+  memmove(&batch->ranges[i], &batch->ranges[i + n],
+          (batch->nr_ranges - i - n) * sizeof(batch->ranges[0]));
+  batch->nr_ranges -= n;
+}
+
+/* Called with list_lock held; returns FALSE if the list is full. */
+static int batch_add(struct batch_dev *batch, uint64_t start, uint64_t end)
+{
+  struct discard_range *r = batch->ranges;
+  int i, j;
+
+  for (i = 0; i < batch->nr_ranges && r[i].end < start; i++)
+    ;
+
+  for (j = i; j < batch->nr_ranges && r[j].start <= end; j++) {
+    if (r[j].start < start)
+      start = r[j].start;
+    if (r[j].end > end)
+      end = r[j].end;
+    batch->pending -= r[j].end - r[j].start;
+  }
+
+  if (i == j) {
+    if (batch->nr_ranges == DISCARD_MAX_RANGES)
+      return 0;
+    memmove(&r[i + 1], &r[i], (batch->nr_ranges - i) * sizeof(r[0]));
+    batch->nr_ranges++;
+  } else {
+    batch_remove(batch, i + 1, j - i - 1);
+  }
+
+  r[i].start = start;
+  r[i].end = end;
+  batch->pending += end - start;
+  return 1;
+}
+
+/* Called with list_lock held. */
+static void batch_cancel(struct batch_dev *batch, uint64_t start, uint64_t end)
+{
+  struct discard_range *r = batch->ranges;
+  int i;
+
+  for (i = 0; i < batch->nr_ranges && r[i].start < end; i++) {
+    if (r[i].end <= start)
+      continue;
+
+    host_atomic_add(&disk_stats.discards_cancelled, 1);
+
+    if (r[i].start < start && r[i].end > end) {
+      batch->pending -= end - start;
+      if (batch->nr_ranges < DISCARD_MAX_RANGES) {
+        memmove(&r[i + 2], &r[i + 1],
+                (batch->nr_ranges - i - 1) * sizeof(r[0]));
+        batch->nr_ranges++;
+        r[i + 1].start = end;
+        r[i + 1].end = r[i].end;
+      } else {
+        batch->pending -= r[i].end - end;
+      }
+      r[i].end = start;
+      return;
+    }
+
+    if (r[i].start < start) {
+      batch->pending -= r[i].end - start;
+      r[i].end = start;
+    } else if (r[i].end > end) {
+      batch->pending -= end - r[i].start;
+      r[i].start = end;
+    } else {
+      batch->pending -= r[i].end - r[i].start;
+      batch_remove(batch, i--, 1);
+    }
+  }
+}
+
+static int batch_issue(struct batch_dev *batch)
+{
+  struct discard_range ranges[DISCARD_MAX_RANGES];
+  int i, nr, ret = 0;
+
+  host_rwlock_write_lock(&batch->io_lock);
+
+  host_rwlock_write_lock(&batch->list_lock);
+  nr = batch->nr_ranges;
+  memcpy(ranges, batch->ranges, nr * sizeof(ranges[0]));
+  batch->nr_ranges = 0;
+  batch->pending = 0;
+  host_rwlock_write_unlock(&batch->list_lock);
+
+  for (i = 0; i < nr; i++) {
+    int err = disk_discard(batch->lower, ranges[i].start,
+                           ranges[i].end - ranges[i].start);
+    if (err && !ret)
+      ret = err;
+  }
+
+  host_rwlock_write_unlock(&batch->io_lock);
+  return ret;
+}
+
+static int batch_read(struct disk_dev *dev, const struct disk_iovec *iov,
+                      int iovcnt, uint64_t off)
+{
+  struct batch_dev *batch = (struct batch_dev *)dev;
+
+  return disk_read(batch->lower, iov, iovcnt, off);
+}
+
+static int batch_write(struct disk_dev *dev, const struct disk_iovec *iov,
+                       int iovcnt, uint64_t off)
+{
+  struct batch_dev *batch = (struct batch_dev *)dev;
+  uint64_t len = disk_iov_len(iov, iovcnt);
+  int ret;
+
+  host_rwlock_read_lock(&batch->io_lock);
+
+  host_rwlock_write_lock(&batch->list_lock);
+  if (batch->nr_ranges)
+    batch_cancel(batch, off, off + len);
+  host_rwlock_write_unlock(&batch->list_lock);
+
+  ret = disk_write(batch->lower, iov, iovcnt, off);
+
+  host_rwlock_read_unlock(&batch->io_lock);
+  return ret;
+}
+
+static int batch_flush(struct disk_dev *dev)
+{
+  struct batch_dev *batch = (struct batch_dev *)dev;
+
+  /* discards are advisory, don't fail the flush for them */
+  batch_issue(batch);
+  return disk_flush(batch->lower);
+}
+
+static int batch_discard(struct disk_dev *dev, uint64_t off, uint64_t len)
+{
+  struct batch_dev *batch = (struct batch_dev *)dev;
+  int added, issue;
+
+  host_rwlock_write_lock(&batch->list_lock);
+  added = batch_add(batch, off, off + len);
+  issue = !added || batch->pending >= batch->batch_bytes;
+  host_rwlock_write_unlock(&batch->list_lock);
+
+  if (!issue)
+    return 0;
+
+  batch_issue(batch);
+  if (!added)
+    return disk_discard(batch->lower, off, len);
+
+  return 0;
+}
+
+static void batch_close(struct disk_dev *dev)
+{
+  struct batch_dev *batch = (struct batch_dev *)dev;
+
+  batch_issue(batch);
+  disk_close(batch->lower);
+  free(batch);
+}
+
+static const struct disk_ops batch_ops = {
+  .read = batch_read,
+  .write = batch_write,
+  .flush = batch_flush,
+  .discard = batch_discard,
+  .close = batch_close,
+};
+
+struct disk_dev *disk_discard_batch(struct disk_dev *lower,
+                                    uint64_t batch_bytes, int *err)
+{
+  struct batch_dev *batch;
+
+  batch = calloc(1, sizeof(*batch));
+  if (!batch) {
+    if (err)
+      *err = -ENOMEM;
+    return NULL;
+  }
+
+  batch->dev.ops = &batch_ops;
+  batch->dev.size = lower->size;
+  batch->dev.flags = lower->flags;
+  batch->lower = lower;
+  batch->batch_bytes = batch_bytes;
+  host_rwlock_init(&batch->io_lock);
+  host_rwlock_init(&batch->list_lock);
+
+  return &batch->dev;
+}
+
+/*
+ * LKL glue: the host block ops are pointed at the top of the device stack,
+ * which is passed to LKL as the disk handle.  Each virtio request becomes
+ * one disk_req (one per segment for discards) and is completed back to LKL
+ * once all of them are done, so LKL never waits on host I/O.
+ */
+struct lkl_req_ctx {
+  struct lkl_dev_buf *bufs;
+  volatile int64_t pending;
+  volatile int ret;
+  int len;
+  int nr_reqs;
+  struct disk_req *reqs;
+  struct disk_iovec *iov;
+};
+
+static int lkl_blk_get_capacity(union lkl_disk disk, unsigned long long *res)
+{
+  struct disk_dev *dev = disk.handle;
+
+  *res = dev->size;
+  return 0;
+}
+
+static void lkl_req_complete(struct disk_req *req, int ret)
+{
+  struct lkl_req_ctx *ctx = req->priv;
+  unsigned char status;
+
+  if (ret)
+    ctx->ret = ret;
+  if (host_atomic_add(&ctx->pending, -1) != 1)
+    return;
+
+  if (!ctx->ret)
+    status = LKL_DEV_BLK_STATUS_OK;
+  else if (ctx->ret == -EOPNOTSUPP)
+    status = LKL_DEV_BLK_STATUS_UNSUP;
+  else
+    status = LKL_DEV_BLK_STATUS_IOERR;
+
+  lkl_dev_blk_complete(ctx->bufs, status, ctx->len);
+  free(ctx);
+}
+
+static int lkl_req_nr_segments(struct lkl_blk_req *lreq)
+{
+#ifdef LKL_DEV_BLK_TYPE_DISCARD
+  if (lreq->type == LKL_DEV_BLK_TYPE_DISCARD) {
+    int i, nr = 0;
+
+    for (i = 0; i < lreq->count; i++)
+      nr += lreq->buf[i].len / 16;
+    return nr;
+  }
+#else
+  (void)lreq;
+#endif
+
+  return 1;
+}
+
+static struct lkl_req_ctx *lkl_req_alloc(struct lkl_blk_req *lreq)
+{
+  struct lkl_req_ctx *ctx;
+  int nr_reqs = lkl_req_nr_segments(lreq);
+
+  if (!nr_reqs)
+    nr_reqs = 1;
+
+  ctx = calloc(1, sizeof(*ctx) + nr_reqs * sizeof(struct disk_req) +
+                  lreq->count * sizeof(struct disk_iovec));
+  if (!ctx)
+    return NULL;
+
+  ctx->bufs = lreq->buf;
+  ctx->nr_reqs = nr_reqs;
+  ctx->pending = nr_reqs;
+  ctx->reqs = (struct disk_req *)(ctx + 1);
+  ctx->iov = (struct disk_iovec *)(ctx->reqs + nr_reqs);
+  return ctx;
+}
+
+#ifdef LKL_DEV_BLK_TYPE_DISCARD
+/* virtio_blk_discard_write_zeroes segments, little endian */
+static int lkl_req_discard(struct lkl_req_ctx *ctx, struct lkl_blk_req *lreq)
+{
+  int i, n = 0;
+
+  for (i = 0; i < lreq->count; i++) {
+    const char *seg = lreq->buf[i].addr;
+    const char *end = seg + lreq->buf[i].len;
+
+    for (; seg + 16 <= end; seg += 16) {
+      uint64_t sector;
+      uint32_t nr_sectors;
+
+      memcpy(&sector, seg, sizeof(sector));
+      memcpy(&nr_sectors, seg + 8, sizeof(nr_sectors));
+
+      host_atomic_add(&disk_stats.discards, 1);
+      ctx->reqs[n].type = DISK_REQ_DISCARD;
+      ctx->reqs[n].off = sector * DISK_SECTOR_SIZE;
+      ctx->reqs[n].len = (uint64_t)nr_sectors * DISK_SECTOR_SIZE;
+      n++;
+    }
+  }
+
+  return n;
+}
+#endif
+
+static void lkl_blk_request(union lkl_disk disk, struct lkl_blk_req *lreq)
+{
+  struct disk_dev *dev = disk.handle;
+  struct lkl_req_ctx *ctx;
+  struct disk_req *req;
+  int i, nr_reqs;
+
+  ctx = lkl_req_alloc(lreq);
+  if (!ctx) {
+    lkl_dev_blk_complete(lreq->buf, LKL_DEV_BLK_STATUS_IOERR, 0);
+    return;
+  }
+
+  req = &ctx->reqs[0];
+  switch (lreq->type) {
+  case LKL_DEV_BLK_TYPE_READ:
+  case LKL_DEV_BLK_TYPE_WRITE:
+    for (i = 0; i < lreq->count; i++) {
+      ctx->iov[i].base = lreq->buf[i].addr;
+      ctx->iov[i].len = lreq->buf[i].len;
+      ctx->len += lreq->buf[i].len;
+    }
+
+    req->type = lreq->type == LKL_DEV_BLK_TYPE_READ ? DISK_REQ_READ :
+                                                      DISK_REQ_WRITE;
+    req->off = lreq->sector * DISK_SECTOR_SIZE;
+    req->len = ctx->len;
+    req->iov = ctx->iov;
+    req->iovcnt = lreq->count;
+    break;
+  case LKL_DEV_BLK_TYPE_FLUSH:
+  case LKL_DEV_BLK_TYPE_FLUSH_OUT:
+    req->type = DISK_REQ_FLUSH;
+    break;
+#ifdef LKL_DEV_BLK_TYPE_DISCARD
+  case LKL_DEV_BLK_TYPE_DISCARD:
+    if (lkl_req_discard(ctx, lreq))
+      break;
+    req->complete = lkl_req_complete;
+    req->priv = ctx;
+    lkl_req_complete(req, 0);
+    return;
+#endif
+  default:
+    req->complete = lkl_req_complete;
+    req->priv = ctx;
+    lkl_req_complete(req, -EOPNOTSUPP);
+    return;
+  }
+
+  /* the last completion frees ctx, which can't happen before the last submit */
+  nr_reqs = ctx->nr_reqs;
+  for (i = 0; i < nr_reqs; i++) {
+    req = &ctx->reqs[i];
+    req->complete = lkl_req_complete;
+    req->priv = ctx;
+    disk_submit(dev, req);
+  }
+}
+
+int disk_lkl_add(struct disk_dev *dev)
+{
+  union lkl_disk disk;
+
+  lkl_dev_blk_ops.get_capacity = lkl_blk_get_capacity;
+  lkl_dev_blk_ops.request = lkl_blk_request;
+
+  disk.handle = dev;
+  return lkl_disk_add(disk);
+}
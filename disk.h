@@ -0,0 +1,154 @@
+#ifndef _DISK_H
+#define _DISK_H
+
+#include "host.h"
+
+/*
+ * Block device stack behind the LKL virtio disk.  A disk_dev is either a
+ * backend that owns host resources (the raw image file) or a layer that
+ * forwards to the device below it after doing its own work.  Offsets and
+ * lengths are in bytes; all ops return 0 or a negative errno value.
+ */
+
+struct disk_dev;
+
+/* same layout as host_iovec, so vectors are passed to the host as is */
+struct disk_iovec {
+  void *base;
+  size_t len;
+};
+
+enum disk_req_type {
+  DISK_REQ_READ,
+  DISK_REQ_WRITE,
+  DISK_REQ_FLUSH,
+  DISK_REQ_DISCARD,
+};
+
+/*
+ * Asynchronous request.  complete is called exactly once, possibly on
+ * another thread and possibly before disk_submit() returns; the device owns
+ * next while the request is in flight.
+ */
+struct disk_req {
+  enum disk_req_type type;
+  uint64_t off;
+  uint64_t len;
+  struct disk_iovec *iov;
+  int iovcnt;
+  void (*complete)(struct disk_req *req, int ret);
+  void *priv;
+  struct disk_req *next;
+};
+
+struct disk_ops {
+  int (*read)(struct disk_dev *dev, const struct disk_iovec *iov, int iovcnt,
+              uint64_t off);
+  int (*write)(struct disk_dev *dev, const struct disk_iovec *iov, int iovcnt,
+               uint64_t off);
+  int (*flush)(struct disk_dev *dev);
+  int (*discard)(struct disk_dev *dev, uint64_t off, uint64_t len);
+  void (*close)(struct disk_dev *dev);
+  /* optional, devices without it run requests in the caller */
+  void (*submit)(struct disk_dev *dev, struct disk_req *req);
+};
+
+/* device supports discard, i.e. can deallocate ranges on the host */
+#define DISK_F_DISCARD 0x1
+/* the host file was opened with HOST_OPEN_UNBUFFERED */
+#define DISK_F_UNBUFFERED 0x2
+/* writes and discards fail */
+#define DISK_F_READONLY 0x4
+
+struct disk_dev {
+  const struct disk_ops *ops;
+  uint64_t size;
+  unsigned int flags;
+};
+
+struct disk_stats {
+  volatile int64_t discards;
+  volatile int64_t discard_bytes;
+  volatile int64_t host_discards;
+  volatile int64_t discards_cancelled;
+  volatile int64_t queued;
+  volatile int64_t max_in_flight;
+  volatile int64_t merged;
+  volatile int64_t merged_bytes;
+  volatile int64_t sorted;
+  volatile int64_t cache_hits;
+  volatile int64_t cache_misses;
+  volatile int64_t cache_evictions;
+  volatile int64_t cache_writebacks;
+  volatile int64_t bounced;
+  volatile int64_t rmw_sectors;
+  volatile int64_t cow_copies;
+  volatile int64_t delta_blocks;
+  volatile int64_t ram_blocks;
+  volatile int64_t spilled_blocks;
+  volatile int64_t ram_full;
+  volatile int64_t ram_peak_bytes;
+  volatile int64_t chunk_hits;
+  volatile int64_t chunk_loads;
+  volatile int64_t chunk_stores;
+  volatile int64_t chunk_live_bytes;
+  volatile int64_t chunk_image_bytes;
+  volatile int64_t vhd_allocs;
+  volatile int64_t unallocated_bytes;
+  volatile int64_t stripe_splits;
+  volatile int64_t encrypted_bytes;
+  volatile int64_t decrypted_bytes;
+  volatile int64_t sparse_refreshes;
+};
+
+extern struct disk_stats disk_stats;
+
+int disk_read(struct disk_dev *dev, const struct disk_iovec *iov, int iovcnt,
+              uint64_t off);
+int disk_write(struct disk_dev *dev, const struct disk_iovec *iov, int iovcnt,
+               uint64_t off);
+int disk_flush(struct disk_dev *dev);
+int disk_discard(struct disk_dev *dev, uint64_t off, uint64_t len);
+void disk_close(struct disk_dev *dev);
+void disk_submit(struct disk_dev *dev, struct disk_req *req);
+int disk_execute(struct disk_dev *dev, struct disk_req *req);
+size_t disk_iov_len(const struct disk_iovec *iov, int iovcnt);
+void disk_iov_to_buf(const struct disk_iovec *iov, int iovcnt, size_t skip,
+                     void *buf, size_t len);
+void disk_iov_from_buf(const struct disk_iovec *iov, int iovcnt, size_t skip,
+                       const void *buf, size_t len);
+void disk_iov_zero(const struct disk_iovec *iov, int iovcnt, size_t skip,
+                   size_t len);
+int disk_iov_slice(const struct disk_iovec *iov, int iovcnt, size_t skip,
+                   size_t len, struct disk_iovec *out);
+
+struct disk_dev *disk_raw_open(host_file_t file, unsigned int flags,
+                               int *err);
+struct disk_dev *disk_mmap_open(host_file_t file, unsigned int flags,
+                                int *err);
+int disk_chunk_probe(host_file_t file);
+struct disk_dev *disk_chunk_open(host_file_t file, unsigned int flags,
+                                 uint64_t cache_size, int *err);
+int disk_chunk_create(struct disk_dev *src, host_file_t file);
+int disk_vhd_probe(host_file_t file);
+struct disk_dev *disk_vhd_open(host_file_t file, unsigned int flags,
+                               int *err);
+struct disk_dev *disk_part_open(struct disk_dev *lower, int nr, int *err);
+struct disk_dev *disk_stripe_open(struct disk_dev **members, int nr,
+                                  uint64_t stripe_size, int *err);
+struct disk_dev *disk_crypt_open(struct disk_dev *lower, const uint8_t *key,
+                                 size_t key_len, int *err);
+struct disk_dev *disk_overlay_open(struct disk_dev *base, host_file_t delta,
+                                   int *err);
+struct disk_dev *disk_ram_open(struct disk_dev *lower, uint64_t limit,
+                               host_file_t spill, int *err);
+struct disk_dev *disk_discard_batch(struct disk_dev *lower,
+                                    uint64_t batch_bytes, int *err);
+struct disk_dev *disk_cache_open(struct disk_dev *lower, uint64_t size,
+                                 int write_back, int *err);
+struct disk_dev *disk_mq_open(struct disk_dev *lower, int nr_queues,
+                             int depth, int window, int *err);
+
+int disk_lkl_add(struct disk_dev *dev);
+
+#endif /* _DISK_H */
@@ -27,6 +27,7 @@ THE SOFTWARE.
 #include <lkl/lkl.h>
 #include <lkl/lkl_host.h>
 #include "utils.h"
+#include "disk.h"
 
 #define WIN32_NO_STATUS
 #include <windows.h>
@@ -36,6 +37,7 @@ THE SOFTWARE.
 #include <ntstatus.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <winbase.h>
 
@@ -74,7 +76,43 @@ static char lkl_mount_point[MAX_PATH];
 static WCHAR lkl_mount_fstype[MAX_PATH] = L"";
 static WCHAR mount_point[MAX_PATH] = L"M:\\";
 static lkl_mode_t default_mode = 0755;
-static WCHAR disk_path[MAX_PATH];
+static BOOL bypass_paging_cache;
+static DWORD zero_write_threshold;
+static DWORD group_commit_window;
+
+/*
+ * How much FlushFileBuffers and Cleanup guarantee.
+ */
+enum durability {
+  DURABILITY_STRICT,     /* fsync on every flush and at Cleanup. */
+  DURABILITY_FSYNC,      /* fsync, fdatasync if metadata is clean. */
+  DURABILITY_FDATASYNC,  /* fdatasync on every flush. */
+  DURABILITY_PERIODIC,   /* Background syncfs every periodic_sync_interval. */
+  DURABILITY_NONE,       /* Flushes are ignored. */
+  NR_DURABILITY
+};
+
+static const WCHAR *const durability_names[NR_DURABILITY] = {
+  [DURABILITY_STRICT] = L"strict",
+  [DURABILITY_FSYNC] = L"fsync",
+  [DURABILITY_FDATASYNC] = L"fdatasync",
+  [DURABILITY_PERIODIC] = L"periodic",
+  [DURABILITY_NONE] = L"none",
+};
+
+static enum durability durability = DURABILITY_FSYNC;
+static DWORD periodic_sync_interval = 1000;
+static HANDLE periodic_sync_thread;
+static HANDLE periodic_sync_stop;
+/*
+ * Each /r adds an image; with more than one, the disk is striped over
+ * them in stripes of disk_stripe_size bytes (/j).
+ */
+#define MAX_DISK_PATHS 16
+#define DEFAULT_STRIPE_SIZE (256 << 10)
+static WCHAR disk_paths[MAX_DISK_PATHS][MAX_PATH];
+static int nr_disk_paths;
+static uint64_t disk_stripe_size = DEFAULT_STRIPE_SIZE;
 
 int ntstatus_to_lkl_errno(NTSTATUS Status)
 {
@@ -294,6 +332,167 @@ NTSTATUS lkl_errno_to_ntstatus(int rc)
   if (val & flag) {                                                            \
   }
 
+/*
+ * O_DIRECT requests must be aligned to the logical block size of the
+ * LKL disk, bounce buffers are allocated page-aligned.
+ */
+#define LKL_DIRECT_IO_ALIGN 512
+#define LKL_BOUNCE_BUF_ALIGN 4096
+
+#ifndef LKL_POSIX_FADV_NORMAL
+#define LKL_POSIX_FADV_NORMAL 0
+#define LKL_POSIX_FADV_RANDOM 1
+#define LKL_POSIX_FADV_SEQUENTIAL 2
+#define LKL_POSIX_FADV_WILLNEED 3
+#define LKL_POSIX_FADV_DONTNEED 4
+#define LKL_POSIX_FADV_NOREUSE 5
+#endif
+
+static const char *const fadvise_names[] = {
+  [LKL_POSIX_FADV_NORMAL] = "normal",
+  [LKL_POSIX_FADV_RANDOM] = "random",
+  [LKL_POSIX_FADV_SEQUENTIAL] = "sequential",
+  [LKL_POSIX_FADV_WILLNEED] = "willneed",
+  [LKL_POSIX_FADV_DONTNEED] = "dontneed",
+  [LKL_POSIX_FADV_NOREUSE] = "noreuse",
+};
+
+#define NR_FADVISE (sizeof(fadvise_names) / sizeof(fadvise_names[0]))
+
+enum { IO_CACHED, IO_DIRECT, NR_IO_PATHS };
+
+static const char *const io_path_names[NR_IO_PATHS] = {
+  [IO_CACHED] = "cached",
+  [IO_DIRECT] = "direct",
+};
+
+/*
+ * Counters reported when the volume is unmounted.
+ */
+static struct {
+  volatile LONG fadvise[NR_FADVISE];
+  volatile LONG64 read_bytes[NR_IO_PATHS];
+  volatile LONG64 read_ticks[NR_IO_PATHS];
+  volatile LONG64 write_bytes[NR_IO_PATHS];
+  volatile LONG64 write_ticks[NR_IO_PATHS];
+  volatile LONG bounced;
+  volatile LONG direct_fallbacks;
+  volatile LONG64 hole_bytes;
+  volatile LONG64 zero_bytes_punched;
+  volatile LONG64 zero_bytes_skipped;
+  volatile LONG flushes;
+  volatile LONG commits;
+  volatile LONG commit_fsync;
+  volatile LONG commit_fdatasync;
+  volatile LONG commit_syncfs;
+  volatile LONG flushes_ignored;
+  volatile LONG periodic_syncs;
+  volatile LONG async_closes;
+  volatile LONG async_deletes;
+  volatile LONG delete_waits;
+  volatile LONG64 prealloc_bytes;
+  volatile LONG preallocated_files;
+  volatile LONG64 preallocated_extents;
+} lkl_stats;
+
+static LONG64 stats_ticks(void) {
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return now.QuadPart;
+}
+
+#ifndef LKL_SEEK_DATA
+#define LKL_SEEK_END 2
+#define LKL_SEEK_DATA 3
+#define LKL_SEEK_HOLE 4
+#endif
+
+#ifndef LKL_FALLOC_FL_KEEP_SIZE
+#define LKL_FALLOC_FL_KEEP_SIZE 0x01
+#define LKL_FALLOC_FL_PUNCH_HOLE 0x02
+#define LKL_FALLOC_FL_ZERO_RANGE 0x10
+#endif
+
+/* Granularity of zero detection on writes, the usual filesystem block. */
+#define ZERO_BLOCK_SIZE 4096
+
+/* Bounds of the speculative preallocation ahead of appending writers. */
+#define PREALLOC_MIN (4 * 1024 * 1024)
+#define PREALLOC_MAX (64 * 1024 * 1024)
+
+/* Reads shorter than this are not worth the extent lookups. */
+#define SPARSE_READ_MIN (64 * 1024)
+#define NR_CACHED_EXTENTS 8
+
+/*
+ * Bumped by everything that may turn a hole into data. The extent caches
+ * are not per inode, so a write through any handle invalidates all of them.
+ */
+static volatile LONG data_generation;
+
+struct lkl_extent {
+  LONGLONG start;
+  LONGLONG end;
+  BOOL hole;
+};
+
+/*
+ * The last SEEK_DATA/SEEK_HOLE results of a handle.
+ */
+struct lkl_extent_cache {
+  SRWLOCK lock;
+  LONG generation;
+  int nr;
+  int next;              /* Slot replaced by the next insertion. */
+  BOOL unsupported;      /* The filesystem rejected SEEK_DATA. */
+  struct lkl_extent extents[NR_CACHED_EXTENTS];
+};
+
+#define LKL_UTIME_OMIT ((1l << 30) - 2l)
+
+/*
+ * Timestamp and attribute changes made through a handle, applied to its
+ * descriptor at Cleanup instead of walking the path for every call.
+ */
+struct lkl_pending_meta {
+  SRWLOCK lock;
+  BOOL has_times;
+  struct lkl_timespec ts[2];   /* atime, mtime; LKL_UTIME_OMIT if unset. */
+  BOOL has_mode;
+  lkl_mode_t mode;
+};
+
+/*
+ * Per-handle state, stored in DokanFileInfo->Context from CreateFile until
+ * CloseFile.
+ */
+struct lkl_file {
+  int fd;
+  int flags;             /* Flags used to open fd. */
+  SRWLOCK mode_lock;     /* Held shared while fd is used in its mode. */
+  BOOL direct;           /* LKL_O_DIRECT is currently set on fd. */
+  BOOL delete_on_close;
+  int fadvise;           /* Access pattern hint given to LKL. */
+  volatile LONG meta_dirty; /* Metadata changed since the last fsync. */
+  volatile LONG data_dirty; /* Written since the last sync. */
+  struct lkl_extent_cache extent_cache;
+  struct lkl_pending_meta pending_meta;
+
+  /*
+   * Only tracked for handles that deny write sharing, nobody else can
+   * change the size then.
+   */
+  SRWLOCK size_lock;
+  BOOL exclusive_writer;
+  LONGLONG size;
+  LONGLONG prealloc_end;   /* End of the space reserved beyond size. */
+  BOOL preallocated;
+};
+
+static struct lkl_file *lkl_file_get(PDOKAN_FILE_INFO DokanFileInfo) {
+  return (struct lkl_file *)(ULONG_PTR)DokanFileInfo->Context;
+}
+
 static int convert_flags(DWORD flags) {
   BOOL want_read = (flags & GENERIC_READ) != 0;
   BOOL want_write = (flags & GENERIC_WRITE) != 0;
@@ -306,6 +505,645 @@ static int convert_flags(DWORD flags) {
   return LKL_O_RDWR;
 }
 
+/*
+ * Map the caching related CreateOptions onto LKL open flags.
+ */
+static int convert_create_options(ULONG CreateOptions) {
+  int flags = 0;
+  if (CreateOptions & FILE_WRITE_THROUGH)
+    flags |= LKL_O_DSYNC;
+
+  if (CreateOptions & FILE_NO_INTERMEDIATE_BUFFERING)
+    flags |= LKL_O_DIRECT;
+
+  return flags;
+}
+
+/*
+ * Translate the access pattern hints of CreateOptions into fadvise advice.
+ * Files that are discarded after use are not worth keeping cached.
+ */
+static int convert_access_hint(ULONG CreateOptions, ULONG FileAttributes) {
+  if ((CreateOptions & FILE_SEQUENTIAL_ONLY) &&
+      !(CreateOptions & FILE_RANDOM_ACCESS))
+    return LKL_POSIX_FADV_SEQUENTIAL;
+
+  if ((CreateOptions & FILE_RANDOM_ACCESS) &&
+      !(CreateOptions & FILE_SEQUENTIAL_ONLY))
+    return LKL_POSIX_FADV_RANDOM;
+
+  if ((CreateOptions & FILE_DELETE_ON_CLOSE) ||
+      (FileAttributes & FILE_ATTRIBUTE_TEMPORARY))
+    return LKL_POSIX_FADV_NOREUSE;
+
+  return LKL_POSIX_FADV_NORMAL;
+}
+
+static void lkl_file_advise(struct lkl_file *fh, LPCWSTR FileName,
+                            int advice) {
+  int lkl_ret = 0;
+  if (advice != LKL_POSIX_FADV_NORMAL)
+    lkl_ret = lkl_sys_fadvise64(fh->fd, 0, 0, advice);
+
+  if (lkl_ret < 0) {
+    DbgPrint(L"%s: fadvise %S failed on %s: %d\n", __func__,
+             fadvise_names[advice], FileName, lkl_ret);
+    advice = LKL_POSIX_FADV_NORMAL;
+  }
+
+  fh->fadvise = advice;
+  InterlockedIncrement(&lkl_stats.fadvise[advice]);
+}
+
+#ifndef LKL_FS_IOC_FIEMAP
+#define LKL_FS_IOC_FIEMAP 0xc020660b
+
+struct lkl_fiemap {
+  unsigned long long fm_start;
+  unsigned long long fm_length;
+  unsigned int fm_flags;
+  unsigned int fm_mapped_extents;
+  unsigned int fm_extent_count;
+  unsigned int fm_reserved;
+};
+#endif
+
+/*
+ * Number of extents of the file, or a negative error.
+ */
+static int lkl_file_count_extents(int fd) {
+  int lkl_ret;
+  struct lkl_fiemap fiemap;
+
+  ZeroMemory(&fiemap, sizeof(fiemap));
+  fiemap.fm_length = ~0ULL;
+  lkl_ret = lkl_sys_ioctl(fd, LKL_FS_IOC_FIEMAP, (unsigned long)&fiemap);
+  if (lkl_ret < 0)
+    return lkl_ret;
+
+  return fiemap.fm_mapped_extents;
+}
+
+/*
+ * Reserve [start, end) without changing the file size, so that the data
+ * written there later ends up in few extents.
+ */
+static void lkl_file_prealloc(struct lkl_file *fh, LONGLONG start,
+                              LONGLONG end) {
+  if (end <= start)
+    return;
+
+  if (lkl_sys_fallocate(fh->fd, LKL_FALLOC_FL_KEEP_SIZE, start,
+                        end - start) < 0)
+    return;
+
+  fh->preallocated = TRUE;
+  InterlockedAdd64(&lkl_stats.prealloc_bytes, end - start);
+}
+
+/*
+ * Called before a write through an exclusive writer. An append that runs
+ * past the reserved space first reserves as much again as the file will
+ * hold, between PREALLOC_MIN and PREALLOC_MAX, in a single fallocate. The
+ * appended data is then allocated inside the reservation too.
+ */
+static void lkl_file_reserve_append(struct lkl_file *fh, LONGLONG off,
+                                    LONGLONG end) {
+  LONGLONG chunk;
+
+  if (!fh->exclusive_writer)
+    return;
+
+  AcquireSRWLockExclusive(&fh->size_lock);
+  if (off == fh->size && end > fh->prealloc_end) {
+    chunk = min(max(end, PREALLOC_MIN), PREALLOC_MAX);
+    lkl_file_prealloc(fh, max(off, fh->prealloc_end), end + chunk);
+    fh->prealloc_end = end + chunk;
+  }
+  ReleaseSRWLockExclusive(&fh->size_lock);
+}
+
+/*
+ * Called after a write through an exclusive writer.
+ */
+static void lkl_file_grow(struct lkl_file *fh, LONGLONG end) {
+  if (!fh->exclusive_writer)
+    return;
+
+  AcquireSRWLockExclusive(&fh->size_lock);
+  fh->size = max(fh->size, end);
+  ReleaseSRWLockExclusive(&fh->size_lock);
+}
+
+/*
+ * Give back the space reserved beyond EOF, from Cleanup while no other
+ * handle may write yet. Truncating to the current size releases it on
+ * ext4; the size is taken from fstat so the file never shrinks. The handle
+ * stops tracking the size, paging writes that still come in must not
+ * reserve again.
+ */
+static void lkl_file_trim_prealloc(struct lkl_file *fh) {
+  int extents;
+  struct lkl_stat lkl_stat;
+
+  AcquireSRWLockExclusive(&fh->size_lock);
+  fh->exclusive_writer = FALSE;
+  if (!fh->preallocated)
+    goto out;
+
+  if (lkl_sys_fstat(fh->fd, &lkl_stat) == 0 &&
+      fh->prealloc_end > lkl_stat.st_size &&
+      lkl_sys_ftruncate(fh->fd, lkl_stat.st_size) == 0)
+    fh->meta_dirty = 1;
+  fh->preallocated = FALSE;
+
+  extents = lkl_file_count_extents(fh->fd);
+  if (extents >= 0) {
+    InterlockedIncrement(&lkl_stats.preallocated_files);
+    InterlockedAdd64(&lkl_stats.preallocated_extents, extents);
+  }
+out:
+  ReleaseSRWLockExclusive(&fh->size_lock);
+}
+
+static void lkl_file_free(struct lkl_file *fh) {
+  lkl_sys_close(fh->fd);
+  free(fh);
+}
+
+/*
+ * Return fh->fd with its LKL_O_DIRECT setting switched to @direct, and keep
+ * it that way until lkl_file_put_fd. The file may have been renamed since
+ * it was opened, so the setting is changed with F_SETFL instead of opening
+ * a second descriptor. A dup would share the setting with fh->fd anyway.
+ */
+static int lkl_file_get_fd(struct lkl_file *fh, BOOL direct) {
+  int lkl_ret, flags;
+  for (;;) {
+    AcquireSRWLockShared(&fh->mode_lock);
+    if (fh->direct == direct)
+      return fh->fd;
+
+    ReleaseSRWLockShared(&fh->mode_lock);
+
+    AcquireSRWLockExclusive(&fh->mode_lock);
+    lkl_ret = 0;
+    if (fh->direct != direct) {
+      flags = direct ? fh->flags | LKL_O_DIRECT : fh->flags & ~LKL_O_DIRECT;
+      lkl_ret = lkl_sys_fcntl(fh->fd, LKL_F_SETFL, flags);
+      if (lkl_ret == 0)
+        fh->direct = direct;
+    }
+    ReleaseSRWLockExclusive(&fh->mode_lock);
+
+    if (lkl_ret < 0)
+      return lkl_ret;
+  }
+}
+
+static void lkl_file_put_fd(struct lkl_file *fh) {
+  ReleaseSRWLockShared(&fh->mode_lock);
+}
+
+static int lkl_pread_full(int fd, char *buf, DWORD len, LONGLONG off,
+                          DWORD *done) {
+  int lkl_ret;
+  *done = 0;
+  do {
+    lkl_ret = lkl_sys_pread64(fd, buf + *done, len - *done, off + *done);
+    if (lkl_ret <= 0)
+      break;
+
+    *done += lkl_ret;
+  } while (*done < len);
+
+  return lkl_ret < 0 ? lkl_ret : 0;
+}
+
+static int lkl_pwrite_full(int fd, const char *buf, DWORD len, LONGLONG off,
+                           DWORD *done) {
+  int lkl_ret;
+  *done = 0;
+  do {
+    lkl_ret = lkl_sys_pwrite64(fd, buf + *done, len - *done, off + *done);
+    if (lkl_ret <= 0)
+      break;
+
+    *done += lkl_ret;
+  } while (*done < len);
+
+  return lkl_ret < 0 ? lkl_ret : 0;
+}
+
+static BOOL lkl_direct_io_aligned(LONGLONG off, DWORD len) {
+  return !(off & (LKL_DIRECT_IO_ALIGN - 1)) &&
+         !(len & (LKL_DIRECT_IO_ALIGN - 1));
+}
+
+/*
+ * Read through an O_DIRECT descriptor. Requests that are not aligned are
+ * widened to the alignment and bounced through an aligned buffer.
+ */
+static int lkl_direct_pread(int fd, char *buf, DWORD len, LONGLONG off,
+                            DWORD *done) {
+  int lkl_ret;
+  char *bounce;
+  DWORD got, skip;
+  LONGLONG start = off & ~(LONGLONG)(LKL_DIRECT_IO_ALIGN - 1);
+  LONGLONG end = (off + len + LKL_DIRECT_IO_ALIGN - 1) &
+                 ~(LONGLONG)(LKL_DIRECT_IO_ALIGN - 1);
+
+  if (lkl_direct_io_aligned(off, len) &&
+      !((ULONG_PTR)buf & (LKL_DIRECT_IO_ALIGN - 1)))
+    return lkl_pread_full(fd, buf, len, off, done);
+
+  *done = 0;
+  bounce = alloc_aligned_buf((size_t)(end - start), LKL_BOUNCE_BUF_ALIGN);
+  if (!bounce)
+    return -LKL_ENOMEM;
+
+  InterlockedIncrement(&lkl_stats.bounced);
+
+  lkl_ret = lkl_pread_full(fd, bounce, (DWORD)(end - start), start, &got);
+  skip = (DWORD)(off - start);
+  if (!lkl_ret && got > skip) {
+    *done = min(len, got - skip);
+    CopyMemory(buf, bounce + skip, *done);
+  }
+
+  free_aligned_buf(bounce);
+  return lkl_ret;
+}
+
+/*
+ * Write an aligned range through an O_DIRECT descriptor. An unaligned user
+ * buffer is bounced.
+ */
+static int lkl_direct_pwrite(int fd, const char *buf, DWORD len,
+                             LONGLONG off, DWORD *done) {
+  int lkl_ret;
+  char *bounce;
+
+  if (!((ULONG_PTR)buf & (LKL_DIRECT_IO_ALIGN - 1)))
+    return lkl_pwrite_full(fd, buf, len, off, done);
+
+  *done = 0;
+  bounce = alloc_aligned_buf(len, LKL_BOUNCE_BUF_ALIGN);
+  if (!bounce)
+    return -LKL_ENOMEM;
+
+  InterlockedIncrement(&lkl_stats.bounced);
+
+  CopyMemory(bounce, buf, len);
+  lkl_ret = lkl_pwrite_full(fd, bounce, len, off, done);
+  free_aligned_buf(bounce);
+  return lkl_ret;
+}
+
+/*
+ * Apply the buffered metadata changes of @fh with futimens and fchmod.
+ */
+static int lkl_file_apply_meta(struct lkl_file *fh) {
+  int lkl_ret = 0, ret;
+  struct lkl_pending_meta *pm = &fh->pending_meta;
+
+  AcquireSRWLockExclusive(&pm->lock);
+  if (pm->has_times) {
+    ret = lkl_sys_utimensat(fh->fd, NULL, pm->ts, 0);
+    if (ret < 0)
+      lkl_ret = ret;
+    pm->has_times = FALSE;
+    fh->meta_dirty = 1;
+  }
+
+  if (pm->has_mode) {
+    ret = lkl_sys_fchmod(fh->fd, pm->mode);
+    if (ret < 0)
+      lkl_ret = ret;
+    pm->has_mode = FALSE;
+    fh->meta_dirty = 1;
+  }
+  ReleaseSRWLockExclusive(&pm->lock);
+
+  return lkl_ret;
+}
+
+/*
+ * Make the stat of a handle reflect its buffered metadata changes.
+ */
+static void lkl_file_overlay_meta(struct lkl_file *fh,
+                                  struct lkl_stat *lkl_stat) {
+  struct lkl_pending_meta *pm = &fh->pending_meta;
+
+  AcquireSRWLockShared(&pm->lock);
+  if (pm->has_times) {
+    if (pm->ts[0].tv_nsec != LKL_UTIME_OMIT)
+      lkl_stat->lkl_st_atime = pm->ts[0].tv_sec;
+    if (pm->ts[1].tv_nsec != LKL_UTIME_OMIT)
+      lkl_stat->lkl_st_mtime = pm->ts[1].tv_sec;
+  }
+
+  if (pm->has_mode)
+    lkl_stat->st_mode = (lkl_stat->st_mode & ~07777) | pm->mode;
+  ReleaseSRWLockShared(&pm->lock);
+}
+
+struct flush_waiter {
+  struct lkl_file *fh;
+  struct flush_waiter *next;
+  BOOL done;
+  int ret;
+};
+
+/*
+ * Flushes that arrive while a commit is running, or within
+ * group_commit_window milliseconds of the first one, are made durable
+ * together by the next commit.
+ */
+static struct {
+  SRWLOCK lock;
+  CONDITION_VARIABLE cond;
+  struct flush_waiter *pending;
+  BOOL committing;
+} group_commit = { SRWLOCK_INIT, CONDITION_VARIABLE_INIT, NULL, FALSE };
+
+/*
+ * One handle is synced on its own, with fdatasync unless its metadata
+ * changed or the durability level says otherwise. Several handles are
+ * synced with one syncfs, which costs a single journal commit.
+ */
+static int commit_batch(struct flush_waiter *batch) {
+  int lkl_ret;
+  BOOL meta_dirty = FALSE, single = TRUE;
+  struct flush_waiter *w;
+
+  for (w = batch; w; w = w->next) {
+    if (w->fh != batch->fh)
+      single = FALSE;
+    if (InterlockedExchange(&w->fh->meta_dirty, 0))
+      meta_dirty = TRUE;
+    w->fh->data_dirty = 0;
+  }
+
+  if (durability == DURABILITY_STRICT)
+    meta_dirty = TRUE;
+  else if (durability == DURABILITY_FDATASYNC)
+    meta_dirty = FALSE;
+
+  InterlockedIncrement(&lkl_stats.commits);
+  if (!single) {
+    InterlockedIncrement(&lkl_stats.commit_syncfs);
+    lkl_ret = lkl_sys_syncfs(batch->fh->fd);
+  } else if (meta_dirty) {
+    InterlockedIncrement(&lkl_stats.commit_fsync);
+    lkl_ret = lkl_sys_fsync(batch->fh->fd);
+  } else {
+    InterlockedIncrement(&lkl_stats.commit_fdatasync);
+    lkl_ret = lkl_sys_fdatasync(batch->fh->fd);
+  }
+
+  if (lkl_ret < 0)
+    for (w = batch; w; w = w->next) {
+      w->fh->meta_dirty = 1;
+      w->fh->data_dirty = 1;
+    }
+
+  return lkl_ret;
+}
+
+static int group_commit_flush(struct lkl_file *fh) {
+  struct flush_waiter self = { fh, NULL, FALSE, 0 };
+  struct flush_waiter *batch, *w, *next;
+  int lkl_ret;
+
+  InterlockedIncrement(&lkl_stats.flushes);
+  AcquireSRWLockExclusive(&group_commit.lock);
+  self.next = group_commit.pending;
+  group_commit.pending = &self;
+  while (!self.done) {
+    if (group_commit.committing) {
+      SleepConditionVariableSRW(&group_commit.cond, &group_commit.lock,
+                                INFINITE, 0);
+      continue;
+    }
+
+    /* Lead the next commit. */
+    group_commit.committing = TRUE;
+    if (group_commit_window) {
+      ReleaseSRWLockExclusive(&group_commit.lock);
+      Sleep(group_commit_window);
+      AcquireSRWLockExclusive(&group_commit.lock);
+    }
+
+    batch = group_commit.pending;
+    group_commit.pending = NULL;
+    ReleaseSRWLockExclusive(&group_commit.lock);
+
+    lkl_ret = commit_batch(batch);
+
+    AcquireSRWLockExclusive(&group_commit.lock);
+    for (w = batch; w; w = next) {
+      next = w->next;
+      w->ret = lkl_ret;
+      w->done = TRUE;
+    }
+    group_commit.committing = FALSE;
+    WakeAllConditionVariable(&group_commit.cond);
+  }
+  ReleaseSRWLockExclusive(&group_commit.lock);
+
+  return self.ret;
+}
+
+/*
+ * Closing and deleting files happens on a background thread, so that
+ * writeback and extent freeing do not stall the Dokan thread. Jobs run in
+ * order on a single thread, which keeps the operations on a path ordered.
+ */
+struct close_job {
+  struct lkl_file *fh;   /* Closed and freed when set. */
+  char *unix_filename;   /* Deleted when set. */
+  BOOL is_dir;
+  struct close_job *next;
+};
+
+static struct {
+  SRWLOCK lock;
+  CONDITION_VARIABLE cond;
+  struct close_job *head, *tail;
+  struct close_job *running;
+  volatile LONG nr_deletes;   /* Queued or running deletions. */
+  BOOL stop;
+  HANDLE thread;
+} close_queue = { SRWLOCK_INIT, CONDITION_VARIABLE_INIT };
+
+static void run_close_job(struct close_job *job) {
+  int lkl_ret;
+  if (job->fh)
+    lkl_file_free(job->fh);
+
+  if (!job->unix_filename)
+    return;
+
+  if (!job->is_dir)
+    lkl_ret = lkl_sys_unlink(job->unix_filename);
+  else
+    lkl_ret = lkl_sys_rmdir(job->unix_filename);
+
+  if (lkl_ret < 0)
+    DbgPrint(L"%s: can't delete %S: %d\n", __func__, job->unix_filename,
+             lkl_ret);
+}
+
+static DWORD WINAPI close_queue_main(LPVOID arg) {
+  struct close_job *job;
+  UNREFERENCED_PARAMETER(arg);
+
+  AcquireSRWLockExclusive(&close_queue.lock);
+  for (;;) {
+    while (!close_queue.head && !close_queue.stop)
+      SleepConditionVariableSRW(&close_queue.cond, &close_queue.lock,
+                                INFINITE, 0);
+
+    job = close_queue.head;
+    if (!job)
+      break;
+
+    close_queue.head = job->next;
+    if (!close_queue.head)
+      close_queue.tail = NULL;
+    close_queue.running = job;
+    ReleaseSRWLockExclusive(&close_queue.lock);
+
+    run_close_job(job);
+
+    AcquireSRWLockExclusive(&close_queue.lock);
+    close_queue.running = NULL;
+    if (job->unix_filename) {
+      InterlockedDecrement(&close_queue.nr_deletes);
+      free_char_buf(job->unix_filename);
+    }
+    free(job);
+    WakeAllConditionVariable(&close_queue.cond);
+  }
+  ReleaseSRWLockExclusive(&close_queue.lock);
+
+  return 0;
+}
+
+/*
+ * Hand the job over to the close thread. Runs it right away when the
+ * thread is not available.
+ */
+static void close_queue_push(struct lkl_file *fh, char *unix_filename,
+                             BOOL is_dir) {
+  struct close_job *job = NULL;
+
+  if (close_queue.thread)
+    job = malloc(sizeof(struct close_job));
+
+  if (!job) {
+    struct close_job sync_job = { fh, unix_filename, is_dir, NULL };
+    run_close_job(&sync_job);
+    if (unix_filename)
+      free_char_buf(unix_filename);
+    return;
+  }
+
+  job->fh = fh;
+  job->unix_filename = unix_filename;
+  job->is_dir = is_dir;
+  job->next = NULL;
+
+  AcquireSRWLockExclusive(&close_queue.lock);
+  if (unix_filename) {
+    InterlockedIncrement(&close_queue.nr_deletes);
+    InterlockedIncrement(&lkl_stats.async_deletes);
+  } else
+    InterlockedIncrement(&lkl_stats.async_closes);
+
+  if (close_queue.tail)
+    close_queue.tail->next = job;
+  else
+    close_queue.head = job;
+  close_queue.tail = job;
+  WakeAllConditionVariable(&close_queue.cond);
+  ReleaseSRWLockExclusive(&close_queue.lock);
+}
+
+/*
+ * Does the deletion of @job_path affect @path? With @subtree, deletions
+ * below @path count as well.
+ */
+static BOOL close_job_affects(const char *job_path, const char *path,
+                              BOOL subtree) {
+  size_t len = strlen(path);
+  if (!strcmp(job_path, path))
+    return TRUE;
+
+  if (!subtree || strncmp(job_path, path, len) != 0)
+    return FALSE;
+
+  return (len && path[len - 1] == '/') || job_path[len] == '/';
+}
+
+static BOOL close_queue_has_delete(const char *path, BOOL subtree) {
+  struct close_job *job;
+  if (close_queue.running && close_queue.running->unix_filename &&
+      close_job_affects(close_queue.running->unix_filename, path, subtree))
+    return TRUE;
+
+  for (job = close_queue.head; job; job = job->next)
+    if (job->unix_filename &&
+        close_job_affects(job->unix_filename, path, subtree))
+      return TRUE;
+
+  return FALSE;
+}
+
+/*
+ * Wait until the pending deletions of @path (and below it with @subtree)
+ * are done, so that a new name does not race with an old unlink.
+ */
+static void close_queue_wait(const char *path, BOOL subtree) {
+  if (!close_queue.nr_deletes)
+    return;
+
+  AcquireSRWLockExclusive(&close_queue.lock);
+  if (close_queue_has_delete(path, subtree)) {
+    InterlockedIncrement(&lkl_stats.delete_waits);
+    do {
+      SleepConditionVariableSRW(&close_queue.cond, &close_queue.lock,
+                                INFINITE, 0);
+    } while (close_queue_has_delete(path, subtree));
+  }
+  ReleaseSRWLockExclusive(&close_queue.lock);
+}
+
+static void close_queue_start(void) {
+  close_queue.thread = CreateThread(NULL, 0, close_queue_main, NULL, 0, NULL);
+  if (!close_queue.thread)
+    fprintf(stderr, "can't start close thread, closing synchronously\n");
+}
+
+/*
+ * Run every queued job and stop the thread.
+ */
+static void close_queue_stop(void) {
+  HANDLE thread = close_queue.thread;
+  if (!thread)
+    return;
+
+  AcquireSRWLockExclusive(&close_queue.lock);
+  close_queue.stop = TRUE;
+  WakeAllConditionVariable(&close_queue.cond);
+  ReleaseSRWLockExclusive(&close_queue.lock);
+
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+  close_queue.thread = NULL;
+}
+
 static NTSTATUS DOKAN_CALLBACK
 LklCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
               ACCESS_MASK DesiredAccess, ULONG FileAttributes,
@@ -313,6 +1151,7 @@ LklCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
               ULONG CreateOptions, PDOKAN_FILE_INFO DokanFileInfo) {
   int lkl_ret;
   int flags = convert_flags(DesiredAccess) | LKL_O_LARGEFILE;
+  struct lkl_file *fh;
   NTSTATUS retval = STATUS_SUCCESS;
   char *unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
   if (!unix_filename) {
@@ -321,6 +1160,7 @@ LklCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
   }
 
   DbgPrint(L"%s: FileName = %s\n", __func__, FileName);
+  close_queue_wait(unix_filename, FALSE);
   if (CreateDisposition == FILE_CREATE || CreateDisposition == FILE_OPEN_IF) {
     if ((CreateOptions & FILE_DIRECTORY_FILE) != FILE_DIRECTORY_FILE) {
       flags |= LKL_O_CREAT;
@@ -358,14 +1198,55 @@ LklCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
     }
   }
 
+  if (!DokanFileInfo->IsDirectory)
+    flags |= convert_create_options(CreateOptions);
+
   lkl_ret = lkl_sys_open(unix_filename, flags, default_mode);
-  if (lkl_ret < 0)
+  if (lkl_ret < 0) {
     retval = lkl_errno_to_ntstatus(lkl_ret);
-  else {
-    retval = STATUS_SUCCESS;
-    DokanFileInfo->Context = lkl_ret;
+    goto out;
+  }
+
+  fh = malloc(sizeof(struct lkl_file));
+  if (!fh) {
+    lkl_sys_close(lkl_ret);
+    retval = STATUS_INSUFFICIENT_RESOURCES;
+    goto out;
   }
 
+  fh->fd = lkl_ret;
+  fh->flags = flags;
+  InitializeSRWLock(&fh->mode_lock);
+  fh->direct = (flags & LKL_O_DIRECT) != 0;
+  fh->delete_on_close = (CreateOptions & FILE_DELETE_ON_CLOSE) != 0;
+  fh->fadvise = LKL_POSIX_FADV_NORMAL;
+  fh->meta_dirty = (flags & LKL_O_CREAT) != 0;
+  ZeroMemory(&fh->extent_cache, sizeof(fh->extent_cache));
+  InitializeSRWLock(&fh->extent_cache.lock);
+  ZeroMemory(&fh->pending_meta, sizeof(fh->pending_meta));
+  InitializeSRWLock(&fh->pending_meta.lock);
+  fh->extent_cache.generation = data_generation - 1;
+  InitializeSRWLock(&fh->size_lock);
+  fh->exclusive_writer = FALSE;
+  fh->size = 0;
+  fh->prealloc_end = 0;
+  fh->preallocated = FALSE;
+  if (!DokanFileInfo->IsDirectory && (flags & (LKL_O_WRONLY | LKL_O_RDWR)) &&
+      !(ShareAccess & FILE_SHARE_WRITE)) {
+    struct lkl_stat lkl_stat;
+    if (lkl_sys_fstat(fh->fd, &lkl_stat) == 0) {
+      fh->exclusive_writer = TRUE;
+      fh->size = lkl_stat.st_size;
+      fh->prealloc_end = lkl_stat.st_size;
+    }
+  }
+  if (!DokanFileInfo->IsDirectory)
+    lkl_file_advise(fh, FileName,
+                    convert_access_hint(CreateOptions, FileAttributes));
+
+  retval = STATUS_SUCCESS;
+  DokanFileInfo->Context = (ULONG64)(ULONG_PTR)fh;
+
 out:
   if (unix_filename)
     free_char_buf(unix_filename);
@@ -373,29 +1254,289 @@ out:
   return retval;
 }
 
+/*
+ * Paging I/O and flushes still arrive between Cleanup and CloseFile, so the
+ * handle is only given up here.
+ */
 static void DOKAN_CALLBACK LklCloseFile(LPCWSTR FileName,
                                         PDOKAN_FILE_INFO DokanFileInfo) {
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
   DokanFileInfo->Context = 0;
+  if (!fh)
+    return;
+
+  if (lkl_file_apply_meta(fh) < 0)
+    DbgPrint(L"%s: can't apply metadata of %s\n", __func__, FileName);
+
+  close_queue_push(fh, NULL, DokanFileInfo->IsDirectory);
 }
 
 static void DOKAN_CALLBACK LklCleanup(LPCWSTR FileName,
                                       PDOKAN_FILE_INFO DokanFileInfo) {
-  int lkl_fd = (int)DokanFileInfo->Context;
-  DokanFileInfo->Context = 0;
-  lkl_sys_close(lkl_fd);
+  char *unix_filename = NULL;
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
+  if (fh) {
+    DbgPrint(L"%s: FileName = %s, fadvise = %S\n", __func__, FileName,
+             fadvise_names[fh->fadvise]);
+    if (lkl_file_apply_meta(fh) < 0)
+      DbgPrint(L"%s: can't apply metadata of %s\n", __func__, FileName);
+
+    if (!DokanFileInfo->IsDirectory && !fh->delete_on_close &&
+        !DokanFileInfo->DeleteOnClose)
+      lkl_file_trim_prealloc(fh);
+
+    if (durability == DURABILITY_STRICT && !DokanFileInfo->IsDirectory &&
+        !fh->delete_on_close && !DokanFileInfo->DeleteOnClose &&
+        (fh->data_dirty || fh->meta_dirty))
+      group_commit_flush(fh);
+  }
 
   if (DokanFileInfo->DeleteOnClose) {
-    char *unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
+    unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
     if (!unix_filename)
-      return;
+      DbgPrint(L"%s: can't delete %s\n", __func__, FileName);
+  }
+
+  if (unix_filename)
+    close_queue_push(NULL, unix_filename, DokanFileInfo->IsDirectory);
+}
+
+static void invalidate_extent_caches(void) {
+  InterlockedIncrement(&data_generation);
+}
+
+/*
+ * Find the extent containing @pos, from the cache or with SEEK_DATA and
+ * SEEK_HOLE. *end is set to @pos when @pos is at or beyond EOF.
+ */
+static int lkl_file_find_extent(struct lkl_file *fh, LONGLONG pos,
+                                struct lkl_extent *ext) {
+  int i;
+  LONGLONG lkl_ret;
+  struct lkl_extent_cache *cache = &fh->extent_cache;
+  LONG generation = data_generation;
+
+  AcquireSRWLockShared(&cache->lock);
+  if (cache->generation == generation) {
+    for (i = 0; i < cache->nr; i++) {
+      if (cache->extents[i].start <= pos && pos < cache->extents[i].end) {
+        *ext = cache->extents[i];
+        ReleaseSRWLockShared(&cache->lock);
+        return 0;
+      }
+    }
+  }
+  ReleaseSRWLockShared(&cache->lock);
+
+  ext->start = pos;
+  lkl_ret = lkl_sys_lseek(fh->fd, pos, LKL_SEEK_DATA);
+  if (lkl_ret == -LKL_ENXIO) {
+    /* Nothing but a hole up to EOF. */
+    lkl_ret = lkl_sys_lseek(fh->fd, 0, LKL_SEEK_END);
+    if (lkl_ret < 0)
+      return (int)lkl_ret;
+
+    ext->end = max(pos, lkl_ret);
+    ext->hole = TRUE;
+  } else if (lkl_ret < 0) {
+    return (int)lkl_ret;
+  } else if (lkl_ret > pos) {
+    ext->end = lkl_ret;
+    ext->hole = TRUE;
+  } else {
+    lkl_ret = lkl_sys_lseek(fh->fd, pos, LKL_SEEK_HOLE);
+    if (lkl_ret < 0)
+      return (int)lkl_ret;
+
+    ext->end = lkl_ret;
+    ext->hole = FALSE;
+  }
+
+  if (ext->end == pos)
+    return 0;
+
+  AcquireSRWLockExclusive(&cache->lock);
+  if (cache->generation != generation) {
+    cache->generation = generation;
+    cache->nr = 0;
+    cache->next = 0;
+  }
+  cache->extents[cache->next] = *ext;
+  cache->next = (cache->next + 1) % NR_CACHED_EXTENTS;
+  if (cache->nr < NR_CACHED_EXTENTS)
+    cache->nr++;
+  ReleaseSRWLockExclusive(&cache->lock);
+  return 0;
+}
 
-    if (!DokanFileInfo->IsDirectory)
-      lkl_sys_unlink(unix_filename);
+/*
+ * Read only the data extents through LKL and fill holes in place. memset
+ * of the CRT is already vectorized.
+ */
+static int lkl_sparse_pread(struct lkl_file *fh, int fd, BOOL direct,
+                            char *buf, DWORD len, LONGLONG off,
+                            DWORD *done) {
+  int lkl_ret;
+  DWORD chunk, got;
+  struct lkl_extent ext;
+
+  *done = 0;
+  while (*done < len) {
+    LONGLONG pos = off + *done;
+    lkl_ret = lkl_file_find_extent(fh, pos, &ext);
+    if (lkl_ret == -LKL_EINVAL || lkl_ret == -LKL_EOPNOTSUPP) {
+      fh->extent_cache.unsupported = TRUE;
+      break;
+    }
+    if (lkl_ret < 0)
+      return lkl_ret;
+
+    if (ext.end == pos)
+      return 0;
+
+    chunk = (DWORD)min((LONGLONG)(len - *done), ext.end - pos);
+    if (ext.hole) {
+      ZeroMemory(buf + *done, chunk);
+      *done += chunk;
+      InterlockedAdd64(&lkl_stats.hole_bytes, chunk);
+      continue;
+    }
+
+    if (direct)
+      lkl_ret = lkl_direct_pread(fd, buf + *done, chunk, pos, &got);
     else
-      lkl_sys_rmdir(unix_filename);
+      lkl_ret = lkl_pread_full(fd, buf + *done, chunk, pos, &got);
 
-    free_char_buf(unix_filename);
+    *done += got;
+    if (lkl_ret < 0)
+      return lkl_ret;
+
+    if (got < chunk)
+      return 0;
+  }
+
+  if (*done < len) {
+    /* SEEK_DATA is unsupported, read the rest as it is. */
+    if (direct)
+      lkl_ret = lkl_direct_pread(fd, buf + *done, len - *done, off + *done,
+                                 &got);
+    else
+      lkl_ret = lkl_pread_full(fd, buf + *done, len - *done, off + *done,
+                               &got);
+
+    *done += got;
+    return lkl_ret;
   }
+
+  return 0;
+}
+
+static int lkl_file_pwrite(int fd, BOOL direct, const char *buf, DWORD len,
+                           LONGLONG off, DWORD *done) {
+  if (direct)
+    return lkl_direct_pwrite(fd, buf, len, off, done);
+
+  return lkl_pwrite_full(fd, buf, len, off, done);
+}
+
+/*
+ * Turn [start, end) of a write that is known to be all zeroes into holes.
+ * The part below EOF is punched out, the part beyond EOF is simply not
+ * written. Returns the offset up to which the range has been dealt with.
+ */
+static LONGLONG lkl_file_zero_range(int fd, LONGLONG start, LONGLONG end,
+                                    LONGLONG size) {
+  int lkl_ret;
+  LONGLONG punch_end = min(end, size);
+
+  if (start < punch_end) {
+    lkl_ret = lkl_sys_fallocate(fd, LKL_FALLOC_FL_PUNCH_HOLE |
+                                LKL_FALLOC_FL_KEEP_SIZE,
+                                start, punch_end - start);
+    if (lkl_ret == -LKL_EOPNOTSUPP)
+      lkl_ret = lkl_sys_fallocate(fd, LKL_FALLOC_FL_ZERO_RANGE |
+                                  LKL_FALLOC_FL_KEEP_SIZE,
+                                  start, punch_end - start);
+    if (lkl_ret < 0)
+      return start;
+
+    InterlockedAdd64(&lkl_stats.zero_bytes_punched, punch_end - start);
+  }
+
+  if (punch_end < end)
+    InterlockedAdd64(&lkl_stats.zero_bytes_skipped, end - max(start, size));
+
+  return end;
+}
+
+/*
+ * Write @buf, replacing block aligned runs of zeroes of at least
+ * zero_write_threshold bytes by holes. The last block of a write that
+ * extends the file is always written, so the file size grows without
+ * racing against other writers through ftruncate.
+ */
+static int lkl_zero_aware_pwrite(struct lkl_file *fh, int fd, BOOL direct,
+                                 const char *buf, DWORD len, LONGLONG off,
+                                 DWORD *done) {
+  int lkl_ret;
+  DWORD got;
+  struct lkl_stat lkl_stat;
+  LONGLONG end = off + len, data_start = off, zero_start = -1, blk;
+
+  *done = 0;
+  lkl_ret = lkl_sys_fstat(fh->fd, &lkl_stat);
+  if (lkl_ret < 0)
+    return lkl_file_pwrite(fd, direct, buf, len, off, done);
+
+  if (end > lkl_stat.st_size)
+    end -= ZERO_BLOCK_SIZE;
+
+  blk = (off + ZERO_BLOCK_SIZE - 1) & ~(LONGLONG)(ZERO_BLOCK_SIZE - 1);
+  for (;; blk += ZERO_BLOCK_SIZE) {
+    BOOL zero = blk + ZERO_BLOCK_SIZE <= end &&
+                is_zero_buf(buf + (blk - off), ZERO_BLOCK_SIZE);
+    if (zero) {
+      if (zero_start < 0)
+        zero_start = blk;
+      continue;
+    }
+
+    if (zero_start >= 0 && blk - zero_start >= zero_write_threshold) {
+      lkl_ret = lkl_file_pwrite(fd, direct, buf + (data_start - off),
+                                (DWORD)(zero_start - data_start),
+                                data_start, &got);
+      *done += got;
+      if (lkl_ret < 0)
+        return lkl_ret;
+
+      *done += (DWORD)(blk - zero_start);
+      data_start = lkl_file_zero_range(fh->fd, zero_start, blk,
+                                       lkl_stat.st_size);
+      if (data_start != blk)
+        *done -= (DWORD)(blk - zero_start);
+    }
+    zero_start = -1;
+
+    if (blk + ZERO_BLOCK_SIZE > end)
+      break;
+  }
+
+  lkl_ret = lkl_file_pwrite(fd, direct, buf + (data_start - off),
+                            (DWORD)(off + len - data_start), data_start,
+                            &got);
+  *done += got;
+  return lkl_ret;
+}
+
+/*
+ * Paging I/O comes from the Windows cache manager, which already caches the
+ * data. When bypass_paging_cache is set such requests skip the LKL page
+ * cache so that its memory is left to metadata.
+ */
+static BOOL lkl_file_use_direct(struct lkl_file *fh,
+                                PDOKAN_FILE_INFO DokanFileInfo) {
+  return (fh->flags & LKL_O_DIRECT) ||
+         (bypass_paging_cache && DokanFileInfo->PagingIo);
 }
 
 static NTSTATUS DOKAN_CALLBACK LklReadFile(LPCWSTR FileName, LPVOID Buffer,
@@ -404,33 +1545,46 @@ static NTSTATUS DOKAN_CALLBACK LklReadFile(LPCWSTR FileName, LPVOID Buffer,
                                            LONGLONG Offset,
                                            PDOKAN_FILE_INFO DokanFileInfo) {
   NTSTATUS retval;
-  int lkl_fd, lkl_ret;
-  DWORD orig_BufferLength = BufferLength;
+  int lkl_ret, fd = -1, path = IO_CACHED;
+  DWORD done;
+  LONG64 start = stats_ticks();
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
   if (DokanFileInfo->IsDirectory)
     return STATUS_INVALID_PARAMETER;
 
   if (ReadLength)
     *ReadLength = 0;
 
-  lkl_fd = (int)DokanFileInfo->Context;
-
-  do {
-    lkl_ret = lkl_sys_pread64(lkl_fd, Buffer, BufferLength, Offset);
-    if (lkl_ret <= 0)
-      break;
+  if (lkl_file_use_direct(fh, DokanFileInfo)) {
+    fd = lkl_file_get_fd(fh, TRUE);
+    if (fd >= 0)
+      path = IO_DIRECT;
+    else
+      InterlockedIncrement(&lkl_stats.direct_fallbacks);
+  }
 
-    BufferLength -= lkl_ret;
-    Offset += lkl_ret;
-    Buffer += lkl_ret;
-  } while (BufferLength > 0);
+  if (path == IO_CACHED) {
+    fd = lkl_file_get_fd(fh, FALSE);
+    if (fd < 0)
+      return lkl_errno_to_ntstatus(fd);
+  }
 
-  if (lkl_ret < 0)
-    retval = lkl_errno_to_ntstatus(lkl_ret);
+  if (BufferLength >= SPARSE_READ_MIN && !fh->extent_cache.unsupported)
+    lkl_ret = lkl_sparse_pread(fh, fd, path == IO_DIRECT, Buffer,
+                               BufferLength, Offset, &done);
+  else if (path == IO_DIRECT)
+    lkl_ret = lkl_direct_pread(fd, Buffer, BufferLength, Offset, &done);
   else
-    retval = STATUS_SUCCESS;
+    lkl_ret = lkl_pread_full(fd, Buffer, BufferLength, Offset, &done);
+  lkl_file_put_fd(fh);
 
+  retval = lkl_errno_to_ntstatus(lkl_ret);
+  if (retval == STATUS_SUCCESS) {
+    InterlockedAdd64(&lkl_stats.read_bytes[path], done);
+    InterlockedAdd64(&lkl_stats.read_ticks[path], stats_ticks() - start);
+  }
   if (retval == STATUS_SUCCESS && ReadLength)
-    *ReadLength = orig_BufferLength - BufferLength;
+    *ReadLength = done;
 
   return retval;
 }
@@ -441,46 +1595,124 @@ static NTSTATUS DOKAN_CALLBACK LklWriteFile(LPCWSTR FileName, LPCVOID Buffer,
                                             LONGLONG Offset,
                                             PDOKAN_FILE_INFO DokanFileInfo) {
   NTSTATUS retval;
-  int lkl_fd, lkl_ret;
-  DWORD orig_NumberOfBytesToWrite = NumberOfBytesToWrite;
+  int lkl_ret, fd = -1, path = IO_CACHED;
+  DWORD done;
+  LONG64 start = stats_ticks();
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
   if (DokanFileInfo->IsDirectory)
     return STATUS_INVALID_PARAMETER;
 
   if (NumberOfBytesWritten)
     *NumberOfBytesWritten = 0;
 
-  lkl_fd = (int)DokanFileInfo->Context;
+  /*
+   * An unaligned range is written buffered, a read-modify-write cycle
+   * would race with other writers.
+   */
+  if (lkl_file_use_direct(fh, DokanFileInfo)) {
+    fd = -LKL_EINVAL;
+    if (lkl_direct_io_aligned(Offset, NumberOfBytesToWrite))
+      fd = lkl_file_get_fd(fh, TRUE);
+    if (fd >= 0)
+      path = IO_DIRECT;
+    else
+      InterlockedIncrement(&lkl_stats.direct_fallbacks);
+  }
 
-  do {
-    lkl_ret = lkl_sys_pwrite64(lkl_fd, Buffer, NumberOfBytesToWrite, Offset);
-    if (lkl_ret <= 0)
-      break;
+  if (path == IO_CACHED) {
+    fd = lkl_file_get_fd(fh, FALSE);
+    if (fd < 0)
+      return lkl_errno_to_ntstatus(fd);
+  }
 
-    NumberOfBytesToWrite -= lkl_ret;
-    Offset += lkl_ret;
-    Buffer += lkl_ret;
-  } while (NumberOfBytesToWrite > 0);
+  lkl_file_reserve_append(fh, Offset, Offset + NumberOfBytesToWrite);
 
-  if (lkl_ret < 0)
-    retval = lkl_errno_to_ntstatus(lkl_ret);
+  if (zero_write_threshold &&
+      NumberOfBytesToWrite >= zero_write_threshold + ZERO_BLOCK_SIZE)
+    lkl_ret = lkl_zero_aware_pwrite(fh, fd, path == IO_DIRECT, Buffer,
+                                    NumberOfBytesToWrite, Offset, &done);
   else
-    retval = STATUS_SUCCESS;
+    lkl_ret = lkl_file_pwrite(fd, path == IO_DIRECT, Buffer,
+                              NumberOfBytesToWrite, Offset, &done);
+  lkl_file_put_fd(fh);
+
+  if (done) {
+    invalidate_extent_caches();
+    fh->data_dirty = 1;
+    lkl_file_grow(fh, Offset + done);
+  }
 
+  retval = lkl_errno_to_ntstatus(lkl_ret);
+  if (retval == STATUS_SUCCESS) {
+    InterlockedAdd64(&lkl_stats.write_bytes[path], done);
+    InterlockedAdd64(&lkl_stats.write_ticks[path], stats_ticks() - start);
+  }
   if (retval == STATUS_SUCCESS && NumberOfBytesWritten)
-    *NumberOfBytesWritten =
-      orig_NumberOfBytesToWrite - NumberOfBytesToWrite;
+    *NumberOfBytesWritten = done;
 
   return retval;
 }
 
 static NTSTATUS DOKAN_CALLBACK
 LklFlushFileBuffers(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
-  int lkl_fd;
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
   if (DokanFileInfo->IsDirectory)
     return STATUS_SUCCESS;
 
-  lkl_fd = (int)DokanFileInfo->Context;
-  return lkl_errno_to_ntstatus(lkl_sys_fsync(lkl_fd));
+  /* Temporary files are thrown away at Cleanup, never make them durable. */
+  if (fh->delete_on_close || DokanFileInfo->DeleteOnClose)
+    return STATUS_SUCCESS;
+
+  if (durability == DURABILITY_PERIODIC || durability == DURABILITY_NONE) {
+    InterlockedIncrement(&lkl_stats.flushes_ignored);
+    return STATUS_SUCCESS;
+  }
+
+  lkl_file_apply_meta(fh);
+  return lkl_errno_to_ntstatus(group_commit_flush(fh));
+}
+
+/*
+ * Bounds the data loss window of DURABILITY_PERIODIC.
+ */
+static DWORD WINAPI periodic_sync_main(LPVOID arg) {
+  int fd = lkl_sys_open(lkl_mount_point_final, LKL_O_RDONLY | LKL_O_DIRECTORY,
+                        0);
+  UNREFERENCED_PARAMETER(arg);
+  if (fd < 0) {
+    fprintf(stderr, "can't open %s for periodic sync: %s\n",
+            lkl_mount_point_final, lkl_strerror(fd));
+    return 1;
+  }
+
+  while (WaitForSingleObject(periodic_sync_stop, periodic_sync_interval) ==
+         WAIT_TIMEOUT) {
+    lkl_sys_syncfs(fd);
+    InterlockedIncrement(&lkl_stats.periodic_syncs);
+  }
+
+  lkl_sys_close(fd);
+  return 0;
+}
+
+static int parse_durability(const WCHAR *arg) {
+  int i;
+  size_t len;
+  for (i = 0; i < NR_DURABILITY; i++) {
+    len = wcslen(durability_names[i]);
+    if (wcsncmp(arg, durability_names[i], len) != 0)
+      continue;
+
+    if (i == DURABILITY_PERIODIC && arg[len] == L':')
+      periodic_sync_interval = (DWORD)_wtol(arg + len + 1);
+    else if (arg[len] != L'\0')
+      continue;
+
+    durability = i;
+    return 0;
+  }
+
+  return -1;
 }
 
 lkl_stat_to_def(file_info, BY_HANDLE_FILE_INFORMATION)
@@ -490,16 +1722,27 @@ static NTSTATUS DOKAN_CALLBACK LklGetFileInformation(
     PDOKAN_FILE_INFO DokanFileInfo) {
   struct lkl_stat lkl_stat;
   NTSTATUS retval = STATUS_SUCCESS;
-  char *unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
-  if (!unix_filename) {
-    retval = STATUS_INSUFFICIENT_RESOURCES;
-    goto out;
-  }
+  char *unix_filename = NULL;
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
+
+  ZeroMemory(&lkl_stat, sizeof(struct lkl_stat));
+  if (fh) {
+    retval = lkl_errno_to_ntstatus(lkl_sys_fstat(fh->fd, &lkl_stat));
+    if (retval != STATUS_SUCCESS)
+      goto out;
 
-  ZeroMemory(&lkl_stat, sizeof(struct lkl_stat));
-  retval = lkl_errno_to_ntstatus(lkl_sys_lstat(unix_filename, &lkl_stat));
-  if (retval != STATUS_SUCCESS)
-    goto out;
+    lkl_file_overlay_meta(fh, &lkl_stat);
+  } else {
+    unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
+    if (!unix_filename) {
+      retval = STATUS_INSUFFICIENT_RESOURCES;
+      goto out;
+    }
+
+    retval = lkl_errno_to_ntstatus(lkl_sys_lstat(unix_filename, &lkl_stat));
+    if (retval != STATUS_SUCCESS)
+      goto out;
+  }
 
   HandleFileInformation->nNumberOfLinks = lkl_stat.st_nlink;
   if (LKL_S_ISDIR(lkl_stat.st_mode))
@@ -532,6 +1775,7 @@ LklFindFiles(LPCWSTR FileName,
     goto out;
   }
 
+  close_queue_wait(unix_filename, TRUE);
   dir = lkl_opendir(unix_filename, &lkl_ret);
   if (!dir) {
     retval = lkl_errno_to_ntstatus(lkl_ret);
@@ -586,6 +1830,7 @@ out:
 
 static NTSTATUS DOKAN_CALLBACK
 LklDeleteFile(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+  struct lkl_stat lkl_stat;
   NTSTATUS retval = STATUS_SUCCESS;
   char *unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
   if (!unix_filename) {
@@ -593,7 +1838,10 @@ LklDeleteFile(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
     goto out;
   }
 
-  retval = lkl_errno_to_ntstatus(lkl_sys_unlink(unix_filename));
+  /* Only check, the file is deleted at Cleanup. */
+  retval = lkl_errno_to_ntstatus(lkl_sys_lstat(unix_filename, &lkl_stat));
+  if (retval == STATUS_SUCCESS && LKL_S_ISDIR(lkl_stat.st_mode))
+    retval = STATUS_ACCESS_DENIED;
 out:
   if (unix_filename)
     free_char_buf(unix_filename);
@@ -603,6 +1851,9 @@ out:
 
 static NTSTATUS DOKAN_CALLBACK
 LklDeleteDirectory(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+  int lkl_ret;
+  struct lkl_dir *dir;
+  struct lkl_linux_dirent64 *de;
   NTSTATUS retval = STATUS_SUCCESS;
   char *unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
   if (!unix_filename) {
@@ -610,7 +1861,25 @@ LklDeleteDirectory(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
     goto out;
   }
 
-  retval = lkl_errno_to_ntstatus(lkl_sys_rmdir(unix_filename));
+  /*
+   * Only check, the directory is removed at Cleanup. Deletions of its
+   * entries that are still queued have to finish first.
+   */
+  close_queue_wait(unix_filename, TRUE);
+  dir = lkl_opendir(unix_filename, &lkl_ret);
+  if (!dir) {
+    retval = lkl_errno_to_ntstatus(lkl_ret);
+    goto out;
+  }
+
+  while ((de = lkl_readdir(dir))) {
+    if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+      retval = STATUS_DIRECTORY_NOT_EMPTY;
+      break;
+    }
+  }
+
+  lkl_closedir(dir);
 out:
   if (unix_filename)
     free_char_buf(unix_filename);
@@ -630,62 +1899,164 @@ LklMoveFile(LPCWSTR FileName, // existing file name
     goto out;
   }
 
+  close_queue_wait(unix_filename, TRUE);
+  close_queue_wait(unix_new_filename, TRUE);
   retval = lkl_errno_to_ntstatus(lkl_sys_rename(unix_filename, unix_new_filename));
 out:
   if (unix_filename)
     free_char_buf(unix_filename);
 
   if (unix_new_filename)
-    free_char_buf(unix_filename);
+    free_char_buf(unix_new_filename);
 
   return retval;
 }
 
-/* The physical file size is also referred to as the end of the file. */
+/*
+ * Copy engines set the final size first and then fill the file in pieces.
+ * Growth is reserved with fallocate before the size is set, so that the
+ * file is not left sparse and fragmented.
+ */
 static NTSTATUS DOKAN_CALLBACK LklSetEndOfFile(
     LPCWSTR FileName, LONGLONG ByteOffset, PDOKAN_FILE_INFO DokanFileInfo) {
-  int lkl_fd = (int)DokanFileInfo->Context, lkl_ret;
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
+  struct lkl_stat lkl_stat;
+  int lkl_ret;
   if (DokanFileInfo->IsDirectory)
     return STATUS_INVALID_PARAMETER;
 
-  lkl_ret = lkl_sys_ftruncate(lkl_fd, ByteOffset);
+  AcquireSRWLockExclusive(&fh->size_lock);
+  if (lkl_sys_fstat(fh->fd, &lkl_stat) < 0)
+    lkl_stat.st_size = ByteOffset;
+
+  if (ByteOffset > lkl_stat.st_size)
+    lkl_file_prealloc(fh, lkl_stat.st_size, ByteOffset);
+
+  lkl_ret = lkl_sys_ftruncate(fh->fd, ByteOffset);
+  if (lkl_ret == 0 && fh->exclusive_writer) {
+    fh->size = ByteOffset;
+    /* Truncating down also released what was reserved beyond EOF. */
+    if (ByteOffset <= lkl_stat.st_size)
+      fh->prealloc_end = ByteOffset;
+    else
+      fh->prealloc_end = max(fh->prealloc_end, ByteOffset);
+  }
+  ReleaseSRWLockExclusive(&fh->size_lock);
+
+  invalidate_extent_caches();
+  fh->meta_dirty = 1;
   return lkl_errno_to_ntstatus(lkl_ret);
 }
 
+/*
+ * The allocation size reserves space without changing the file size.
+ * Shrinking it below EOF truncates the file as on NTFS; space reserved
+ * beyond the new allocation size is punched out.
+ */
 static NTSTATUS DOKAN_CALLBACK LklSetAllocationSize(
     LPCWSTR FileName, LONGLONG AllocSize, PDOKAN_FILE_INFO DokanFileInfo) {
-  int lkl_fd = (int)DokanFileInfo->Context, lkl_ret;
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
+  struct lkl_stat lkl_stat;
+  LONGLONG alloc_end, punch_start;
+  int lkl_ret;
   if (DokanFileInfo->IsDirectory)
     return STATUS_INVALID_PARAMETER;
 
-  lkl_ret = lkl_sys_fallocate(lkl_fd, 0, 0, AllocSize);
+  AcquireSRWLockExclusive(&fh->size_lock);
+  lkl_ret = lkl_sys_fstat(fh->fd, &lkl_stat);
+  if (lkl_ret < 0)
+    goto out;
+
+  if (AllocSize > lkl_stat.st_size) {
+    lkl_ret = lkl_sys_fallocate(fh->fd, LKL_FALLOC_FL_KEEP_SIZE, 0, AllocSize);
+    if (lkl_ret < 0)
+      goto out;
+
+    InterlockedAdd64(&lkl_stats.prealloc_bytes, AllocSize - lkl_stat.st_size);
+    /* Only an exclusive writer gives the reservation back at Cleanup. */
+    if (fh->exclusive_writer) {
+      fh->preallocated = TRUE;
+      fh->prealloc_end = max(fh->prealloc_end, AllocSize);
+    }
+    goto out;
+  }
+
+  /* Allocated blocks cannot reach further than this past EOF. */
+  alloc_end = max(fh->prealloc_end,
+                  lkl_stat.st_size + lkl_stat.st_blocks * 512);
+
+  if (AllocSize < lkl_stat.st_size) {
+    lkl_ret = lkl_sys_ftruncate(fh->fd, AllocSize);
+    if (lkl_ret < 0)
+      goto out;
+
+    if (fh->exclusive_writer)
+      fh->size = AllocSize;
+  }
+
+  punch_start = (AllocSize + ZERO_BLOCK_SIZE - 1) &
+                ~(LONGLONG)(ZERO_BLOCK_SIZE - 1);
+  if (alloc_end > punch_start) {
+    lkl_ret = lkl_sys_fallocate(fh->fd, LKL_FALLOC_FL_PUNCH_HOLE |
+                                LKL_FALLOC_FL_KEEP_SIZE,
+                                punch_start, alloc_end - punch_start);
+    if (lkl_ret == -LKL_EOPNOTSUPP)
+      lkl_ret = 0;
+  }
+  if (fh->exclusive_writer)
+    fh->prealloc_end = AllocSize;
+
+out:
+  ReleaseSRWLockExclusive(&fh->size_lock);
+  invalidate_extent_caches();
+  fh->meta_dirty = 1;
   return lkl_errno_to_ntstatus(lkl_ret);
 }
 
 static NTSTATUS DOKAN_CALLBACK LklSetFileAttributes(
     LPCWSTR FileName, DWORD FileAttributes, PDOKAN_FILE_INFO DokanFileInfo) {
   NTSTATUS retval = STATUS_SUCCESS;
-  char *unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
-  if (!unix_filename) {
-    retval = STATUS_INSUFFICIENT_RESOURCES;
-    goto out;
-  }
+  BOOL has_mode = FALSE;
+  lkl_mode_t mode = default_mode;
+  char *unix_filename = NULL;
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
 
   /*
    * TODO: supports for other attributes.
    */
   if (FileAttributes == FILE_ATTRIBUTE_NORMAL) {
-    retval = lkl_errno_to_ntstatus(
-        lkl_sys_chmod(unix_filename, default_mode));
+    has_mode = TRUE;
   } else {
     if ((FileAttributes & FILE_ATTRIBUTE_READONLY) == FILE_ATTRIBUTE_READONLY) {
-      retval = lkl_errno_to_ntstatus(
-          lkl_sys_chmod(unix_filename, LKL_S_IRUSR|LKL_S_IRGRP|LKL_S_IROTH));
+      mode = LKL_S_IRUSR|LKL_S_IRGRP|LKL_S_IROTH;
+      has_mode = TRUE;
     }
     if ((FileAttributes & FILE_ATTRIBUTE_TEMPORARY) == FILE_ATTRIBUTE_TEMPORARY)
       retval = STATUS_NOT_IMPLEMENTED;
 
   }
+
+  if (!has_mode)
+    goto out;
+
+  if (fh) {
+    AcquireSRWLockExclusive(&fh->pending_meta.lock);
+    fh->pending_meta.has_mode = TRUE;
+    fh->pending_meta.mode = mode;
+    ReleaseSRWLockExclusive(&fh->pending_meta.lock);
+    goto out;
+  }
+
+  unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
+  if (!unix_filename) {
+    retval = STATUS_INSUFFICIENT_RESOURCES;
+    goto out;
+  }
+
+  if (retval == STATUS_SUCCESS)
+    retval = lkl_errno_to_ntstatus(lkl_sys_chmod(unix_filename, mode));
+  else
+    lkl_sys_chmod(unix_filename, mode);
 out:
   if (unix_filename)
     free_char_buf(unix_filename);
@@ -693,19 +2064,14 @@ out:
   return retval;
 }
 
-#define LKL_UTIME_OMIT ((1l << 30) - 2l)
-
 static NTSTATUS DOKAN_CALLBACK
 LklSetFileTime(LPCWSTR FileName, CONST FILETIME *CreationTime,
                CONST FILETIME *LastAccessTime, CONST FILETIME *LastWriteTime,
                PDOKAN_FILE_INFO DokanFileInfo) {
   struct lkl_timespec ts[2];
   NTSTATUS retval = STATUS_SUCCESS;
-  char *unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
-  if (!unix_filename) {
-    retval = STATUS_INSUFFICIENT_RESOURCES;
-    goto out;
-  }
+  char *unix_filename = NULL;
+  struct lkl_file *fh = lkl_file_get(DokanFileInfo);
 
   ts[0].tv_sec = 0;
   ts[0].tv_nsec = LKL_UTIME_OMIT;
@@ -722,6 +2088,28 @@ LklSetFileTime(LPCWSTR FileName, CONST FILETIME *CreationTime,
     ts[1].tv_nsec = 0;
   }
 
+  if (fh) {
+    struct lkl_pending_meta *pm = &fh->pending_meta;
+    AcquireSRWLockExclusive(&pm->lock);
+    if (!pm->has_times) {
+      pm->ts[0].tv_nsec = LKL_UTIME_OMIT;
+      pm->ts[1].tv_nsec = LKL_UTIME_OMIT;
+      pm->has_times = TRUE;
+    }
+    if (ts[0].tv_nsec != LKL_UTIME_OMIT)
+      pm->ts[0] = ts[0];
+    if (ts[1].tv_nsec != LKL_UTIME_OMIT)
+      pm->ts[1] = ts[1];
+    ReleaseSRWLockExclusive(&pm->lock);
+    goto out;
+  }
+
+  unix_filename = win_path_to_unix(wchar_to_utf8_buf(FileName, NULL));
+  if (!unix_filename) {
+    retval = STATUS_INSUFFICIENT_RESOURCES;
+    goto out;
+  }
+
   retval = lkl_errno_to_ntstatus(
         lkl_sys_utimensat(-1, unix_filename, ts, LKL_AT_SYMLINK_NOFOLLOW));
 out:
@@ -784,7 +2172,7 @@ static NTSTATUS DOKAN_CALLBACK LklGetVolumeInformation(
 static NTSTATUS DOKAN_CALLBACK LklMounted(PDOKAN_FILE_INFO DokanFileInfo) {
   UNREFERENCED_PARAMETER(DokanFileInfo);
 
-  DbgPrint(L"Mounted\n");
+  DbgPrint(L"Mounted, durability %s\n", durability_names[durability]);
   return STATUS_SUCCESS;
 }
 
@@ -795,12 +2183,82 @@ static NTSTATUS DOKAN_CALLBACK LklUnmounted(PDOKAN_FILE_INFO DokanFileInfo) {
   return STATUS_SUCCESS;
 }
 
-static HANDLE disk_handle = INVALID_HANDLE_VALUE;
+static struct disk_dev *disk_dev;
 static int disk_id;
-static union lkl_disk lkl_disk;
+
+/*
+ * With /e the filesystem is mounted with online discard and freed blocks
+ * are punched out of the image file.  Discards are merged until
+ * discard_batch_bytes accumulate; 0 hands each one to the host.
+ */
+static BOOL discard_enabled;
+static uint64_t discard_batch_bytes;
+
+/*
+ * /q serves the disk from disk_queues queues of disk_queue_depth host
+ * threads each; without it requests run synchronously in LKL's thread.
+ * Queued requests are sorted by offset over the last disk_sort_window
+ * of them, 0 keeps them in submission order.
+ */
+static int disk_queues;
+static int disk_queue_depth;
+static int disk_sort_window = 16;
+
+/*
+ * /h opens the image past the host page cache, so its blocks are only
+ * cached by LKL (and by /b, if asked for).
+ */
+static BOOL disk_unbuffered;
+
+/*
+ * /x maps the image into the process and serves the disk from the mapping.
+ * The filesystem is mounted with "dax" first, and without it if it doesn't
+ * support that.
+ */
+static BOOL disk_mapped;
+
+/*
+ * /v keeps the image read-only and sends all writes to a copy-on-write
+ * delta file, which is created if it doesn't exist.
+ */
+static WCHAR delta_path[MAX_PATH];
+
+/*
+ * /a keeps every write in up to ram_limit bytes of memory over the
+ * read-only image, then in the temporary spill_path if one is given.
+ * Nothing is ever written back.
+ */
+static BOOL ram_layer;
+static uint64_t ram_limit;
+static WCHAR spill_path[MAX_PATH];
+
+/*
+ * Images that aren't raw are recognized by their header.  Compressed ones
+ * keep up to COMPRESSED_CACHE_SIZE bytes of chunks decompressed.
+ */
+enum image_format {
+  IMAGE_RAW,
+  IMAGE_COMPRESSED,
+  IMAGE_VHD,
+};
+
+#define COMPRESSED_CACHE_SIZE (32 << 20)
+static enum image_format image_format;
+
+/* /p mounts partition disk_partition of a partitioned disk image. */
+static int disk_partition;
+
+/* /k decrypts the image with the XTS-AES key disk_key. */
+static uint8_t disk_key[64];
+static size_t disk_key_len;
+
+/* /b puts a disk_cache_size bytes block cache in front of the image. */
+static uint64_t disk_cache_size;
+static BOOL disk_cache_write_back;
 
 static int start_lkl(void)
 {
+  char opts[32];
   long ret;
   char *fstype = wchar_to_utf8_buf(lkl_mount_fstype, NULL);
 
@@ -810,8 +2268,20 @@ static int start_lkl(void)
     goto out;
   }
 
-  ret = lkl_mount_dev(disk_id, fstype, 0, NULL,
-    lkl_mount_point, sizeof(lkl_mount_point));
+  opts[0] = 0;
+  if (discard_enabled)
+    strcat(opts, "discard");
+  if (disk_mapped) {
+    ret = lkl_mount_dev(disk_id, fstype, 0,
+                        discard_enabled ? "dax,discard" : "dax",
+                        lkl_mount_point, sizeof(lkl_mount_point));
+    if (ret)
+      fprintf(stderr, "can't mount with dax, using the block path: %s\n",
+              lkl_strerror(ret));
+  }
+  if (!disk_mapped || ret)
+    ret = lkl_mount_dev(disk_id, fstype, 0, opts[0] ? opts : NULL,
+                        lkl_mount_point, sizeof(lkl_mount_point));
 
   if (ret) {
     fprintf(stderr, "can't mount disk: %s\n", lkl_strerror(ret));
@@ -825,6 +2295,20 @@ static int start_lkl(void)
     goto out_umount;
   }
 
+  close_queue_start();
+
+  if (durability == DURABILITY_PERIODIC) {
+    periodic_sync_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    periodic_sync_thread = CreateThread(NULL, 0, periodic_sync_main, NULL, 0,
+                                        NULL);
+    if (!periodic_sync_thread) {
+      fprintf(stderr, "can't start periodic sync thread\n");
+      close_queue_stop();
+      ret = -1;
+      goto out_umount;
+    }
+  }
+
   ret = 0;
   goto out;
 
@@ -841,10 +2325,140 @@ out:
   return ret;
 }
 
+static double stats_mib_per_sec(LONG64 bytes, LONG64 ticks)
+{
+  LARGE_INTEGER freq;
+  if (!ticks)
+    return 0;
+
+  QueryPerformanceFrequency(&freq);
+  return (double)bytes / (1024 * 1024) * freq.QuadPart / ticks;
+}
+
+static void print_stats(void)
+{
+  unsigned int i;
+
+  fprintf(stderr, "fadvise hints:");
+  for (i = 0; i < NR_FADVISE; i++)
+    fprintf(stderr, " %s=%ld", fadvise_names[i], lkl_stats.fadvise[i]);
+
+  fprintf(stderr, "\n");
+
+  for (i = 0; i < NR_IO_PATHS; i++)
+    fprintf(stderr, "%s I/O: read %lld bytes (%.1f MiB/s), "
+                    "wrote %lld bytes (%.1f MiB/s)\n",
+            io_path_names[i],
+            lkl_stats.read_bytes[i],
+            stats_mib_per_sec(lkl_stats.read_bytes[i],
+                              lkl_stats.read_ticks[i]),
+            lkl_stats.write_bytes[i],
+            stats_mib_per_sec(lkl_stats.write_bytes[i],
+                              lkl_stats.write_ticks[i]));
+
+  fprintf(stderr, "direct I/O: %ld bounced, %ld fell back to cached\n",
+          lkl_stats.bounced, lkl_stats.direct_fallbacks);
+  fprintf(stderr, "sparse reads: %lld bytes of holes filled\n",
+          lkl_stats.hole_bytes);
+  fprintf(stderr, "zero writes: %lld bytes punched, %lld bytes skipped\n",
+          lkl_stats.zero_bytes_punched, lkl_stats.zero_bytes_skipped);
+  fprintf(stderr, "durability %ls: flushes: %ld in %ld commits "
+                  "(%ld fsync, %ld fdatasync, %ld syncfs), %ld ignored, "
+                  "%ld periodic syncs\n",
+          durability_names[durability], lkl_stats.flushes,
+          lkl_stats.commits, lkl_stats.commit_fsync,
+          lkl_stats.commit_fdatasync, lkl_stats.commit_syncfs,
+          lkl_stats.flushes_ignored, lkl_stats.periodic_syncs);
+  fprintf(stderr, "preallocation: %lld bytes reserved, %lld extents in "
+                  "%ld preallocated files\n",
+          lkl_stats.prealloc_bytes, lkl_stats.preallocated_extents,
+          lkl_stats.preallocated_files);
+  fprintf(stderr, "background close: %ld closes, %ld deletes, "
+                  "%ld waits for pending deletes\n",
+          lkl_stats.async_closes, lkl_stats.async_deletes,
+          lkl_stats.delete_waits);
+  if (discard_enabled)
+    fprintf(stderr, "discard: %lld requests, %lld host punches "
+                    "(%lld bytes), %lld cancelled by writes\n",
+            (long long)disk_stats.discards,
+            (long long)disk_stats.host_discards,
+            (long long)disk_stats.discard_bytes,
+            (long long)disk_stats.discards_cancelled);
+  if (disk_queues)
+    fprintf(stderr, "disk queues: %lld requests queued, "
+                    "at most %lld in flight, %lld sorted, %lld merged "
+                    "into %lld bytes of vectored I/O\n",
+            (long long)disk_stats.queued,
+            (long long)disk_stats.max_in_flight,
+            (long long)disk_stats.sorted,
+            (long long)disk_stats.merged,
+            (long long)disk_stats.merged_bytes);
+  if (disk_unbuffered)
+    fprintf(stderr, "unbuffered image: %lld requests bounced, "
+                    "%lld partial sector writes\n",
+            (long long)disk_stats.bounced,
+            (long long)disk_stats.rmw_sectors);
+  if (image_format == IMAGE_COMPRESSED)
+    fprintf(stderr, "compressed image: %lld chunk cache hits, "
+                    "%lld chunks decompressed, %lld appended, "
+                    "%lld of %lld bytes live\n",
+            (long long)disk_stats.chunk_hits,
+            (long long)disk_stats.chunk_loads,
+            (long long)disk_stats.chunk_stores,
+            (long long)disk_stats.chunk_live_bytes,
+            (long long)disk_stats.chunk_image_bytes);
+  if (image_format == IMAGE_RAW && !disk_mapped)
+    fprintf(stderr, "sparse image: %lld bytes of holes read without I/O, "
+                    "%lld allocation map refreshes\n",
+            (long long)disk_stats.unallocated_bytes,
+            (long long)disk_stats.sparse_refreshes);
+  if (image_format == IMAGE_VHD)
+    fprintf(stderr, "vhd image: %lld blocks allocated, %lld bytes of "
+                    "unallocated blocks read without I/O\n",
+            (long long)disk_stats.vhd_allocs,
+            (long long)disk_stats.unallocated_bytes);
+  if (nr_disk_paths > 1)
+    fprintf(stderr, "stripe: %d images, %lld requests spanning several\n",
+            nr_disk_paths, (long long)disk_stats.stripe_splits);
+  if (disk_key_len)
+    fprintf(stderr, "encryption: %lld bytes encrypted, %lld decrypted\n",
+            (long long)disk_stats.encrypted_bytes,
+            (long long)disk_stats.decrypted_bytes);
+  if (delta_path[0])
+    fprintf(stderr, "overlay: %lld blocks in the delta, %lld copied up "
+                    "from the base\n",
+            (long long)disk_stats.delta_blocks,
+            (long long)disk_stats.cow_copies);
+  if (ram_layer)
+    fprintf(stderr, "ram layer: %lld blocks in memory (peak %lld bytes), "
+                    "%lld spilled, %lld writes failed for lack of space\n",
+            (long long)disk_stats.ram_blocks,
+            (long long)disk_stats.ram_peak_bytes,
+            (long long)disk_stats.spilled_blocks,
+            (long long)disk_stats.ram_full);
+  if (disk_cache_size)
+    fprintf(stderr, "block cache: %lld hits, %lld misses, %lld evictions, "
+                    "%lld write-backs\n",
+            (long long)disk_stats.cache_hits,
+            (long long)disk_stats.cache_misses,
+            (long long)disk_stats.cache_evictions,
+            (long long)disk_stats.cache_writebacks);
+}
+
 static void stop_lkl(void)
 {
   int ret;
 
+  close_queue_stop();
+
+  if (periodic_sync_thread) {
+    SetEvent(periodic_sync_stop);
+    WaitForSingleObject(periodic_sync_thread, INFINITE);
+    CloseHandle(periodic_sync_thread);
+    CloseHandle(periodic_sync_stop);
+    periodic_sync_thread = NULL;
+  }
+
   ret = lkl_sys_chdir("/");
   if (ret)
     fprintf(stderr, "can't chdir to /: %s\n", lkl_strerror(ret));
@@ -856,6 +2470,286 @@ static void stop_lkl(void)
   lkl_sys_halt();
 }
 
+static int parse_disk_cache(const WCHAR *arg)
+{
+  WCHAR *end;
+
+  disk_cache_size = (uint64_t)wcstol(arg, &end, 10) << 20;
+  if (!wcscmp(end, L":wb"))
+    disk_cache_write_back = TRUE;
+  else if (wcscmp(end, L"") && wcscmp(end, L":wt"))
+    return -1;
+
+  return disk_cache_size ? 0 : -1;
+}
+
+static int parse_ram_layer(const WCHAR *arg)
+{
+  WCHAR *end;
+
+  ram_layer = TRUE;
+  ram_limit = (uint64_t)wcstol(arg, &end, 10) << 20;
+  if (*end == L':')
+    return wcscpy_s(spill_path, sizeof(spill_path) / sizeof(WCHAR),
+                    end + 1) ? -1 : 0;
+
+  return *end ? -1 : 0;
+}
+
+static int parse_disk_key(const WCHAR *arg)
+{
+  size_t i, len = wcslen(arg);
+
+  SecureZeroMemory(disk_key, sizeof(disk_key));
+  disk_key_len = 0;
+  if (len != 64 && len != 128)
+    return -1;
+
+  for (i = 0; i < len; i++) {
+    WCHAR c = towlower(arg[i]);
+    int v;
+
+    if (c >= L'0' && c <= L'9')
+      v = c - L'0';
+    else if (c >= L'a' && c <= L'f')
+      v = c - L'a' + 10;
+    else
+      return -1;
+    disk_key[i / 2] = (uint8_t)(disk_key[i / 2] << 4 | v);
+  }
+
+  disk_key_len = len / 2;
+  return 0;
+}
+
+static int parse_disk_queues(const WCHAR *arg)
+{
+  WCHAR *end;
+
+  disk_queues = wcstol(arg, &end, 10);
+  if (*end != L':')
+    return -1;
+  disk_queue_depth = wcstol(end + 1, &end, 10);
+  if (*end == L':')
+    disk_sort_window = wcstol(end + 1, &end, 10);
+  if (*end || disk_queues < 1 || disk_queue_depth < 1 || disk_sort_window < 0)
+    return -1;
+
+  return 0;
+}
+
+/* Opens the image at path as a raw image, mapped with /x. */
+static struct disk_dev *open_raw_image(const WCHAR *path, unsigned int flags,
+                                       int *err)
+{
+  host_file_t file;
+
+  file = host_file_open(path,
+                        (disk_unbuffered ? HOST_OPEN_UNBUFFERED : 0) |
+                        (flags & DISK_F_READONLY ? HOST_OPEN_READONLY : 0),
+                        err);
+  if (file == HOST_INVALID_FILE)
+    return NULL;
+
+  if (disk_mapped)
+    return disk_mmap_open(file, flags, err);
+  return disk_raw_open(file, flags, err);
+}
+
+/* Opens every /r image raw and stripes the disk over them. */
+static struct disk_dev *open_stripe(unsigned int flags, int *err)
+{
+  struct disk_dev *members[MAX_DISK_PATHS];
+  int i, j;
+
+  for (i = 0; i < nr_disk_paths; i++) {
+    members[i] = open_raw_image(disk_paths[i], flags, err);
+    if (!members[i]) {
+      fwprintf(stderr, L"can't open %s\n", disk_paths[i]);
+      for (j = 0; j < i; j++)
+        disk_close(members[j]);
+      return NULL;
+    }
+  }
+
+  return disk_stripe_open(members, nr_disk_paths, disk_stripe_size, err);
+}
+
+/* Opens the single /r image, in whichever format its header says. */
+static struct disk_dev *open_image(unsigned int flags, int *err)
+{
+  host_file_t file;
+  int ret;
+
+  file = host_file_open(disk_paths[0],
+                        (disk_unbuffered ? HOST_OPEN_UNBUFFERED : 0) |
+                        (flags & DISK_F_READONLY ? HOST_OPEN_READONLY : 0),
+                        err);
+  if (file == HOST_INVALID_FILE)
+    return NULL;
+
+  ret = disk_chunk_probe(file);
+  if (ret > 0) {
+    image_format = IMAGE_COMPRESSED;
+  } else if (!ret) {
+    ret = disk_vhd_probe(file);
+    if (ret > 0)
+      image_format = IMAGE_VHD;
+  }
+  if (ret < 0) {
+    host_file_close(file);
+    *err = ret;
+    return NULL;
+  }
+
+  if (image_format != IMAGE_RAW && (disk_mapped || disk_unbuffered)) {
+    fprintf(stderr, "/x and /h only work with raw images\n");
+    host_file_close(file);
+    *err = -EINVAL;
+    return NULL;
+  }
+
+  if (image_format == IMAGE_COMPRESSED)
+    return disk_chunk_open(file, flags, COMPRESSED_CACHE_SIZE, err);
+  if (image_format == IMAGE_VHD)
+    return disk_vhd_open(file, flags, err);
+  if (disk_mapped)
+    return disk_mmap_open(file, flags, err);
+  return disk_raw_open(file, flags, err);
+}
+
+/* Builds the block device stack behind the LKL disk. */
+static int open_disk(void)
+{
+  struct disk_dev *dev;
+  host_file_t file;
+  unsigned int flags = 0;
+  int ret = 0;
+
+  /* The delta and the spill file would hold decrypted blocks. */
+  if (disk_key_len && (delta_path[0] || spill_path[0])) {
+    fprintf(stderr, "/k can't be used with /v or a spill file\n");
+    SecureZeroMemory(disk_key, sizeof(disk_key));
+    return -EINVAL;
+  }
+
+  if (delta_path[0] || ram_layer)
+    flags |= DISK_F_READONLY;
+  else if (discard_enabled)
+    flags |= DISK_F_DISCARD;
+  if (disk_unbuffered)
+    flags |= DISK_F_UNBUFFERED;
+
+  if (nr_disk_paths > 1)
+    dev = open_stripe(flags, &ret);
+  else
+    dev = open_image(flags, &ret);
+  if (!dev)
+    return ret;
+
+  if (disk_key_len) {
+    struct disk_dev *crypt;
+
+    crypt = disk_crypt_open(dev, disk_key, disk_key_len, &ret);
+    SecureZeroMemory(disk_key, sizeof(disk_key));
+    if (!crypt) {
+      if (ret == -EINVAL)
+        fprintf(stderr, "the two halves of the key must differ\n");
+      disk_close(dev);
+      return ret;
+    }
+    dev = crypt;
+  }
+
+  if (disk_partition) {
+    struct disk_dev *part;
+
+    part = disk_part_open(dev, disk_partition, &ret);
+    if (!part) {
+      if (ret == -ENOENT)
+        fprintf(stderr, "no partition %d in the image\n", disk_partition);
+      disk_close(dev);
+      return ret;
+    }
+    dev = part;
+  }
+
+  if (delta_path[0]) {
+    struct disk_dev *overlay;
+
+    file = host_file_open(delta_path, HOST_OPEN_CREATE, &ret);
+    if (file == HOST_INVALID_FILE) {
+      disk_close(dev);
+      return ret;
+    }
+
+    overlay = disk_overlay_open(dev, file, &ret);
+    if (!overlay) {
+      disk_close(dev);
+      return ret;
+    }
+    dev = overlay;
+  }
+
+  if (ram_layer) {
+    struct disk_dev *ram;
+
+    file = HOST_INVALID_FILE;
+    if (spill_path[0]) {
+      file = host_file_open(spill_path, HOST_OPEN_TEMPORARY, &ret);
+      if (file == HOST_INVALID_FILE) {
+        disk_close(dev);
+        return ret;
+      }
+    }
+
+    ram = disk_ram_open(dev, ram_limit, file, &ret);
+    if (!ram) {
+      disk_close(dev);
+      return ret;
+    }
+    dev = ram;
+  }
+
+  if (discard_enabled && discard_batch_bytes) {
+    struct disk_dev *batch;
+
+    batch = disk_discard_batch(dev, discard_batch_bytes, &ret);
+    if (!batch) {
+      disk_close(dev);
+      return ret;
+    }
+    dev = batch;
+  }
+
+  if (disk_cache_size) {
+    struct disk_dev *cache;
+
+    cache = disk_cache_open(dev, disk_cache_size, disk_cache_write_back,
+                            &ret);
+    if (!cache) {
+      disk_close(dev);
+      return ret;
+    }
+    dev = cache;
+  }
+
+  if (disk_queues) {
+    struct disk_dev *mq;
+
+    mq = disk_mq_open(dev, disk_queues, disk_queue_depth, disk_sort_window,
+                      &ret);
+    if (!mq) {
+      disk_close(dev);
+      return ret;
+    }
+    dev = mq;
+  }
+
+  disk_dev = dev;
+  return 0;
+}
+
 int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
   int status;
   int ret;
@@ -873,7 +2767,8 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
 
   if (argc < 3) {
     fprintf(stderr, "mirror.exe\n"
-                    "  /r File/Device (ex. /r c:\\test)\n"
+                    "  /r File/Device (ex. /r c:\\test, repeat to stripe "
+                    "the disk over several images)\n"
                     "  /f Filesystem (ex. btrfs)\n"
                     "  /l DriveLetter (ex. /l m)\n"
                     "  /t ThreadCount (ex. /t 5)\n"
@@ -884,7 +2779,37 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
                     "  /w (write-protect drive)\n"
                     "  /o (use mount manager)\n"
                     "  /c (mount for current session only)\n"
-                    "  /i (Timeout in Milliseconds ex. /i 30000)\n");
+                    "  /i (Timeout in Milliseconds ex. /i 30000)\n"
+                    "  /u (paging I/O bypasses the LKL page cache)\n"
+                    "  /z Bytes (turn zeroed runs of writes into holes, "
+                    "ex. /z 65536)\n"
+                    "  /g Milliseconds (wait for more flushes before "
+                    "committing, ex. /g 2)\n"
+                    "  /y Durability (strict, fsync, fdatasync, "
+                    "periodic[:Milliseconds] or none, ex. /y periodic:5000)\n"
+                    "  /e BatchBytes (punch discarded blocks out of the "
+                    "image, merging up to BatchBytes, ex. /e 1048576)\n"
+                    "  /q Queues:Depth[:Window] (serve the disk "
+                    "asynchronously from host threads, merging adjacent "
+                    "requests sorted over Window, ex. /q 4:8:32)\n"
+                    "  /b MiB[:wt|:wb] (cache disk blocks in host memory, "
+                    "write-through or write-back, ex. /b 256:wb)\n"
+                    "  /h (access the image unbuffered, bypassing the host "
+                    "page cache)\n"
+                    "  /x (map the image into memory and mount with dax "
+                    "where supported)\n"
+                    "  /v DeltaFile (keep the image read-only and write to "
+                    "a copy-on-write delta, ex. /v c:\\job1.delta)\n"
+                    "  /a MiB[:SpillFile] (keep all writes in memory, then "
+                    "in a temporary file, never writing the image, "
+                    "ex. /a 512:c:\\temp\\scratch.tmp)\n"
+                    "  /p Partition (mount a partition of a disk image "
+                    "with an MBR or GPT partition table, ex. /p 2)\n"
+                    "  /j KiB (stripe size with several /r images, "
+                    "ex. /j 256)\n"
+                    "  /k KeyHex (the image is encrypted with XTS-AES, "
+                    "64 hex digits for AES-128, 128 for AES-256; "
+                    "not with /v or a spill file)\n");
     free(dokanOperations);
     free(dokanOptions);
     return EXIT_FAILURE;
@@ -901,7 +2826,14 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
     switch (towlower(argv[command][1])) {
     case L'r':
       command++;
-      wcscpy_s(disk_path, sizeof(disk_path) / sizeof(WCHAR), argv[command]);
+      if (nr_disk_paths == MAX_DISK_PATHS) {
+        fwprintf(stderr, L"at most %d images can be striped\n",
+                 MAX_DISK_PATHS);
+        free(dokanOperations);
+        free(dokanOptions);
+        return EXIT_FAILURE;
+      }
+      wcscpy_s(disk_paths[nr_disk_paths++], MAX_PATH, argv[command]);
       break;
     case L'f':
       command++;
@@ -941,6 +2873,103 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
       command++;
       dokanOptions->Timeout = (ULONG)_wtol(argv[command]);
       break;
+    case L'u':
+      bypass_paging_cache = TRUE;
+      break;
+    case L'z':
+      command++;
+      zero_write_threshold = (DWORD)_wtol(argv[command]);
+      break;
+    case L'g':
+      command++;
+      group_commit_window = (DWORD)_wtol(argv[command]);
+      break;
+    case L'y':
+      command++;
+      if (parse_durability(argv[command]) < 0) {
+        fwprintf(stderr, L"unknown durability: %s\n", argv[command]);
+        free(dokanOperations);
+        free(dokanOptions);
+        return EXIT_FAILURE;
+      }
+      break;
+    case L'e':
+      command++;
+#ifndef LKL_DEV_BLK_TYPE_DISCARD
+      fwprintf(stderr, L"/e needs an LKL built with block discard support\n");
+      free(dokanOperations);
+      free(dokanOptions);
+      return EXIT_FAILURE;
+#endif
+      discard_enabled = TRUE;
+      discard_batch_bytes = _wtoi64(argv[command]);
+      break;
+    case L'h':
+      disk_unbuffered = TRUE;
+      break;
+    case L'x':
+      disk_mapped = TRUE;
+      break;
+    case L'a':
+      command++;
+      if (parse_ram_layer(argv[command]) < 0) {
+        fwprintf(stderr, L"invalid ram layer: %s\n", argv[command]);
+        free(dokanOperations);
+        free(dokanOptions);
+        return EXIT_FAILURE;
+      }
+      break;
+    case L'p':
+      command++;
+      disk_partition = _wtoi(argv[command]);
+      if (disk_partition < 1) {
+        fwprintf(stderr, L"invalid partition: %s\n", argv[command]);
+        free(dokanOperations);
+        free(dokanOptions);
+        return EXIT_FAILURE;
+      }
+      break;
+    case L'k':
+      command++;
+      if (parse_disk_key(argv[command]) < 0) {
+        fwprintf(stderr, L"invalid key: %s\n", argv[command]);
+        free(dokanOperations);
+        free(dokanOptions);
+        return EXIT_FAILURE;
+      }
+      break;
+    case L'j':
+      command++;
+      disk_stripe_size = (uint64_t)_wtoi64(argv[command]) << 10;
+      if (!disk_stripe_size || disk_stripe_size % 512) {
+        fwprintf(stderr, L"invalid stripe size: %s\n", argv[command]);
+        free(dokanOperations);
+        free(dokanOptions);
+        return EXIT_FAILURE;
+      }
+      break;
+    case L'v':
+      command++;
+      wcscpy_s(delta_path, sizeof(delta_path) / sizeof(WCHAR), argv[command]);
+      break;
+    case L'b':
+      command++;
+      if (parse_disk_cache(argv[command]) < 0) {
+        fwprintf(stderr, L"invalid cache: %s\n", argv[command]);
+        free(dokanOperations);
+        free(dokanOptions);
+        return EXIT_FAILURE;
+      }
+      break;
+    case L'q':
+      command++;
+      if (parse_disk_queues(argv[command]) < 0) {
+        fwprintf(stderr, L"invalid queues: %s\n", argv[command]);
+        free(dokanOperations);
+        free(dokanOptions);
+        return EXIT_FAILURE;
+      }
+      break;
     default:
       fwprintf(stderr, L"unknown command: %s\n", argv[command]);
       free(dokanOperations);
@@ -950,20 +2979,25 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
   }
 
 
-  disk_handle = CreateFile(disk_path, GENERIC_READ|GENERIC_WRITE,
-                   FILE_SHARE_READ, NULL, OPEN_EXISTING,
-                   FILE_ATTRIBUTE_NORMAL, NULL);
-  if (disk_handle == INVALID_HANDLE_VALUE) {
-    fwprintf(stderr, L"Can't add disk: %s\n", L"Failed to open the file/device.");
+  if (disk_mapped && disk_unbuffered) {
+    fwprintf(stderr, L"/x and /h can't be used together.\n");
+    free(dokanOperations);
+    free(dokanOptions);
+    return -1;
+  }
+
+  ret = open_disk();
+  if (ret) {
+    fprintf(stderr, "Can't add disk: %s\n", strerror(-ret));
     free(dokanOperations);
     free(dokanOptions);
     return -1;
   }
-  lkl_disk.fd = disk_handle;
-  disk_id = lkl_disk_add(lkl_disk);
+
+  disk_id = disk_lkl_add(disk_dev);
   if (disk_id < 0) {
-    fprintf(stderr, "Can't add disk: %s\n", lkl_strerror(ret));
-    CloseHandle(disk_handle);
+    fprintf(stderr, "Can't add disk: %s\n", lkl_strerror(disk_id));
+    disk_close(disk_dev);
     free(dokanOperations);
     free(dokanOptions);
     return -1;
@@ -1063,11 +3097,11 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
     break;
   }
 
+  print_stats();
   stop_lkl();
 
 out:
-  if (disk_handle != INVALID_HANDLE_VALUE)
-    CloseHandle(disk_handle);
+  disk_close(disk_dev);
 
   free(dokanOptions);
   free(dokanOperations);
@@ -0,0 +1,844 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#include <winioctl.h>
+
+/*
+ * Image files are opened for overlapped I/O so that requests on different
+ * threads are not serialized on the handle; each thread waits for its own
+ * requests on a private event.
+ */
+static __thread HANDLE io_event;
+
+static int host_error(DWORD error)
+{
+  switch (error) {
+  case ERROR_FILE_NOT_FOUND:
+  case ERROR_PATH_NOT_FOUND:
+    return -ENOENT;
+  case ERROR_ACCESS_DENIED:
+  case ERROR_SHARING_VIOLATION:
+    return -EACCES;
+  case ERROR_NOT_ENOUGH_MEMORY:
+  case ERROR_OUTOFMEMORY:
+    return -ENOMEM;
+  case ERROR_DISK_FULL:
+  case ERROR_HANDLE_DISK_FULL:
+    return -ENOSPC;
+  case ERROR_INVALID_PARAMETER:
+    return -EINVAL;
+  case ERROR_NOT_SUPPORTED:
+  case ERROR_INVALID_FUNCTION:
+    return -EOPNOTSUPP;
+  default:
+    return -EIO;
+  }
+}
+
+static HANDLE host_io_event(void)
+{
+  if (!io_event)
+    io_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+  return io_event;
+}
+
+host_file_t host_file_open(const host_char_t *path, int flags, int *err)
+{
+  HANDLE file;
+  DWORD access = GENERIC_READ, disposition = OPEN_EXISTING;
+  DWORD attrs = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED;
+
+  if (!(flags & HOST_OPEN_READONLY))
+    access |= GENERIC_WRITE;
+  if (flags & HOST_OPEN_CREATE)
+    disposition = OPEN_ALWAYS;
+  if (flags & HOST_OPEN_UNBUFFERED)
+    attrs |= FILE_FLAG_NO_BUFFERING;
+  if (flags & HOST_OPEN_TEMPORARY) {
+    disposition = CREATE_ALWAYS;
+    attrs |= FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE;
+  }
+
+  file = CreateFileW(path, access, FILE_SHARE_READ, NULL,
+                     disposition, attrs, NULL);
+  if (file == INVALID_HANDLE_VALUE && err)
+    *err = host_error(GetLastError());
+
+  return file;
+}
+
+void host_file_close(host_file_t file)
+{
+  CloseHandle(file);
+}
+
+int host_file_size(host_file_t file, uint64_t *size)
+{
+  LARGE_INTEGER li;
+  GET_LENGTH_INFORMATION info;
+  DWORD ret;
+
+  if (GetFileSizeEx(file, &li)) {
+    *size = li.QuadPart;
+    return 0;
+  }
+
+  /* raw volumes and physical drives have no file size */
+  if (!DeviceIoControl(file, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0,
+                       &info, sizeof(info), &ret, NULL))
+    return host_error(GetLastError());
+
+  *size = info.Length.QuadPart;
+  return 0;
+}
+
+static int host_file_io(host_file_t file, void *buf, size_t len,
+                        uint64_t off, BOOL write)
+{
+  while (len) {
+    OVERLAPPED ov = { 0 };
+    DWORD chunk = len > 0x40000000 ? 0x40000000 : (DWORD)len;
+    DWORD done = 0;
+    BOOL ok;
+
+    ov.Offset = (DWORD)off;
+    ov.OffsetHigh = (DWORD)(off >> 32);
+    ov.hEvent = host_io_event();
+
+    if (write)
+      ok = WriteFile(file, buf, chunk, NULL, &ov);
+    else
+      ok = ReadFile(file, buf, chunk, NULL, &ov);
+
+    if (!ok && GetLastError() != ERROR_IO_PENDING)
+      ok = FALSE;
+    else
+      ok = GetOverlappedResult(file, &ov, &done, TRUE);
+
+    if (!ok) {
+      DWORD error = GetLastError();
+
+      if (write || error != ERROR_HANDLE_EOF)
+        return host_error(error);
+      done = 0;
+    }
+
+    if (!done) {
+      if (write)
+        return -EIO;
+      /* reads past the end of the image return zeroes */
+      memset(buf, 0, len);
+      return 0;
+    }
+
+    buf = (char *)buf + done;
+    len -= done;
+    off += done;
+  }
+
+  return 0;
+}
+
+int host_file_read(host_file_t file, void *buf, size_t len, uint64_t off)
+{
+  return host_file_io(file, buf, len, off, FALSE);
+}
+
+int host_file_write(host_file_t file, const void *buf, size_t len,
+                    uint64_t off)
+{
+  return host_file_io(file, (void *)buf, len, off, TRUE);
+}
+
+/*
+ * Windows has no positional scatter/gather I/O for buffered handles, so
+ * small vectors are gathered into one buffer to get a single host request.
+ * The buffer is sector aligned so that this works on unbuffered handles.
+ */
+#define HOST_GATHER_MAX (1024 * 1024)
+#define HOST_GATHER_ALIGN 4096
+
+int host_file_readv(host_file_t file, const struct host_iovec *iov,
+                    int iovcnt, uint64_t off)
+{
+  size_t len = 0;
+  char *buf, *p;
+  int i, ret;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].len;
+
+  buf = iovcnt > 1 && len <= HOST_GATHER_MAX ?
+        host_alloc_aligned(len, HOST_GATHER_ALIGN) : NULL;
+  if (!buf) {
+    for (i = 0; i < iovcnt; i++) {
+      ret = host_file_read(file, iov[i].base, iov[i].len, off);
+      if (ret)
+        return ret;
+      off += iov[i].len;
+    }
+    return 0;
+  }
+
+  ret = host_file_read(file, buf, len, off);
+  for (i = 0, p = buf; !ret && i < iovcnt; p += iov[i++].len)
+    memcpy(iov[i].base, p, iov[i].len);
+
+  host_free_aligned(buf);
+  return ret;
+}
+
+int host_file_writev(host_file_t file, const struct host_iovec *iov,
+                     int iovcnt, uint64_t off)
+{
+  size_t len = 0;
+  char *buf, *p;
+  int i, ret;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].len;
+
+  buf = iovcnt > 1 && len <= HOST_GATHER_MAX ?
+        host_alloc_aligned(len, HOST_GATHER_ALIGN) : NULL;
+  if (!buf) {
+    for (i = 0; i < iovcnt; i++) {
+      ret = host_file_write(file, iov[i].base, iov[i].len, off);
+      if (ret)
+        return ret;
+      off += iov[i].len;
+    }
+    return 0;
+  }
+
+  for (i = 0, p = buf; i < iovcnt; p += iov[i++].len)
+    memcpy(p, iov[i].base, iov[i].len);
+  ret = host_file_write(file, buf, len, off);
+
+  host_free_aligned(buf);
+  return ret;
+}
+
+int host_file_flush(host_file_t file)
+{
+  if (!FlushFileBuffers(file))
+    return host_error(GetLastError());
+  return 0;
+}
+
+/*
+ * NTFS only leaves unwritten ranges unallocated, and only deallocates
+ * ranges, in files flagged as sparse.
+ */
+int host_file_set_sparse(host_file_t file)
+{
+  FILE_SET_SPARSE_BUFFER sparse = { TRUE };
+  OVERLAPPED ov = { 0 };
+  DWORD ret;
+  BOOL ok;
+
+  ov.hEvent = host_io_event();
+  ok = DeviceIoControl(file, FSCTL_SET_SPARSE, &sparse, sizeof(sparse),
+                       NULL, 0, NULL, &ov);
+  if (ok || GetLastError() == ERROR_IO_PENDING)
+    ok = GetOverlappedResult(file, &ov, &ret, TRUE);
+  if (!ok)
+    return host_error(GetLastError());
+
+  return 0;
+}
+
+int host_file_punch_hole(host_file_t file, uint64_t off, uint64_t len)
+{
+  FILE_ZERO_DATA_INFORMATION zero;
+  OVERLAPPED ov = { 0 };
+  DWORD ret;
+  BOOL ok;
+  int err;
+
+  err = host_file_set_sparse(file);
+  if (err)
+    return err;
+
+  zero.FileOffset.QuadPart = off;
+  zero.BeyondFinalZero.QuadPart = off + len;
+  memset(&ov, 0, sizeof(ov));
+  ov.hEvent = host_io_event();
+  ok = DeviceIoControl(file, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero),
+                       NULL, 0, NULL, &ov);
+  if (ok || GetLastError() == ERROR_IO_PENDING)
+    ok = GetOverlappedResult(file, &ov, &ret, TRUE);
+  if (!ok)
+    return host_error(GetLastError());
+
+  return 0;
+}
+
+/*
+ * Finds the first allocated range of the file at or after off, [*data,
+ * *hole); -ENXIO if there is none.
+ */
+int host_file_next_data(host_file_t file, uint64_t off, uint64_t *data,
+                        uint64_t *hole)
+{
+  FILE_ALLOCATED_RANGE_BUFFER query, range;
+  OVERLAPPED ov = { 0 };
+  uint64_t size;
+  DWORD ret = 0;
+  BOOL ok;
+  int err;
+
+  err = host_file_size(file, &size);
+  if (err)
+    return err;
+  if (off >= size)
+    return -ENXIO;
+
+  /* only the first range is needed; the rest makes it ERROR_MORE_DATA */
+  query.FileOffset.QuadPart = off;
+  query.Length.QuadPart = size - off;
+  ov.hEvent = host_io_event();
+  ok = DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query,
+                       sizeof(query), &range, sizeof(range), NULL, &ov);
+  if (ok || GetLastError() == ERROR_IO_PENDING ||
+      GetLastError() == ERROR_MORE_DATA)
+    ok = GetOverlappedResult(file, &ov, &ret, TRUE);
+  if (!ok && GetLastError() != ERROR_MORE_DATA)
+    return host_error(GetLastError());
+  if (ret < sizeof(range))
+    return -ENXIO;
+
+  *data = (uint64_t)range.FileOffset.QuadPart;
+  if (*data < off)
+    *data = off;
+  *hole = (uint64_t)range.FileOffset.QuadPart + range.Length.QuadPart;
+  return 0;
+}
+
+int host_file_map(host_file_t file, uint64_t size, int readonly,
+                  struct host_map *map)
+{
+  map->mapping = CreateFileMapping(file, NULL,
+                                   readonly ? PAGE_READONLY : PAGE_READWRITE,
+                                   (DWORD)(size >> 32), (DWORD)size, NULL);
+  if (!map->mapping)
+    return host_error(GetLastError());
+
+  map->addr = MapViewOfFile(map->mapping,
+                            readonly ? FILE_MAP_READ : FILE_MAP_WRITE,
+                            0, 0, (SIZE_T)size);
+  if (!map->addr) {
+    int ret = host_error(GetLastError());
+
+    CloseHandle(map->mapping);
+    return ret;
+  }
+
+  map->size = size;
+  return 0;
+}
+
+/* Writes the dirty pages of the range back to the file. */
+int host_map_flush(struct host_map *map, uint64_t off, uint64_t len)
+{
+  if (!FlushViewOfFile((char *)map->addr + off, (SIZE_T)len))
+    return host_error(GetLastError());
+  return 0;
+}
+
+void host_file_unmap(struct host_map *map)
+{
+  UnmapViewOfFile(map->addr);
+  CloseHandle(map->mapping);
+}
+
+/* The sector size that unbuffered I/O has to be aligned to. */
+unsigned int host_file_sector_size(host_file_t file)
+{
+  FILE_STORAGE_INFO info;
+
+  if (!GetFileInformationByHandleEx(file, FileStorageInfo, &info,
+                                    sizeof(info)))
+    return 4096;
+
+  if (info.PhysicalBytesPerSectorForPerformance > info.LogicalBytesPerSector)
+    return info.PhysicalBytesPerSectorForPerformance;
+  return info.LogicalBytesPerSector;
+}
+
+void *host_alloc_aligned(size_t size, size_t align)
+{
+  return _aligned_malloc(size, align);
+}
+
+void host_free_aligned(void *buf)
+{
+  _aligned_free(buf);
+}
+
+void host_rwlock_init(host_rwlock_t *lock)
+{
+  InitializeSRWLock(lock);
+}
+
+void host_rwlock_read_lock(host_rwlock_t *lock)
+{
+  AcquireSRWLockShared(lock);
+}
+
+void host_rwlock_read_unlock(host_rwlock_t *lock)
+{
+  ReleaseSRWLockShared(lock);
+}
+
+void host_rwlock_write_lock(host_rwlock_t *lock)
+{
+  AcquireSRWLockExclusive(lock);
+}
+
+void host_rwlock_write_unlock(host_rwlock_t *lock)
+{
+  ReleaseSRWLockExclusive(lock);
+}
+
+void host_mutex_init(host_mutex_t *mutex)
+{
+  InitializeSRWLock(mutex);
+}
+
+void host_mutex_lock(host_mutex_t *mutex)
+{
+  AcquireSRWLockExclusive(mutex);
+}
+
+void host_mutex_unlock(host_mutex_t *mutex)
+{
+  ReleaseSRWLockExclusive(mutex);
+}
+
+void host_cond_init(host_cond_t *cond)
+{
+  InitializeConditionVariable(cond);
+}
+
+void host_cond_wait(host_cond_t *cond, host_mutex_t *mutex)
+{
+  SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+}
+
+void host_cond_signal(host_cond_t *cond)
+{
+  WakeConditionVariable(cond);
+}
+
+void host_cond_broadcast(host_cond_t *cond)
+{
+  WakeAllConditionVariable(cond);
+}
+
+struct host_thread_start {
+  void (*fn)(void *);
+  void *arg;
+};
+
+static DWORD WINAPI host_thread_main(LPVOID param)
+{
+  struct host_thread_start start = *(struct host_thread_start *)param;
+
+  free(param);
+  start.fn(start.arg);
+
+  if (io_event)
+    CloseHandle(io_event);
+  return 0;
+}
+
+int host_thread_create(host_thread_t *thread, void (*fn)(void *), void *arg)
+{
+  struct host_thread_start *start = malloc(sizeof(*start));
+
+  if (!start)
+    return -ENOMEM;
+
+  start->fn = fn;
+  start->arg = arg;
+  *thread = CreateThread(NULL, 0, host_thread_main, start, 0, NULL);
+  if (!*thread) {
+    free(start);
+    return host_error(GetLastError());
+  }
+
+  return 0;
+}
+
+void host_thread_join(host_thread_t thread)
+{
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+#else /* !_WIN32 */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+host_file_t host_file_open(const host_char_t *path, int flags, int *err)
+{
+  int oflags = flags & HOST_OPEN_READONLY ? O_RDONLY : O_RDWR;
+  int fd;
+
+  if (flags & HOST_OPEN_CREATE)
+    oflags |= O_CREAT;
+  if (flags & HOST_OPEN_UNBUFFERED)
+    oflags |= O_DIRECT;
+  if (flags & HOST_OPEN_TEMPORARY)
+    oflags |= O_CREAT | O_TRUNC;
+
+  fd = open(path, oflags | O_CLOEXEC, 0644);
+  if (fd < 0 && err)
+    *err = -errno;
+  if (fd >= 0 && (flags & HOST_OPEN_TEMPORARY))
+    unlink(path);
+
+  return fd;
+}
+
+void host_file_close(host_file_t file)
+{
+  close(file);
+}
+
+int host_file_size(host_file_t file, uint64_t *size)
+{
+  struct stat st;
+
+  if (fstat(file, &st) < 0)
+    return -errno;
+
+  if (S_ISBLK(st.st_mode)) {
+    if (ioctl(file, BLKGETSIZE64, size) < 0)
+      return -errno;
+    return 0;
+  }
+
+  *size = st.st_size;
+  return 0;
+}
+
+int host_file_read(host_file_t file, void *buf, size_t len, uint64_t off)
+{
+  while (len) {
+    ssize_t ret = pread(file, buf, len, off);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (!ret) {
+      /* reads past the end of the image return zeroes */
+      memset(buf, 0, len);
+      return 0;
+    }
+
+    buf = (char *)buf + ret;
+    len -= ret;
+    off += ret;
+  }
+
+  return 0;
+}
+
+int host_file_write(host_file_t file, const void *buf, size_t len,
+                    uint64_t off)
+{
+  while (len) {
+    ssize_t ret = pwrite(file, buf, len, off);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (!ret)
+      return -EIO;
+
+    buf = (const char *)buf + ret;
+    len -= ret;
+    off += ret;
+  }
+
+  return 0;
+}
+
+/*
+ * preadv/pwritev; a short transfer finishes the vector one segment at a
+ * time, which also takes care of reads past the end of the image.
+ */
+static int host_file_rwv(host_file_t file, const struct host_iovec *iov,
+                         int iovcnt, uint64_t off, int write)
+{
+  while (iovcnt) {
+    int cnt = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+    ssize_t ret;
+    int i;
+
+    if (write)
+      ret = pwritev(file, (const struct iovec *)iov, cnt, off);
+    else
+      ret = preadv(file, (const struct iovec *)iov, cnt, off);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+
+    for (i = 0; i < cnt; i++) {
+      size_t done = (size_t)ret < iov[i].len ? (size_t)ret : iov[i].len;
+      int err = 0;
+
+      if (done < iov[i].len) {
+        char *base = (char *)iov[i].base + done;
+
+        if (write)
+          err = host_file_write(file, base, iov[i].len - done, off + done);
+        else
+          err = host_file_read(file, base, iov[i].len - done, off + done);
+        if (err)
+          return err;
+      }
+
+      ret -= done;
+      off += iov[i].len;
+    }
+
+    iov += cnt;
+    iovcnt -= cnt;
+  }
+
+  return 0;
+}
+
+int host_file_readv(host_file_t file, const struct host_iovec *iov,
+                    int iovcnt, uint64_t off)
+{
+  return host_file_rwv(file, iov, iovcnt, off, 0);
+}
+
+int host_file_writev(host_file_t file, const struct host_iovec *iov,
+                     int iovcnt, uint64_t off)
+{
+  return host_file_rwv(file, iov, iovcnt, off, 1);
+}
+
+int host_file_flush(host_file_t file)
+{
+  if (fdatasync(file) < 0)
+    return -errno;
+  return 0;
+}
+
+/* POSIX files are sparse to begin with. */
+int host_file_set_sparse(host_file_t file)
+{
+  (void)file;
+  return 0;
+}
+
+int host_file_punch_hole(host_file_t file, uint64_t off, uint64_t len)
+{
+  if (fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                off, len) < 0)
+    return -errno;
+  return 0;
+}
+
+/*
+ * Finds the first allocated range of the file at or after off, [*data,
+ * *hole); -ENXIO if there is none.
+ */
+int host_file_next_data(host_file_t file, uint64_t off, uint64_t *data,
+                        uint64_t *hole)
+{
+  off_t ret;
+
+  ret = lseek(file, off, SEEK_DATA);
+  if (ret < 0)
+    return -errno;
+  *data = ret;
+
+  ret = lseek(file, ret, SEEK_HOLE);
+  if (ret < 0)
+    return -errno;
+  *hole = ret;
+
+  return 0;
+}
+
+int host_file_map(host_file_t file, uint64_t size, int readonly,
+                  struct host_map *map)
+{
+  map->addr = mmap(NULL, size, PROT_READ | (readonly ? 0 : PROT_WRITE),
+                   MAP_SHARED, file, 0);
+  if (map->addr == MAP_FAILED)
+    return -errno;
+
+  map->size = size;
+  return 0;
+}
+
+/* Writes the dirty pages of the range back to the file. */
+int host_map_flush(struct host_map *map, uint64_t off, uint64_t len)
+{
+  uint64_t start = off & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+
+  if (msync((char *)map->addr + start, len + off - start, MS_SYNC) < 0)
+    return -errno;
+  return 0;
+}
+
+void host_file_unmap(struct host_map *map)
+{
+  munmap(map->addr, map->size);
+}
+
+/* The sector size that unbuffered I/O has to be aligned to. */
+unsigned int host_file_sector_size(host_file_t file)
+{
+  struct stat st;
+  int size;
+
+  if (!fstat(file, &st) && S_ISBLK(st.st_mode) &&
+      !ioctl(file, BLKPBSZGET, &size) && size > 0)
+    return size;
+
+  /* regular files: the usual file system block size is a safe bet */
+  return 4096;
+}
+
+void *host_alloc_aligned(size_t size, size_t align)
+{
+  void *buf;
+
+  if (posix_memalign(&buf, align, size))
+    return NULL;
+  return buf;
+}
+
+void host_free_aligned(void *buf)
+{
+  free(buf);
+}
+
+void host_rwlock_init(host_rwlock_t *lock)
+{
+  pthread_rwlock_init(lock, NULL);
+}
+
+void host_rwlock_read_lock(host_rwlock_t *lock)
+{
+  pthread_rwlock_rdlock(lock);
+}
+
+void host_rwlock_read_unlock(host_rwlock_t *lock)
+{
+  pthread_rwlock_unlock(lock);
+}
+
+void host_rwlock_write_lock(host_rwlock_t *lock)
+{
+  pthread_rwlock_wrlock(lock);
+}
+
+void host_rwlock_write_unlock(host_rwlock_t *lock)
+{
+  pthread_rwlock_unlock(lock);
+}
+
+void host_mutex_init(host_mutex_t *mutex)
+{
+  pthread_mutex_init(mutex, NULL);
+}
+
+void host_mutex_lock(host_mutex_t *mutex)
+{
+  pthread_mutex_lock(mutex);
+}
+
+void host_mutex_unlock(host_mutex_t *mutex)
+{
+  pthread_mutex_unlock(mutex);
+}
+
+void host_cond_init(host_cond_t *cond)
+{
+  pthread_cond_init(cond, NULL);
+}
+
+void host_cond_wait(host_cond_t *cond, host_mutex_t *mutex)
+{
+  pthread_cond_wait(cond, mutex);
+}
+
+void host_cond_signal(host_cond_t *cond)
+{
+  pthread_cond_signal(cond);
+}
+
+void host_cond_broadcast(host_cond_t *cond)
+{
+  pthread_cond_broadcast(cond);
+}
+
+struct host_thread_start {
+  void (*fn)(void *);
+  void *arg;
+};
+
+static void *host_thread_main(void *param)
+{
+  struct host_thread_start start = *(struct host_thread_start *)param;
+
+  free(param);
+  start.fn(start.arg);
+  return NULL;
+}
+
+int host_thread_create(host_thread_t *thread, void (*fn)(void *), void *arg)
+{
+  struct host_thread_start *start = malloc(sizeof(*start));
+  int ret;
+
+  if (!start)
+    return -ENOMEM;
+
+  start->fn = fn;
+  start->arg = arg;
+  ret = pthread_create(thread, NULL, host_thread_main, start);
+  if (ret) {
+    free(start);
+    return -ret;
+  }
+
+  return 0;
+}
+
+void host_thread_join(host_thread_t thread)
+{
+  pthread_join(thread, NULL);
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,115 @@
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+
+/*
+ * Thin layer over the host OS used by the disk backends, so that they can be
+ * built against the Windows and the POSIX flavours of liblkl alike.  All
+ * functions return 0 or a negative errno value.
+ */
+
+#ifdef _WIN32
+#include <Windows.h>
+
+typedef HANDLE host_file_t;
+typedef WCHAR host_char_t;
+typedef SRWLOCK host_rwlock_t;
+typedef SRWLOCK host_mutex_t;
+typedef CONDITION_VARIABLE host_cond_t;
+typedef HANDLE host_thread_t;
+
+#define HOST_INVALID_FILE INVALID_HANDLE_VALUE
+#define HOST_RWLOCK_INIT SRWLOCK_INIT
+#else
+#include <pthread.h>
+
+typedef int host_file_t;
+typedef char host_char_t;
+typedef pthread_rwlock_t host_rwlock_t;
+typedef pthread_mutex_t host_mutex_t;
+typedef pthread_cond_t host_cond_t;
+typedef pthread_t host_thread_t;
+
+#define HOST_INVALID_FILE (-1)
+#define HOST_RWLOCK_INIT PTHREAD_RWLOCK_INITIALIZER
+#endif
+
+#ifndef EOPNOTSUPP
+#define EOPNOTSUPP 95
+#endif
+
+#ifdef _WIN32
+#define host_atomic_add(p, v) \
+  InterlockedExchangeAdd64((volatile LONG64 *)(p), (v))
+#else
+#define host_atomic_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#endif
+
+/* same layout as the POSIX struct iovec */
+struct host_iovec {
+  void *base;
+  size_t len;
+};
+
+#define HOST_OPEN_READONLY 0x1
+#define HOST_OPEN_CREATE 0x2
+/* bypass the host page cache; I/O must be sector aligned */
+#define HOST_OPEN_UNBUFFERED 0x4
+/* create a new file that goes away once closed */
+#define HOST_OPEN_TEMPORARY 0x8
+
+host_file_t host_file_open(const host_char_t *path, int flags, int *err);
+void host_file_close(host_file_t file);
+int host_file_size(host_file_t file, uint64_t *size);
+int host_file_read(host_file_t file, void *buf, size_t len, uint64_t off);
+int host_file_write(host_file_t file, const void *buf, size_t len,
+                    uint64_t off);
+int host_file_readv(host_file_t file, const struct host_iovec *iov,
+                    int iovcnt, uint64_t off);
+int host_file_writev(host_file_t file, const struct host_iovec *iov,
+                     int iovcnt, uint64_t off);
+int host_file_flush(host_file_t file);
+int host_file_set_sparse(host_file_t file);
+int host_file_punch_hole(host_file_t file, uint64_t off, uint64_t len);
+int host_file_next_data(host_file_t file, uint64_t off, uint64_t *data,
+                        uint64_t *hole);
+unsigned int host_file_sector_size(host_file_t file);
+
+/* a whole file mapped shared into the address space */
+struct host_map {
+  void *addr;
+  uint64_t size;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+};
+
+int host_file_map(host_file_t file, uint64_t size, int readonly,
+                  struct host_map *map);
+int host_map_flush(struct host_map *map, uint64_t off, uint64_t len);
+void host_file_unmap(struct host_map *map);
+
+void *host_alloc_aligned(size_t size, size_t align);
+void host_free_aligned(void *buf);
+
+void host_rwlock_init(host_rwlock_t *lock);
+void host_rwlock_read_lock(host_rwlock_t *lock);
+void host_rwlock_read_unlock(host_rwlock_t *lock);
+void host_rwlock_write_lock(host_rwlock_t *lock);
+void host_rwlock_write_unlock(host_rwlock_t *lock);
+
+void host_mutex_init(host_mutex_t *mutex);
+void host_mutex_lock(host_mutex_t *mutex);
+void host_mutex_unlock(host_mutex_t *mutex);
+void host_cond_init(host_cond_t *cond);
+void host_cond_wait(host_cond_t *cond, host_mutex_t *mutex);
+void host_cond_signal(host_cond_t *cond);
+void host_cond_broadcast(host_cond_t *cond);
+
+int host_thread_create(host_thread_t *thread, void (*fn)(void *), void *arg);
+void host_thread_join(host_thread_t thread);
+
+#endif /* _HOST_H */
@@ -0,0 +1,11 @@
+#!/bin/sh
+# Builds the tests on Linux. They need a Linux build of liblkl, with its
+# headers laid out as for compile.sh under $LKL (default: the source tree).
+# dokany-lkl.c hands WCHAR image paths to host_file_open, which takes char
+# paths on Linux; fs-test opens the image itself, hence the -Wno.
+cd "$(dirname "$0")"
+LKL=${LKL:-..}
+${CC:=gcc} -g -O2 -Icompat -I../include -I$LKL/include -I$LKL/include/lkl -L$LKL -D_UNICODE -Wno-incompatible-pointer-types fs-test.c ../utils.c ../host.c ../disk.c ../disk-mq.c ../disk-cache.c ../disk-mmap.c ../disk-overlay.c ../disk-ram.c ../disk-chunk.c ../disk-vhd.c ../disk-part.c ../disk-stripe.c ../disk-crypt.c -llkl -llz4 -lpthread -lrt -o fs-test
+${CC} -g -O2 -I$LKL/include -I$LKL/include/lkl -L$LKL vhd-test.c ../host.c ../disk.c ../disk-vhd.c -llkl -lpthread -lrt -o vhd-test
+${CC} -g -O2 -I$LKL/include -I$LKL/include/lkl -L$LKL part-test.c ../host.c ../disk.c ../disk-part.c -llkl -lpthread -lrt -o part-test
+${CC} -g -O2 -I$LKL/include -I$LKL/include/lkl -L$LKL crypt-bench.c ../host.c ../disk.c ../disk-crypt.c -llkl -lpthread -lrt -o crypt-bench
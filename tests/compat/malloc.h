@@ -0,0 +1,19 @@
+#ifndef _COMPAT_MALLOC_H
+#define _COMPAT_MALLOC_H
+
+#include_next <malloc.h>
+#include <stdlib.h>
+
+#define _malloca(size) malloc(size)
+#define _freea(p) free(p)
+
+static inline void *_aligned_malloc(size_t size, size_t align)
+{
+  void *p;
+
+  return posix_memalign(&p, align, size) ? NULL : p;
+}
+
+#define _aligned_free(p) free(p)
+
+#endif /* _COMPAT_MALLOC_H */
@@ -0,0 +1,513 @@
+/*
+ * Just enough of the Win32 API, over pthreads and the C library, to build
+ * dokany-lkl.c and utils.c on Linux for the tests.  Only what those files
+ * use is here, with the semantics they rely on.
+ */
+#ifndef _COMPAT_WINDOWS_H
+#define _COMPAT_WINDOWS_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#define WINAPI
+#define __cdecl
+#define __stdcall
+#define __declspec(x)
+#define CONST const
+#define MAX_PATH 260
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define CP_UTF8 65001
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+typedef int BOOL;
+typedef unsigned char UCHAR, BYTE, BOOLEAN;
+typedef char CCHAR;
+typedef unsigned short USHORT, WORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG, *PULONG, DWORD, *LPDWORD, ACCESS_MASK;
+typedef DWORD SECURITY_INFORMATION, *PSECURITY_INFORMATION;
+typedef long long LONGLONG, LONG64;
+typedef unsigned long long ULONGLONG, ULONG64, *PULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef wchar_t WCHAR, *PWCHAR, *PWSTR, *LPWSTR;
+typedef const wchar_t *LPCWSTR;
+typedef void *LPVOID, *HANDLE, *PSECURITY_DESCRIPTOR;
+typedef const void *LPCVOID;
+typedef LONG NTSTATUS;
+
+typedef union {
+  struct {
+    DWORD LowPart;
+    LONG HighPart;
+  };
+  LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct {
+  DWORD dwLowDateTime;
+  DWORD dwHighDateTime;
+} FILETIME, *PFILETIME, *LPFILETIME;
+
+typedef struct {
+  DWORD dwFileAttributes;
+  FILETIME ftCreationTime;
+  FILETIME ftLastAccessTime;
+  FILETIME ftLastWriteTime;
+  DWORD dwVolumeSerialNumber;
+  DWORD nFileSizeHigh;
+  DWORD nFileSizeLow;
+  DWORD nNumberOfLinks;
+  DWORD nFileIndexHigh;
+  DWORD nFileIndexLow;
+} BY_HANDLE_FILE_INFORMATION, *LPBY_HANDLE_FILE_INFORMATION;
+
+typedef struct {
+  DWORD dwFileAttributes;
+  FILETIME ftCreationTime;
+  FILETIME ftLastAccessTime;
+  FILETIME ftLastWriteTime;
+  DWORD nFileSizeHigh;
+  DWORD nFileSizeLow;
+  DWORD dwReserved0;
+  DWORD dwReserved1;
+  WCHAR cFileName[MAX_PATH];
+  WCHAR cAlternateFileName[14];
+} WIN32_FIND_DATAW, *PWIN32_FIND_DATAW, *LPWIN32_FIND_DATAW;
+
+typedef struct {
+  LARGE_INTEGER StreamSize;
+  WCHAR cStreamName[MAX_PATH + 36];
+} WIN32_FIND_STREAM_DATA, *PWIN32_FIND_STREAM_DATA;
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+
+#define FILE_SHARE_READ 0x1
+#define FILE_SHARE_WRITE 0x2
+#define FILE_SHARE_DELETE 0x4
+
+#define FILE_ATTRIBUTE_READONLY 0x1
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_ATTRIBUTE_TEMPORARY 0x100
+
+#define FILE_CASE_SENSITIVE_SEARCH 0x1
+#define FILE_CASE_PRESERVED_NAMES 0x2
+#define FILE_UNICODE_ON_DISK 0x4
+#define FILE_PERSISTENT_ACLS 0x8
+#define FILE_SUPPORTS_REMOTE_STORAGE 0x100
+
+#define UNREFERENCED_PARAMETER(x) ((void)(x))
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#define CopyMemory(d, s, n) memcpy((d), (s), (n))
+#define Int32x32To64(a, b) ((LONGLONG)(LONG)(a) * (LONG)(b))
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+static inline void *SecureZeroMemory(void *p, size_t n)
+{
+  volatile char *v = p;
+
+  while (n--)
+    *v++ = 0;
+  return p;
+}
+
+#define InterlockedIncrement(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v) \
+  __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, v, cmp) \
+  __sync_val_compare_and_swap((p), (cmp), (v))
+#define InterlockedAdd64(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+
+/*
+ * Slim reader/writer locks.  A condition variable sleeps with the lock
+ * held exclusively, which is all dokany-lkl.c does.
+ */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int readers;
+  int writer;
+} SRWLOCK, *PSRWLOCK;
+
+#define SRWLOCK_INIT \
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 }
+
+typedef struct {
+  pthread_cond_t cond;
+} CONDITION_VARIABLE, *PCONDITION_VARIABLE;
+
+#define CONDITION_VARIABLE_INIT { PTHREAD_COND_INITIALIZER }
+
+static inline void InitializeSRWLock(PSRWLOCK lock)
+{
+  pthread_mutex_init(&lock->mutex, NULL);
+  pthread_cond_init(&lock->cond, NULL);
+  lock->readers = 0;
+  lock->writer = 0;
+}
+
+static inline void AcquireSRWLockShared(PSRWLOCK lock)
+{
+  pthread_mutex_lock(&lock->mutex);
+  while (lock->writer)
+    pthread_cond_wait(&lock->cond, &lock->mutex);
+  lock->readers++;
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline void ReleaseSRWLockShared(PSRWLOCK lock)
+{
+  pthread_mutex_lock(&lock->mutex);
+  if (!--lock->readers)
+    pthread_cond_broadcast(&lock->cond);
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline void AcquireSRWLockExclusive(PSRWLOCK lock)
+{
+  pthread_mutex_lock(&lock->mutex);
+  while (lock->writer || lock->readers)
+    pthread_cond_wait(&lock->cond, &lock->mutex);
+  lock->writer = 1;
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline void ReleaseSRWLockExclusive(PSRWLOCK lock)
+{
+  pthread_mutex_lock(&lock->mutex);
+  lock->writer = 0;
+  pthread_cond_broadcast(&lock->cond);
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline struct timespec compat_deadline(DWORD ms)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return ts;
+}
+
+/*
+ * The lock's mutex is held from giving up the lock until the wait starts,
+ * and a waker needs the lock to change what is waited for, so no wakeup
+ * gets lost.
+ */
+static inline BOOL SleepConditionVariableSRW(PCONDITION_VARIABLE cv,
+                                             PSRWLOCK lock, DWORD ms,
+                                             ULONG flags)
+{
+  struct timespec ts;
+  int ret = 0;
+
+  (void)flags;
+  pthread_mutex_lock(&lock->mutex);
+  lock->writer = 0;
+  pthread_cond_broadcast(&lock->cond);
+  if (ms == INFINITE) {
+    ret = pthread_cond_wait(&cv->cond, &lock->mutex);
+  } else {
+    ts = compat_deadline(ms);
+    ret = pthread_cond_timedwait(&cv->cond, &lock->mutex, &ts);
+  }
+  while (lock->writer || lock->readers)
+    pthread_cond_wait(&lock->cond, &lock->mutex);
+  lock->writer = 1;
+  pthread_mutex_unlock(&lock->mutex);
+
+  return ret != ETIMEDOUT;
+}
+
+static inline void WakeAllConditionVariable(PCONDITION_VARIABLE cv)
+{
+  pthread_cond_broadcast(&cv->cond);
+}
+
+/* Threads and events are the only handles. */
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+
+struct compat_handle {
+  BOOL is_thread;
+  pthread_t thread;
+  BOOL joined;
+  LPTHREAD_START_ROUTINE start;
+  LPVOID arg;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  BOOL manual_reset;
+  BOOL signaled;
+};
+
+static inline void *compat_thread_main(void *arg)
+{
+  struct compat_handle *h = arg;
+
+  h->start(h->arg);
+  return NULL;
+}
+
+static inline HANDLE CreateThread(void *attr, size_t stack_size,
+                                  LPTHREAD_START_ROUTINE start, LPVOID arg,
+                                  DWORD flags, LPDWORD id)
+{
+  struct compat_handle *h = calloc(1, sizeof(*h));
+
+  (void)attr;
+  (void)stack_size;
+  (void)flags;
+  (void)id;
+  if (!h)
+    return NULL;
+
+  h->is_thread = TRUE;
+  h->start = start;
+  h->arg = arg;
+  if (pthread_create(&h->thread, NULL, compat_thread_main, h)) {
+    free(h);
+    return NULL;
+  }
+  return h;
+}
+
+static inline HANDLE CreateEvent(void *attr, BOOL manual_reset,
+                                 BOOL initial_state, LPCWSTR name)
+{
+  struct compat_handle *h = calloc(1, sizeof(*h));
+
+  (void)attr;
+  (void)name;
+  if (!h)
+    return NULL;
+
+  pthread_mutex_init(&h->mutex, NULL);
+  pthread_cond_init(&h->cond, NULL);
+  h->manual_reset = manual_reset;
+  h->signaled = initial_state;
+  return h;
+}
+
+static inline BOOL SetEvent(HANDLE handle)
+{
+  struct compat_handle *h = handle;
+
+  pthread_mutex_lock(&h->mutex);
+  h->signaled = TRUE;
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->mutex);
+  return TRUE;
+}
+
+static inline DWORD WaitForSingleObject(HANDLE handle, DWORD ms)
+{
+  struct compat_handle *h = handle;
+  struct timespec ts;
+  DWORD ret = WAIT_OBJECT_0;
+
+  if (h->is_thread) {
+    if (!h->joined)
+      pthread_join(h->thread, NULL);
+    h->joined = TRUE;
+    return WAIT_OBJECT_0;
+  }
+
+  ts = compat_deadline(ms);
+  pthread_mutex_lock(&h->mutex);
+  while (!h->signaled && ret == WAIT_OBJECT_0) {
+    if (ms == INFINITE)
+      pthread_cond_wait(&h->cond, &h->mutex);
+    else if (pthread_cond_timedwait(&h->cond, &h->mutex, &ts) == ETIMEDOUT)
+      ret = WAIT_TIMEOUT;
+  }
+  if (ret == WAIT_OBJECT_0 && !h->manual_reset)
+    h->signaled = FALSE;
+  pthread_mutex_unlock(&h->mutex);
+  return ret;
+}
+
+static inline BOOL CloseHandle(HANDLE handle)
+{
+  struct compat_handle *h = handle;
+
+  if (h->is_thread && !h->joined)
+    pthread_detach(h->thread);
+  free(h);
+  return TRUE;
+}
+
+static inline void Sleep(DWORD ms)
+{
+  struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000 };
+
+  nanosleep(&ts, NULL);
+}
+
+static inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq)
+{
+  freq->QuadPart = 1000000000;
+  return TRUE;
+}
+
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  count->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  return TRUE;
+}
+
+/*
+ * UTF-8 from and to UTF-32 wchar_t.  Both count the terminator, as they
+ * are only ever called with a length of -1.
+ */
+static inline int MultiByteToWideChar(unsigned int cp, DWORD flags,
+                                      const char *src, int src_len,
+                                      WCHAR *dst, int dst_len)
+{
+  const unsigned char *s = (const unsigned char *)src;
+  int n = 0;
+
+  (void)cp;
+  (void)flags;
+  (void)src_len;
+  for (;;) {
+    uint32_t c = *s++;
+    int more = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+
+    if (more)
+      c &= 0x3f >> more;
+    while (more--) {
+      if ((*s & 0xc0) != 0x80)
+        return 0;
+      c = c << 6 | (*s++ & 0x3f);
+    }
+
+    if (dst) {
+      if (n >= dst_len)
+        return 0;
+      dst[n] = c;
+    }
+    n++;
+    if (!c)
+      return n;
+  }
+}
+
+static inline int WideCharToMultiByte(unsigned int cp, DWORD flags,
+                                      const WCHAR *src, int src_len,
+                                      char *dst, int dst_len,
+                                      const char *def, BOOL *used_def)
+{
+  char buf[4];
+  int n = 0, i, len;
+
+  (void)cp;
+  (void)flags;
+  (void)src_len;
+  (void)def;
+  (void)used_def;
+  for (;; src++) {
+    uint32_t c = *src;
+
+    if (c < 0x80) {
+      buf[0] = c;
+      len = 1;
+    } else if (c < 0x800) {
+      buf[0] = 0xc0 | c >> 6;
+      buf[1] = 0x80 | (c & 0x3f);
+      len = 2;
+    } else if (c < 0x10000) {
+      buf[0] = 0xe0 | c >> 12;
+      buf[1] = 0x80 | (c >> 6 & 0x3f);
+      buf[2] = 0x80 | (c & 0x3f);
+      len = 3;
+    } else {
+      buf[0] = 0xf0 | c >> 18;
+      buf[1] = 0x80 | (c >> 12 & 0x3f);
+      buf[2] = 0x80 | (c >> 6 & 0x3f);
+      buf[3] = 0x80 | (c & 0x3f);
+      len = 4;
+    }
+
+    for (i = 0; i < len; i++, n++) {
+      if (dst) {
+        if (n >= dst_len)
+          return 0;
+        dst[n] = buf[i];
+      }
+    }
+    if (!c)
+      return n;
+  }
+}
+
+#define _wtoi(s) ((int)wcstol((s), NULL, 10))
+#define _wtol(s) ((LONG)wcstol((s), NULL, 10))
+#define _wtoi64(s) ((LONGLONG)wcstoll((s), NULL, 10))
+
+static inline int wcscpy_s(WCHAR *dst, size_t size, const WCHAR *src)
+{
+  if (wcslen(src) >= size)
+    return ERANGE;
+  wcscpy(dst, src);
+  return 0;
+}
+
+static inline int _vscwprintf(const WCHAR *format, va_list ap)
+{
+  size_t size = 256;
+  WCHAR *buf = NULL;
+  va_list aq;
+  int ret = -1;
+
+  while (size <= (1 << 20)) {
+    buf = realloc(buf, size * sizeof(WCHAR));
+    if (!buf)
+      return -1;
+
+    va_copy(aq, ap);
+    ret = vswprintf(buf, size, format, aq);
+    va_end(aq);
+    if (ret >= 0)
+      break;
+    size *= 2;
+  }
+
+  free(buf);
+  return ret;
+}
+
+#define vswprintf_s(buf, size, format, ap) vswprintf(buf, size, format, ap)
+
+static inline void OutputDebugStringW(LPCWSTR s)
+{
+  fputws(s, stderr);
+}
+
+#endif /* _COMPAT_WINDOWS_H */
@@ -0,0 +1,175 @@
+/*
+ * Throughput of the encryption layer against the plain image under it:
+ * sequential writes and reads in 1 MiB requests and random 4 KiB reads,
+ * first on the raw image, then through disk_crypt_open over the same file.
+ *
+ *   crypt-bench IMAGE [MIB [unbuffered]]
+ *
+ * IMAGE is created or overwritten.  Buffered, the image mostly stays in the
+ * host page cache, so the difference is the cost of the cipher itself.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../disk.h"
+
+#define SEQ_LEN (1 << 20)
+#define RANDOM_LEN 4096
+#define NR_RANDOM 16384
+
+struct result {
+  double write;          /* MiB/s */
+  double read;
+  double random;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(struct disk_dev *dev, char *buf, struct result *r)
+{
+  struct disk_iovec iov;
+  uint64_t off, nr = dev->size / RANDOM_LEN;
+  double start;
+  int i, ret = 0;
+
+  iov.base = buf;
+  iov.len = SEQ_LEN;
+  start = now();
+  for (off = 0; !ret && off + SEQ_LEN <= dev->size; off += SEQ_LEN)
+    ret = disk_write(dev, &iov, 1, off);
+  if (!ret)
+    ret = disk_flush(dev);
+  r->write = (double)off / SEQ_LEN / (now() - start);
+
+  start = now();
+  for (off = 0; !ret && off + SEQ_LEN <= dev->size; off += SEQ_LEN)
+    ret = disk_read(dev, &iov, 1, off);
+  r->read = (double)off / SEQ_LEN / (now() - start);
+
+  iov.len = RANDOM_LEN;
+  srand(1);
+  start = now();
+  for (i = 0; !ret && i < NR_RANDOM; i++)
+    ret = disk_read(dev, &iov, 1, (uint64_t)(rand() % nr) * RANDOM_LEN);
+  r->random = (double)i * RANDOM_LEN / (1 << 20) / (now() - start);
+
+  return ret;
+}
+
+static struct disk_dev *open_image(const char *path, uint64_t size,
+                                   int unbuffered, int fill, const char *buf)
+{
+  struct disk_dev *dev;
+  struct disk_iovec iov;
+  host_file_t file;
+  uint64_t off;
+  int ret;
+
+  file = host_file_open(path, HOST_OPEN_CREATE |
+                        (unbuffered ? HOST_OPEN_UNBUFFERED : 0), &ret);
+  if (file == HOST_INVALID_FILE)
+    goto out;
+
+  /* sizes the image */
+  ret = host_file_write(file, buf, RANDOM_LEN, size - RANDOM_LEN);
+  if (ret) {
+    host_file_close(file);
+    goto out;
+  }
+
+  dev = disk_raw_open(file, unbuffered ? DISK_F_UNBUFFERED : 0, &ret);
+  if (!dev)
+    goto out;
+
+  /* Both passes overwrite blocks the host filesystem already allocated. */
+  iov.base = (void *)buf;
+  iov.len = SEQ_LEN;
+  for (off = 0; fill && !ret && off + SEQ_LEN <= size; off += SEQ_LEN)
+    ret = disk_write(dev, &iov, 1, off);
+  if (!ret)
+    return dev;
+
+  disk_close(dev);
+out:
+  fprintf(stderr, "can't open %s: %s\n", path, strerror(-ret));
+  return NULL;
+}
+
+static double overhead(double plain, double crypt)
+{
+  return (plain / crypt - 1) * 100;
+}
+
+int main(int argc, char **argv)
+{
+  struct disk_dev *dev, *crypt;
+  struct result plain, xts;
+  uint8_t key[64];
+  uint64_t size;
+  int i, unbuffered, ret;
+  char *buf;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s IMAGE [MIB [unbuffered]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  size = (uint64_t)(argc > 2 ? atoi(argv[2]) : 256) << 20;
+  unbuffered = argc > 3 && !strcmp(argv[3], "unbuffered");
+  if (size < SEQ_LEN)
+    return EXIT_FAILURE;
+
+  buf = host_alloc_aligned(SEQ_LEN, 4096);
+  if (!buf)
+    return EXIT_FAILURE;
+  for (i = 0; i < SEQ_LEN; i++)
+    buf[i] = (char)rand();
+
+  dev = open_image(argv[1], size, unbuffered, 1, buf);
+  if (!dev)
+    return EXIT_FAILURE;
+  ret = bench(dev, buf, &plain);
+  disk_close(dev);
+  if (ret) {
+    fprintf(stderr, "plain: %s\n", strerror(-ret));
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < 64; i++)
+    key[i] = (uint8_t)(i * 7 + 1);
+  dev = open_image(argv[1], size, unbuffered, 0, buf);
+  if (!dev)
+    return EXIT_FAILURE;
+  crypt = disk_crypt_open(dev, key, sizeof(key), &ret);
+  if (!crypt) {
+    fprintf(stderr, "can't open the encryption layer: %s\n", strerror(-ret));
+    disk_close(dev);
+    return EXIT_FAILURE;
+  }
+  ret = bench(crypt, buf, &xts);
+  disk_close(crypt);
+  if (ret) {
+    fprintf(stderr, "xts: %s\n", strerror(-ret));
+    return EXIT_FAILURE;
+  }
+
+  printf("%llu MiB %s image, MiB/s:  seq write  seq read  4K random read\n",
+         (unsigned long long)(size >> 20),
+         unbuffered ? "unbuffered" : "buffered");
+  printf("plain                        %9.1f %9.1f %15.1f\n",
+         plain.write, plain.read, plain.random);
+  printf("xts-aes-256                  %9.1f %9.1f %15.1f\n",
+         xts.write, xts.read, xts.random);
+  printf("overhead                     %8.1f%% %8.1f%% %14.1f%%\n",
+         overhead(plain.write, xts.write), overhead(plain.read, xts.read),
+         overhead(plain.random, xts.random));
+
+  host_free_aligned(buf);
+  return EXIT_SUCCESS;
+}
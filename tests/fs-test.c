@@ -0,0 +1,776 @@
+/*
+ * Drives the Dokan callbacks of dokany-lkl.c against an ext4 image mounted
+ * with LKL, on Linux and without Dokan: the Win32 calls come from compat/.
+ * Each mode checks or measures one thing and mounts a fresh image:
+ *
+ *   fs-test IMAGE mount            a file written and read back
+ *   fs-test IMAGE prealloc         allocation size and preallocation handling
+ *   fs-test IMAGE writethrough [N] flushed appends, cached vs write-through
+ *   fs-test IMAGE durability LEVEL [THREADS [N]]
+ *                                  flush-heavy workloads at a durability level
+ *   fs-test IMAGE extents [MIB]    extents and read-back of copied files
+ *
+ * Exits non-zero if a check fails.
+ */
+#include "../dokany-lkl.c"
+
+int DOKANAPI DokanMain(PDOKAN_OPTIONS DokanOptions,
+                       PDOKAN_OPERATIONS DokanOperations)
+{
+  UNREFERENCED_PARAMETER(DokanOptions);
+  UNREFERENCED_PARAMETER(DokanOperations);
+  return DOKAN_START_ERROR;
+}
+
+static volatile LONG failures;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      InterlockedIncrement(&failures);                                  \
+    }                                                                   \
+  } while (0)
+
+#define SHARE_ALL (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE)
+
+/* An open file as Dokan keeps it, from CreateFile until CloseFile. */
+struct handle {
+  const WCHAR *name;
+  DOKAN_FILE_INFO info;
+};
+
+static NTSTATUS h_open(struct handle *h, const WCHAR *name, ULONG share,
+                       ULONG disposition, ULONG options)
+{
+  ZeroMemory(&h->info, sizeof(h->info));
+  h->name = name;
+  return LklCreateFile(name, NULL, GENERIC_READ | GENERIC_WRITE,
+                       FILE_ATTRIBUTE_NORMAL, share, disposition, options,
+                       &h->info);
+}
+
+static NTSTATUS h_write(struct handle *h, const void *buf, DWORD len,
+                        LONGLONG off)
+{
+  DWORD done = 0;
+  NTSTATUS status;
+
+  status = LklWriteFile(h->name, buf, len, &done, off, &h->info);
+  if (status == STATUS_SUCCESS && done != len)
+    status = STATUS_UNSUCCESSFUL;
+  return status;
+}
+
+static NTSTATUS h_read(struct handle *h, void *buf, DWORD len, LONGLONG off)
+{
+  DWORD done = 0;
+  NTSTATUS status;
+
+  status = LklReadFile(h->name, buf, len, &done, off, &h->info);
+  if (status == STATUS_SUCCESS && done != len)
+    status = STATUS_UNSUCCESSFUL;
+  return status;
+}
+
+/* Paging I/O is what the cache manager sends, also after Cleanup. */
+static NTSTATUS h_paging_write(struct handle *h, const void *buf, DWORD len,
+                               LONGLONG off)
+{
+  NTSTATUS status;
+
+  h->info.PagingIo = 1;
+  status = h_write(h, buf, len, off);
+  h->info.PagingIo = 0;
+  return status;
+}
+
+static NTSTATUS h_paging_read(struct handle *h, void *buf, DWORD len,
+                              LONGLONG off)
+{
+  NTSTATUS status;
+
+  h->info.PagingIo = 1;
+  status = h_read(h, buf, len, off);
+  h->info.PagingIo = 0;
+  return status;
+}
+
+static void h_cleanup(struct handle *h)
+{
+  LklCleanup(h->name, &h->info);
+}
+
+static void h_close(struct handle *h)
+{
+  LklCloseFile(h->name, &h->info);
+}
+
+static void fill(char *buf, size_t len, unsigned int seed)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    buf[i] = (char)(i * 31 + seed + i / 4096);
+}
+
+/* Whether buf holds what fill() put there. */
+static BOOL filled(const char *buf, size_t len, unsigned int seed)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    if (buf[i] != (char)(i * 31 + seed + i / 4096))
+      return FALSE;
+  return TRUE;
+}
+
+static long long file_size(const char *path)
+{
+  struct lkl_stat st;
+
+  if (lkl_sys_lstat(path, &st) < 0)
+    return -1;
+  return st.st_size;
+}
+
+static long long file_allocated(const char *path)
+{
+  struct lkl_stat st;
+
+  if (lkl_sys_lstat(path, &st) < 0)
+    return -1;
+  return (long long)st.st_blocks * 512;
+}
+
+static double seconds_since(LONG64 start)
+{
+  LARGE_INTEGER freq;
+
+  QueryPerformanceFrequency(&freq);
+  return (double)(stats_ticks() - start) / freq.QuadPart;
+}
+
+#define KIB 1024
+#define MIB (1024 * 1024)
+
+/* The image mounts, and a file written through the callbacks reads back. */
+static int run_mount(int argc, char **argv)
+{
+  char *buf = alloc_aligned_buf(64 * KIB, LKL_BOUNCE_BUF_ALIGN);
+  struct handle h;
+
+  UNREFERENCED_PARAMETER(argc);
+  UNREFERENCED_PARAMETER(argv);
+  if (!buf)
+    return -ENOMEM;
+
+  fill(buf, 64 * KIB, 0);
+  CHECK(h_open(&h, L"\\mount", FILE_SHARE_READ, FILE_CREATE, 0) ==
+        STATUS_SUCCESS);
+  CHECK(h_write(&h, buf, 64 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(LklFlushFileBuffers(h.name, &h.info) == STATUS_SUCCESS);
+  ZeroMemory(buf, 64 * KIB);
+  CHECK(h_read(&h, buf, 64 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(filled(buf, 64 * KIB, 0));
+  h_cleanup(&h);
+  h_close(&h);
+  CHECK(file_size("/mount") == 64 * KIB);
+
+  free_aligned_buf(buf);
+  return 0;
+}
+
+/* A reservation of an exclusive writer is given back at Cleanup. */
+static void prealloc_exclusive(char *buf)
+{
+  struct handle h;
+
+  fill(buf, 100 * KIB, 1);
+  CHECK(h_open(&h, L"\\excl", FILE_SHARE_READ, FILE_CREATE, 0) ==
+        STATUS_SUCCESS);
+  CHECK(h_write(&h, buf, 100 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(LklSetAllocationSize(h.name, 8 * MIB, &h.info) == STATUS_SUCCESS);
+  CHECK(file_size("/excl") == 100 * KIB);
+  CHECK(file_allocated("/excl") >= 8 * MIB);
+
+  h_cleanup(&h);
+  CHECK(file_size("/excl") == 100 * KIB);
+  CHECK(file_allocated("/excl") < 1 * MIB);
+  h_close(&h);
+}
+
+/*
+ * A handle that shares writing does not know the size, so it keeps the
+ * size and data others wrote, also when another handle reserved.
+ */
+static void prealloc_shared(char *buf)
+{
+  struct handle a, b;
+
+  fill(buf, 100 * KIB, 2);
+  CHECK(h_open(&a, L"\\shared", SHARE_ALL, FILE_CREATE, 0) ==
+        STATUS_SUCCESS);
+  CHECK(h_write(&a, buf, 100 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(LklSetAllocationSize(a.name, 8 * MIB, &a.info) == STATUS_SUCCESS);
+  CHECK(file_size("/shared") == 100 * KIB);
+
+  CHECK(h_open(&b, L"\\shared", SHARE_ALL, FILE_OPEN, 0) == STATUS_SUCCESS);
+  fill(buf, 1 * MIB, 3);
+  CHECK(h_write(&b, buf, 1 * MIB, 0) == STATUS_SUCCESS);
+
+  h_cleanup(&a);
+  CHECK(file_size("/shared") == 1 * MIB);
+  h_close(&a);
+
+  ZeroMemory(buf, 1 * MIB);
+  CHECK(h_read(&b, buf, 1 * MIB, 0) == STATUS_SUCCESS);
+  CHECK(filled(buf, 1 * MIB, 3));
+  h_cleanup(&b);
+  h_close(&b);
+  CHECK(file_size("/shared") == 1 * MIB);
+}
+
+/*
+ * The handle that reserved is cleaned up before a new writer extends the
+ * file and only closed afterwards; its CloseFile must not trim.
+ */
+static void prealloc_late_close(char *buf)
+{
+  struct handle a, b;
+
+  fill(buf, 2 * MIB, 4);
+  CHECK(h_open(&a, L"\\late", FILE_SHARE_READ, FILE_CREATE, 0) ==
+        STATUS_SUCCESS);
+  CHECK(h_write(&a, buf, 64 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(LklSetAllocationSize(a.name, 8 * MIB, &a.info) == STATUS_SUCCESS);
+  h_cleanup(&a);
+
+  CHECK(h_open(&b, L"\\late", FILE_SHARE_READ, FILE_OPEN, 0) ==
+        STATUS_SUCCESS);
+  CHECK(h_write(&b, buf, 2 * MIB, 0) == STATUS_SUCCESS);
+  h_cleanup(&b);
+
+  h_close(&a);
+  CHECK(file_size("/late") == 2 * MIB);
+
+  ZeroMemory(buf, 2 * MIB);
+  CHECK(h_read(&b, buf, 2 * MIB, 0) == STATUS_SUCCESS);
+  CHECK(filled(buf, 2 * MIB, 4));
+  h_close(&b);
+}
+
+/* An allocation size below EOF truncates, as on NTFS. */
+static void prealloc_shrink(char *buf)
+{
+  struct handle h;
+
+  fill(buf, 1 * MIB, 5);
+  CHECK(h_open(&h, L"\\shrink", FILE_SHARE_READ, FILE_CREATE, 0) ==
+        STATUS_SUCCESS);
+  CHECK(h_write(&h, buf, 1 * MIB, 0) == STATUS_SUCCESS);
+  CHECK(LklSetAllocationSize(h.name, 100 * KIB, &h.info) == STATUS_SUCCESS);
+  CHECK(file_size("/shrink") == 100 * KIB);
+
+  /* The appends after the shrink must not reserve from the old size. */
+  CHECK(h_write(&h, buf + 100 * KIB, 4 * KIB, 100 * KIB) == STATUS_SUCCESS);
+  h_cleanup(&h);
+  CHECK(file_size("/shrink") == 104 * KIB);
+
+  ZeroMemory(buf, 104 * KIB);
+  CHECK(h_read(&h, buf, 104 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(filled(buf, 104 * KIB, 5));
+  h_close(&h);
+}
+
+/* Paging I/O and flushes still work between Cleanup and CloseFile. */
+static void prealloc_after_cleanup(char *buf)
+{
+  struct handle h;
+
+  fill(buf, 64 * KIB, 6);
+  CHECK(h_open(&h, L"\\paging", FILE_SHARE_READ, FILE_CREATE, 0) ==
+        STATUS_SUCCESS);
+  CHECK(h_write(&h, buf, 32 * KIB, 0) == STATUS_SUCCESS);
+  h_cleanup(&h);
+
+  CHECK(h_paging_write(&h, buf + 32 * KIB, 32 * KIB, 32 * KIB) ==
+        STATUS_SUCCESS);
+  CHECK(LklFlushFileBuffers(h.name, &h.info) == STATUS_SUCCESS);
+  ZeroMemory(buf, 64 * KIB);
+  CHECK(h_paging_read(&h, buf, 64 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(filled(buf, 64 * KIB, 6));
+  CHECK(LklSetEndOfFile(h.name, 48 * KIB, &h.info) == STATUS_SUCCESS);
+  h_close(&h);
+  CHECK(file_size("/paging") == 48 * KIB);
+}
+
+/*
+ * Direct paging reads go to the open file, not to whatever now has its
+ * old name.
+ */
+static void prealloc_renamed(char *buf)
+{
+  struct handle a, b;
+  DOKAN_FILE_INFO info;
+  LONG64 direct_bytes;
+
+  bypass_paging_cache = TRUE;
+  fill(buf, 64 * KIB, 7);
+  CHECK(h_open(&a, L"\\old", FILE_SHARE_READ | FILE_SHARE_DELETE,
+               FILE_CREATE, 0) == STATUS_SUCCESS);
+  CHECK(h_write(&a, buf, 64 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(LklFlushFileBuffers(a.name, &a.info) == STATUS_SUCCESS);
+
+  ZeroMemory(&info, sizeof(info));
+  CHECK(LklMoveFile(L"\\old", L"\\new", FALSE, &info) == STATUS_SUCCESS);
+
+  fill(buf, 64 * KIB, 8);
+  CHECK(h_open(&b, L"\\old", FILE_SHARE_READ, FILE_CREATE, 0) ==
+        STATUS_SUCCESS);
+  CHECK(h_write(&b, buf, 64 * KIB, 0) == STATUS_SUCCESS);
+  h_cleanup(&b);
+  h_close(&b);
+
+  direct_bytes = lkl_stats.read_bytes[IO_DIRECT];
+  ZeroMemory(buf, 64 * KIB);
+  CHECK(h_paging_read(&a, buf, 64 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(filled(buf, 64 * KIB, 7));
+  CHECK(lkl_stats.read_bytes[IO_DIRECT] - direct_bytes == 64 * KIB);
+
+  /* And buffered again, after the descriptor was switched to direct. */
+  ZeroMemory(buf, 64 * KIB);
+  CHECK(h_read(&a, buf, 64 * KIB, 0) == STATUS_SUCCESS);
+  CHECK(filled(buf, 64 * KIB, 7));
+  h_cleanup(&a);
+  h_close(&a);
+  bypass_paging_cache = FALSE;
+}
+
+static int run_prealloc(int argc, char **argv)
+{
+  char *buf = alloc_aligned_buf(2 * MIB, LKL_BOUNCE_BUF_ALIGN);
+
+  UNREFERENCED_PARAMETER(argc);
+  UNREFERENCED_PARAMETER(argv);
+  if (!buf)
+    return -ENOMEM;
+
+  prealloc_exclusive(buf);
+  prealloc_shared(buf);
+  prealloc_late_close(buf);
+  prealloc_shrink(buf);
+  prealloc_after_cleanup(buf);
+  prealloc_renamed(buf);
+
+  free_aligned_buf(buf);
+  return 0;
+}
+
+/*
+ * A database log: 4 KiB appends, each flushed. Before CreateOptions were
+ * mapped, a write-through handle got what the first variant measures, and
+ * a delete-on-close one was flushed like any other.
+ */
+static void writethrough_run(const WCHAR *name, const char *what,
+                             ULONG options, char *buf, int nr)
+{
+  struct handle h;
+  LONG commits = lkl_stats.commits;
+  LONG64 start;
+  double secs;
+  int i;
+
+  CHECK(h_open(&h, name, FILE_SHARE_READ, FILE_CREATE, options) ==
+        STATUS_SUCCESS);
+  start = stats_ticks();
+  for (i = 0; i < nr; i++) {
+    CHECK(h_write(&h, buf, 4 * KIB, (LONGLONG)i * 4 * KIB) ==
+          STATUS_SUCCESS);
+    CHECK(LklFlushFileBuffers(h.name, &h.info) == STATUS_SUCCESS);
+  }
+  secs = seconds_since(start);
+  h.info.DeleteOnClose = (options & FILE_DELETE_ON_CLOSE) != 0;
+  h_cleanup(&h);
+  h_close(&h);
+
+  printf("%-34s %d ops in %.2f s: %.0f ops/s, %.2f MiB/s, %ld commits\n",
+         what, nr, secs, nr / secs, nr * 4.0 * KIB / MIB / secs,
+         (long)(lkl_stats.commits - commits));
+}
+
+static int run_writethrough(int argc, char **argv)
+{
+  char *buf = alloc_aligned_buf(4 * KIB, LKL_BOUNCE_BUF_ALIGN);
+  int nr = argc > 0 ? atoi(argv[0]) : 2000;
+
+  if (!buf)
+    return -ENOMEM;
+
+  fill(buf, 4 * KIB, 9);
+  writethrough_run(L"\\cached", "cached, flags ignored (before)", 0, buf,
+                   nr);
+  writethrough_run(L"\\dsync", "FILE_WRITE_THROUGH", FILE_WRITE_THROUGH,
+                   buf, nr);
+  writethrough_run(L"\\direct", "FILE_WRITE_THROUGH | no buffering",
+                   FILE_WRITE_THROUGH | FILE_NO_INTERMEDIATE_BUFFERING, buf,
+                   nr);
+  writethrough_run(L"\\temp", "FILE_DELETE_ON_CLOSE", FILE_DELETE_ON_CLOSE,
+                   buf, nr);
+
+  free_aligned_buf(buf);
+  return 0;
+}
+
+#define EXTENT_FILES 4
+#define EXTENT_PIECE (64 * KIB)
+#define EXTENT_READ (1 * MIB)
+
+enum {
+  EXTENTS_TRUNCATE,        /* Size set with a bare ftruncate, as before. */
+  EXTENTS_SET_END,         /* Size set with LklSetEndOfFile. */
+  EXTENTS_SHARED_APPEND,   /* Appends without preallocation, as before. */
+  EXTENTS_APPEND,          /* Appends by exclusive writers. */
+};
+
+/* Fisher-Yates with a fixed LCG, so that every run writes alike. */
+static void shuffle(int *order, int nr, unsigned int seed)
+{
+  int i, j, t;
+
+  for (i = 0; i < nr; i++)
+    order[i] = i;
+  for (i = nr - 1; i > 0; i--) {
+    seed = seed * 1103515245 + 12345;
+    j = (seed >> 8) % (i + 1);
+    t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+}
+
+/*
+ * Copies into EXTENT_FILES files at once, in 64 KiB pieces in random order
+ * after the size was set, or appended. Then counts the extents and reads
+ * the files back with O_DIRECT.
+ */
+static void extents_run(int variant, const char *prefix, const char *what,
+                        char *buf, int nr_pieces)
+{
+  struct handle h[EXTENT_FILES];
+  WCHAR names[EXTENT_FILES][32];
+  int *order[EXTENT_FILES];
+  LONGLONG size = (LONGLONG)nr_pieces * EXTENT_PIECE, off;
+  LONG64 start, bytes = 0;
+  BOOL random = variant == EXTENTS_TRUNCATE || variant == EXTENTS_SET_END;
+  char path[32];
+  int i, f, fd, lkl_ret, extents = 0;
+  DWORD done;
+
+  fill(buf, EXTENT_PIECE, 11);
+  for (f = 0; f < EXTENT_FILES; f++) {
+    order[f] = malloc(nr_pieces * sizeof(int));
+    CHECK(order[f] != NULL);
+    if (!order[f])
+      return;
+    shuffle(order[f], nr_pieces, f + 1);
+
+    swprintf(names[f], 32, L"\\%s%d", prefix, f);
+    CHECK(h_open(&h[f], names[f], variant == EXTENTS_SHARED_APPEND ?
+                 SHARE_ALL : FILE_SHARE_READ, FILE_CREATE, 0) ==
+          STATUS_SUCCESS);
+    if (variant == EXTENTS_TRUNCATE)
+      CHECK(lkl_sys_ftruncate(lkl_file_get(&h[f].info)->fd, size) == 0);
+    else if (variant == EXTENTS_SET_END)
+      CHECK(LklSetEndOfFile(h[f].name, size, &h[f].info) == STATUS_SUCCESS);
+  }
+
+  for (i = 0; i < nr_pieces; i++) {
+    for (f = 0; f < EXTENT_FILES; f++) {
+      off = (LONGLONG)(random ? order[f][i] : i) * EXTENT_PIECE;
+      CHECK(h_write(&h[f], buf, EXTENT_PIECE, off) == STATUS_SUCCESS);
+    }
+    /* Allocate as writeback under memory pressure would, not all at once. */
+    if (i % 64 == 63)
+      lkl_sys_syncfs(lkl_file_get(&h[0].info)->fd);
+  }
+
+  for (f = 0; f < EXTENT_FILES; f++) {
+    h_cleanup(&h[f]);
+    h_close(&h[f]);
+    free(order[f]);
+  }
+
+  start = stats_ticks();
+  for (f = 0; f < EXTENT_FILES; f++) {
+    snprintf(path, sizeof(path), "/%s%d", prefix, f);
+    CHECK(file_size(path) == size);
+    fd = lkl_sys_open(path, LKL_O_RDONLY | LKL_O_DIRECT, 0);
+    CHECK(fd >= 0);
+    if (fd < 0)
+      continue;
+
+    lkl_ret = lkl_file_count_extents(fd);
+    CHECK(lkl_ret >= 0);
+    if (lkl_ret > 0)
+      extents += lkl_ret;
+
+    for (off = 0; off < size; off += done) {
+      lkl_ret = lkl_pread_full(fd, buf, EXTENT_READ, off, &done);
+      CHECK(lkl_ret == 0 && done > 0);
+      if (lkl_ret || !done)
+        break;
+      bytes += done;
+    }
+    lkl_sys_close(fd);
+  }
+
+  printf("%-30s %d files of %lld MiB: %.1f extents per file, "
+         "read back at %.1f MiB/s\n",
+         what, EXTENT_FILES, size / MIB, (double)extents / EXTENT_FILES,
+         bytes / seconds_since(start) / MIB);
+}
+
+static int run_extents(int argc, char **argv)
+{
+  char *buf = alloc_aligned_buf(EXTENT_READ, LKL_BOUNCE_BUF_ALIGN);
+  int file_mib = argc > 0 ? atoi(argv[0]) : 32;
+  int nr_pieces = file_mib * (MIB / EXTENT_PIECE);
+
+  if (!buf)
+    return -ENOMEM;
+  if (nr_pieces < 1) {
+    free_aligned_buf(buf);
+    return -EINVAL;
+  }
+
+  extents_run(EXTENTS_TRUNCATE, "truncate", "ftruncate, random (before)",
+              buf, nr_pieces);
+  extents_run(EXTENTS_SET_END, "setend", "SetEndOfFile, random", buf,
+              nr_pieces);
+  extents_run(EXTENTS_SHARED_APPEND, "shared", "appends, shared (before)",
+              buf, nr_pieces);
+  extents_run(EXTENTS_APPEND, "append", "appends, exclusive", buf,
+              nr_pieces);
+
+  free_aligned_buf(buf);
+  return 0;
+}
+
+/*
+ * LKL cannot be started again once halted, so every durability level is
+ * measured by its own run; the level is set before mounting.
+ */
+static int setup_durability(int argc, char **argv)
+{
+  WCHAR level[64];
+
+  if (argc < 1 || mbstowcs(level, argv[0], 64) >= 64 ||
+      parse_durability(level) < 0)
+    return -EINVAL;
+  return 0;
+}
+
+struct durability_worker {
+  int id;
+  int nr;
+  char *buf;
+  HANDLE thread;
+};
+
+/* Appends to a log of its own, flushing each 4 KiB. */
+static DWORD WINAPI durability_appends(LPVOID arg)
+{
+  struct durability_worker *w = arg;
+  struct handle h;
+  WCHAR name[32];
+  int i;
+
+  swprintf(name, 32, L"\\log%d", w->id);
+  CHECK(h_open(&h, name, FILE_SHARE_READ, FILE_CREATE, 0) ==
+        STATUS_SUCCESS);
+  for (i = 0; i < w->nr; i++) {
+    CHECK(h_write(&h, w->buf, 4 * KIB, (LONGLONG)i * 4 * KIB) ==
+          STATUS_SUCCESS);
+    CHECK(LklFlushFileBuffers(h.name, &h.info) == STATUS_SUCCESS);
+  }
+  h_cleanup(&h);
+  h_close(&h);
+  return 0;
+}
+
+/* Creates, writes and flushes small files, so each flush has metadata. */
+static DWORD WINAPI durability_files(LPVOID arg)
+{
+  struct durability_worker *w = arg;
+  struct handle h;
+  WCHAR name[32];
+  int i;
+
+  for (i = 0; i < w->nr; i++) {
+    swprintf(name, 32, L"\\f%d-%d", w->id, i);
+    CHECK(h_open(&h, name, FILE_SHARE_READ, FILE_CREATE, 0) ==
+          STATUS_SUCCESS);
+    CHECK(h_write(&h, w->buf, 4 * KIB, 0) == STATUS_SUCCESS);
+    CHECK(LklFlushFileBuffers(h.name, &h.info) == STATUS_SUCCESS);
+    h_cleanup(&h);
+    h_close(&h);
+  }
+  return 0;
+}
+
+static void durability_phase(const char *what, LPTHREAD_START_ROUTINE fn,
+                             struct durability_worker *workers, int nr_threads)
+{
+  LONG commits = lkl_stats.commits;
+  LONG fsyncs = lkl_stats.commit_fsync;
+  LONG fdatasyncs = lkl_stats.commit_fdatasync;
+  LONG syncfs = lkl_stats.commit_syncfs;
+  LONG ignored = lkl_stats.flushes_ignored;
+  LONG periodic = lkl_stats.periodic_syncs;
+  LONG64 start = stats_ticks();
+  double secs;
+  int i, ops = 0;
+
+  for (i = 0; i < nr_threads; i++) {
+    workers[i].thread = CreateThread(NULL, 0, fn, &workers[i], 0, NULL);
+    CHECK(workers[i].thread != NULL);
+  }
+  for (i = 0; i < nr_threads; i++) {
+    if (!workers[i].thread)
+      continue;
+    WaitForSingleObject(workers[i].thread, INFINITE);
+    CloseHandle(workers[i].thread);
+    ops += workers[i].nr;
+  }
+  secs = seconds_since(start);
+
+  printf("%-9ls %-12s %d threads, %d flushes in %.2f s: %.0f ops/s; "
+         "%ld commits (%ld fsync, %ld fdatasync, %ld syncfs), %ld ignored, "
+         "%ld periodic syncs\n",
+         durability_names[durability], what, nr_threads, ops, secs,
+         ops / secs, (long)(lkl_stats.commits - commits),
+         (long)(lkl_stats.commit_fsync - fsyncs),
+         (long)(lkl_stats.commit_fdatasync - fdatasyncs),
+         (long)(lkl_stats.commit_syncfs - syncfs),
+         (long)(lkl_stats.flushes_ignored - ignored),
+         (long)(lkl_stats.periodic_syncs - periodic));
+}
+
+static int run_durability(int argc, char **argv)
+{
+  struct durability_worker *workers;
+  int i, nr_threads = argc > 1 ? atoi(argv[1]) : 8;
+  int nr = argc > 2 ? atoi(argv[2]) : 500;
+  char *buf;
+
+  if (nr_threads < 1)
+    return -EINVAL;
+
+  buf = alloc_aligned_buf(4 * KIB, LKL_BOUNCE_BUF_ALIGN);
+  workers = calloc(nr_threads, sizeof(*workers));
+  if (!buf || !workers) {
+    free(workers);
+    if (buf)
+      free_aligned_buf(buf);
+    return -ENOMEM;
+  }
+
+  fill(buf, 4 * KIB, 10);
+  for (i = 0; i < nr_threads; i++) {
+    workers[i].id = i;
+    workers[i].buf = buf;
+  }
+
+  for (i = 0; i < nr_threads; i++)
+    workers[i].nr = nr;
+  durability_phase("appends", durability_appends, workers, nr_threads);
+
+  for (i = 0; i < nr_threads; i++)
+    workers[i].nr = nr / 4;
+  durability_phase("small files", durability_files, workers, nr_threads);
+
+  free(workers);
+  free_aligned_buf(buf);
+  return 0;
+}
+
+struct mode {
+  const char *name;
+  BOOL unbuffered;      /* Open the image with HOST_OPEN_UNBUFFERED. */
+  int (*setup)(int argc, char **argv);   /* Before mounting, if set. */
+  int (*run)(int argc, char **argv);
+};
+
+static const struct mode modes[] = {
+  { "mount", FALSE, NULL, run_mount },
+  { "prealloc", FALSE, NULL, run_prealloc },
+  { "writethrough", FALSE, NULL, run_writethrough },
+  { "durability", FALSE, setup_durability, run_durability },
+  { "extents", TRUE, NULL, run_extents },
+};
+
+static int mount_image(const char *path, BOOL unbuffered)
+{
+  host_file_t file;
+  int ret;
+
+  file = host_file_open(path, unbuffered ? HOST_OPEN_UNBUFFERED : 0, &ret);
+  if (file == HOST_INVALID_FILE)
+    return ret;
+
+  disk_unbuffered = unbuffered;
+  disk_dev = disk_raw_open(file, unbuffered ? DISK_F_UNBUFFERED : 0, &ret);
+  if (!disk_dev)
+    return ret;
+
+  disk_id = disk_lkl_add(disk_dev);
+  if (disk_id < 0) {
+    disk_close(disk_dev);
+    return disk_id;
+  }
+
+  wcscpy(lkl_mount_fstype, L"ext4");
+  return start_lkl() ? -EIO : 0;
+}
+
+int main(int argc, char **argv)
+{
+  const struct mode *mode = NULL;
+  unsigned int i;
+  int ret;
+
+  for (i = 0; argc >= 3 && i < sizeof(modes) / sizeof(modes[0]); i++)
+    if (!strcmp(argv[2], modes[i].name))
+      mode = &modes[i];
+
+  if (!mode) {
+    fprintf(stderr, "usage: %s IMAGE MODE [ARGS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (mode->setup && mode->setup(argc - 3, argv + 3) < 0) {
+    fprintf(stderr, "%s: bad arguments\n", mode->name);
+    return EXIT_FAILURE;
+  }
+
+  ret = mount_image(argv[1], mode->unbuffered);
+  if (ret) {
+    fprintf(stderr, "can't mount %s: %s\n", argv[1], strerror(-ret));
+    return EXIT_FAILURE;
+  }
+
+  ret = mode->run(argc - 3, argv + 3);
+  if (ret)
+    fprintf(stderr, "%s: %s\n", mode->name, strerror(-ret));
+
+  print_stats();
+  stop_lkl();
+  disk_close(disk_dev);
+
+  if (ret || failures) {
+    fprintf(stderr, "%s: %d checks failed\n", mode->name, failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/*
+ * Opens partitions 1 to MAX_PART of an image made by partgen.py through
+ * disk-part.c.  Partition N must open and read back as DIR/N when that
+ * file exists, and must fail to open when it doesn't.  Requests past the
+ * end of a partition must fail too.
+ *
+ *   part-test IMAGE DIR
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../disk.h"
+
+#define MAX_PART 8
+
+static char *load(const char *path, uint64_t *size)
+{
+  FILE *f = fopen(path, "rb");
+  char *buf = NULL;
+  long len;
+
+  if (!f)
+    return NULL;
+
+  if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) > 0 &&
+      !fseek(f, 0, SEEK_SET)) {
+    buf = malloc(len);
+    if (buf && fread(buf, 1, len, f) != (size_t)len) {
+      free(buf);
+      buf = NULL;
+    }
+    *size = len;
+  }
+
+  fclose(f);
+  return buf;
+}
+
+static int check(struct disk_dev *dev, const char *ref, uint64_t size, int nr)
+{
+  struct disk_iovec iov;
+  int ret;
+
+  if (dev->size != size) {
+    fprintf(stderr, "partition %d: size %llu, expected %llu\n", nr,
+            (unsigned long long)dev->size, (unsigned long long)size);
+    return -1;
+  }
+
+  iov.base = malloc(size);
+  iov.len = size;
+  if (!iov.base)
+    return -1;
+
+  ret = disk_read(dev, &iov, 1, 0);
+  if (ret)
+    fprintf(stderr, "partition %d: read failed: %s\n", nr, strerror(-ret));
+  else if (memcmp(iov.base, ref, size))
+    fprintf(stderr, "partition %d: contents differ\n", nr);
+  ret = ret || memcmp(iov.base, ref, size) ? -1 : 0;
+
+  /* the last sector and the one after it */
+  iov.len = 1024;
+  if (!ret && !disk_read(dev, &iov, 1, size - 512)) {
+    fprintf(stderr, "partition %d: read past the end succeeded\n", nr);
+    ret = -1;
+  }
+
+  free(iov.base);
+  return ret;
+}
+
+int main(int argc, char **argv)
+{
+  char path[4096], *ref;
+  uint64_t size;
+  int nr, ret, failures = 0;
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s IMAGE DIR\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (nr = 1; nr <= MAX_PART; nr++) {
+    struct disk_dev *lower, *dev;
+    host_file_t file;
+
+    file = host_file_open(argv[1], HOST_OPEN_READONLY, &ret);
+    if (file == HOST_INVALID_FILE) {
+      fprintf(stderr, "can't open %s: %s\n", argv[1], strerror(-ret));
+      return EXIT_FAILURE;
+    }
+    lower = disk_raw_open(file, 0, &ret);
+    if (!lower) {
+      fprintf(stderr, "can't open %s: %s\n", argv[1], strerror(-ret));
+      return EXIT_FAILURE;
+    }
+
+    snprintf(path, sizeof(path), "%s/%d", argv[2], nr);
+    ref = load(path, &size);
+    dev = disk_part_open(lower, nr, &ret);
+
+    if (!ref && dev) {
+      fprintf(stderr, "partition %d: opened, but there is none\n", nr);
+      failures++;
+    } else if (ref && !dev) {
+      fprintf(stderr, "partition %d: %s\n", nr, strerror(-ret));
+      failures++;
+    } else if (ref && check(dev, ref, size, nr)) {
+      failures++;
+    }
+
+    disk_close(dev ? dev : lower);
+    free(ref);
+  }
+
+  if (failures) {
+    fprintf(stderr, "%s: %d partitions failed\n", argv[1], failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
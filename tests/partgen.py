@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""Writes partitioned disk images, independently of disk-part.c.
+
+  partgen.py KIND IMAGE DIR
+      Writes a 16 MiB image with random data in its partitions, and the
+      contents of partition N to DIR/N.  KIND is one of:
+
+      mbr          primaries 1 and 4, logical 5 and 6 in extended 2
+      gpt          GPT entries 1, 2 and 4 on 512 byte sectors
+      gpt4k        the same on 4 KiB sectors
+      gpt-backup   gpt with the primary header wiped
+      gpt-entry-size, gpt-entries-outside, gpt-part-outside
+                   GPTs with valid checksums but a field out of range;
+                   no partition may be opened
+"""
+import os
+import random
+import struct
+import sys
+import uuid
+import zlib
+
+MB = 1 << 20
+SIZE = 16 * MB
+SECTOR = 512
+GPT_ENTRIES = 128
+GPT_ENTRY_SIZE = 128
+LINUX_DATA_GUID = uuid.UUID('0FC63DAF-8483-4772-8E79-3DD8D7128E3A').bytes_le
+
+
+def mbr_entry(type_, lba_first, nr_sectors):
+    return struct.pack('<B3sB3sII', 0, b'', type_, b'', lba_first, nr_sectors)
+
+
+def mbr_sector(entries):
+    s = bytearray(SECTOR)
+    for i, e in enumerate(entries):
+        s[446 + 16 * i:446 + 16 * (i + 1)] = e
+    s[510:512] = b'\x55\xaa'
+    return s
+
+
+def fill(disk, parts, start, size, nr):
+    parts[nr] = random.randbytes(size)
+    disk[start:start + size] = parts[nr]
+
+
+def gen_mbr(disk, parts):
+    ext_start = 4096
+    disk[0:SECTOR] = mbr_sector([
+        mbr_entry(0x83, 2048, 2048),
+        mbr_entry(0x05, ext_start, 16384),
+        bytes(16),
+        mbr_entry(0x83, 20480, 4096),
+    ])
+    fill(disk, parts, 2048 * SECTOR, 2048 * SECTOR, 1)
+    fill(disk, parts, 20480 * SECTOR, 4096 * SECTOR, 4)
+
+    # Logical partitions start relative to their EBR, the next EBR
+    # relative to the extended partition.
+    ebr = ext_start
+    disk[ebr * SECTOR:(ebr + 1) * SECTOR] = mbr_sector([
+        mbr_entry(0x83, 2048, 3072),
+        mbr_entry(0x05, 8192, 8192),
+    ])
+    fill(disk, parts, (ebr + 2048) * SECTOR, 3072 * SECTOR, 5)
+    ebr = ext_start + 8192
+    disk[ebr * SECTOR:(ebr + 1) * SECTOR] = mbr_sector([
+        mbr_entry(0x83, 2048, 1024),
+    ])
+    fill(disk, parts, (ebr + 2048) * SECTOR, 1024 * SECTOR, 6)
+
+
+def gpt_header(lba_size, current, backup, entries_lba, entries_crc,
+               entry_size):
+    last = SIZE // lba_size - 1
+    nr_entry_lbas = GPT_ENTRIES * entry_size // lba_size
+    h = bytearray(92)
+    h[0:8] = b'EFI PART'
+    struct.pack_into('<IIII', h, 8, 0x10000, 92, 0, 0)
+    struct.pack_into('<QQQQ', h, 24, current, backup, 2 + nr_entry_lbas,
+                     last - 1 - nr_entry_lbas)
+    h[56:72] = uuid.UUID(int=1).bytes_le
+    struct.pack_into('<QIII', h, 72, entries_lba, GPT_ENTRIES, entry_size,
+                     entries_crc)
+    struct.pack_into('<I', h, 16, zlib.crc32(h))
+    return h
+
+
+def gen_gpt(disk, parts, lba_size, wipe_primary=False, **bad):
+    # Entries this big are consistent, but more than disk-part.c accepts.
+    entry_size = 1024 if 'entry_size' in bad else GPT_ENTRY_SIZE
+    last = SIZE // lba_size - 1
+    nr_entry_lbas = GPT_ENTRIES * entry_size // lba_size
+    disk[0:SECTOR] = mbr_sector([
+        mbr_entry(0xee, 1, min(last, 0xffffffff)),
+    ])
+
+    entries = bytearray(GPT_ENTRIES * entry_size)
+    layout = {1: (MB, 2 * MB), 2: (4 * MB, 3 * MB), 4: (9 * MB, 4 * MB)}
+    if 'part_outside' in bad:
+        layout = {1: (MB, SIZE)}
+    for nr, (start, size) in layout.items():
+        e = (nr - 1) * entry_size
+        entries[e:e + 16] = LINUX_DATA_GUID
+        entries[e + 16:e + 32] = uuid.uuid4().bytes_le
+        struct.pack_into('<QQ', entries, e + 32, start // lba_size,
+                         (start + size) // lba_size - 1)
+        if not bad:
+            fill(disk, parts, start, size, nr)
+
+    crc = zlib.crc32(entries)
+    backup_entries = last - nr_entry_lbas
+    for current, backup, entries_lba in ((1, last, 2),
+                                         (last, 1, backup_entries)):
+        if 'entries_outside' in bad:
+            entries_lba = 1 << 40
+        h = gpt_header(lba_size, current, backup, entries_lba, crc,
+                       entry_size)
+        disk[current * lba_size:current * lba_size + len(h)] = h
+        if entries_lba < last:
+            disk[entries_lba * lba_size:
+                 entries_lba * lba_size + len(entries)] = entries
+
+    if wipe_primary:
+        disk[lba_size:2 * lba_size] = bytes(lba_size)
+
+
+KINDS = {
+    'mbr': gen_mbr,
+    'gpt': lambda d, p: gen_gpt(d, p, 512),
+    'gpt4k': lambda d, p: gen_gpt(d, p, 4096),
+    'gpt-backup': lambda d, p: gen_gpt(d, p, 512, wipe_primary=True),
+    'gpt-entry-size': lambda d, p: gen_gpt(d, p, 512, entry_size=1),
+    'gpt-entries-outside': lambda d, p: gen_gpt(d, p, 512,
+                                                entries_outside=1),
+    'gpt-part-outside': lambda d, p: gen_gpt(d, p, 512, part_outside=1),
+}
+
+
+def main():
+    args = sys.argv[1:]
+    if len(args) != 3 or args[0] not in KINDS:
+        sys.exit(__doc__)
+
+    random.seed(1)
+    disk = bytearray(SIZE)
+    parts = {}
+    KINDS[args[0]](disk, parts)
+
+    with open(args[1], 'wb') as f:
+        f.write(disk)
+    os.makedirs(args[2], exist_ok=True)
+    for nr, data in parts.items():
+        with open(os.path.join(args[2], str(nr)), 'wb') as f:
+            f.write(data)
+
+
+if __name__ == '__main__':
+    main()
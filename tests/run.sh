@@ -0,0 +1,48 @@
+#!/bin/sh
+# Runs the tests built by build.sh, each on a fresh scratch image.
+set -e
+cd "$(dirname "$0")"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+ext4_image()
+{
+  rm -f "$dir/ext4.img"
+  truncate -s ${1:-256M} "$dir/ext4.img"
+  mkfs.ext4 -q -F "$dir/ext4.img"
+}
+
+ext4_image
+./fs-test "$dir/ext4.img" mount
+
+ext4_image
+./fs-test "$dir/ext4.img" prealloc
+
+ext4_image
+./fs-test "$dir/ext4.img" writethrough
+
+for level in strict fsync fdatasync periodic:1000 none; do
+  ext4_image
+  ./fs-test "$dir/ext4.img" durability $level
+done
+
+ext4_image 1G
+./fs-test "$dir/ext4.img" extents
+
+# Not a multiple of the block size of either format.
+for fmt in vhd vhdx; do
+  python3 vhdgen.py gen $fmt 67110400 "$dir/t.$fmt" "$dir/t.$fmt.ref"
+  ./vhd-test "$dir/t.$fmt" "$dir/t.$fmt.ref" "$dir/t.$fmt.out"
+  python3 vhdgen.py read $fmt "$dir/t.$fmt" "$dir/t.$fmt.check"
+  cmp "$dir/t.$fmt.out" "$dir/t.$fmt.check"
+done
+
+for kind in mbr gpt gpt4k gpt-backup gpt-entry-size gpt-entries-outside \
+            gpt-part-outside; do
+  rm -rf "$dir/parts"
+  python3 partgen.py $kind "$dir/part.img" "$dir/parts"
+  ./part-test "$dir/part.img" "$dir/parts"
+done
+
+./crypt-bench "$dir/crypt.img" 256
+./crypt-bench "$dir/crypt.img" 256 unbuffered
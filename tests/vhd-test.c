@@ -0,0 +1,196 @@
+/*
+ * Round trip through disk-vhd.c: reads an image made by vhdgen.py and
+ * compares it with the contents vhdgen.py wrote alongside, then does
+ * random reads and writes against that reference, reopens the image and
+ * compares again.  The final contents are written to OUT, to be compared
+ * with what vhdgen.py reads back from the image.
+ *
+ *   vhd-test IMAGE FLAT OUT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../disk.h"
+
+#define NR_OPS 4000
+#define MAX_LEN (3 << 20)
+
+static char *ref;
+static uint64_t size;
+
+static struct disk_dev *open_vhd(const char *path)
+{
+  struct disk_dev *dev;
+  host_file_t file;
+  int ret;
+
+  file = host_file_open(path, 0, &ret);
+  if (file == HOST_INVALID_FILE) {
+    fprintf(stderr, "can't open %s: %s\n", path, strerror(-ret));
+    return NULL;
+  }
+
+  if (disk_vhd_probe(file) != 1) {
+    fprintf(stderr, "%s is not a VHD or VHDX image\n", path);
+    host_file_close(file);
+    return NULL;
+  }
+
+  dev = disk_vhd_open(file, 0, &ret);
+  if (!dev)
+    fprintf(stderr, "can't open %s: %s\n", path, strerror(-ret));
+  return dev;
+}
+
+static int verify(struct disk_dev *dev, const char *when)
+{
+  struct disk_iovec iov;
+  int ret;
+
+  if (dev->size != size) {
+    fprintf(stderr, "%s: size %llu, expected %llu\n", when,
+            (unsigned long long)dev->size, (unsigned long long)size);
+    return -1;
+  }
+
+  iov.base = malloc(size);
+  iov.len = size;
+  if (!iov.base)
+    return -1;
+
+  ret = disk_read(dev, &iov, 1, 0);
+  if (ret)
+    fprintf(stderr, "%s: read failed: %s\n", when, strerror(-ret));
+  else if (memcmp(iov.base, ref, size))
+    fprintf(stderr, "%s: contents differ\n", when);
+
+  ret = ret || memcmp(iov.base, ref, size) ? -1 : 0;
+  free(iov.base);
+  return ret;
+}
+
+/*
+ * Sector aligned requests of up to MAX_LEN, mostly small, split over two
+ * iovecs.  Writes land in allocated and unallocated blocks alike.
+ */
+static int random_io(struct disk_dev *dev)
+{
+  static char buf[MAX_LEN];
+  struct disk_iovec iov[2];
+  uint64_t off;
+  size_t len, i;
+  int op, ret;
+
+  srand(3);
+  for (op = 0; op < NR_OPS; op++) {
+    off = ((uint64_t)rand() * RAND_MAX + rand()) % size & ~511ULL;
+    len = 512 * (1 + rand() % (rand() % 4 ? 16 : MAX_LEN / 512));
+    if (len > size - off)
+      len = size - off;
+
+    iov[0].base = buf;
+    iov[0].len = len / 2;
+    iov[1].base = buf + len / 2;
+    iov[1].len = len - len / 2;
+
+    if (rand() % 2) {
+      ret = disk_read(dev, iov, 2, off);
+      if (!ret && memcmp(buf, ref + off, len)) {
+        fprintf(stderr, "op %d: read at %llu differs\n", op,
+                (unsigned long long)off);
+        return -1;
+      }
+    } else {
+      for (i = 0; i < len; i++)
+        buf[i] = (char)rand();
+      memcpy(ref + off, buf, len);
+      ret = disk_write(dev, iov, 2, off);
+    }
+
+    if (!ret && op % 500 == 499)
+      ret = disk_flush(dev);
+    if (ret) {
+      fprintf(stderr, "op %d: %s\n", op, strerror(-ret));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int load(const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  long len;
+
+  if (!f || fseek(f, 0, SEEK_END) || (len = ftell(f)) <= 0 ||
+      fseek(f, 0, SEEK_SET)) {
+    fprintf(stderr, "can't read %s\n", path);
+    goto out;
+  }
+
+  size = len;
+  ref = malloc(size);
+  if (ref && fread(ref, 1, size, f) == size) {
+    fclose(f);
+    return 0;
+  }
+  fprintf(stderr, "can't read %s\n", path);
+
+out:
+  if (f)
+    fclose(f);
+  return -1;
+}
+
+static int store(const char *path)
+{
+  FILE *f = fopen(path, "wb");
+
+  if (!f || fwrite(ref, 1, size, f) != size) {
+    fprintf(stderr, "can't write %s\n", path);
+    if (f)
+      fclose(f);
+    return -1;
+  }
+  return fclose(f) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct disk_dev *dev;
+  int ret;
+
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s IMAGE FLAT OUT\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (load(argv[2]))
+    return EXIT_FAILURE;
+
+  dev = open_vhd(argv[1]);
+  if (!dev)
+    return EXIT_FAILURE;
+
+  ret = verify(dev, "open");
+  if (!ret)
+    ret = random_io(dev);
+  disk_close(dev);
+  if (ret)
+    return EXIT_FAILURE;
+
+  dev = open_vhd(argv[1]);
+  if (!dev)
+    return EXIT_FAILURE;
+
+  ret = verify(dev, "reopen");
+  disk_close(dev);
+  if (ret || store(argv[3]))
+    return EXIT_FAILURE;
+
+  printf("%s: %lld blocks allocated, %lld bytes of unallocated blocks "
+         "read without I/O\n", argv[1], (long long)disk_stats.vhd_allocs,
+         (long long)disk_stats.unallocated_bytes);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,277 @@
+#!/usr/bin/env python3
+"""Writes and reads dynamic VHD and VHDX images, independently of disk-vhd.c.
+
+  vhdgen.py gen vhd|vhdx SIZE IMAGE FLAT
+      Writes a SIZE byte image with random data in some of its blocks, and
+      in some of the sectors of those for VHD, and its contents to FLAT.
+  vhdgen.py read vhd|vhdx IMAGE FLAT
+      Writes the contents of IMAGE to FLAT.
+"""
+import random
+import struct
+import sys
+import uuid
+
+MB = 1 << 20
+SECTOR = 512
+
+VHD_BLOCK_SIZE = 512 * 1024
+VHD_DYNAMIC = 3
+VHD_BAT_UNUSED = 0xffffffff
+
+VHDX_BLOCK_SIZE = MB
+VHDX_LOGICAL_SECTOR = 512
+VHDX_FULLY_PRESENT = 6
+VHDX_METADATA_OFF = 2 * MB
+VHDX_BAT_OFF = 3 * MB
+
+
+def guid(s):
+    return uuid.UUID(s).bytes_le
+
+
+BAT_GUID = guid('2DC27766-F623-4200-9D64-115E9BFD4A08')
+METADATA_GUID = guid('8B7CA206-4790-4B9A-B8FE-575F050F886E')
+FILE_PARAMS_GUID = guid('CAA16737-FA36-4D43-B3B6-33F0AA44E76B')
+DISK_SIZE_GUID = guid('2FA54224-CD1B-4876-B211-5DBED83BF4B8')
+LOGICAL_SECTOR_GUID = guid('8141BF1D-A96F-4709-BA47-F233A8FAAB5F')
+PHYSICAL_SECTOR_GUID = guid('CDA348C7-445D-4471-9CC9-E9885251C556')
+PAGE83_GUID = guid('BECA12AB-B2E6-4523-93EF-C309E000C746')
+
+CRC32C_TABLE = []
+for i in range(256):
+    c = i
+    for _ in range(8):
+        c = (c >> 1) ^ (0x82f63b78 if c & 1 else 0)
+    CRC32C_TABLE.append(c)
+
+
+def crc32c(buf):
+    crc = 0xffffffff
+    for b in buf:
+        crc = CRC32C_TABLE[(crc ^ b) & 0xff] ^ (crc >> 8)
+    return crc ^ 0xffffffff
+
+
+def vhd_checksum(buf, off):
+    return ~(sum(buf[:off]) + sum(buf[off + 4:])) & 0xffffffff
+
+
+def vhd_bitmap_size(block_size):
+    return (block_size // SECTOR // 8 + SECTOR - 1) // SECTOR * SECTOR
+
+
+def vhd_footer(size):
+    f = bytearray(512)
+    f[0:8] = b'conectix'
+    struct.pack_into('>II', f, 8, 2, 0x10000)
+    struct.pack_into('>Q', f, 16, 512)
+    struct.pack_into('>QQ', f, 40, size, size)
+    struct.pack_into('>I', f, 60, VHD_DYNAMIC)
+    f[68:84] = uuid.uuid4().bytes
+    struct.pack_into('>I', f, 64, vhd_checksum(f, 64))
+    return f
+
+
+def vhd_write(path, size, data, blocks):
+    """blocks maps a block number to the sectors of it that are present."""
+    bs = VHD_BLOCK_SIZE
+    nr = (size + bs - 1) // bs
+    bitmap_size = vhd_bitmap_size(bs)
+    bat_off = 512 + 1024
+    footer = vhd_footer(size)
+
+    dyn = bytearray(1024)
+    dyn[0:8] = b'cxsparse'
+    struct.pack_into('>QQ', dyn, 8, 0xffffffffffffffff, bat_off)
+    struct.pack_into('>III', dyn, 24, 0x10000, nr, bs)
+    struct.pack_into('>I', dyn, 36, vhd_checksum(dyn, 36))
+
+    out = footer + dyn + b'\xff' * ((nr * 4 + 511) // 512 * 512)
+    for blk, sectors in sorted(blocks.items()):
+        struct.pack_into('>I', out, bat_off + 4 * blk, len(out) // SECTOR)
+        bitmap = bytearray(bitmap_size)
+        block = bytearray(bs)
+        for s in sectors:
+            bitmap[s // 8] |= 0x80 >> (s % 8)
+            off = blk * bs + s * SECTOR
+            block[s * SECTOR:(s + 1) * SECTOR] = data[off:off + SECTOR]
+        out += bitmap + block
+    out += footer
+
+    with open(path, 'wb') as f:
+        f.write(out)
+
+
+def vhd_read(path):
+    with open(path, 'rb') as f:
+        d = f.read()
+
+    footer = d[-512:]
+    assert footer[:8] == b'conectix', 'no footer'
+    assert struct.unpack_from('>I', footer, 64)[0] == \
+        vhd_checksum(footer, 64), 'bad footer checksum'
+    assert d[:512] == footer, 'footer copy differs'
+    dyn = d[512:1536]
+    assert dyn[:8] == b'cxsparse', 'no dynamic header'
+
+    size = struct.unpack_from('>Q', footer, 48)[0]
+    bat_off = struct.unpack_from('>Q', dyn, 16)[0]
+    nr, bs = struct.unpack_from('>II', dyn, 28)
+    bitmap_size = vhd_bitmap_size(bs)
+    res = bytearray(size)
+    for blk in range(nr):
+        entry = struct.unpack_from('>I', d, bat_off + 4 * blk)[0]
+        if entry == VHD_BAT_UNUSED:
+            continue
+        start = entry * SECTOR
+        bitmap = d[start:start + bitmap_size]
+        for s in range(bs // SECTOR):
+            off = blk * bs + s * SECTOR
+            if off >= size:
+                break
+            if bitmap[s // 8] & (0x80 >> (s % 8)):
+                src = start + bitmap_size + s * SECTOR
+                res[off:off + SECTOR] = d[src:src + SECTOR]
+    return bytes(res)
+
+
+def vhdx_chunk_ratio():
+    return (1 << 23) * VHDX_LOGICAL_SECTOR // VHDX_BLOCK_SIZE
+
+
+def vhdx_write(path, size, data, blocks):
+    bs = VHDX_BLOCK_SIZE
+    nr = (size + bs - 1) // bs
+    ratio = vhdx_chunk_ratio()
+    out = bytearray(4 * MB)
+    out[0:8] = b'vhdxfile'
+
+    for i, seq in enumerate((1, 2)):
+        h = bytearray(4096)
+        struct.pack_into('<IIQ', h, 0, 0x64616568, 0, seq)
+        h[16:32] = uuid.uuid4().bytes
+        h[32:48] = uuid.uuid4().bytes
+        # No log GUID: nothing to replay.
+        struct.pack_into('<HHIQ', h, 64, 0, 1, MB, MB)
+        struct.pack_into('<I', h, 4, crc32c(h))
+        out[(1 + i) * 65536:(1 + i) * 65536 + 4096] = h
+
+    r = bytearray(65536)
+    struct.pack_into('<IIII', r, 0, 0x69676572, 0, 2, 0)
+    r[16:32] = BAT_GUID
+    struct.pack_into('<QII', r, 32, VHDX_BAT_OFF, MB, 1)
+    r[48:64] = METADATA_GUID
+    struct.pack_into('<QII', r, 64, VHDX_METADATA_OFF, MB, 1)
+    struct.pack_into('<I', r, 4, crc32c(r))
+    out[192 * 1024:256 * 1024] = r
+    out[256 * 1024:320 * 1024] = r
+
+    m = bytearray(MB)
+    m[0:8] = b'metadata'
+    items = [
+        (FILE_PARAMS_GUID, struct.pack('<II', bs, 0), 4),
+        (DISK_SIZE_GUID, struct.pack('<Q', size), 6),
+        (LOGICAL_SECTOR_GUID, struct.pack('<I', VHDX_LOGICAL_SECTOR), 6),
+        (PHYSICAL_SECTOR_GUID, struct.pack('<I', 4096), 6),
+        (PAGE83_GUID, uuid.uuid4().bytes, 6),
+    ]
+    struct.pack_into('<HH', m, 8, 0, len(items))
+    off = 65536
+    for i, (g, val, flags) in enumerate(items):
+        e = 32 + 32 * i
+        m[e:e + 16] = g
+        struct.pack_into('<IIII', m, e + 16, off, len(val), flags, 0)
+        m[off:off + len(val)] = val
+        off += len(val)
+    out[VHDX_METADATA_OFF:VHDX_METADATA_OFF + MB] = m
+
+    for blk in sorted(blocks):
+        start = len(out)
+        out += data[blk * bs:(blk + 1) * bs].ljust(bs, b'\0')
+        struct.pack_into('<Q', out, VHDX_BAT_OFF + 8 * (blk + blk // ratio),
+                         start | VHDX_FULLY_PRESENT)
+
+    with open(path, 'wb') as f:
+        f.write(out)
+
+
+def vhdx_read(path):
+    with open(path, 'rb') as f:
+        d = f.read()
+
+    assert d[:8] == b'vhdxfile', 'no file identifier'
+    valid = 0
+    for i in range(2):
+        h = bytearray(d[(1 + i) * 65536:(1 + i) * 65536 + 4096])
+        crc = struct.unpack_from('<I', h, 4)[0]
+        struct.pack_into('<I', h, 4, 0)
+        if h[:4] == b'head' and crc32c(h) == crc:
+            valid += 1
+    assert valid, 'no valid header'
+
+    m = d[VHDX_METADATA_OFF:]
+    bs = size = None
+    for i in range(struct.unpack_from('<H', m, 10)[0]):
+        e = 32 + 32 * i
+        off = struct.unpack_from('<I', m, e + 16)[0]
+        if m[e:e + 16] == FILE_PARAMS_GUID:
+            bs = struct.unpack_from('<I', m, off)[0]
+        elif m[e:e + 16] == DISK_SIZE_GUID:
+            size = struct.unpack_from('<Q', m, off)[0]
+    assert bs and size, 'metadata missing'
+
+    nr = (size + bs - 1) // bs
+    ratio = vhdx_chunk_ratio()
+    res = bytearray(size)
+    for blk in range(nr):
+        entry = struct.unpack_from('<Q', d, VHDX_BAT_OFF +
+                                   8 * (blk + blk // ratio))[0]
+        if entry & 7 == VHDX_FULLY_PRESENT:
+            start = entry & ~(MB - 1)
+            n = min(bs, size - blk * bs)
+            res[blk * bs:blk * bs + n] = d[start:start + n]
+    return bytes(res)
+
+
+def gen(fmt, size, image, flat):
+    random.seed(1)
+    data = bytearray(size)
+    for off in range(0, size, 4096):
+        data[off:off + 4096] = random.randbytes(4096)[:size - off]
+
+    if fmt == 'vhd':
+        bs = VHD_BLOCK_SIZE
+        blocks = {}
+        for blk in range((size + bs - 1) // bs):
+            if random.random() < 0.4:
+                blocks[blk] = [s for s in range(bs // SECTOR)
+                               if random.random() < 0.5 and
+                               blk * bs + s * SECTOR < size]
+        vhd_write(image, size, data, blocks)
+    else:
+        bs = VHDX_BLOCK_SIZE
+        blocks = [blk for blk in range((size + bs - 1) // bs)
+                  if random.random() < 0.4]
+        vhdx_write(image, size, data, blocks)
+
+    read(fmt, image, flat)
+
+
+def read(fmt, image, flat):
+    with open(flat, 'wb') as f:
+        f.write(vhd_read(image) if fmt == 'vhd' else vhdx_read(image))
+
+
+def main():
+    args = sys.argv[1:]
+    if len(args) == 5 and args[0] == 'gen' and args[1] in ('vhd', 'vhdx'):
+        gen(args[1], int(args[2]), args[3], args[4])
+    elif len(args) == 4 and args[0] == 'read' and args[1] in ('vhd', 'vhdx'):
+        read(args[1], args[2], args[3])
+    else:
+        sys.exit(__doc__)
+
+
+if __name__ == '__main__':
+    main()
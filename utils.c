@@ -1,6 +1,13 @@
 #include <time.h>
+#include <malloc.h>
 #include <Windows.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
 wchar_t *utf8_to_wchar_buf(const char *src, int *nr_char)
 {
   int len;
@@ -89,6 +96,41 @@ void free_char_buf(void *buf)
   free(buf);
 }
 
+void *alloc_aligned_buf(size_t size, size_t align)
+{
+  return _aligned_malloc(size, align);
+}
+
+void free_aligned_buf(void *buf)
+{
+  _aligned_free(buf);
+}
+
+BOOL is_zero_buf(const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  size_t i = 0;
+
+#ifdef HAVE_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 64 <= len; i += 64) {
+    __m128i v = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+                     _mm_loadu_si128((const __m128i *)(p + i + 16))),
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                     _mm_loadu_si128((const __m128i *)(p + i + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+      return FALSE;
+  }
+#endif
+
+  for (; i < len; i++)
+    if (p[i])
+      return FALSE;
+
+  return TRUE;
+}
+
 void *win_path_to_unix(char *path)
 {
   // Replace slashes
@@ -7,6 +7,9 @@
 wchar_t *utf8_to_wchar_buf(const char *src, int *nr_char);
 char *wchar_to_utf8_buf(const wchar_t *src, int *size);
 void free_char_buf(void *buf);
+void *alloc_aligned_buf(size_t size, size_t align);
+void free_aligned_buf(void *buf);
+BOOL is_zero_buf(const void *buf, size_t len);
 void *win_path_to_unix(char *path);
 void *unix_path_to_win(char *path);
 char *append_unix_path(const char *path, const char *name, int path_len,